@@ -20,28 +20,440 @@
 */
 #include "Arduino.h"
 #include "AsyncWebSocket.h"
+#include "WebHash.h"
+#include "WebSocketMask.h"
+#include "WebSocketPool.h"
 
 #include <libb64/cencode.h>
 
-#ifndef ESP8266
-extern "C" {
-  typedef struct
+#define MAX_PRINTF_LEN 64
+
+/*
+   Message pool
+
+   Payloads of small messages and whole control frames are taken from a fixed set of blocks
+   instead of the heap, so a dashboard pushing updates to several pages does not fragment it.
+   The message objects queued per client come from a second pool sized for them. Both fall
+   back to the heap once exhausted. Broadcasts share one AsyncWebSocketMessageBuffer between
+   all clients. Messages are queued from the user task and released from the AsyncTCP task.
+*/
+
+// 0 disables the pool; at most 32 blocks
+#ifndef WS_POOL_BLOCKS
+  #define WS_POOL_BLOCKS            16
+#endif
+
+// Holds a control frame (125 byte payload at most) and a typical status update
+#ifndef WS_POOL_BLOCK_SIZE
+  #define WS_POOL_BLOCK_SIZE        128
+#endif
+
+// Message objects, one per queued message and client; 0 disables, at most 32
+#ifndef WS_MESSAGE_POOL_BLOCKS
+  #define WS_MESSAGE_POOL_BLOCKS    16
+#endif
+
+// Clients whose queue depth is tracked, see webSocketClientQueueStats()
+#ifndef WS_QUEUE_STATS_CLIENTS
+  #define WS_QUEUE_STATS_CLIENTS    8
+#endif
+
+#define WS_MESSAGE_SIZE (sizeof(AsyncWebSocketBasicMessage) > sizeof(AsyncWebSocketMultiMessage) ? \
+                         sizeof(AsyncWebSocketBasicMessage) : sizeof(AsyncWebSocketMultiMessage))
+
+static WebSocketPool<WS_POOL_BLOCKS, WS_POOL_BLOCK_SIZE> webSocketPayloadPool;
+static WebSocketPool<WS_MESSAGE_POOL_BLOCKS, WS_MESSAGE_SIZE> webSocketMessagePool;
+
+static void * webSocketPoolAlloc(size_t size)
+{
+  void * block = webSocketPayloadPool.take(size);
+  return block ? block : malloc(size);
+}
+
+static void webSocketPoolFree(void * ptr)
+{
+  if (webSocketPayloadPool.owns(ptr))
+    webSocketPayloadPool.give(ptr);
+  else
+    free(ptr);
+}
+
+struct WebSocketClientQueue
+{
+  const AsyncWebSocketClient * client;    // NULL = free
+  AsyncWebSocketClientQueueStats stats;
+};
+
+static AsyncWebSocketQueueStats webSocketStats;
+static WebSocketClientQueue webSocketClientQueues[WS_QUEUE_STATS_CLIENTS];
+static WebSocketPoolLock webSocketStatsLock;
+
+// Under webSocketStatsLock
+static WebSocketClientQueue * webSocketClientQueue(const AsyncWebSocketClient * client)
+{
+  for (uint8_t i = 0; i < WS_QUEUE_STATS_CLIENTS; i++)
+  {
+    if (webSocketClientQueues[i].client == client)
+      return &webSocketClientQueues[i];
+  }
+
+  return NULL;
+}
+
+static void webSocketClientTracked(const AsyncWebSocketClient * client, bool connected)
+{
+  webSocketStatsLock.lock();
+  WebSocketClientQueue * q = webSocketClientQueue(connected ? NULL : client);
+
+  if (q)
+  {
+    memset(q, 0, sizeof(*q));
+    q->client = connected ? client : NULL;
+  }
+
+  webSocketStatsLock.unlock();
+}
+
+static void webSocketQueued(const AsyncWebSocketClient * client, bool accepted)
+{
+  webSocketStatsLock.lock();
+  WebSocketClientQueue * q = webSocketClientQueue(client);
+
+  if (accepted)
+  {
+    webSocketStats.queued++;
+
+    if (q)
+    {
+      q->stats.queued++;
+
+      if (++q->stats.depth > q->stats.peakDepth)
+        q->stats.peakDepth = q->stats.depth;
+    }
+  }
+  else
+  {
+    webSocketStats.dropped++;
+
+    if (q)
+      q->stats.dropped++;
+  }
+
+  webSocketStatsLock.unlock();
+}
+
+static void webSocketDequeued(const AsyncWebSocketClient * client)
+{
+  webSocketStatsLock.lock();
+  WebSocketClientQueue * q = webSocketClientQueue(client);
+
+  if (q)
+    q->stats.depth--;
+
+  webSocketStatsLock.unlock();
+}
+
+void webSocketQueueStats(AsyncWebSocketQueueStats * stats)
+{
+  webSocketStatsLock.lock();
+  *stats = webSocketStats;
+  webSocketStatsLock.unlock();
+  stats->payloads = webSocketPayloadPool.stats();
+  stats->messages = webSocketMessagePool.stats();
+}
+
+bool webSocketClientQueueStats(const AsyncWebSocketClient * client, AsyncWebSocketClientQueueStats * stats)
+{
+  webSocketStatsLock.lock();
+  WebSocketClientQueue * q = client ? webSocketClientQueue(client) : NULL;
+
+  if (q)
+    *stats = q->stats;
+
+  webSocketStatsLock.unlock();
+  return q != NULL;
+}
+
+/*
+   permessage-deflate (RFC 7692)
+
+   Negotiated when WS_PERMESSAGE_DEFLATE is set and the browser offers it, always without
+   context takeover, so every message is compressed and inflated on its own and nothing is
+   kept between messages. Outgoing messages are compressed with fixed Huffman codes over a
+   2^WS_DEFLATE_WINDOW_BITS byte window; that is enough for the repetitive JSON of the
+   portal and needs no per-client state. Messages that would not shrink go out as they are.
+   Incoming compressed messages are collected and inflated with the ROM tinfl into one
+   buffer of at most WS_DEFLATE_MAX_MESSAGE bytes; larger ones close the connection (1009).
+   The compressor and its knobs are in WebSocketDeflate.h.
+*/
+
+#ifndef WS_PERMESSAGE_DEFLATE
+  #define WS_PERMESSAGE_DEFLATE     0
+#endif
+
+// Shorter messages are not worth it
+#ifndef WS_DEFLATE_MIN_SIZE
+  #define WS_DEFLATE_MIN_SIZE       64
+#endif
+
+// Largest message inflated from a client
+#ifndef WS_DEFLATE_MAX_MESSAGE
+  #define WS_DEFLATE_MAX_MESSAGE    4096
+#endif
+
+// Clients that can use the extension at the same time, the others get plain frames
+#ifndef WS_DEFLATE_CLIENTS
+  #define WS_DEFLATE_CLIENTS        8
+#endif
+
+#define WS_RSV1                     0x40
+
+#if WS_PERMESSAGE_DEFLATE && !defined(ESP32)
+  #error "WS_PERMESSAGE_DEFLATE needs the tinfl of the ESP32 ROM"
+#endif
+
+#if WS_PERMESSAGE_DEFLATE
+
+#include "rom/miniz.h"
+#include "WebSocketDeflate.h"
+
+const char * WS_STR_EXTENSIONS = "Sec-WebSocket-Extensions";
+
+static SemaphoreHandle_t webSocketDeflateMutex;
+static StaticSemaphore_t webSocketDeflateMutexBuffer;
+
+// The compressor state is shared, one message is compressed at a time
+static size_t webSocketDeflate(const uint8_t *data, size_t len, uint8_t *out, size_t size)
+{
+  xSemaphoreTake(webSocketDeflateMutex, portMAX_DELAY);
+  size_t n = webSocketDeflateBlock(data, len, out, size);
+  xSemaphoreGive(webSocketDeflateMutex);
+
+  return n;
+}
+
+// Per-client state, found by the TCP connection during the handshake and by the client after
+struct WebSocketDeflateClient
+{
+  AsyncClient *tcp;               // NULL = free
+  AsyncWebSocketClient *client;   // NULL while the handshake is running
+  uint32_t reservedAt;
+  bool inflating;                 // the current message is compressed
+  uint8_t *rx;
+  size_t rxLen;
+};
+
+static WebSocketDeflateClient webSocketDeflateClients[WS_DEFLATE_CLIENTS];
+
+static WebSocketDeflateClient * webSocketDeflateFind(const AsyncWebSocketClient * client)
+{
+  for (uint8_t i = 0; i < WS_DEFLATE_CLIENTS; i++)
   {
-    uint32_t state[5];
-    uint32_t count[2];
-    unsigned char buffer[64];
-  } SHA1_CTX;
+    if (webSocketDeflateClients[i].client == client)
+      return &webSocketDeflateClients[i];
+  }
+
+  return NULL;
+}
 
-  void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]);
-  void SHA1Init(SHA1_CTX* context);
-  void SHA1Update(SHA1_CTX* context, const unsigned char* data, uint32_t len);
-  void SHA1Final(unsigned char digest[20], SHA1_CTX* context);
+static void webSocketDeflateRelease(WebSocketDeflateClient * d)
+{
+  free(d->rx);
+  memset(d, 0, sizeof(*d));
 }
+
+// Handshake: reserve a slot for this connection if the offer can be accepted. Client
+// parameters only restrict how the browser compresses, which does not matter without
+// context takeover; a server window smaller than ours is declined.
+static bool webSocketDeflateAccept(AsyncWebServerRequest * request)
+{
+  AsyncClient * tcp = request->client();
+  WebSocketDeflateClient * slot = NULL;
+
+  for (uint8_t i = 0; i < WS_DEFLATE_CLIENTS; i++)
+  {
+    WebSocketDeflateClient &d = webSocketDeflateClients[i];
+
+    // Left over from a connection that did not finish its handshake
+    if (d.tcp && (d.tcp == tcp || (!d.client && millis() - d.reservedAt > 10000)))
+      webSocketDeflateRelease(&d);
+
+    if (!d.tcp && !slot)
+      slot = &d;
+  }
+
+  if (!slot || !request->hasHeader(WS_STR_EXTENSIONS))
+    return false;
+
+  const String &offer = request->getHeader(WS_STR_EXTENSIONS)->value();
+  int at = offer.indexOf("permessage-deflate");
+
+  if (at < 0)
+    return false;
+
+  int bits = offer.indexOf("server_max_window_bits=", at);
+
+  if (bits >= 0 && offer.substring(bits + 23).toInt() < WS_DEFLATE_WINDOW_BITS)
+    return false;
+
+  slot->tcp = tcp;
+  slot->reservedAt = millis();
+  return true;
+}
+
+// Collect a compressed message, inflate it once complete
+static bool webSocketDeflateCollect(WebSocketDeflateClient * d, const uint8_t * data, size_t len)
+{
+  if (!d->rx)
+    d->rx = (uint8_t *)malloc(WS_DEFLATE_MAX_MESSAGE + 4);
+
+  if (!d->rx || d->rxLen + len > WS_DEFLATE_MAX_MESSAGE)
+    return false;
+
+  memcpy(d->rx + d->rxLen, data, len);
+  d->rxLen += len;
+  return true;
+}
+
+// The message was handed over or refused, clients rarely send so the buffer is not kept
+static void webSocketDeflateDone(WebSocketDeflateClient * d)
+{
+  free(d->rx);
+  d->rx = NULL;
+  d->rxLen = 0;
+  d->inflating = false;
+}
+
+// Inflate the collected message; returns a buffer with one spare byte for a terminator
+static uint8_t * webSocketInflate(WebSocketDeflateClient * d, size_t * len)
+{
+  static const uint8_t tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+  memcpy(d->rx + d->rxLen, tail, 4);
+
+  tinfl_decompressor * inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+  uint8_t * out = (uint8_t *)malloc(WS_DEFLATE_MAX_MESSAGE + 1);
+
+  if (!inflator || !out)
+  {
+    free(inflator);
+    free(out);
+    return NULL;
+  }
+
+  tinfl_init(inflator);
+  size_t inLen = d->rxLen + 4;
+  size_t outLen = WS_DEFLATE_MAX_MESSAGE;
+  tinfl_status status = tinfl_decompress(inflator, d->rx, &inLen, out, out, &outLen,
+                                         TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  free(inflator);
+
+  // Everything consumed and waiting for the next block: the message is complete
+  if ((status != TINFL_STATUS_NEEDS_MORE_INPUT && status != TINFL_STATUS_DONE) || inLen != d->rxLen + 4)
+  {
+    free(out);
+    return NULL;
+  }
+
+  out[outLen] = 0;
+  *len = outLen;
+  return out;
+}
+
+// Handshake is done: the slot reserved for the connection belongs to the client now
+static void webSocketDeflateClaim(AsyncWebSocketClient * client, AsyncClient * tcp)
+{
+  for (uint8_t i = 0; i < WS_DEFLATE_CLIENTS; i++)
+  {
+    if (webSocketDeflateClients[i].tcp == tcp && !webSocketDeflateClients[i].client)
+      webSocketDeflateClients[i].client = client;
+  }
+}
+
+#endif
+
+// A message to one client, compressed if it negotiated the extension and it helps
+static AsyncWebSocketMessage * webSocketMessage(AsyncWebSocketClient * client, const char * data, size_t len,
+                                                uint8_t opcode)
+{
+#if WS_PERMESSAGE_DEFLATE
+
+  if (len >= WS_DEFLATE_MIN_SIZE && webSocketDeflateFind(client))
+  {
+    uint8_t * packed = (uint8_t *)webSocketPoolAlloc(len);
+    size_t packedLen = packed ? webSocketDeflate((const uint8_t *)data, len, packed, len - 1) : 0;
+    AsyncWebSocketMessage * message = NULL;
+
+    if (packedLen)
+      message = webSocketMessagePool.create<AsyncWebSocketBasicMessage>((const char *)packed, packedLen,
+                                                                         opcode | WS_RSV1);
+
+    if (packed)
+      webSocketPoolFree(packed);
+
+    if (message)
+      return message;
+  }
+
 #else
-#include <Hash.h>
+  (void)client;
 #endif
 
-#define MAX_PRINTF_LEN 64
+  return webSocketMessagePool.create<AsyncWebSocketBasicMessage>(data, len, opcode);
+}
+
+// Compressed copy of a broadcast buffer, shared by the clients that negotiated the
+// extension; NULL if none did or it does not help
+static AsyncWebSocketMessageBuffer * webSocketDeflateShared(AsyncWebSocket * server,
+                                                            AsyncWebSocket::AsyncWebSocketClientLinkedList & clients,
+                                                            AsyncWebSocketMessageBuffer * buffer)
+{
+#if WS_PERMESSAGE_DEFLATE
+  size_t len = buffer->length();
+
+  if (len < WS_DEFLATE_MIN_SIZE || !buffer->get())
+    return NULL;
+
+  bool wanted = false;
+
+  for (const auto& c : clients)
+    wanted |= c->status() == WS_CONNECTED && webSocketDeflateFind(c);
+
+  if (!wanted)
+    return NULL;
+
+  uint8_t * packed = (uint8_t *)webSocketPoolAlloc(len);
+  size_t packedLen = packed ? webSocketDeflate(buffer->get(), len, packed, len - 1) : 0;
+  AsyncWebSocketMessageBuffer * shared = packedLen ? server->makeBuffer(packed, packedLen) : NULL;
+
+  if (packed)
+    webSocketPoolFree(packed);
+
+  return shared;
+#else
+  (void)server;
+  (void)clients;
+  (void)buffer;
+  return NULL;
+#endif
+}
+
+static void webSocketQueueShared(AsyncWebSocketClient * client, AsyncWebSocketMessageBuffer * buffer,
+                                 AsyncWebSocketMessageBuffer * packed, uint8_t opcode)
+{
+#if WS_PERMESSAGE_DEFLATE
+
+  if (packed && webSocketDeflateFind(client))
+  {
+    client->message(webSocketMessagePool.create<AsyncWebSocketMultiMessage>(packed, opcode | WS_RSV1));
+    return;
+  }
+
+#else
+  (void)packed;
+#endif
+
+  client->message(webSocketMessagePool.create<AsyncWebSocketMultiMessage>(buffer, opcode));
+}
 
 size_t webSocketSendFrameWindow(AsyncClient *client)
 {
@@ -72,10 +484,16 @@ size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool
   if (len && mask)
   {
     headLen += 4;
+#ifdef ESP32
+    // Hardware RNG, one call for the whole mask
+    uint32_t r = esp_random();
+    memcpy(mbuf, &r, 4);
+#else
     mbuf[0] = rand() % 0xFF;
     mbuf[1] = rand() % 0xFF;
     mbuf[2] = rand() % 0xFF;
     mbuf[3] = rand() % 0xFF;
+#endif
   }
 
   if (len > 125)
@@ -89,15 +507,9 @@ size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool
   if (len > space)
     len = space;
 
-  uint8_t *buf = (uint8_t*)malloc(headLen);
+  uint8_t buf[8];
 
-  if (buf == NULL)
-  {
-    //os_printf("could not malloc %u bytes for frame header\n", headLen);
-    return 0;
-  }
-
-  buf[0] = opcode & 0x0F;
+  buf[0] = opcode & (0x0F | WS_RSV1);
 
   if (final)
     buf[0] |= 0x80;
@@ -120,21 +532,13 @@ size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool
   if (client->add((const char *)buf, headLen) != headLen)
   {
     //os_printf("error adding %lu header bytes\n", headLen);
-    free(buf);
     return 0;
   }
 
-  free(buf);
-
   if (len)
   {
     if (len && mask)
-    {
-      size_t i;
-
-      for (i = 0; i < len; i++)
-        data[i] = data[i] ^ mbuf[i % 4];
-    }
+      webSocketMask(data, len, mbuf, 0);
 
     if (client->add((const char *)data, len) != len)
     {
@@ -180,7 +584,7 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(uint8_t * data, size_t
     return;
   }
 
-  _data = new uint8_t[_len + 1];
+  _data = (uint8_t *)webSocketPoolAlloc(_len + 1);
 
   if (_data)
   {
@@ -196,7 +600,7 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(size_t size)
   , _lock(false)
   , _count(0)
 {
-  _data = new uint8_t[_len + 1];
+  _data = (uint8_t *)webSocketPoolAlloc(_len + 1);
 
   if (_data)
   {
@@ -217,8 +621,7 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(const AsyncWebSocketMes
 
   if (_len)
   {
-    _data = new uint8_t[_len + 1];
-    _data[_len] = 0;
+    _data = (uint8_t *)webSocketPoolAlloc(_len + 1);
   }
 
   if (_data)
@@ -251,7 +654,7 @@ AsyncWebSocketMessageBuffer::~AsyncWebSocketMessageBuffer()
 {
   if (_data)
   {
-    delete[] _data;
+    webSocketPoolFree(_data);
   }
 }
 
@@ -261,11 +664,11 @@ bool AsyncWebSocketMessageBuffer::reserve(size_t size)
 
   if (_data)
   {
-    delete[] _data;
+    webSocketPoolFree(_data);
     _data = nullptr;
   }
 
-  _data = new uint8_t[_len + 1];
+  _data = (uint8_t *)webSocketPoolAlloc(_len + 1);
 
   if (_data)
   {
@@ -308,7 +711,7 @@ class AsyncWebSocketControl
         if (_len > 125)
           _len = 125;
 
-        _data = (uint8_t*)malloc(_len);
+        _data = (uint8_t*)webSocketPoolAlloc(_len);
 
         if (_data == NULL)
           _len = 0;
@@ -321,7 +724,15 @@ class AsyncWebSocketControl
     virtual ~AsyncWebSocketControl()
     {
       if (_data != NULL)
-        free(_data);
+        webSocketPoolFree(_data);
+    }
+    static void * operator new(size_t size) noexcept
+    {
+      return webSocketPoolAlloc(size);
+    }
+    static void operator delete(void * ptr)
+    {
+      webSocketPoolFree(ptr);
     }
     virtual bool finished() const
     {
@@ -353,9 +764,9 @@ AsyncWebSocketBasicMessage::AsyncWebSocketBasicMessage(const char * data, size_t
   , _ack(0)
   , _acked(0)
 {
-  _opcode = opcode & 0x07;
+  _opcode = opcode & (0x07 | WS_RSV1);
   _mask = mask;
-  _data = (uint8_t*)malloc(_len + 1);
+  _data = (uint8_t*)webSocketPoolAlloc(_len + 1);
 
   if (_data == NULL)
   {
@@ -376,7 +787,7 @@ AsyncWebSocketBasicMessage::AsyncWebSocketBasicMessage(uint8_t opcode, bool mask
   , _acked(0)
   , _data(NULL)
 {
-  _opcode = opcode & 0x07;
+  _opcode = opcode & (0x07 | WS_RSV1);
   _mask = mask;
 
 }
@@ -385,7 +796,7 @@ AsyncWebSocketBasicMessage::AsyncWebSocketBasicMessage(uint8_t opcode, bool mask
 AsyncWebSocketBasicMessage::~AsyncWebSocketBasicMessage()
 {
   if (_data != NULL)
-    free(_data);
+    webSocketPoolFree(_data);
 }
 
 void AsyncWebSocketBasicMessage::ack(size_t len, uint32_t time)
@@ -476,7 +887,7 @@ AsyncWebSocketMultiMessage::AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuff
   , _WSbuffer(nullptr)
 {
 
-  _opcode = opcode & 0x07;
+  _opcode = opcode & (0x07 | WS_RSV1);
   _mask = mask;
 
   if (buffer)
@@ -582,12 +993,14 @@ AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, Async
 {
   delete  c;
 }))
-, _messageQueue(LinkedList<AsyncWebSocketMessage *>([](AsyncWebSocketMessage *m)
+, _messageQueue(LinkedList<AsyncWebSocketMessage *>([this](AsyncWebSocketMessage *m)
 {
-  delete  m;
+  webSocketDequeued(this);
+  webSocketMessagePool.destroy(m);
 }))
 , _tempObject(NULL)
 {
+  webSocketClientTracked(this, true);
   _client = request->client();
   _server = server;
   _clientId = _server->_getNextId();
@@ -626,6 +1039,9 @@ AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, Async
     (void)c;
     ((AsyncWebSocketClient*)(r))->_onPoll();
   }, this);
+#if WS_PERMESSAGE_DEFLATE
+  webSocketDeflateClaim(this, _client);
+#endif
   _server->_addClient(this);
   _server->_handleEvent(this, WS_EVT_CONNECT, request, NULL, 0);
   delete request;
@@ -635,6 +1051,14 @@ AsyncWebSocketClient::~AsyncWebSocketClient()
 {
   _messageQueue.free();
   _controlQueue.free();
+  webSocketClientTracked(this, false);
+#if WS_PERMESSAGE_DEFLATE
+  WebSocketDeflateClient * deflate = webSocketDeflateFind(this);
+
+  if (deflate)
+    webSocketDeflateRelease(deflate);
+
+#endif
   _server->_handleEvent(this, WS_EVT_DISCONNECT, NULL, NULL, 0);
 }
 
@@ -717,17 +1141,20 @@ void AsyncWebSocketClient::_queueMessage(AsyncWebSocketMessage *dataMessage)
 
   if (_status != WS_CONNECTED)
   {
-    delete dataMessage;
+    webSocketQueued(this, false);
+    webSocketMessagePool.destroy(dataMessage);
     return;
   }
 
   if (_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES)
   {
     ets_printf("ERROR: Too many messages queued\n");
-    delete dataMessage;
+    webSocketQueued(this, false);
+    webSocketMessagePool.destroy(dataMessage);
   }
   else
   {
+    webSocketQueued(this, true);
     _messageQueue.add(dataMessage);
   }
 
@@ -740,6 +1167,10 @@ void AsyncWebSocketClient::_queueControl(AsyncWebSocketControl *controlMessage)
   if (controlMessage == NULL)
     return;
 
+  webSocketStatsLock.lock();
+  webSocketStats.controls++;
+  webSocketStatsLock.unlock();
+
   _controlQueue.add(controlMessage);
 
   if (_client->canSend())
@@ -765,22 +1196,18 @@ void AsyncWebSocketClient::close(uint16_t code, const char * message)
       packetLen += mlen;
     }
 
-    char * buf = (char*)malloc(packetLen);
+    uint8_t buf[125];
 
-    if (buf != NULL)
-    {
-      buf[0] = (uint8_t)(code >> 8);
-      buf[1] = (uint8_t)(code & 0xFF);
+    buf[0] = (uint8_t)(code >> 8);
+    buf[1] = (uint8_t)(code & 0xFF);
 
-      if (message != NULL)
-      {
-        memcpy(buf + 2, message, packetLen - 2);
-      }
-
-      _queueControl(new AsyncWebSocketControl(WS_DISCONNECT, (uint8_t*)buf, packetLen));
-      free(buf);
-      return;
+    if (message != NULL)
+    {
+      memcpy(buf + 2, message, packetLen - 2);
     }
+
+    _queueControl(new AsyncWebSocketControl(WS_DISCONNECT, buf, packetLen));
+    return;
   }
 
   _queueControl(new AsyncWebSocketControl(WS_DISCONNECT));
@@ -819,6 +1246,14 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen)
       _pinfo.index = 0;
       _pinfo.final = (fdata[0] & 0x80) != 0;
       _pinfo.opcode = fdata[0] & 0x0F;
+#if WS_PERMESSAGE_DEFLATE
+      WebSocketDeflateClient * deflate = webSocketDeflateFind(this);
+
+      // RSV1 on the first frame marks the whole message as compressed
+      if (deflate && (_pinfo.opcode == WS_TEXT || _pinfo.opcode == WS_BINARY))
+        deflate->inflating = (fdata[0] & WS_RSV1) != 0;
+
+#endif
       _pinfo.masked = (fdata[1] & 0x80) != 0;
       _pinfo.len = fdata[1] & 0x7F;
       data += 2;
@@ -850,11 +1285,52 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen)
     const auto datalast = data[datalen];
 
     if (_pinfo.masked)
+      webSocketMask(data, datalen, _pinfo.mask, _pinfo.index);
+
+#if WS_PERMESSAGE_DEFLATE
+    WebSocketDeflateClient * deflate = _pinfo.opcode < 8 ? webSocketDeflateFind(this) : NULL;
+
+    // Compressed data is collected and handed over once, inflated, when the message is complete
+    if (deflate && deflate->inflating)
     {
-      for (size_t i = 0; i < datalen; i++)
-        data[i] ^= _pinfo.mask[(_pinfo.index + i) % 4];
-    }
+      _pstate = (datalen + _pinfo.index) < _pinfo.len;
+
+      if (_pinfo.index == 0 && _pinfo.opcode)
+        _pinfo.message_opcode = _pinfo.opcode;
+
+      if (!webSocketDeflateCollect(deflate, data, datalen))
+      {
+        webSocketDeflateDone(deflate);
+        close(1009);
+        break;
+      }
 
+      _pinfo.index += datalen;
+
+      if (!_pstate && _pinfo.final)
+      {
+        size_t len = 0;
+        uint8_t * message = webSocketInflate(deflate, &len);
+        webSocketDeflateDone(deflate);
+
+        if (!message)
+        {
+          close(1007);
+          break;
+        }
+
+        AwsFrameInfo info = _pinfo;
+        info.opcode = info.message_opcode;
+        info.num = 0;
+        info.masked = false;
+        info.index = 0;
+        info.len = len;
+        _server->_handleEvent(this, WS_EVT_DATA, (void *)&info, message, len);
+        free(message);
+      }
+    }
+    else
+#endif
     if ((datalen + _pinfo.index) < _pinfo.len)
     {
       _pstate = 1;
@@ -1021,7 +1497,7 @@ size_t AsyncWebSocketClient::printf_P(PGM_P formatP, ...)
 
 void AsyncWebSocketClient::text(const char * message, size_t len)
 {
-  _queueMessage(new AsyncWebSocketBasicMessage(message, len));
+  _queueMessage(webSocketMessage(this, message, len, WS_TEXT));
 }
 void AsyncWebSocketClient::text(const char * message)
 {
@@ -1042,36 +1518,25 @@ void AsyncWebSocketClient::text(const String &message)
 void AsyncWebSocketClient::text(const __FlashStringHelper *data)
 {
   PGM_P p = reinterpret_cast<PGM_P>(data);
-  size_t n = 0;
-
-  while (1)
-  {
-    if (pgm_read_byte(p + n) == 0)
-      break;
-
-    n += 1;
-  }
-
-  char * message = (char*) malloc(n + 1);
+  size_t n = strlen_P(p);
+  char * message = (char *)webSocketPoolAlloc(n + 1);
 
   if (message)
   {
-    for (size_t b = 0; b < n; b++)
-      message[b] = pgm_read_byte(p++);
-
+    memcpy_P(message, p, n);
     message[n] = 0;
     text(message, n);
-    free(message);
+    webSocketPoolFree(message);
   }
 }
 void AsyncWebSocketClient::text(AsyncWebSocketMessageBuffer * buffer)
 {
-  _queueMessage(new AsyncWebSocketMultiMessage(buffer));
+  _queueMessage(webSocketMessagePool.create<AsyncWebSocketMultiMessage>(buffer));
 }
 
 void AsyncWebSocketClient::binary(const char * message, size_t len)
 {
-  _queueMessage(new AsyncWebSocketBasicMessage(message, len, WS_BINARY));
+  _queueMessage(webSocketMessage(this, message, len, WS_BINARY));
 }
 void AsyncWebSocketClient::binary(const char * message)
 {
@@ -1091,22 +1556,18 @@ void AsyncWebSocketClient::binary(const String &message)
 }
 void AsyncWebSocketClient::binary(const __FlashStringHelper *data, size_t len)
 {
-  PGM_P p = reinterpret_cast<PGM_P>(data);
-  char * message = (char*) malloc(len);
+  char * message = (char *)webSocketPoolAlloc(len);
 
   if (message)
   {
-    for (size_t b = 0; b < len; b++)
-      message[b] = pgm_read_byte(p++);
-
+    memcpy_P(message, reinterpret_cast<PGM_P>(data), len);
     binary(message, len);
-    free(message);
+    webSocketPoolFree(message);
   }
-
 }
 void AsyncWebSocketClient::binary(AsyncWebSocketMessageBuffer * buffer)
 {
-  _queueMessage(new AsyncWebSocketMultiMessage(buffer, WS_BINARY));
+  _queueMessage(webSocketMessagePool.create<AsyncWebSocketMultiMessage>(buffer, WS_BINARY));
 }
 
 IPAddress AsyncWebSocketClient::remoteIP()
@@ -1149,6 +1610,12 @@ AsyncWebSocket::AsyncWebSocket(const String& url)
 }))
 {
   _eventHandler = NULL;
+
+#if WS_PERMESSAGE_DEFLATE
+  // Not on first use: a mutex cannot be created under the pool spinlock
+  if (!webSocketDeflateMutex)
+    webSocketDeflateMutex = xSemaphoreCreateMutexStatic(&webSocketDeflateMutexBuffer);
+#endif
 }
 
 AsyncWebSocket::~AsyncWebSocket() {}
@@ -1276,15 +1743,22 @@ void AsyncWebSocket::textAll(AsyncWebSocketMessageBuffer * buffer)
     return;
 
   buffer->lock();
+  AsyncWebSocketMessageBuffer * packed = webSocketDeflateShared(this, _clients, buffer);
+
+  if (packed)
+    packed->lock();
 
   for (const auto& c : _clients)
   {
     if (c->status() == WS_CONNECTED)
     {
-      c->text(buffer);
+      webSocketQueueShared(c, buffer, packed, WS_TEXT);
     }
   }
 
+  if (packed)
+    packed->unlock();
+
   buffer->unlock();
   _cleanBuffers();
 }
@@ -1316,13 +1790,20 @@ void AsyncWebSocket::binaryAll(AsyncWebSocketMessageBuffer * buffer)
     return;
 
   buffer->lock();
+  AsyncWebSocketMessageBuffer * packed = webSocketDeflateShared(this, _clients, buffer);
+
+  if (packed)
+    packed->lock();
 
   for (const auto& c : _clients)
   {
     if (c->status() == WS_CONNECTED)
-      c->binary(buffer);
+      webSocketQueueShared(c, buffer, packed, WS_BINARY);
   }
 
+  if (packed)
+    packed->unlock();
+
   buffer->unlock();
   _cleanBuffers();
 }
@@ -1481,10 +1962,13 @@ void AsyncWebSocket::textAll(const String &message)
 }
 void AsyncWebSocket::textAll(const __FlashStringHelper *message)
 {
-  for (const auto& c : _clients)
+  PGM_P p = reinterpret_cast<PGM_P>(message);
+  AsyncWebSocketMessageBuffer * buffer = makeBuffer(strlen_P(p));
+
+  if (buffer && buffer->get())
   {
-    if (c->status() == WS_CONNECTED)
-      c->text(message);
+    memcpy_P(buffer->get(), p, buffer->length());
+    textAll(buffer);
   }
 }
 void AsyncWebSocket::binary(uint32_t id, const char * message)
@@ -1528,10 +2012,12 @@ void AsyncWebSocket::binaryAll(const String &message)
 }
 void AsyncWebSocket::binaryAll(const __FlashStringHelper *message, size_t len)
 {
-  for (const auto& c : _clients)
+  AsyncWebSocketMessageBuffer * buffer = makeBuffer(len);
+
+  if (buffer && buffer->get())
   {
-    if (c->status() == WS_CONNECTED)
-      c-> binary(message, len);
+    memcpy_P(buffer->get(), reinterpret_cast<PGM_P>(message), len);
+    binaryAll(buffer);
   }
 }
 
@@ -1558,6 +2044,9 @@ bool AsyncWebSocket::canHandle(AsyncWebServerRequest *request)
   request->addInterestingHeader(WS_STR_VERSION);
   request->addInterestingHeader(WS_STR_KEY);
   request->addInterestingHeader(WS_STR_PROTOCOL);
+#if WS_PERMESSAGE_DEFLATE
+  request->addInterestingHeader(WS_STR_EXTENSIONS);
+#endif
   return true;
 }
 
@@ -1594,6 +2083,13 @@ void AsyncWebSocket::handleRequest(AsyncWebServerRequest *request)
     response->addHeader(WS_STR_PROTOCOL, protocol->value());
   }
 
+#if WS_PERMESSAGE_DEFLATE
+
+  if (webSocketDeflateAccept(request))
+    response->addHeader(WS_STR_EXTENSIONS, "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+
+#endif
+
   request->send(response);
 }
 
@@ -1652,41 +2148,22 @@ AsyncWebSocketResponse::AsyncWebSocketResponse(const String& key, AsyncWebSocket
   _code = 101;
   _sendContentLength = false;
 
-  uint8_t * hash = (uint8_t*)malloc(20);
-
-  if (hash == NULL)
-  {
-    _state = RESPONSE_FAILED;
-    return;
-  }
-
-  char * buffer = (char *) malloc(33);
+  uint8_t hash[WEB_HASH_SHA1_LEN];
+  char buffer[33];
 
-  if (buffer == NULL)
-  {
-    free(hash);
-    _state = RESPONSE_FAILED;
-    return;
-  }
+  WebHashSHA1 sha1;
+  sha1.update(key.c_str(), key.length());
+  sha1.update(WS_STR_UUID);
+  sha1.finish(hash);
 
-#ifdef ESP8266
-  sha1(key + WS_STR_UUID, hash);
-#else
-  (String&)key += WS_STR_UUID;
-  SHA1_CTX ctx;
-  SHA1Init(&ctx);
-  SHA1Update(&ctx, (const unsigned char*)key.c_str(), key.length());
-  SHA1Final(hash, &ctx);
-#endif
   base64_encodestate _state;
   base64_init_encodestate(&_state);
-  int len = base64_encode_block((const char *) hash, 20, buffer, &_state);
-  len = base64_encode_blockend((buffer + len), &_state);
+  int len = base64_encode_block((const char *) hash, WEB_HASH_SHA1_LEN, buffer, &_state);
+  len += base64_encode_blockend((buffer + len), &_state);
+  buffer[len] = 0;
   addHeader(WS_STR_CONNECTION, WS_STR_UPGRADE);
   addHeader(WS_STR_UPGRADE, "websocket");
   addHeader(WS_STR_ACCEPT, buffer);
-  free(buffer);
-  free(hash);
 }
 
 void AsyncWebSocketResponse::_respond(AsyncWebServerRequest *request)
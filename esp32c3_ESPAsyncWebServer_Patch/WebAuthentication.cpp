@@ -19,102 +19,107 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include "WebAuthentication.h"
+#include "WebHash.h"
 #include <libb64/cencode.h>
-#ifdef ESP32
-  #include "mbedtls/md5.h"
-  #include "mbedtls/version.h"
-#else
-  #include "md5.h"
-#endif
 
 
 // Basic Auth hash = base64("username:password")
+// "username:password" is gathered in a block on the stack and encoded a block at a time, so
+// usual credentials take one pass of the encoder, as the whole string did, without the heap
 
-bool checkBasicAuthentication(const char * hash, const char * username, const char * password)
+#define BASIC_AUTH_BLOCK    192     // a multiple of 3: blocks encode on their own
+
+struct BasicAuthMatcher
 {
-  if (username == NULL || password == NULL || hash == NULL)
-    return false;
+  char plain[BASIC_AUTH_BLOCK];
+  size_t fill;
+  const char * expected;
+  size_t expectedLen;
+  size_t pos;
+  uint8_t diff;
+
+  void compare(const char * encoded, size_t len)
+  {
+    if (pos + len > expectedLen)
+    {
+      diff = 1;
+      return;
+    }
 
-  size_t toencodeLen = strlen(username) + strlen(password) + 1;
-  size_t encodedLen = base64_encode_expected_len(toencodeLen);
+    // A word at a time, as memcmp() would, but without stopping at the first difference
+    const char * e = expected + pos;
+    uint32_t d = 0;
+    size_t i = 0;
 
-  if (strlen(hash) != encodedLen)
-    return false;
+    for (; i + 4 <= len; i += 4)
+    {
+      uint32_t a, b;
+      memcpy(&a, encoded + i, 4);
+      memcpy(&b, e + i, 4);
+      d |= a ^ b;
+    }
 
-  char *toencode = new char[toencodeLen + 1];
+    for (; i < len; i++)
+      d |= (uint8_t)(encoded[i] ^ e[i]);
 
-  if (toencode == NULL)
-  {
-    return false;
+    diff |= d != 0;
+    pos += len;
   }
 
-  char *encoded = new char[base64_encode_expected_len(toencodeLen) + 1];
-
-  if (encoded == NULL)
+  void feed(const char * data, size_t len)
   {
-    delete[] toencode;
-    return false;
-  }
+    while (len)
+    {
+      size_t n = sizeof(plain) - fill;
 
-  sprintf(toencode, "%s:%s", username, password);
+      if (n > len)
+        n = len;
 
-  if (base64_encode_chars(toencode, toencodeLen, encoded) > 0 && memcmp(hash, encoded, encodedLen) == 0)
-  {
-    delete[] toencode;
-    delete[] encoded;
-    return true;
+      memcpy(plain + fill, data, n);
+      fill += n;
+      data += n;
+      len -= n;
+
+      if (fill == sizeof(plain))
+        flush();
+    }
   }
 
-  delete[] toencode;
-  delete[] encoded;
-  return false;
-}
+  void flush()
+  {
+    char encoded[BASIC_AUTH_BLOCK / 3 * 4 + 1];
+    compare(encoded, base64_encode_chars(plain, fill, encoded));
+    fill = 0;
+  }
+};
 
-static bool getMD5(uint8_t * data, uint16_t len, char * output) //33 bytes or more
+bool checkBasicAuthentication(const char * hash, const char * username, const char * password)
 {
-#ifdef ESP32
-  mbedtls_md5_context _ctx;
-#else
-  md5_context_t _ctx;
-#endif
-  uint8_t i;
-  uint8_t * _buf = (uint8_t*)malloc(16);
+  if (username == NULL || password == NULL || hash == NULL)
+    return false;
 
-  if (_buf == NULL)
+  size_t usernameLen = strlen(username);
+  size_t passwordLen = strlen(password);
+  size_t encodedLen = base64_encode_expected_len(usernameLen + passwordLen + 1);
+
+  if (strlen(hash) != encodedLen)
     return false;
 
-  memset(_buf, 0x00, 16);
-#ifdef ESP32
-  mbedtls_md5_init(&_ctx);
-
-  // KH
-#if (MBEDTLS_VERSION_NUMBER < 0x02070000)
-#warning MBEDTLS_VERSION_NUMBER < 2.7.0
-  // Superseded from v2.7.0
-  mbedtls_md5_starts(&_ctx);
-  mbedtls_md5_update(&_ctx, data, len);
-  mbedtls_md5_finish(&_ctx, _buf);
-#else
-#warning MBEDTLS_VERSION_NUMBER >= 2.7.0
-  mbedtls_md5_starts_ret(&_ctx);
-  mbedtls_md5_update_ret(&_ctx, data, len);
-  mbedtls_md5_finish_ret(&_ctx, _buf);
-#endif
-  //////
+  BasicAuthMatcher matcher;
+  matcher.fill = 0;
+  matcher.expected = hash;
+  matcher.expectedLen = encodedLen;
+  matcher.pos = 0;
+  matcher.diff = 0;
 
-#else
-  MD5Init(&_ctx);
-  MD5Update(&_ctx, data, len);
-  MD5Final(_buf, &_ctx);
-#endif
+  matcher.feed(username, usernameLen);
+  matcher.feed(":", 1);
+  matcher.feed(password, passwordLen);
 
-  for (i = 0; i < 16; i++)
-  {
-    sprintf(output + (i * 2), "%02x", _buf[i]);
-  }
+  if (matcher.fill)
+    matcher.flush();
 
-  free(_buf);
-  return true;
+  return matcher.diff == 0 && matcher.pos == encodedLen;
 }
 
 static String genRandomMD5()
@@ -122,28 +127,13 @@ static String genRandomMD5()
 #ifdef ESP8266
   uint32_t r = RANDOM_REG32;
 #else
-  uint32_t r = rand();
+  uint32_t r = esp_random();
 #endif
-  char * out = (char*)malloc(33);
-
-  if (out == NULL || !getMD5((uint8_t*)(&r), 4, out))
-    return "";
-
-  String res = String(out);
-  free(out);
-  return res;
-}
-
-static String stringMD5(const String& in)
-{
-  char * out = (char*)malloc(33);
-
-  if (out == NULL || !getMD5((uint8_t*)(in.c_str()), in.length(), out))
-    return "";
-
-  String res = String(out);
-  free(out);
-  return res;
+  char out[WEB_HASH_MD5_LEN * 2 + 1];
+  WebHashMD5 md5;
+  md5.update(&r, sizeof(r));
+  md5.finishHex(out);
+  return String(out);
 }
 
 String generateDigestHash(const char * username, const char * password, const char * realm)
@@ -153,19 +143,20 @@ String generateDigestHash(const char * username, const char * password, const ch
     return "";
   }
 
-  char * out = (char*)malloc(33);
+  char out[WEB_HASH_MD5_LEN * 2 + 1];
+  WebHashMD5 md5;
+  md5.update(username);
+  md5.update(":");
+  md5.update(realm);
+  md5.update(":");
+  md5.update(password);
+  md5.finishHex(out);
+
   String res = String(username);
   res.concat(":");
   res.concat(realm);
   res.concat(":");
-  String in = res;
-  in.concat(password);
-
-  if (out == NULL || !getMD5((uint8_t*)(in.c_str()), in.length(), out))
-    return "";
-
   res.concat(out);
-  free(out);
   return res;
 }
 
@@ -186,6 +177,23 @@ String requestDigestAuthentication(const char * realm)
   return header;
 }
 
+// A piece of the Authorization header, parsed in place
+struct DigestAuthSpan
+{
+  const char * data;
+  size_t len;
+
+  bool equals(const char * s) const
+  {
+    return strncmp(data, s, len) == 0 && s[len] == '\0';
+  }
+};
+
+static bool isDigestSpace(char c)
+{
+  return c == ' ' || c == '\t';
+}
+
 bool checkDigestAuthentication(const char * header, const char * method, const char * username, const char * password,
                                const char * realm, bool passwordIsHash, const char * nonce, const char * opaque, const char * uri)
 {
@@ -195,82 +203,112 @@ bool checkDigestAuthentication(const char * header, const char * method, const c
     return false;
   }
 
-  String myHeader = String(header);
-  int nextBreak = myHeader.indexOf(",");
-
-  if (nextBreak < 0)
+  if (strchr(header, ',') == NULL)
   {
     //os_printf("AUTH FAIL: no variables\n");
     return false;
   }
 
-  String myUsername = String();
-  String myRealm = String();
-  String myNonce = String();
-  String myUri = String();
-  String myResponse = String();
-  String myQop = String();
-  String myNc = String();
-  String myCnonce = String();
+  DigestAuthSpan myUsername = { "", 0 };
+  DigestAuthSpan myRealm = { "", 0 };
+  DigestAuthSpan myNonce = { "", 0 };
+  DigestAuthSpan myUri = { "", 0 };
+  DigestAuthSpan myResponse = { "", 0 };
+  DigestAuthSpan myQop = { "", 0 };
+  DigestAuthSpan myNc = { "", 0 };
+  DigestAuthSpan myCnonce = { "", 0 };
 
-  myHeader += ", ";
+  const char * p = header;
 
-  do
+  while (*p)
   {
-    String avLine = myHeader.substring(0, nextBreak);
-    avLine.trim();
-    myHeader = myHeader.substring(nextBreak + 1);
-    nextBreak = myHeader.indexOf(",");
+    while (isDigestSpace(*p) || *p == ',')
+      p++;
 
-    int eqSign = avLine.indexOf("=");
+    if (*p == '\0')
+      break;
 
-    if (eqSign < 0)
+    DigestAuthSpan varName = { p, 0 };
+
+    while (*p && *p != '=' && *p != ',')
+      p++;
+
+    if (*p != '=')
     {
       //os_printf("AUTH FAIL: no = sign\n");
       return false;
     }
 
-    String varName = avLine.substring(0, eqSign);
-    avLine = avLine.substring(eqSign + 1);
+    varName.len = p - varName.data;
+
+    while (varName.len && isDigestSpace(varName.data[varName.len - 1]))
+      varName.len--;
+
+    p++;
+
+    while (isDigestSpace(*p))
+      p++;
 
-    if (avLine.startsWith("\""))
+    DigestAuthSpan value;
+
+    if (*p == '"')
     {
-      avLine = avLine.substring(1, avLine.length() - 1);
+      value.data = ++p;
+
+      while (*p && *p != '"')
+        p++;
+
+      value.len = p - value.data;
+
+      if (*p)
+        p++;
+    }
+    else
+    {
+      value.data = p;
+
+      while (*p && *p != ',')
+        p++;
+
+      value.len = p - value.data;
+
+      while (value.len && isDigestSpace(value.data[value.len - 1]))
+        value.len--;
     }
 
     if (varName.equals("username"))
     {
-      if (!avLine.equals(username))
+      if (!value.equals(username))
       {
         //os_printf("AUTH FAIL: username\n");
         return false;
       }
 
-      myUsername = avLine;
+      myUsername = value;
     }
     else if (varName.equals("realm"))
     {
-      if (realm != NULL && !avLine.equals(realm))
+      if (realm != NULL && !value.equals(realm))
       {
         //os_printf("AUTH FAIL: realm\n");
         return false;
       }
 
-      myRealm = avLine;
+      myRealm = value;
     }
     else if (varName.equals("nonce"))
     {
-      if (nonce != NULL && !avLine.equals(nonce))
+      if (nonce != NULL && !value.equals(nonce))
       {
         //os_printf("AUTH FAIL: nonce\n");
         return false;
       }
 
-      myNonce = avLine;
+      myNonce = value;
     }
     else if (varName.equals("opaque"))
     {
-      if (opaque != NULL && !avLine.equals(opaque))
+      if (opaque != NULL && !value.equals(opaque))
       {
         //os_printf("AUTH FAIL: opaque\n");
         return false;
@@ -278,37 +316,76 @@ bool checkDigestAuthentication(const char * header, const char * method, const c
     }
     else if (varName.equals("uri"))
     {
-      if (uri != NULL && !avLine.equals(uri))
+      if (uri != NULL && !value.equals(uri))
       {
         //os_printf("AUTH FAIL: uri\n");
         return false;
       }
 
-      myUri = avLine;
+      myUri = value;
     }
     else if (varName.equals("response"))
     {
-      myResponse = avLine;
+      myResponse = value;
     }
     else if (varName.equals("qop"))
     {
-      myQop = avLine;
+      myQop = value;
     }
     else if (varName.equals("nc"))
     {
-      myNc = avLine;
+      myNc = value;
     }
     else if (varName.equals("cnonce"))
     {
-      myCnonce = avLine;
+      myCnonce = value;
     }
-  } while (nextBreak > 0);
+  }
+
+  char ha1[WEB_HASH_MD5_LEN * 2 + 1];
+  char ha2[WEB_HASH_MD5_LEN * 2 + 1];
+  char expected[WEB_HASH_MD5_LEN * 2 + 1];
 
-  String ha1 = (passwordIsHash) ? String(password) : stringMD5(myUsername + ":" + myRealm + ":" + String(password));
-  String ha2 = String(method) + ":" + myUri;
-  String response = ha1 + ":" + myNonce + ":" + myNc + ":" + myCnonce + ":" + myQop + ":" + stringMD5(ha2);
+  if (passwordIsHash)
+  {
+    strlcpy(ha1, password, sizeof(ha1));
+  }
+  else
+  {
+    WebHashMD5 md5;
+    md5.update(myUsername.data, myUsername.len);
+    md5.update(":");
+    md5.update(myRealm.data, myRealm.len);
+    md5.update(":");
+    md5.update(password);
+    md5.finishHex(ha1);
+  }
+
+  {
+    WebHashMD5 md5;
+    md5.update(method);
+    md5.update(":");
+    md5.update(myUri.data, myUri.len);
+    md5.finishHex(ha2);
+  }
+
+  {
+    WebHashMD5 md5;
+    md5.update(ha1);
+    md5.update(":");
+    md5.update(myNonce.data, myNonce.len);
+    md5.update(":");
+    md5.update(myNc.data, myNc.len);
+    md5.update(":");
+    md5.update(myCnonce.data, myCnonce.len);
+    md5.update(":");
+    md5.update(myQop.data, myQop.len);
+    md5.update(":");
+    md5.update(ha2);
+    md5.finishHex(expected);
+  }
 
-  if (myResponse.equals(stringMD5(response)))
+  if (myResponse.len == WEB_HASH_MD5_LEN * 2 && webHashEqual(myResponse.data, expected, WEB_HASH_MD5_LEN * 2))
   {
     //os_printf("AUTH SUCCESS\n");
     return true;
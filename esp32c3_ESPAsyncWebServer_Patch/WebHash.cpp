@@ -0,0 +1,178 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebHash.h"
+
+#ifdef ESP32
+  #include "mbedtls/version.h"
+
+  // The _ret variants superseded the void ones in 2.7.0 and were renamed back in 3.0.0
+  #if (MBEDTLS_VERSION_NUMBER >= 0x02070000) && (MBEDTLS_VERSION_NUMBER < 0x03000000)
+    #define WEB_HASH_MBEDTLS_RET
+  #endif
+#endif
+
+/*
+   MD5
+*/
+
+WebHashMD5::WebHashMD5()
+{
+#ifdef ESP32
+  mbedtls_md5_init(&_ctx);
+#ifdef WEB_HASH_MBEDTLS_RET
+  mbedtls_md5_starts_ret(&_ctx);
+#else
+  mbedtls_md5_starts(&_ctx);
+#endif
+#else
+  MD5Init(&_ctx);
+#endif
+}
+
+WebHashMD5::~WebHashMD5()
+{
+#ifdef ESP32
+  mbedtls_md5_free(&_ctx);
+#endif
+}
+
+void WebHashMD5::update(const void * data, size_t len)
+{
+#ifdef ESP32
+#ifdef WEB_HASH_MBEDTLS_RET
+  mbedtls_md5_update_ret(&_ctx, (const unsigned char *)data, len);
+#else
+  mbedtls_md5_update(&_ctx, (const unsigned char *)data, len);
+#endif
+#else
+  const uint8_t * p = (const uint8_t *)data;
+
+  // Takes 16-bit lengths
+  while (len)
+  {
+    uint16_t n = len > 0xFFFF ? 0xFFFF : len;
+    MD5Update(&_ctx, p, n);
+    p += n;
+    len -= n;
+  }
+
+#endif
+}
+
+void WebHashMD5::finish(uint8_t digest[WEB_HASH_MD5_LEN])
+{
+#ifdef ESP32
+#ifdef WEB_HASH_MBEDTLS_RET
+  mbedtls_md5_finish_ret(&_ctx, digest);
+#else
+  mbedtls_md5_finish(&_ctx, digest);
+#endif
+#else
+  MD5Final(digest, &_ctx);
+#endif
+}
+
+void WebHashMD5::finishHex(char hex[WEB_HASH_MD5_LEN * 2 + 1])
+{
+  uint8_t digest[WEB_HASH_MD5_LEN];
+  finish(digest);
+  webHashHex(digest, WEB_HASH_MD5_LEN, hex);
+}
+
+/*
+   SHA-1
+*/
+
+WebHashSHA1::WebHashSHA1()
+{
+#ifdef ESP32
+  mbedtls_sha1_init(&_ctx);
+#ifdef WEB_HASH_MBEDTLS_RET
+  mbedtls_sha1_starts_ret(&_ctx);
+#else
+  mbedtls_sha1_starts(&_ctx);
+#endif
+#else
+  br_sha1_init(&_ctx);
+#endif
+}
+
+WebHashSHA1::~WebHashSHA1()
+{
+#ifdef ESP32
+  mbedtls_sha1_free(&_ctx);
+#endif
+}
+
+void WebHashSHA1::update(const void * data, size_t len)
+{
+#ifdef ESP32
+#ifdef WEB_HASH_MBEDTLS_RET
+  mbedtls_sha1_update_ret(&_ctx, (const unsigned char *)data, len);
+#else
+  mbedtls_sha1_update(&_ctx, (const unsigned char *)data, len);
+#endif
+#else
+  br_sha1_update(&_ctx, data, len);
+#endif
+}
+
+void WebHashSHA1::finish(uint8_t digest[WEB_HASH_SHA1_LEN])
+{
+#ifdef ESP32
+#ifdef WEB_HASH_MBEDTLS_RET
+  mbedtls_sha1_finish_ret(&_ctx, digest);
+#else
+  mbedtls_sha1_finish(&_ctx, digest);
+#endif
+#else
+  br_sha1_out(&_ctx, digest);
+#endif
+}
+
+/*
+   Helpers
+*/
+
+void webHashHex(const uint8_t * digest, size_t len, char * hex)
+{
+  static const char digits[] = "0123456789abcdef";
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hex[i * 2] = digits[digest[i] >> 4];
+    hex[i * 2 + 1] = digits[digest[i] & 0x0F];
+  }
+
+  hex[len * 2] = 0;
+}
+
+bool webHashEqual(const void * a, const void * b, size_t len)
+{
+  const uint8_t * x = (const uint8_t *)a;
+  const uint8_t * y = (const uint8_t *)b;
+  uint8_t diff = 0;
+
+  for (size_t i = 0; i < len; i++)
+    diff |= x[i] ^ y[i];
+
+  return diff == 0;
+}
@@ -0,0 +1,95 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WEB_HASH_H_
+#define WEB_HASH_H_
+
+#include "Arduino.h"
+
+#ifdef ESP32
+  #include "mbedtls/md5.h"
+  #include "mbedtls/sha1.h"
+#else
+  #include "md5.h"
+  #include <bearssl/bearssl_hash.h>
+#endif
+
+/*
+   Hashes for the WebSocket handshake and HTTP authentication. Contexts live on the stack and
+   nothing is allocated. On ESP32 SHA-1 goes through mbedtls, which uses the SHA engine of
+   the chip; MD5 has no engine and is computed in software, as it is on ESP8266.
+*/
+
+#define WEB_HASH_MD5_LEN    16
+#define WEB_HASH_SHA1_LEN   20
+
+class WebHashMD5
+{
+  public:
+    WebHashMD5();
+    ~WebHashMD5();
+    void update(const void * data, size_t len);
+    void update(const char * s)
+    {
+      update(s, strlen(s));
+    }
+    void update(const String &s)
+    {
+      update(s.c_str(), s.length());
+    }
+    void finish(uint8_t digest[WEB_HASH_MD5_LEN]);
+    // Lower case hex, 33 bytes with the terminator
+    void finishHex(char hex[WEB_HASH_MD5_LEN * 2 + 1]);
+
+  private:
+#ifdef ESP32
+    mbedtls_md5_context _ctx;
+#else
+    md5_context_t _ctx;
+#endif
+};
+
+class WebHashSHA1
+{
+  public:
+    WebHashSHA1();
+    ~WebHashSHA1();
+    void update(const void * data, size_t len);
+    void update(const char * s)
+    {
+      update(s, strlen(s));
+    }
+    void finish(uint8_t digest[WEB_HASH_SHA1_LEN]);
+
+  private:
+#ifdef ESP32
+    mbedtls_sha1_context _ctx;
+#else
+    br_sha1_context _ctx;
+#endif
+};
+
+void webHashHex(const uint8_t * digest, size_t len, char * hex);
+
+// Compare in a time that does not depend on where the first difference is
+bool webHashEqual(const void * a, const void * b, size_t len);
+
+#endif /* WEB_HASH_H_ */
@@ -0,0 +1,218 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WEB_SOCKET_DEFLATE_H_
+#define WEB_SOCKET_DEFLATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+   The permessage-deflate compressor of AsyncWebSocket.cpp: one fixed Huffman block per
+   message over a small LZ77 window, see the notes there.
+*/
+
+// 8..15, the LZ77 window of the compressor
+#ifndef WS_DEFLATE_WINDOW_BITS
+  #define WS_DEFLATE_WINDOW_BITS    11
+#endif
+
+// Match candidates tried per position, more is slower and compresses a little better
+#ifndef WS_DEFLATE_CHAIN
+  #define WS_DEFLATE_CHAIN          8
+#endif
+
+static_assert(WS_DEFLATE_WINDOW_BITS >= 8 && WS_DEFLATE_WINDOW_BITS <= 15, "WS_DEFLATE_WINDOW_BITS is 8..15");
+
+#define WS_DEFLATE_WINDOW           (1U << WS_DEFLATE_WINDOW_BITS)
+#define WS_DEFLATE_HASH_BITS        10
+
+// Fixed Huffman block writer, bits go out LSB first
+struct WebSocketDeflateOut
+{
+  uint8_t *out;
+  size_t size;
+  size_t pos;
+  uint32_t bits;
+  uint8_t count;
+
+  bool put(uint32_t value, uint8_t n)
+  {
+    bits |= value << count;
+    count += n;
+
+    while (count >= 8)
+    {
+      if (pos == size)
+        return false;
+
+      out[pos++] = bits & 0xFF;
+      bits >>= 8;
+      count -= 8;
+    }
+
+    return true;
+  }
+
+  // Huffman codes are defined MSB first
+  bool code(uint32_t value, uint8_t n)
+  {
+    uint32_t reversed = 0;
+
+    for (uint8_t i = 0; i < n; i++)
+      reversed |= ((value >> i) & 1) << (n - 1 - i);
+
+    return put(reversed, n);
+  }
+
+  bool symbol(uint16_t s)
+  {
+    if (s < 144)
+      return code(0x30 + s, 8);
+
+    if (s < 256)
+      return code(0x190 + s - 144, 9);
+
+    if (s < 280)
+      return code(s - 256, 7);
+
+    return code(0xC0 + s - 280, 8);
+  }
+
+  bool literal(uint8_t c)
+  {
+    return symbol(c);
+  }
+
+  bool match(uint16_t length, uint16_t distance)
+  {
+    static const uint16_t lengthBase[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                           67, 83, 99, 115, 131, 163, 195, 227, 258
+                                         };
+    static const uint16_t distanceBase[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                             513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+                                           };
+    uint8_t l = 28;
+
+    while (lengthBase[l] > length)
+      l--;
+
+    uint8_t d = 29;
+
+    while (distanceBase[d] > distance)
+      d--;
+
+    uint8_t lengthExtra = (l < 8 || l == 28) ? 0 : (l - 4) / 4;
+    uint8_t distanceExtra = d < 4 ? 0 : (d - 2) / 2;
+
+    return symbol(257 + l) && put(length - lengthBase[l], lengthExtra)
+           && code(d, 5) && put(distance - distanceBase[d], distanceExtra);
+  }
+};
+
+// Hash chains of the compressor, shared by all messages: the caller serializes
+static uint16_t webSocketDeflateHead[1 << WS_DEFLATE_HASH_BITS];
+static uint16_t webSocketDeflatePrev[WS_DEFLATE_WINDOW];
+
+static inline uint16_t webSocketDeflateHash(const uint8_t *p)
+{
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << WS_DEFLATE_HASH_BITS) - 1);
+}
+
+// Compress data into out as one non-final fixed Huffman block followed by the header bits of
+// an empty stored block, which is what is left after removing the 00 00 ff ff tail.
+// Returns the length, or 0 if it does not fit into size.
+static size_t webSocketDeflateBlock(const uint8_t *data, size_t len, uint8_t *out, size_t size)
+{
+  if (len >= 0xFFFF)
+    return 0;
+
+  memset(webSocketDeflateHead, 0, sizeof(webSocketDeflateHead));
+
+  WebSocketDeflateOut w = { out, size, 0, 0, 0 };
+  bool ok = w.put(0, 1) && w.put(1, 2);   // BFINAL 0, BTYPE fixed
+  size_t i = 0;
+
+  // head and prev hold position + 1, 0 = none
+  while (ok && i < len)
+  {
+    uint16_t bestLength = 0;
+    uint16_t bestDistance = 0;
+
+    if (i + 3 <= len)
+    {
+      uint16_t h = webSocketDeflateHash(data + i);
+      size_t candidate = webSocketDeflateHead[h];
+      uint8_t chain = WS_DEFLATE_CHAIN;
+      size_t limit = len - i < 258 ? len - i : 258;
+
+      while (candidate && chain--)
+      {
+        size_t c = candidate - 1;
+
+        if (i - c > WS_DEFLATE_WINDOW - 1)
+          break;
+
+        size_t n = 0;
+
+        while (n < limit && data[c + n] == data[i + n])
+          n++;
+
+        if (n >= 3 && n > bestLength)
+        {
+          bestLength = n;
+          bestDistance = i - c;
+
+          if (n == limit)
+            break;
+        }
+
+        size_t next = webSocketDeflatePrev[c & (WS_DEFLATE_WINDOW - 1)];
+
+        // The slot was reused by a newer position
+        if (next >= candidate)
+          break;
+
+        candidate = next;
+      }
+    }
+
+    size_t step = bestLength ? bestLength : 1;
+    ok = bestLength ? w.match(bestLength, bestDistance) : w.literal(data[i]);
+
+    for (size_t k = i; k < i + step && k + 3 <= len; k++)
+    {
+      uint16_t h = webSocketDeflateHash(data + k);
+      webSocketDeflatePrev[k & (WS_DEFLATE_WINDOW - 1)] = webSocketDeflateHead[h];
+      webSocketDeflateHead[h] = k + 1;
+    }
+
+    i += step;
+  }
+
+  // End of block, then BFINAL 0 and BTYPE stored, padded to a byte
+  ok = ok && w.symbol(256) && w.put(0, 3) && (w.count == 0 || w.put(0, 8 - w.count));
+
+  return ok ? w.pos : 0;
+}
+
+#endif // WEB_SOCKET_DEFLATE_H_
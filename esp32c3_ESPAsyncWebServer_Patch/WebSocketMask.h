@@ -0,0 +1,68 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WEB_SOCKET_MASK_H_
+#define WEB_SOCKET_MASK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// XOR data with the 4-byte frame mask; offset is the position of data[0] in the payload.
+// Bytes before the first word boundary and after the last one go one by one, the rest as
+// aligned 32-bit words with the mask rotated to match the position.
+static inline void webSocketMask(uint8_t *data, size_t len, const uint8_t *mask, size_t offset)
+{
+  size_t i = 0;
+
+  while (i < len && ((uintptr_t)(data + i) & 3))
+  {
+    data[i] ^= mask[(offset + i) & 3];
+    i++;
+  }
+
+  if (len - i >= 4)
+  {
+    uint8_t rotated[4];
+
+    for (uint8_t k = 0; k < 4; k++)
+      rotated[k] = mask[(offset + i + k) & 3];
+
+    uint32_t word;
+    memcpy(&word, rotated, 4);
+
+    uint32_t *p = (uint32_t *)(data + i);
+    size_t words = (len - i) / 4;
+
+    for (size_t w = 0; w < words; w++)
+      p[w] ^= word;
+
+    i += words * 4;
+  }
+
+  while (i < len)
+  {
+    data[i] ^= mask[(offset + i) & 3];
+    i++;
+  }
+}
+
+#endif // WEB_SOCKET_MASK_H_
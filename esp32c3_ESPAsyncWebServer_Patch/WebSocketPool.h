@@ -0,0 +1,208 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WEB_SOCKET_POOL_H_
+#define WEB_SOCKET_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <new>
+#include <utility>
+
+#if defined(ESP32)
+  #include <freertos/FreeRTOS.h>
+#elif defined(ESP8266)
+  #include <Arduino.h>
+#else
+  #include <atomic>
+#endif
+
+// Short critical section: pools are used from the user task and the AsyncTCP task
+class WebSocketPoolLock
+{
+  public:
+#if defined(ESP32)
+    void lock()
+    {
+      portENTER_CRITICAL(&_mux);
+    }
+    void unlock()
+    {
+      portEXIT_CRITICAL(&_mux);
+    }
+
+  private:
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+#elif defined(ESP8266)
+    void lock()
+    {
+      noInterrupts();
+    }
+    void unlock()
+    {
+      interrupts();
+    }
+#else
+    void lock()
+    {
+      while (_flag.test_and_set(std::memory_order_acquire))
+        ;
+    }
+    void unlock()
+    {
+      _flag.clear(std::memory_order_release);
+    }
+
+  private:
+    std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+#endif
+};
+
+struct WebSocketPoolStats
+{
+  uint32_t hits;
+  uint32_t misses;        // pool exhausted or too large, left to the heap
+  uint8_t inUse;
+  uint8_t peakInUse;
+};
+
+// BLOCKS fixed blocks of SIZE bytes, at most 32; 0 leaves everything to the heap. take()
+// returns NULL when the pool cannot serve a request, the caller falls back to the heap.
+template <uint8_t BLOCKS, size_t SIZE>
+class WebSocketPool
+{
+    static_assert(BLOCKS <= 32, "blocks are tracked in a 32-bit mask");
+
+  public:
+    WebSocketPool() : _used(0)
+    {
+      memset(&_stats, 0, sizeof(_stats));
+    }
+
+    void * take(size_t size)
+    {
+      void * block = NULL;
+      _lock.lock();
+
+      for (uint8_t i = 0; i < BLOCKS && size <= SIZE && !block; i++)
+      {
+        if (!(_used & (1UL << i)))
+        {
+          _used |= 1UL << i;
+          block = _blocks[i];
+        }
+      }
+
+      if (block)
+      {
+        _stats.hits++;
+
+        if (++_stats.inUse > _stats.peakInUse)
+          _stats.peakInUse = _stats.inUse;
+      }
+      else
+        _stats.misses++;
+
+      _lock.unlock();
+      return block;
+    }
+
+    bool owns(const void * ptr) const
+    {
+      return (uintptr_t)ptr - (uintptr_t)_blocks < sizeof(_blocks) && BLOCKS > 0;
+    }
+
+    void give(void * ptr)
+    {
+      _lock.lock();
+      _used &= ~(1UL << (((uintptr_t)ptr - (uintptr_t)_blocks) / sizeof(_blocks[0])));
+      _stats.inUse--;
+      _lock.unlock();
+    }
+
+    // Placement-new into a block, plain new once the pool is exhausted
+    template <typename T, typename... Args>
+    T * create(Args && ... args)
+    {
+      void * block = take(sizeof(T));
+      return block ? new (block) T(std::forward<Args>(args)...) : new T(std::forward<Args>(args)...);
+    }
+
+    // Counterpart of create(), for T or a base of it with a virtual destructor
+    template <typename T>
+    void destroy(T * object)
+    {
+      if (!owns(object))
+      {
+        delete object;
+        return;
+      }
+
+      object->~T();
+      give(object);
+    }
+
+    WebSocketPoolStats stats()
+    {
+      _lock.lock();
+      WebSocketPoolStats copy = _stats;
+      _lock.unlock();
+      return copy;
+    }
+
+  private:
+    alignas(8) uint8_t _blocks[BLOCKS ? BLOCKS : 1][(SIZE + 7) / 8 * 8];
+    uint32_t _used;
+    WebSocketPoolStats _stats;
+    WebSocketPoolLock _lock;
+};
+
+/*
+   Queue statistics of AsyncWebSocket.cpp. AsyncWebSocket.h is not part of the patch, so
+   they are read with these functions instead of members.
+*/
+
+class AsyncWebSocketClient;
+
+struct AsyncWebSocketQueueStats
+{
+  uint32_t queued;                // data messages accepted, all clients
+  uint32_t dropped;               // data messages refused, queue full or client gone
+  uint32_t controls;              // control frames queued
+  WebSocketPoolStats payloads;    // message payloads and control frames
+  WebSocketPoolStats messages;    // the per-client message objects
+};
+
+struct AsyncWebSocketClientQueueStats
+{
+  uint32_t queued;
+  uint32_t dropped;
+  uint16_t depth;                 // data messages waiting right now
+  uint16_t peakDepth;
+};
+
+void webSocketQueueStats(AsyncWebSocketQueueStats * stats);
+
+// False if the client is not tracked, see WS_QUEUE_STATS_CLIENTS
+bool webSocketClientQueueStats(const AsyncWebSocketClient * client, AsyncWebSocketClientQueueStats * stats);
+
+#endif // WEB_SOCKET_POOL_H_
@@ -46,11 +46,26 @@
 
 #define WM_HTTP_PORT     80
 #define WM_DNS_PORT      53
+
+// Optional WebSocket channel for the portal page on /ws, see wm_socket.h. The reference
+// page utils/portal/index.html uses it when it is there.
+#ifndef WM_PORTAL_WEBSOCKET
+  #define WM_PORTAL_WEBSOCKET   false
+#endif
 #define WM_MULTI_WIFI false
 
+// How long the portal stays up once the device is ready, so an open page still sees the
+// final state before the web and DNS servers are closed and the portal cache released
+#ifndef WM_PORTAL_LINGER_MS
+  #define WM_PORTAL_LINGER_MS   10000
+#endif
+
 ///////////////////////////////////////////
 
-#include <ESPAsyncDNSServer.h>
+#include "wm_dns.h"
+#if !WM_CAPTIVE_DNS
+  #include <ESPAsyncDNSServer.h>
+#endif
 #include <memory>
 #undef min
 #undef max
@@ -66,6 +81,11 @@
 #include "wm_config.h"
 #include "wm_wifi.h"
 #include "wm_fermion.h"
+#include "wm_portal.h"
+#if WM_PORTAL_WEBSOCKET
+  #include "wm_socket.h"
+#endif
+#include "wm_retry.h"
 
 //////////////////////////////////////////////
 
@@ -119,9 +139,13 @@ MultiResetDetector* rd;
 ///////////////////////////////////////////
 
 const char PASS_OBFUSCATE_STRING[]            PROGMEM = "********";
-const char FERMI_CLOUD_USERCODE_URL[]         PROGMEM = "https://fermicloud.dev/auth/realms/fermi-cloud/protocol/openid-connect/auth/device";
 const char FERMI_CLOUD_USERCODE_PAYLOAD[]     PROGMEM = "client_id=fermi-device&scope=openid offline_access";
 
+#define WM_DEVICE_FLOW_POLL_MS          5000L
+#define WM_DEVICE_CODE_MAX_LEN          256
+#define WM_USER_CODE_MAX_LEN            16
+#define WM_VERIFICATION_URI_MAX_LEN     160
+
 #define MIN_WIFI_CHANNEL        1
 #define MAX_WIFI_CHANNEL        11    // Channel 13 is flaky, because of bad number 13 ;-)
 
@@ -211,13 +235,17 @@ class WiFiManager
     {
 #define TIMEOUT_CONNECT_WIFI      30000
 
+      timeBegin = millis();
+
       rd = new MultiResetDetector(RD_TIMEOUT, RD_ADDRESS);
 
       wmSetHostname();
 
       if (!rd->detectMultiReset()) {
-        if (cloudConnect())
+        if (cloudConnect()) {
+          markReady();
           return;
+        }
       }
 
       // failed to connect, will start configuration mode
@@ -285,6 +313,12 @@ class WiFiManager
       // You can also call rd.stop() when you wish to no longer
       // consider the next reset as a double reset.
       rd->loop();
+      wmDnsCache.loop();
+      // MQTT events and cloud handlers are processed here, in loop context
+      Particle.loop();
+#if WM_PORTAL_WEBSOCKET
+      loopSocket();
+#endif
       loopState();
       return;
 
@@ -379,6 +413,9 @@ class WiFiManager
     //////////////////////////////////////////////
 
     bool isConfigMode()       { return state != WM_READY; }
+
+    // Milliseconds from begin() until the device first reached WM_READY, 0 if not yet
+    unsigned long getBootToReadyTime() { return bootToReadyMs; }
     String localIP()          { return WiFi.localIP().toString(); }
 
     void setMinimumSignalQuality(const int& quality) { _minimumQuality = quality; }
@@ -444,7 +481,16 @@ class WiFiManager
 #endif
     AsyncWebServer *server = nullptr;
     AsyncEventSource *events = nullptr;
+    WMProbeHandler *probes = nullptr;     // owned by server
+#if WM_PORTAL_WEBSOCKET
+    AsyncWebSocket *ws = nullptr;         // owned by server
+    WMPortalSocket portalSocket { PASS_OBFUSCATE_STRING };
+#endif
+#if WM_CAPTIVE_DNS
+    WMCaptiveDns *dnsServer = nullptr;
+#else
     AsyncDNSServer *dnsServer = nullptr;
+#endif
 
     unsigned long configTimeout;
 
@@ -459,8 +505,28 @@ class WiFiManager
     WMState state = WM_READY;
     unsigned long timeLastStateCheck = 0;
     unsigned long timeLastStateChange = 0;
+    unsigned long stateCheckInterval = 0;
+    unsigned long pollInterval = WM_DEVICE_FLOW_POLL_MS;
+
+    // One backoff policy per network step and endpoint set (the index in Particle.cloud),
+    // so a region failed over to starts with its own budget; see wm_retry.h
+    WMRetryPolicy codeRetry[FERMI_CLOUD_MAX_ENDPOINTS];
+    WMRetryPolicy tokenRetry[FERMI_CLOUD_MAX_ENDPOINTS];
+    WMRetryPolicy brokerRetry[FERMI_CLOUD_MAX_ENDPOINTS];
+    // Association with the access point
+    WMRetryPolicy wifiRetry;
+    unsigned long wifiAttemptAt = 0;
+    unsigned long wifiTimeoutMs = 0;
+    // A connect() whose outcome has not been seen yet, and on which endpoint set
+    bool brokerAttempt = false;
+    uint8_t brokerEndpoint = 0;
+    unsigned long brokerAttemptAt = 0;
+    // Connected at the last check, so a drop is followed by a spread first attempt
+    bool brokerWasUp = false;
     String deviceCode = "";
     String userCode = "";
+    unsigned long timeBegin = 0;
+    unsigned long bootToReadyMs = 0;
 
 #if USING_CORS_FEATURE
     PGM_P _CORS_Header = WM_HTTP_CORS_ALLOW_ALL;   // "*";
@@ -473,46 +539,65 @@ class WiFiManager
 
     bool fetchUserCode(long timeout = 5000) {
       WiFiClientSecure client;
-      client.setCACert(fermiRootCACertificate);
+      Particle.setupTlsClient(client);
       {
         // Add a scoping block for HTTPClient https to make sure it is destroyed before WiFiClientSecure client is 
         HTTPClient https;
         bool result = false;
+        uint8_t endpoint = Particle.cloud.currentIndex();
 
         https.setConnectTimeout(timeout);
         https.setTimeout(timeout);
-        https.begin(client, FERMI_CLOUD_USERCODE_URL);
+        Particle.beginHttps(https, client, Particle.endpoints().deviceCodeUrl, timeout);
         https.addHeader("Content-Type", "application/x-www-form-urlencoded", false, false);
+        const char *headerKeys[] = { "Retry-After" };
+        https.collectHeaders(headerKeys, 1);
 
         int httpCode = https.POST(FERMI_CLOUD_USERCODE_PAYLOAD);
+        if (httpCode < 0)
+          Particle.cloud.reportFailure();
         ESP_WML_LOGINFO1(F("s:DNS IP = "), WiFi.dnsIP(0).toString());
         ESP_WML_LOGINFO1(F("s:Gateway IP = "), WiFi.gatewayIP().toString());
         ESP_WML_LOGINFO1(F("s:Status code = "), httpCode);
-        StaticJsonDocument<200> filter;
-        StaticJsonDocument<400> doc;
+        WMJsonStreamSource source(https.getStream(), timeout);
         if (httpCode == 200) {
-            filter["device_code"] = true;
-            filter["user_code"] = true;
-            filter["verification_uri_complete"] = true;
-            DeserializationError error = deserializeJson(doc, https.getStream(), DeserializationOption::Filter(filter));
-            if (!error) {
-                deviceCode = doc["device_code"].as<const char*>();
-                userCode = doc["user_code"].as<const char*>();
+            char device[WM_DEVICE_CODE_MAX_LEN + 1];
+            char user[WM_USER_CODE_MAX_LEN + 1];
+            char verificationUri[WM_VERIFICATION_URI_MAX_LEN + 1];
+            char interval[8];
+            WMJsonField fields[] = {
+                { "device_code", device, sizeof(device) },
+                { "user_code", user, sizeof(user) },
+                { "verification_uri_complete", verificationUri, sizeof(verificationUri) },
+                { "interval", interval, sizeof(interval) },
+            };
+            if (wmJsonExtract(source, fields, 4) && fields[0].length && fields[1].length &&
+                !fields[0].truncated && !fields[1].truncated) {
+                deviceCode = device;
+                userCode = user;
+                // RFC 8628: poll no faster than the server asks for, 5 s if it does not say
+                pollInterval = fields[3].length ? atol(interval) * 1000L : WM_DEVICE_FLOW_POLL_MS;
+                if (pollInterval < WM_DEVICE_FLOW_POLL_MS)
+                  pollInterval = WM_DEVICE_FLOW_POLL_MS;
                 ESP_WML_LOGINFO1(F("s:User code = "), userCode.c_str());
-                ESP_WML_LOGINFO1(F("s:Verification URL = "), doc["verification_uri_complete"].as<const char*>());
+                ESP_WML_LOGINFO1(F("s:Verification URL = "), verificationUri);
                 result = true;
             } else {
-                ESP_WML_LOGINFO1(F("s:Deserialisation error: "), error.c_str());
+                ESP_WML_LOGINFO(F("s:Cannot parse device code response"));
             }
         } else {
-            filter["error"] = true;
-            filter["error_description"] = true;
-            DeserializationError error = deserializeJson(doc, https.getStream(), DeserializationOption::Filter(filter));
-            if (!error) {
-                ESP_WML_LOGINFO1(F("s:Got error: "), doc["error"].as<const char*>());
-                ESP_WML_LOGINFO1(F("s:Got error description: "), doc["error_description"].as<const char*>());
+            codeRetry[endpoint].retryAfter(wmParseRetryAfter(https.header("Retry-After")));
+            char err[FERMI_CLOUD_ERROR_MAX_LEN + 1];
+            char errDesc[FERMI_CLOUD_ERROR_DESC_MAX_LEN + 1];
+            WMJsonField fields[] = {
+                { "error", err, sizeof(err) },
+                { "error_description", errDesc, sizeof(errDesc) },
+            };
+            if (wmJsonExtract(source, fields, 2)) {
+                ESP_WML_LOGINFO1(F("s:Got error: "), err);
+                ESP_WML_LOGINFO1(F("s:Got error description: "), errDesc);
             } else {
-                ESP_WML_LOGINFO1(F("s:Deserialisation error: "), error.c_str());
+                ESP_WML_LOGINFO(F("s:Cannot parse error response"));
             }
         }
         https.end();
@@ -601,6 +686,12 @@ class WiFiManager
       parseParam(request, FPSTR("nm"), config.boardName, WM_BOARD_NAME_MAX_LEN);
 #endif
 
+      saveConfig();
+      request->send(204, FPSTR(WM_HTTP_HEAD_TEXT_HTML));
+    }
+
+    void saveConfig()
+    {
       {
 #if USE_LITTLEFS
         ESP_WML_LOGERROR1(F("h:Updating LittleFS:"), WM_CONFIG_FILENAME);
@@ -611,10 +702,58 @@ class WiFiManager
 #endif
 
         config.save();
-        request->send(204, FPSTR(WM_HTTP_HEAD_TEXT_HTML));
       }
     }
 
+#if WM_PORTAL_WEBSOCKET
+    //////////////////////////////////////////////
+
+    // Portal channel on /ws, see wm_socket.h
+
+    static void readConfigStatic(void *context, String &json)
+    {
+      ((WiFiManager *)context)->createConfigJson(json);
+    }
+
+    void handleSocketMessage(AsyncWebSocketClient *client, const char *data, size_t len)
+    {
+      String reply = portalSocket.handle(data, len, readConfigStatic, this);
+      if (reply.length())
+        client->text(reply);
+    }
+
+    // A config sent by a page is saved here, not on the AsyncTCP task it came in on
+    void loopSocket()
+    {
+      if (!portalSocket.take(config))
+        return;
+      saveConfig();
+      socketBroadcast('k', String());
+      setState(WM_CONNECTING);
+    }
+
+    void onSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+    {
+      if (type == WS_EVT_CONNECT) {
+        client->text("s" + String(this->state));
+        client->text("c" + this->userCode);
+      }
+      else if (type == WS_EVT_DATA) {
+        // Portal messages are small, fragmented frames are not expected
+        AwsFrameInfo *info = (AwsFrameInfo *)arg;
+        if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
+          handleSocketMessage(client, (const char *)data, len);
+      }
+    }
+
+    // Push a message to every open portal page
+    void socketBroadcast(char type, const String &value)
+    {
+      if (ws && ws->count())
+        ws->textAll(type + value);
+    }
+#endif
+
     //////////////////////////////////////////////
 
 #ifndef CONFIG_TIMEOUT
@@ -629,69 +768,155 @@ class WiFiManager
         return;
       timeLastStateChange = millis();
       if (events) events->send(String(newState).c_str(), "s", timeLastStateChange, 1000);
+#if WM_PORTAL_WEBSOCKET
+      socketBroadcast('s', String(newState));
+#endif
       switch (newState) {
         case WM_READY:
+          markReady();
+          break;
         case WM_WIFI_CONFIG:
         case WM_FETCH_CODE:
           break;
         case WM_CONNECTING:
-#if WM_MULTI_WIFI
-          wmConnectWifi(wifiMulti, config, WIFI_AP_STA);
-#else
-          WiFi.begin(config.getSSID(0), config.getPW(0));
-#endif
+          beginWifi(WM_RETRY_BASE_MS);
           break;
         case WM_FETCH_TOKEN:
           if (events) events->send(this->userCode.c_str(), "c", timeLastStateChange, 1000);
+#if WM_PORTAL_WEBSOCKET
+          socketBroadcast('c', this->userCode);
+#endif
           break;
       }
       this->state = newState;
-      timeLastStateCheck = 0;
+      timeLastStateCheck = millis();
+      stateCheckInterval = 0;
+    }
+
+    // Start associating and give it timeoutMs before the next attempt
+    void beginWifi(uint32_t timeoutMs) {
+#if WM_MULTI_WIFI
+      wmConnectWifi(wifiMulti, config, WIFI_AP_STA);
+#else
+      WiFi.begin(config.getSSID(0), config.getPW(0));
+#endif
+      wifiAttemptAt = millis();
+      wifiTimeoutMs = timeoutMs;
+    }
+
+    void markReady() {
+      if (bootToReadyMs == 0) {
+        bootToReadyMs = millis() - timeBegin;
+        ESP_WML_LOGWARN1(F("s:Boot to ready ms = "), bootToReadyMs);
+      }
     }
 
     void loopState() {
       unsigned long curMillis = millis();
-      if (curMillis - timeLastStateCheck < wmStateCheckIntervals[this->state])
+      if (curMillis - timeLastStateCheck < stateCheckInterval)
         return;
       timeLastStateCheck = curMillis;
+      stateCheckInterval = wmStateCheckIntervals[this->state];
 
       switch (this->state) {
         case WM_READY:
-          if (!Particle.isConnected()) {
-            if (Particle.accessToken.isEmpty()) {
-              setState(WM_FETCH_TOKEN);
-              return;            
+          if (server && curMillis - timeLastStateChange >= WM_PORTAL_LINGER_MS)
+            closePortal();
+          if (Particle.isConnected()) {
+            brokerRetry[Particle.cloud.currentIndex()].succeeded();
+            brokerAttempt = false;
+            brokerWasUp = true;
+            Particle.cloud.reportSuccess();
+            // A much faster region showed up: move there, the reconnect below picks it
+            if (Particle.cloud.reselect()) {
+              Particle.disconnect();
+              brokerWasUp = false;
+              break;
             }
-            if (!Particle.connect()) return;
+            Particle.heartBeat();
+            break;
+          }
+          if (Particle.isConnecting())
+            break;
+          if (Particle.accessToken.isEmpty()) {
+            setState(WM_FETCH_TOKEN);
+            return;
+          }
+          if (brokerWasUp || (brokerAttempt && Particle._wasConnected)) {
+            // A working session was lost, most likely by the whole fleet at once
+            brokerWasUp = false;
+            brokerAttempt = false;
+            stateCheckInterval = brokerRetry[Particle.cloud.currentIndex()].first();
+            break;
+          }
+          if (brokerAttempt) {
+            // The broker never accepted the last session. Only this counts as a failure,
+            // with the delay taken from when that attempt started.
+            brokerAttempt = false;
+            uint32_t delayMs = brokerRetry[brokerEndpoint].failed();
+            unsigned long spent = curMillis - brokerAttemptAt;
+            stateCheckInterval = delayMs > spent ? delayMs - spent : 0;
+            break;
           }
-          Particle.heartBeat();
+          brokerAttemptAt = curMillis;
+          brokerAttempt = Particle.connect();
+          brokerEndpoint = Particle.cloud.currentIndex();
+          if (!brokerAttempt)
+            stateCheckInterval = brokerRetry[brokerEndpoint].failed();
           break;
         case WM_WIFI_CONFIG:
           if (!config.isZero() && curMillis - timeLastStateChange > CONFIG_TIMEOUT)
             setState(WM_CONNECTING);
           break;
         case WM_CONNECTING:
-          if (WiFi.status() == WL_CONNECTED)
+          if (WiFi.status() == WL_CONNECTED) {
+            wifiRetry.succeeded();
             setState(Particle.hasRefreshToken() ? WM_FETCH_TOKEN : WM_FETCH_CODE);
+          } else if (curMillis - wifiAttemptAt >= wifiTimeoutMs) {
+            // Not associated in time: every device behind the same access point
+            // retries, so back off like the cloud steps do
+            beginWifi(wifiRetry.failed());
+          }
           // abort after TIMEOUT_CONNECT_WIFI milliseconds and go back to Wifi config mode
           // if (curMillis - timeLastStateChange > TIMEOUT_CONNECT_WIFI)
           //   setState(WM_WIFI_CONFIG);
           break;
-        case WM_FETCH_CODE:
-          if (fetchUserCode(wmStateCheckIntervals[this->state] - 200))
+        case WM_FETCH_CODE: {
+          uint8_t endpoint = Particle.cloud.currentIndex();
+          if (fetchUserCode(wmStateCheckIntervals[WM_FETCH_CODE] - 200)) {
+            codeRetry[endpoint].succeeded();
             setState(WM_FETCH_TOKEN);
+          } else
+            stateCheckInterval = codeRetry[endpoint].failed();
           break;
+        }
         case WM_FETCH_TOKEN:
-          FetchAccessTokenResult error = Particle.fetchAccessToken(deviceCode.c_str(), wmStateCheckIntervals[this->state] - 200);
+          uint8_t endpoint = Particle.cloud.currentIndex();
+          FetchAccessTokenResult error = Particle.fetchAccessToken(deviceCode.c_str(), wmStateCheckIntervals[WM_FETCH_TOKEN] - 200);
           switch (error) {
             case FC_OK:
+              tokenRetry[endpoint].succeeded();
+              deviceCode = "";
               setState(WM_READY);
               break;
+            case FC_CODE_NOT_VERIFIED_YET:
+              // Regular device flow polling, not a failure
+              stateCheckInterval = pollInterval;
+              break;
+            case FC_SLOW_DOWN:
+              pollInterval += WM_RETRY_SLOW_DOWN_MS;
+              stateCheckInterval = pollInterval;
+              break;
             case FC_INVALID_REFRESH_TOKEN:
               Particle.deleteRefreshToken();
             case FC_CODE_EXPIRED:
             case FC_CANNOT_LOAD_REFRESH_TOKEN:
               setState(WM_FETCH_CODE);
+              break;
+            case FC_INVALID_RESPONSE:
+              tokenRetry[endpoint].retryAfter(Particle.retryAfterMs);
+              stateCheckInterval = tokenRetry[endpoint].failed();
+              break;
           }
       }
     }
@@ -704,7 +929,9 @@ class WiFiManager
         portal_ssid = WM_HOSTNAME();
 
       WiFi.mode(WIFI_AP);
-      listSPIFFSFiles();
+      // Walks the whole filesystem, only worth it when debugging
+      if (_ESP_WM_LITE_LOGLEVEL_ > 3)
+        listSPIFFSFiles();
 
       // New
       delay(100);
@@ -731,7 +958,11 @@ class WiFiManager
       }
 
       if (!dnsServer)
+#if WM_CAPTIVE_DNS
+        dnsServer = new WMCaptiveDns();
+#else
         dnsServer = new AsyncDNSServer();
+#endif
   
       //See https://stackoverflow.com/questions/39803135/c-unresolved-overloaded-function-type?rq=1
       if (server && dnsServer)
@@ -740,22 +971,17 @@ class WiFiManager
         // if DNSServer is started with "*" for domain name, it will reply with provided IP to all DNS requests
         dnsServer->start(WM_DNS_PORT, "*", portal_apIP);
         
-        // reply to all requests with same HTML
+        // Connectivity probes first, they never reach the filesystem
+        if (!probes) {
+          probes = new WMProbeHandler(portal_apIP);
+          server->addHandler(probes);
+        }
+
+        // Portal files (gzip, ETag/304), unknown paths get the index page
         server->onNotFound([this](AsyncWebServerRequest * request)
         {
-          String path = request->url();
-          Serial.print(F("HANDLE REQUEST: "));
-          Serial.println(path);
-          AsyncWebServerResponse *response = request->beginResponse(FileFS, path);
-          if (response != NULL) {
-            request->send(response);
-            return;
-          }
-          response = request->beginResponse(FileFS, "/index.html");
-          if (response != NULL) {
-            request->send(response);
-            return;
-          }
+          ESP_WML_LOGDEBUG1(F("HANDLE REQUEST: "), request->url());
+          wmPortalServe(request);
         });
 
         // config handler
@@ -775,6 +1001,17 @@ class WiFiManager
           client->send(this->userCode.c_str(), "c", millis(), 1000);
         });
         server->addHandler(events);
+
+#if WM_PORTAL_WEBSOCKET
+        if (!ws) {
+          ws = new AsyncWebSocket(PSTR("/ws"));
+          ws->onEvent([this](AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg,
+                             uint8_t *data, size_t len) {
+            onSocketEvent(server, client, type, arg, data, len);
+          });
+          server->addHandler(ws);
+        }
+#endif
         server->begin();
       }
     }
@@ -788,9 +1025,17 @@ class WiFiManager
 
         if (server) {
           server->end();
+          // Deletes its handlers, the event source and the WebSocket with them
           delete server;
           server = nullptr;
+          events = nullptr;
+          probes = nullptr;
+#if WM_PORTAL_WEBSOCKET
+          ws = nullptr;
+#endif
         }
+        // The cached files are only needed while the portal is up
+        wmPortalCache.clear();
     }
 
     void startConfigurationMode()
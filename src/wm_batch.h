@@ -0,0 +1,181 @@
+#pragma once
+
+#ifndef wm_batch_h_
+#define wm_batch_h_
+
+#include <Arduino.h>
+#include "wm_debug.h"
+
+//////////////////////////////////////////////
+
+// Events published with the BATCHED flag are collected into one envelope on
+// devices/<id>/batch instead of one MQTT message each:
+//
+//   {"a":<ms since the first event>,"e":[{"n":"<name>","t":<ms since the first event>,"d":"<data>"},...]}
+//
+// The envelope goes out once the window has passed since its first event or when the next
+// event does not fit the byte budget. The cloud derives each event's time from "a" and "t".
+
+// Byte budget of the event list. 0 disables batching: BATCHED events are sent one by one.
+#ifndef FERMI_CLOUD_BATCH_BYTES
+  #define FERMI_CLOUD_BATCH_BYTES           1024
+#endif
+
+#ifndef FERMI_CLOUD_BATCH_WINDOW_MS
+  #define FERMI_CLOUD_BATCH_WINDOW_MS       1000
+#endif
+
+// Room in front of the event list for {"a":<ms>,"e":
+#define FERMI_CLOUD_BATCH_HEAD_LEN          (sizeof("{\"a\":4294967295,\"e\":") - 1)
+
+struct FermiBatchStats
+{
+    uint32_t events;            // events added to an envelope
+    uint32_t envelopes;         // envelopes sent
+    uint32_t lost;              // events of envelopes that could not be sent
+    uint16_t lastBytes;         // size of the last envelope
+    uint16_t lastEvents;        // events in the last envelope
+};
+
+// Publishes a finished envelope, returns false if it could not be sent
+typedef bool (*FermiBatchSender)(void *context, const char *payload, size_t length);
+
+//////////////////////////////////////////////
+
+class FermiEventBatch
+{
+public:
+    enum Result { ADDED, FULL, TOO_LARGE };
+
+    FermiEventBatch() : length(0), count(0), startedAt(0)
+    {
+        memset(&statistics, 0, sizeof(statistics));
+        lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    }
+
+    bool enabled() const { return FERMI_CLOUD_BATCH_BYTES > 0; }
+
+    // FULL: flush() and add again. TOO_LARGE: the event never fits, send it on its own.
+    Result add(const char *name, const char *data)
+    {
+        size_t nameLength = escapedLength(name);
+        size_t dataLength = escapedLength(data);
+        // ,{"n":"","t":4294967295,"d":""}
+        size_t need = 1 + sizeof("{\"n\":\"\",\"t\":4294967295,\"d\":\"\"}") - 1 + nameLength + dataLength;
+        if (need + 1 > FERMI_CLOUD_BATCH_BYTES)
+            return TOO_LARGE;
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (length + need + 1 > FERMI_CLOUD_BATCH_BYTES)
+        {
+            xSemaphoreGive(lock);
+            return FULL;
+        }
+
+        uint32_t now = millis();
+        if (!count)
+            startedAt = now;
+        char *p = body + length;
+        p += sprintf(p, "%s{\"n\":\"", count ? "," : "[");
+        p = escape(p, name);
+        p += sprintf(p, "\",\"t\":%lu,\"d\":\"", (unsigned long)(now - startedAt));
+        p = escape(p, data);
+        *p++ = '"';
+        *p++ = '}';
+        length = p - body;
+        count++;
+        statistics.events++;
+        xSemaphoreGive(lock);
+        return ADDED;
+    }
+
+    // The first event has waited for the window
+    bool due() const
+    {
+        return count && millis() - startedAt >= FERMI_CLOUD_BATCH_WINDOW_MS;
+    }
+
+    // Close the envelope and hand it to send. The batch is empty afterwards either way.
+    bool flush(FermiBatchSender send, void *context)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (!count)
+        {
+            xSemaphoreGive(lock);
+            return true;
+        }
+
+        char head[FERMI_CLOUD_BATCH_HEAD_LEN + 1];
+        size_t headLength = snprintf(head, sizeof(head), "{\"a\":%lu,\"e\":", (unsigned long)(millis() - startedAt));
+        char *payload = body - headLength;
+        memcpy(payload, head, headLength);
+        body[length++] = ']';
+        body[length++] = '}';
+        body[length] = '\0';
+
+        size_t total = headLength + length;
+        bool sent = send(context, payload, total);
+        if (sent)
+        {
+            statistics.envelopes++;
+            statistics.lastBytes = total;
+            statistics.lastEvents = count;
+        }
+        else
+        {
+            statistics.lost += count;
+            ESP_WML_LOGWARN1(F("s:Batch not sent, events lost = "), count);
+        }
+
+        length = 0;
+        count = 0;
+        xSemaphoreGive(lock);
+        return sent;
+    }
+
+    uint16_t size() const { return count; }
+    const FermiBatchStats &stats() const { return statistics; }
+
+private:
+    // Length of s as the content of a JSON string, NULL is written as ""
+    static size_t escapedLength(const char *s)
+    {
+        size_t n = 0;
+        for (; s && *s; s++)
+        {
+            uint8_t c = *s;
+            n += c == '"' || c == '\\' ? 2 : c < 0x20 ? 6 : 1;
+        }
+        return n;
+    }
+
+    static char *escape(char *p, const char *s)
+    {
+        for (; s && *s; s++)
+        {
+            uint8_t c = *s;
+            if (c == '"' || c == '\\')
+            {
+                *p++ = '\\';
+                *p++ = c;
+            }
+            else if (c < 0x20)
+                p += sprintf(p, "\\u%04x", c);
+            else
+                *p++ = c;
+        }
+        return p;
+    }
+
+    // The event list is built after room for the head, so a flush only prepends it
+    char buffer[FERMI_CLOUD_BATCH_HEAD_LEN + (FERMI_CLOUD_BATCH_BYTES > 0 ? FERMI_CLOUD_BATCH_BYTES : 1) + 2];
+    char *const body = buffer + FERMI_CLOUD_BATCH_HEAD_LEN;
+    size_t length;
+    uint16_t count;
+    uint32_t startedAt;
+    FermiBatchStats statistics;
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lockBuffer;
+};
+
+#endif // wm_batch_h_
@@ -0,0 +1,210 @@
+#pragma once
+
+#ifndef wm_cache_h_
+#define wm_cache_h_
+
+#include <Arduino.h>
+#include <memory>
+#include <esp_heap_caps.h>
+#include "wm_debug.h"
+#include "wm_file.h"
+
+//////////////////////////////////////////////
+
+// Bodies of recently served portal files, so a busy portal does not open and read the
+// filesystem from the AsyncTCP task for every request. Bounded by bytes and entries, least
+// recently used entries go first. Dropped as a whole when wmFileGeneration changes.
+// Only used from the AsyncTCP task, and released by closePortal() once the server is gone.
+
+// 0 disables the cache
+#ifndef WM_PORTAL_CACHE_BYTES
+  #define WM_PORTAL_CACHE_BYTES         32768
+#endif
+
+#ifndef WM_PORTAL_CACHE_ENTRIES
+  #define WM_PORTAL_CACHE_ENTRIES       16
+#endif
+
+// Larger files are streamed from the filesystem as before
+#ifndef WM_PORTAL_CACHE_FILE_MAX
+  #define WM_PORTAL_CACHE_FILE_MAX      8192
+#endif
+
+// Keep the bodies in PSRAM when there is some
+#ifndef WM_PORTAL_CACHE_PSRAM
+  #define WM_PORTAL_CACHE_PSRAM         true
+#endif
+
+#define WM_PORTAL_ETAG_MAX_LEN          24
+
+struct WMCacheStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t invalidations;
+    uint32_t bytes;             // bodies held right now
+    uint8_t entries;
+};
+
+//////////////////////////////////////////////
+
+// A file body. Shared with the responses that are still sending it, so an entry can be
+// evicted while a slow client is downloading.
+struct WMCacheBlob
+{
+    uint8_t *data;
+    size_t length;
+
+    explicit WMCacheBlob(size_t n) : data(NULL), length(n)
+    {
+        if (WM_PORTAL_CACHE_PSRAM)
+            data = (uint8_t *)heap_caps_malloc(n, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!data)
+            data = (uint8_t *)malloc(n);
+    }
+
+    ~WMCacheBlob() { free(data); }
+};
+
+typedef std::shared_ptr<WMCacheBlob> WMCacheBlobPtr;
+
+struct WMCacheEntry
+{
+    String key;                 // requested path, "" = free
+    bool acceptGzip;            // the client accepted gzip, part of the key
+    String path;                // file that was served
+    bool gzip;                  // path.gz was served
+    char etag[WM_PORTAL_ETAG_MAX_LEN];
+    WMCacheBlobPtr blob;
+    uint32_t used;
+};
+
+//////////////////////////////////////////////
+
+class WMFileCache
+{
+public:
+    WMFileCache() : tick(0), generation(0)
+    {
+        memset(&statistics, 0, sizeof(statistics));
+    }
+
+    const WMCacheEntry *find(const String &key, bool acceptGzip)
+    {
+        if (generation != wmFileGeneration)
+        {
+            clear();
+            generation = wmFileGeneration;
+            statistics.invalidations++;
+        }
+        for (uint8_t i = 0; i < WM_PORTAL_CACHE_ENTRIES; i++)
+        {
+            WMCacheEntry &e = entries[i];
+            if (e.blob && e.acceptGzip == acceptGzip && e.key == key)
+            {
+                e.used = ++tick;
+                statistics.hits++;
+                return &e;
+            }
+        }
+        statistics.misses++;
+        return NULL;
+    }
+
+    // Read an open file into the cache. Returns NULL if it is too large or memory is short.
+    const WMCacheEntry *add(const String &key, bool acceptGzip, const String &path, File &file, const char *etag)
+    {
+        size_t length = file.size();
+        if (WM_PORTAL_CACHE_BYTES == 0 || length > WM_PORTAL_CACHE_FILE_MAX || length > WM_PORTAL_CACHE_BYTES)
+            return NULL;
+        bool gzip = String(file.name()).endsWith(".gz");
+
+        // Another key may hold it already, e.g. a file without .gz variant served to clients
+        // with and without gzip
+        WMCacheBlobPtr blob;
+        for (uint8_t i = 0; i < WM_PORTAL_CACHE_ENTRIES && !blob; i++)
+            if (entries[i].blob && entries[i].gzip == gzip && entries[i].path == path && strcmp(entries[i].etag, etag) == 0)
+                blob = entries[i].blob;
+
+        if (!blob)
+        {
+            while (statistics.bytes + length > WM_PORTAL_CACHE_BYTES && evict())
+                ;
+            blob = std::make_shared<WMCacheBlob>(length);
+            if (!blob->data || file.read(blob->data, length) != length)
+                return NULL;
+            statistics.bytes += length;
+        }
+
+        WMCacheEntry *slot = NULL;
+        for (uint8_t i = 0; i < WM_PORTAL_CACHE_ENTRIES && !slot; i++)
+            if (!entries[i].blob)
+                slot = &entries[i];
+        if (!slot)
+        {
+            evict();
+            for (uint8_t i = 0; i < WM_PORTAL_CACHE_ENTRIES && !slot; i++)
+                if (!entries[i].blob)
+                    slot = &entries[i];
+        }
+        if (!slot)
+            return NULL;
+
+        slot->key = key;
+        slot->acceptGzip = acceptGzip;
+        slot->path = path;
+        slot->gzip = gzip;
+        strlcpy(slot->etag, etag, sizeof(slot->etag));
+        slot->blob = blob;
+        slot->used = ++tick;
+        statistics.entries++;
+        return slot;
+    }
+
+    void clear()
+    {
+        for (uint8_t i = 0; i < WM_PORTAL_CACHE_ENTRIES; i++)
+            release(entries[i]);
+        statistics.bytes = 0;
+        statistics.entries = 0;
+    }
+
+    const WMCacheStats &stats() const { return statistics; }
+
+private:
+    // Drop the least recently used entry
+    bool evict()
+    {
+        WMCacheEntry *oldest = NULL;
+        for (uint8_t i = 0; i < WM_PORTAL_CACHE_ENTRIES; i++)
+            if (entries[i].blob && (!oldest || entries[i].used < oldest->used))
+                oldest = &entries[i];
+        if (!oldest)
+            return false;
+
+        bool shared = false;
+        for (uint8_t i = 0; i < WM_PORTAL_CACHE_ENTRIES; i++)
+            shared |= &entries[i] != oldest && entries[i].blob == oldest->blob;
+        if (!shared)
+            statistics.bytes -= oldest->blob->length;
+        release(*oldest);
+        statistics.entries--;
+        statistics.evictions++;
+        return true;
+    }
+
+    static void release(WMCacheEntry &e)
+    {
+        e.blob.reset();
+        e.key = String();
+        e.path = String();
+    }
+
+    WMCacheEntry entries[WM_PORTAL_CACHE_ENTRIES];
+    uint32_t tick;
+    uint32_t generation;
+    WMCacheStats statistics;
+};
+
+#endif // wm_cache_h_
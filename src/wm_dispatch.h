@@ -0,0 +1,339 @@
+#pragma once
+
+#ifndef wm_dispatch_h_
+#define wm_dispatch_h_
+
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+#include "wm_debug.h"
+#include "wm_encoding.h"
+#include "wm_ring.h"
+
+//////////////////////////////////////////////
+
+// Cloud function handlers, see FermiDevice::function()
+typedef int (*CloudFunctionHandler)(String);
+typedef int (*CloudFunctionViewHandler)(const char *params, size_t length);
+
+// Function calls are copied into a fixed ring and run on worker tasks, so a slow handler
+// does not stall the loop task, which drains the MQTT events (and, before, the esp-mqtt
+// task with its keep-alives and acks). 0 runs the handlers inline in loop().
+#ifndef FERMI_CLOUD_FUNCTION_WORKERS
+  #define FERMI_CLOUD_FUNCTION_WORKERS          1
+#endif
+
+// Calls that can wait for a worker; further calls are answered with "busy"
+#ifndef FERMI_CLOUD_FUNCTION_QUEUE_LEN
+  #define FERMI_CLOUD_FUNCTION_QUEUE_LEN        4
+#endif
+
+// Parameters copied into a queue slot. Calls with longer parameters do not take a slot
+// but run inline in loop(), as they do without workers.
+#ifndef FERMI_CLOUD_FUNCTION_PARAMS_MAX_LEN
+  #define FERMI_CLOUD_FUNCTION_PARAMS_MAX_LEN   512
+#endif
+
+#ifndef FERMI_CLOUD_FUNCTION_STACK_SIZE
+  #define FERMI_CLOUD_FUNCTION_STACK_SIZE       4096
+#endif
+
+#ifndef FERMI_CLOUD_FUNCTION_PRIORITY
+  #define FERMI_CLOUD_FUNCTION_PRIORITY         (tskIDLE_PRIORITY + 1)
+#endif
+
+#ifndef FERMI_CLOUD_FUNCTION_CORE
+  #define FERMI_CLOUD_FUNCTION_CORE             tskNO_AFFINITY
+#endif
+
+// Deadline of a call unless the function was registered with its own. The caller gets
+// "timeout" then, but a handler cannot be cancelled: it keeps its worker and its queue
+// slot until it returns, and its late result is dropped.
+#ifndef FERMI_CLOUD_FUNCTION_TIMEOUT_MS
+  #define FERMI_CLOUD_FUNCTION_TIMEOUT_MS       10000
+#endif
+
+// Timeout responses the deadline timer hands to loop(), see FermiFunctionDispatcher::loop()
+#ifndef FERMI_CLOUD_FUNCTION_TIMEOUT_RING_SIZE
+  #define FERMI_CLOUD_FUNCTION_TIMEOUT_RING_SIZE    512
+#endif
+
+#define FERMI_CLOUD_REQUEST_ID_MAX_LEN          20
+#define FERMI_CLOUD_FUNCTION_RESPONSE_MAX_LEN   (sizeof("{\"i\":,\"e\":\"timeout\"}") + FERMI_CLOUD_REQUEST_ID_MAX_LEN + 12)
+
+//////////////////////////////////////////////
+
+struct FermiFunctionJob
+{
+    const char *name;       // registered name, outlives the job
+    CloudFunctionHandler func;
+    CloudFunctionViewHandler view;
+    uint32_t queuedAt;
+    uint32_t timeoutMs;
+    FermiEncoding encoding;     // of the request, used for the response
+    char requestId[FERMI_CLOUD_REQUEST_ID_MAX_LEN + 1];
+    char params[FERMI_CLOUD_FUNCTION_PARAMS_MAX_LEN + 1];
+    size_t paramsLength;
+    // Set by whoever answers first: the worker with the result or the deadline timer
+    std::atomic<bool> answered;
+};
+
+// Updated by the loop task, the workers and the deadline timer
+struct FermiDispatchStats
+{
+    FermiDispatchStats() :
+        queued(0), completed(0), rejected(0), timedOut(0), timeoutsLost(0), lastExecMs(0), maxExecMs(0), maxWaitMs(0), depth(0), maxDepth(0)
+    {}
+
+    std::atomic<uint32_t> queued;
+    std::atomic<uint32_t> completed;
+    std::atomic<uint32_t> rejected;     // queue full or parameters too long
+    std::atomic<uint32_t> timedOut;     // answered with "timeout", incl. calls that expired while queued
+    std::atomic<uint32_t> timeoutsLost; // timeout responses that did not fit the ring for loop()
+    std::atomic<uint32_t> lastExecMs;
+    std::atomic<uint32_t> maxExecMs;
+    std::atomic<uint32_t> maxWaitMs;    // longest time a call spent in the queue
+    std::atomic<uint8_t> depth;         // calls waiting right now
+    std::atomic<uint8_t> maxDepth;
+};
+
+template <typename T>
+static inline void fermiRaise(std::atomic<T> &maximum, T value)
+{
+    T current = maximum.load();
+    while (value > current && !maximum.compare_exchange_weak(current, value))
+        ;
+}
+
+// Publishes a /response payload for the function name
+typedef void (*FermiFunctionResponder)(void *context, const char *name, const char *response, size_t length);
+
+//////////////////////////////////////////////
+
+class FermiFunctionDispatcher
+{
+public:
+    FermiFunctionDispatcher() : responder(NULL), context(NULL), started(false), freeSlots(NULL), pending(NULL) {}
+
+    void setResponder(FermiFunctionResponder r, void *ctx)
+    {
+        responder = r;
+        context = ctx;
+    }
+
+    bool enabled() const { return FERMI_CLOUD_FUNCTION_WORKERS > 0; }
+
+    // Parameters of this length fit into a queue slot
+    bool fits(size_t paramsLength) const { return paramsLength <= FERMI_CLOUD_FUNCTION_PARAMS_MAX_LEN; }
+
+    // Create the queues and worker tasks once the scheduler runs
+    bool begin()
+    {
+        if (!enabled() || started)
+            return started;
+
+        freeSlots = xQueueCreateStatic(FERMI_CLOUD_FUNCTION_QUEUE_LEN, sizeof(uint8_t), freeStorage, &freeQueue);
+        pending = xQueueCreateStatic(FERMI_CLOUD_FUNCTION_QUEUE_LEN, sizeof(uint8_t), pendingStorage, &pendingQueue);
+        for (uint8_t i = 0; i < FERMI_CLOUD_FUNCTION_QUEUE_LEN; i++)
+            xQueueSend(freeSlots, &i, 0);
+
+        for (uint8_t w = 0; w < FERMI_CLOUD_FUNCTION_WORKERS; w++)
+        {
+            workers[w].owner = this;
+            workers[w].job = NULL;
+            workers[w].deadlineDone = xSemaphoreCreateBinaryStatic(&workers[w].deadlineDoneBuffer);
+            esp_timer_create_args_t args = {};
+            args.callback = deadlineStatic;
+            args.arg = &workers[w];
+            args.name = "fermi_deadline";
+            if (esp_timer_create(&args, &workers[w].timer) != ESP_OK ||
+                xTaskCreatePinnedToCore(workerStatic, "fermi_func", FERMI_CLOUD_FUNCTION_STACK_SIZE, &workers[w],
+                                        FERMI_CLOUD_FUNCTION_PRIORITY, NULL, FERMI_CLOUD_FUNCTION_CORE) != pdPASS)
+            {
+                ESP_WML_LOGERROR(F("s:Cannot start function worker"));
+                return false;
+            }
+        }
+        started = true;
+        return true;
+    }
+
+    // Called from FermiDevice::loop(). Copies the call and returns at once; the response is
+    // published by the worker, by loop() once the deadline passed or, if the call cannot be
+    // queued, here.
+    bool submit(const char *name, CloudFunctionHandler func, CloudFunctionViewHandler view, const char *requestId,
+                const char *params, size_t paramsLength, uint32_t timeoutMs, FermiEncoding encoding = FERMI_ENCODING_JSON)
+    {
+        uint8_t slot;
+        if (!started || paramsLength > FERMI_CLOUD_FUNCTION_PARAMS_MAX_LEN || xQueueReceive(freeSlots, &slot, 0) != pdTRUE)
+        {
+            statistics.rejected++;
+            char response[FERMI_CLOUD_FUNCTION_RESPONSE_MAX_LEN];
+            size_t length = fermiFunctionError(response, sizeof(response), encoding, requestId,
+                                               paramsLength > FERMI_CLOUD_FUNCTION_PARAMS_MAX_LEN ? "too_long" : "busy");
+            respond(name, response, length);
+            return false;
+        }
+
+        FermiFunctionJob &job = jobs[slot];
+        job.name = name;
+        job.func = func;
+        job.view = view;
+        job.queuedAt = millis();
+        job.timeoutMs = timeoutMs ? timeoutMs : FERMI_CLOUD_FUNCTION_TIMEOUT_MS;
+        job.encoding = encoding;
+        strlcpy(job.requestId, requestId, sizeof(job.requestId));
+        memcpy(job.params, params, paramsLength);
+        job.params[paramsLength] = '\0';
+        job.paramsLength = paramsLength;
+        job.answered = false;
+
+        statistics.queued++;
+        uint8_t depth = FERMI_CLOUD_FUNCTION_QUEUE_LEN - uxQueueMessagesWaiting(freeSlots);
+        statistics.depth = depth;
+        fermiRaise(statistics.maxDepth, depth);
+
+        xQueueSend(pending, &slot, portMAX_DELAY);
+        return true;
+    }
+
+    // Called from FermiDevice::loop(): publishes the timeout responses of calls whose
+    // handler is still running past its deadline
+    void loop()
+    {
+        WMSpscRing<FERMI_CLOUD_FUNCTION_TIMEOUT_RING_SIZE>::Record *record;
+        while ((record = timeouts.front()) != NULL)
+        {
+            // key: the request id, data: the registered name, which outlives the job
+            const char *name;
+            char requestId[FERMI_CLOUD_REQUEST_ID_MAX_LEN + 1];
+            memcpy(&name, record->data(), sizeof(name));
+            memcpy(requestId, record->key(), record->keyLength);
+            requestId[record->keyLength] = '\0';
+            FermiEncoding encoding = (FermiEncoding)record->type;
+            timeouts.pop();
+
+            ESP_WML_LOGWARN1(F("s:Function deadline exceeded: "), name);
+            char response[FERMI_CLOUD_FUNCTION_RESPONSE_MAX_LEN];
+            size_t length = fermiFunctionError(response, sizeof(response), encoding, requestId, "timeout");
+            respond(name, response, length);
+        }
+    }
+
+    const FermiDispatchStats &stats() const { return statistics; }
+
+private:
+    struct Worker
+    {
+        FermiFunctionDispatcher *owner;
+        esp_timer_handle_t timer;
+        FermiFunctionJob *volatile job;
+        // Given by the deadline callback when it is done with job
+        SemaphoreHandle_t deadlineDone;
+        StaticSemaphore_t deadlineDoneBuffer;
+    };
+
+    void respond(const char *name, const char *response, size_t length)
+    {
+        if (responder)
+            responder(context, name, response, length);
+    }
+
+    void run(Worker &worker, uint8_t slot)
+    {
+        FermiFunctionJob &job = jobs[slot];
+        uint32_t waited = millis() - job.queuedAt;
+        fermiRaise(statistics.maxWaitMs, waited);
+
+        if (waited >= job.timeoutMs)
+        {
+            // Expired while waiting: the caller has given up already
+            job.answered = true;
+            statistics.timedOut++;
+            char response[FERMI_CLOUD_FUNCTION_RESPONSE_MAX_LEN];
+            size_t length = fermiFunctionError(response, sizeof(response), job.encoding, job.requestId, "timeout");
+            respond(job.name, response, length);
+        }
+        else
+        {
+            worker.job = &job;
+            esp_timer_start_once(worker.timer, (uint64_t)(job.timeoutMs - waited) * 1000);
+
+            uint32_t start = millis();
+            int result = job.view ? job.view(job.params, job.paramsLength) : job.func(String(job.params, job.paramsLength));
+            uint32_t elapsed = millis() - start;
+
+            // esp_timer_stop() fails once the callback has been dispatched, and does not wait
+            // for it. The slot must not be reused while the callback still reads the job.
+            if (esp_timer_stop(worker.timer) != ESP_OK)
+                xSemaphoreTake(worker.deadlineDone, portMAX_DELAY);
+            worker.job = NULL;
+
+            statistics.lastExecMs = elapsed;
+            fermiRaise(statistics.maxExecMs, elapsed);
+
+            bool expected = false;
+            if (job.answered.compare_exchange_strong(expected, true))
+            {
+                statistics.completed++;
+                char response[FERMI_CLOUD_FUNCTION_RESPONSE_MAX_LEN];
+                size_t length = fermiFunctionResult(response, sizeof(response), job.encoding, job.requestId, result);
+                respond(job.name, response, length);
+            }
+            else
+                ESP_WML_LOGWARN1(F("s:Late result dropped for "), job.name);
+        }
+
+        xQueueSend(freeSlots, &slot, portMAX_DELAY);
+        statistics.depth = FERMI_CLOUD_FUNCTION_QUEUE_LEN - uxQueueMessagesWaiting(freeSlots);
+    }
+
+    static void workerStatic(void *arg)
+    {
+        Worker &worker = *(Worker *)arg;
+        uint8_t slot;
+        while (true)
+        {
+            if (xQueueReceive(worker.owner->pending, &slot, portMAX_DELAY) == pdTRUE)
+                worker.owner->run(worker, slot);
+        }
+    }
+
+    // esp_timer task: the handler is still running past its deadline. Only claims the answer
+    // and queues the response; publishing takes clientLock and may block, which would stall
+    // every other esp_timer callback. The worker stays busy until the handler returns.
+    static void deadlineStatic(void *arg)
+    {
+        Worker &worker = *(Worker *)arg;
+        FermiFunctionJob *job = worker.job;
+        bool expected = false;
+        if (job && job->answered.compare_exchange_strong(expected, true))
+        {
+            FermiFunctionDispatcher &owner = *worker.owner;
+            owner.statistics.timedOut++;
+            if (!owner.timeouts.push(0, job->encoding, 0, job->requestId, strlen(job->requestId),
+                                     (const char *)&job->name, sizeof(job->name)))
+                owner.statistics.timeoutsLost++;
+        }
+        xSemaphoreGive(worker.deadlineDone);
+    }
+
+    FermiFunctionResponder responder;
+    void *context;
+    bool started;
+    FermiDispatchStats statistics;
+    // esp_timer task (the only producer) -> loop()
+    WMSpscRing<FERMI_CLOUD_FUNCTION_TIMEOUT_RING_SIZE> timeouts;
+
+    FermiFunctionJob jobs[FERMI_CLOUD_FUNCTION_QUEUE_LEN];
+    Worker workers[FERMI_CLOUD_FUNCTION_WORKERS > 0 ? FERMI_CLOUD_FUNCTION_WORKERS : 1];
+
+    QueueHandle_t freeSlots;
+    QueueHandle_t pending;
+    StaticQueue_t freeQueue;
+    StaticQueue_t pendingQueue;
+    uint8_t freeStorage[FERMI_CLOUD_FUNCTION_QUEUE_LEN];
+    uint8_t pendingStorage[FERMI_CLOUD_FUNCTION_QUEUE_LEN];
+};
+
+#endif // wm_dispatch_h_
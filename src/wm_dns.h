@@ -0,0 +1,610 @@
+#pragma once
+
+#ifndef wm_dns_h_
+#define wm_dns_h_
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <AsyncUDP.h>
+#include <sys/time.h>
+#include "lwip/opt.h"
+#include "lwip/dns.h"
+#include "lwip/tcpip.h"
+#include "wm_debug.h"
+
+//////////////////////////////////////////////
+
+// DNS wire format helpers (RFC 1035)
+
+#define WM_DNS_HEADER_LEN         12
+#define WM_DNS_TYPE_A             1
+#define WM_DNS_TYPE_AAAA          28
+#define WM_DNS_CLASS_IN           1
+#define WM_DNS_MAX_PACKET         512
+
+static inline uint16_t _wmDnsGet16(const uint8_t *p) { return (uint16_t)(p[0] << 8) | p[1]; }
+static inline uint32_t _wmDnsGet32(const uint8_t *p) { return ((uint32_t)_wmDnsGet16(p) << 16) | _wmDnsGet16(p + 2); }
+static inline void _wmDnsPut16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = v & 0xFF; }
+static inline void _wmDnsPut32(uint8_t *p, uint32_t v) { _wmDnsPut16(p, v >> 16); _wmDnsPut16(p + 2, v & 0xFFFF); }
+
+// Skip an encoded name at offset, return the offset behind it or 0 if malformed
+static size_t _wmDnsSkipName(const uint8_t *buf, size_t len, size_t pos)
+{
+    while (pos < len)
+    {
+        uint8_t l = buf[pos];
+        if (l == 0)
+            return pos + 1;
+        if ((l & 0xC0) == 0xC0)
+            return pos + 2 <= len ? pos + 2 : 0;
+        pos += l + 1;
+    }
+    return 0;
+}
+
+// Build a recursive A query for host, return the packet length or 0
+size_t wmDnsBuildQuery(uint8_t *buf, size_t size, uint16_t id, const char *host)
+{
+    size_t hostLen = strlen(host);
+    if (hostLen == 0 || WM_DNS_HEADER_LEN + hostLen + 2 + 4 > size)
+        return 0;
+
+    memset(buf, 0, WM_DNS_HEADER_LEN);
+    _wmDnsPut16(buf, id);
+    buf[2] = 0x01;                  // RD
+    _wmDnsPut16(buf + 4, 1);        // QDCOUNT
+
+    size_t pos = WM_DNS_HEADER_LEN;
+    const char *label = host;
+    while (*label)
+    {
+        const char *dot = strchr(label, '.');
+        size_t l = dot ? (size_t)(dot - label) : strlen(label);
+        if (l == 0 || l > 63)
+            return 0;
+        buf[pos++] = (uint8_t)l;
+        memcpy(buf + pos, label, l);
+        pos += l;
+        label += l + (dot ? 1 : 0);
+    }
+    buf[pos++] = 0;
+    _wmDnsPut16(buf + pos, WM_DNS_TYPE_A);
+    _wmDnsPut16(buf + pos + 2, WM_DNS_CLASS_IN);
+    return pos + 4;
+}
+
+// Return the first A record of a response to query id, with its TTL in seconds
+bool wmDnsParseResponse(const uint8_t *buf, size_t len, uint16_t id, uint32_t &ip, uint32_t &ttl)
+{
+    if (len < WM_DNS_HEADER_LEN || _wmDnsGet16(buf) != id || !(buf[2] & 0x80) || (buf[3] & 0x0F) != 0)
+        return false;
+
+    uint16_t qd = _wmDnsGet16(buf + 4);
+    uint16_t an = _wmDnsGet16(buf + 6);
+    size_t pos = WM_DNS_HEADER_LEN;
+
+    while (qd--)
+    {
+        pos = _wmDnsSkipName(buf, len, pos);
+        if (!pos || pos + 4 > len)
+            return false;
+        pos += 4;
+    }
+
+    while (an--)
+    {
+        pos = _wmDnsSkipName(buf, len, pos);
+        if (!pos || pos + 10 > len)
+            return false;
+        uint16_t type = _wmDnsGet16(buf + pos);
+        uint16_t rdlen = _wmDnsGet16(buf + pos + 8);
+        uint32_t recTtl = _wmDnsGet32(buf + pos + 4);
+        pos += 10;
+        if (pos + rdlen > len)
+            return false;
+        if (type == WM_DNS_TYPE_A && rdlen == 4)
+        {
+            memcpy(&ip, buf + pos, 4);  // network order, as in IPAddress
+            ttl = recTtl;
+            return true;
+        }
+        pos += rdlen;   // CNAME and friends
+    }
+    return false;
+}
+
+//////////////////////////////////////////////
+
+// Resolver cache for the cloud hosts. Entries keep the record TTL, survive deep sleep
+// in RTC memory and are served stale while a refresh runs from loop(). Lookups never
+// block: a miss is queued for loop(), and until it is answered the caller lets its
+// transport resolve the host as it would without the cache.
+
+#ifndef WM_DNS_CACHE_ENTRIES
+  #define WM_DNS_CACHE_ENTRIES      4
+#endif
+
+#define WM_DNS_HOST_MAX_LEN         48
+
+// An expired entry is served while it is refreshed for at most this many TTLs ...
+#ifndef WM_DNS_STALE_TTLS
+  #define WM_DNS_STALE_TTLS         2
+#endif
+
+// ... and never longer than this
+#ifndef WM_DNS_STALE_MAX_S
+  #define WM_DNS_STALE_MAX_S        3600L
+#endif
+
+// Refresh shortly before expiry so a busy host never goes stale
+#define WM_DNS_REFRESH_AHEAD_S      10
+#define WM_DNS_MIN_TTL_S            30
+#define WM_DNS_TIMEOUT_MS           2000
+#define WM_DNS_RETRY_MS             5000L
+
+#define WM_DNS_CACHE_MAGIC          0x444E5332    // "DNS2"
+
+// Keep the cache in RTC memory so it is still warm after waking from deep sleep
+#ifndef WM_DNS_PERSIST_DEEP_SLEEP
+  #define WM_DNS_PERSIST_DEEP_SLEEP   false
+#endif
+
+struct WMDnsEntry
+{
+    char host[WM_DNS_HOST_MAX_LEN];
+    uint32_t ip;            // network order, 0 until the first answer
+    uint32_t expires;       // seconds of the RTC clock, see _wmDnsNow()
+    uint32_t ttl;           // seconds, at least WM_DNS_MIN_TTL_S
+};
+
+struct WMDnsStore
+{
+    uint32_t magic;
+    WMDnsEntry entries[WM_DNS_CACHE_ENTRIES];
+};
+
+#if WM_DNS_PERSIST_DEEP_SLEEP
+  RTC_DATA_ATTR WMDnsStore wmDnsStore;
+#else
+  WMDnsStore wmDnsStore;
+#endif
+
+// gettimeofday() keeps counting through deep sleep, millis() does not
+static inline uint32_t _wmDnsNow()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint32_t)tv.tv_sec;
+}
+
+#if LWIP_DNS && DNS_LOCAL_HOSTLIST && DNS_LOCAL_HOSTLIST_IS_DYNAMIC
+
+struct _WMDnsHostEntry
+{
+    char host[WM_DNS_HOST_MAX_LEN];
+    uint32_t ip;
+};
+
+// Runs on the tcpip task; replaces the host's entry, or only removes it for ip 0
+static void _wmDnsSetHostCallback(void *arg)
+{
+    _WMDnsHostEntry *e = (_WMDnsHostEntry *)arg;
+    dns_local_removehost(e->host, NULL);
+    if (e->ip)
+    {
+        ip_addr_t addr;
+        ip_addr_set_ip4_u32(&addr, e->ip);
+        dns_local_addhost(e->host, &addr);
+    }
+    delete e;
+}
+
+#endif
+
+// Set lwIP's local host entry for host, or remove it for ip 0
+static void _wmDnsSetLwipHost(const char *host, uint32_t ip)
+{
+#if LWIP_DNS && DNS_LOCAL_HOSTLIST && DNS_LOCAL_HOSTLIST_IS_DYNAMIC
+    _WMDnsHostEntry *e = new _WMDnsHostEntry;
+    strcpy(e->host, host);
+    e->ip = ip;
+    if (tcpip_callback(_wmDnsSetHostCallback, e) != ERR_OK)
+        delete e;
+#else
+    (void)host;
+    (void)ip;
+#endif
+}
+
+class WMDnsCache
+{
+public:
+    uint32_t hits;
+    uint32_t staleHits;
+    uint32_t misses;
+
+    WMDnsCache() : hits(0), staleHits(0), misses(0), pending(-1), queryId(0), querySent(0), lastFailure(0)
+    {
+        memset(shared, 0, sizeof(shared));
+    }
+
+    // Resolve host from the cache. On a miss the host is queued for loop() and false is
+    // returned at once.
+    bool resolve(const char *host, IPAddress &ip)
+    {
+        if (ip.fromString(host))
+            return true;
+
+        init();
+        uint32_t now = _wmDnsNow();
+        WMDnsEntry *e = find(host);
+        if (e && e->ip)
+        {
+            if ((int32_t)(e->expires - now) > 0)
+            {
+                hits++;
+                ip = e->ip;
+                return true;
+            }
+            if ((int32_t)(now - e->expires) < (int32_t)staleWindow(*e))
+            {
+                staleHits++;
+                ip = e->ip;
+                ESP_WML_LOGDEBUG1(F("d:Serving stale "), host);
+                return true;
+            }
+        }
+
+        misses++;
+        if (!e)
+            store(host, 0, 0);
+        return false;
+    }
+
+    // Let transports that resolve on their own (esp-mqtt) find host in lwIP's local host
+    // list. The entry follows the cache: it is replaced on every refresh and removed once
+    // the address is too stale to serve or the host is evicted. Needs lwIP built with
+    // DNS_LOCAL_HOSTLIST_IS_DYNAMIC, which stock Arduino-ESP32 is not; there this does
+    // nothing and those transports keep resolving through lwIP.
+    void shareWithLwip(const char *host)
+    {
+        IPAddress ip;
+        if (ip.fromString(host) || !resolve(host, ip))
+            return;
+        int i = find(host) - wmDnsStore.entries;
+        shared[i] = true;
+        _wmDnsSetLwipHost(host, ip);
+    }
+
+    // Drive lookups and refreshes, call from the loop task
+    void loop()
+    {
+        if (WiFi.status() != WL_CONNECTED || wmDnsStore.magic != WM_DNS_CACHE_MAGIC)
+            return;
+
+        uint32_t now = _wmDnsNow();
+        for (int i = 0; i < WM_DNS_CACHE_ENTRIES; i++)
+        {
+            WMDnsEntry &e = wmDnsStore.entries[i];
+            if (shared[i] && (int32_t)(now - e.expires) >= (int32_t)staleWindow(e))
+            {
+                _wmDnsSetLwipHost(e.host, 0);
+                shared[i] = false;
+            }
+        }
+
+        if (pending >= 0)
+        {
+            uint32_t addr, ttl;
+            if (receive(addr, ttl))
+            {
+                WMDnsEntry &e = wmDnsStore.entries[pending];
+                set(e, addr, ttl);
+                if (shared[pending])
+                    _wmDnsSetLwipHost(e.host, addr);
+                ESP_WML_LOGDEBUG1(F("d:Resolved "), e.host);
+                pending = -1;
+                lastFailure = 0;
+            }
+            else if (millis() - querySent > WM_DNS_TIMEOUT_MS)
+            {
+                lastFailure = millis();
+                pending = -1;
+            }
+            return;
+        }
+
+        if (lastFailure && millis() - lastFailure < WM_DNS_RETRY_MS)
+            return;
+
+        for (int i = 0; i < WM_DNS_CACHE_ENTRIES; i++)
+        {
+            WMDnsEntry &e = wmDnsStore.entries[i];
+            if (e.host[0] && (int32_t)(e.expires - now) < WM_DNS_REFRESH_AHEAD_S)
+            {
+                if (send(e.host))
+                    pending = i;
+                return;
+            }
+        }
+    }
+
+    void clear()
+    {
+        for (int i = 0; i < WM_DNS_CACHE_ENTRIES; i++)
+            if (shared[i])
+                _wmDnsSetLwipHost(wmDnsStore.entries[i].host, 0);
+        memset(shared, 0, sizeof(shared));
+        memset(&wmDnsStore, 0, sizeof(wmDnsStore));
+        wmDnsStore.magic = WM_DNS_CACHE_MAGIC;
+        pending = -1;
+    }
+
+private:
+    void init()
+    {
+        if (wmDnsStore.magic != WM_DNS_CACHE_MAGIC)
+            clear();
+    }
+
+    static uint32_t staleWindow(const WMDnsEntry &e)
+    {
+        return std::min<uint32_t>(e.ttl * WM_DNS_STALE_TTLS, WM_DNS_STALE_MAX_S);
+    }
+
+    WMDnsEntry *find(const char *host)
+    {
+        for (int i = 0; i < WM_DNS_CACHE_ENTRIES; i++)
+            if (strcmp(wmDnsStore.entries[i].host, host) == 0)
+                return &wmDnsStore.entries[i];
+        return NULL;
+    }
+
+    static void set(WMDnsEntry &e, uint32_t addr, uint32_t ttl)
+    {
+        e.ip = addr;
+        e.ttl = std::max<uint32_t>(ttl, WM_DNS_MIN_TTL_S);
+        e.expires = _wmDnsNow() + e.ttl;
+    }
+
+    // Without an address the entry waits for loop() to look it up
+    void store(const char *host, uint32_t addr, uint32_t ttl)
+    {
+        if (strlen(host) >= WM_DNS_HOST_MAX_LEN)
+            return;
+        WMDnsEntry *e = find(host);
+        if (!e)
+        {
+            // Replace the entry that expired first
+            e = &wmDnsStore.entries[0];
+            for (int i = 1; i < WM_DNS_CACHE_ENTRIES; i++)
+                if ((int32_t)(wmDnsStore.entries[i].expires - e->expires) < 0)
+                    e = &wmDnsStore.entries[i];
+            int i = e - wmDnsStore.entries;
+            if (shared[i])
+                _wmDnsSetLwipHost(e->host, 0);
+            shared[i] = false;
+            if (pending == i)
+                pending = -1;
+            strcpy(e->host, host);
+        }
+        if (addr)
+            set(*e, addr, ttl);
+        else
+        {
+            e->ip = 0;
+            e->ttl = 0;
+            e->expires = _wmDnsNow();
+        }
+    }
+
+    bool send(const char *host)
+    {
+        uint8_t buf[WM_DNS_MAX_PACKET];
+        queryId = (uint16_t)esp_random();
+        size_t len = wmDnsBuildQuery(buf, sizeof(buf), queryId, host);
+        if (!len)
+            return false;
+        // drop anything left over from an earlier, timed out query
+        while (udp.parsePacket() > 0)
+            udp.flush();
+        if (!udp.beginPacket(WiFi.dnsIP(0), 53))
+            return false;
+        udp.write(buf, len);
+        querySent = millis();
+        return udp.endPacket();
+    }
+
+    bool receive(uint32_t &addr, uint32_t &ttl)
+    {
+        int size = udp.parsePacket();
+        if (size <= 0)
+            return false;
+        uint8_t buf[WM_DNS_MAX_PACKET];
+        int len = udp.read(buf, sizeof(buf));
+        return len > 0 && wmDnsParseResponse(buf, len, queryId, addr, ttl);
+    }
+
+    WiFiUDP udp;
+    int pending;
+    uint16_t queryId;
+    uint32_t querySent;
+    uint32_t lastFailure;
+    // Entries handed to lwIP by shareWithLwip(); not persisted, lwIP forgets them on boot
+    bool shared[WM_DNS_CACHE_ENTRIES];
+};
+
+WMDnsCache wmDnsCache;
+
+//////////////////////////////////////////////
+
+// Captive DNS for the portal: every A query is answered with the portal address, every
+// other type with an empty NOERROR, so phones do not fall back to mobile data. The reply
+// is the query with the header flipped and one answer appended, built in a fixed buffer.
+// Each client gets a token bucket; queries over it are dropped without a reply. Runs on
+// the AsyncUDP task. Same start()/stop() as AsyncDNSServer, which stays available with
+// WM_CAPTIVE_DNS false.
+
+#ifndef WM_CAPTIVE_DNS
+  #define WM_CAPTIVE_DNS                true
+#endif
+
+#ifndef WM_CAPTIVE_DNS_TTL_S
+  #define WM_CAPTIVE_DNS_TTL_S          60
+#endif
+
+// Clients tracked for rate limiting, the least recently seen one is replaced
+#ifndef WM_CAPTIVE_DNS_CLIENTS
+  #define WM_CAPTIVE_DNS_CLIENTS        8
+#endif
+
+#ifndef WM_CAPTIVE_DNS_RATE
+  #define WM_CAPTIVE_DNS_RATE           20      // queries per second and client
+#endif
+
+#ifndef WM_CAPTIVE_DNS_BURST
+  #define WM_CAPTIVE_DNS_BURST          40
+#endif
+
+#define WM_DNS_TYPE_ANY           255
+#define WM_DNS_ANSWER_LEN         16      // pointer, type, class, TTL, length, IPv4
+
+struct WMCaptiveDnsStats
+{
+    uint32_t queries;
+    uint32_t answered;          // with the portal address
+    uint32_t empty;             // NOERROR without an answer (AAAA, HTTPS, ...)
+    uint32_t limited;           // dropped by the rate limit
+    uint32_t malformed;         // dropped, not a single-question standard query
+};
+
+class WMCaptiveDns
+{
+public:
+    WMCaptiveDns()
+    {
+        memset(&statistics, 0, sizeof(statistics));
+        memset(clients, 0, sizeof(clients));
+    }
+
+    // domainName is ignored, every name resolves to resolvedIP
+    bool start(uint16_t port, const String &domainName, const IPAddress &resolvedIP)
+    {
+        (void)domainName;
+        for (uint8_t i = 0; i < 4; i++)
+            address[i] = resolvedIP[i];
+        if (!udp.listen(port))
+            return false;
+        udp.onPacket([this](AsyncUDPPacket &packet) { handle(packet); });
+        return true;
+    }
+
+    void stop() { udp.close(); }
+
+    // Turn query into its reply in out (WM_DNS_MAX_PACKET bytes), return the length or 0
+    size_t reply(const uint8_t *query, size_t len, uint8_t *out)
+    {
+        statistics.queries++;
+        if (len < WM_DNS_HEADER_LEN || len > WM_DNS_MAX_PACKET || (query[2] & 0x80) ||
+            ((query[2] >> 3) & 0x0F) != 0 || _wmDnsGet16(query + 4) != 1)
+        {
+            statistics.malformed++;
+            return 0;
+        }
+        size_t end = _wmDnsSkipName(query, len, WM_DNS_HEADER_LEN);
+        if (!end || end + 4 > len)
+        {
+            statistics.malformed++;
+            return 0;
+        }
+        uint16_t type = _wmDnsGet16(query + end);
+        uint16_t cls = _wmDnsGet16(query + end + 2);
+        end += 4;
+
+        // Header and question as received, EDNS and other additional records dropped
+        memcpy(out, query, end);
+        out[2] = 0x84 | (query[2] & 0x01);      // QR, AA, RD as asked
+        out[3] = 0;                             // no recursion, NOERROR
+        _wmDnsPut16(out + 6, 0);
+        _wmDnsPut16(out + 8, 0);
+        _wmDnsPut16(out + 10, 0);
+
+        if ((type == WM_DNS_TYPE_A || type == WM_DNS_TYPE_ANY) && cls == WM_DNS_CLASS_IN)
+        {
+            uint8_t *a = out + end;
+            _wmDnsPut16(a, 0xC000 | WM_DNS_HEADER_LEN);     // name of the question
+            _wmDnsPut16(a + 2, WM_DNS_TYPE_A);
+            _wmDnsPut16(a + 4, WM_DNS_CLASS_IN);
+            _wmDnsPut32(a + 6, WM_CAPTIVE_DNS_TTL_S);
+            _wmDnsPut16(a + 10, 4);
+            memcpy(a + 12, address, 4);
+            _wmDnsPut16(out + 6, 1);
+            statistics.answered++;
+            return end + WM_DNS_ANSWER_LEN;
+        }
+        statistics.empty++;
+        return end;
+    }
+
+    const WMCaptiveDnsStats &stats() const { return statistics; }
+
+private:
+    struct Client
+    {
+        uint32_t ip;
+        uint32_t tokens;        // thousandths
+        uint32_t refilledAt;
+    };
+
+    void handle(AsyncUDPPacket &packet)
+    {
+        if (!allow(packet.remoteIP()))
+        {
+            statistics.queries++;
+            statistics.limited++;
+            return;
+        }
+        size_t len = reply(packet.data(), packet.length(), response);
+        if (len)
+            packet.write(response, len);
+    }
+
+    bool allow(const IPAddress &ip)
+    {
+        uint32_t key = (uint32_t)ip;
+        uint32_t now = millis();
+        Client *c = NULL;
+        Client *oldest = &clients[0];
+        for (uint8_t i = 0; i < WM_CAPTIVE_DNS_CLIENTS && !c; i++)
+        {
+            if (clients[i].ip == key)
+                c = &clients[i];
+            else if (now - clients[i].refilledAt > now - oldest->refilledAt)
+                oldest = &clients[i];
+        }
+        if (!c)
+        {
+            c = oldest;
+            c->ip = key;
+            c->tokens = WM_CAPTIVE_DNS_BURST * 1000;
+            c->refilledAt = now;
+        }
+
+        c->tokens += (now - c->refilledAt) * WM_CAPTIVE_DNS_RATE;
+        c->refilledAt = now;
+        if (c->tokens > WM_CAPTIVE_DNS_BURST * 1000)
+            c->tokens = WM_CAPTIVE_DNS_BURST * 1000;
+        if (c->tokens < 1000)
+            return false;
+        c->tokens -= 1000;
+        return true;
+    }
+
+    AsyncUDP udp;
+    uint8_t address[4];
+    uint8_t response[WM_DNS_MAX_PACKET + WM_DNS_ANSWER_LEN];
+    Client clients[WM_CAPTIVE_DNS_CLIENTS];
+    WMCaptiveDnsStats statistics;
+};
+
+#endif // wm_dns_h_
@@ -0,0 +1,58 @@
+#pragma once
+
+#ifndef wm_encoding_h_
+#define wm_encoding_h_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+//////////////////////////////////////////////
+
+// Payload encoding of function calls, variable values and the heartbeat. JSON is the
+// default; the device lists "msgpack" in its capabilities and the cloud opts in by sending
+// a request as a MessagePack map. Each response uses the encoding of its request, and once
+// the cloud sent one MessagePack request, device-initiated messages switch to it until the
+// next connect.
+
+enum FermiEncoding : uint8_t {
+    FERMI_ENCODING_JSON = 0,
+    FERMI_ENCODING_MSGPACK,
+};
+
+// A MessagePack fixmap (0x80..0x8f) can never start JSON or UTF-8 text, so it marks the
+// binary encoding without a separate content type
+static inline bool fermiIsMsgPack(const char *payload, size_t length)
+{
+    return length > 0 && ((uint8_t)payload[0] & 0xf0) == 0x80;
+}
+
+//////////////////////////////////////////////
+
+// Format the /response payload of a call, returns its length. requestId is a decimal number.
+static inline size_t fermiFunctionResult(char *buffer, size_t size, FermiEncoding encoding, const char *requestId, int result)
+{
+    if (encoding == FERMI_ENCODING_MSGPACK)
+    {
+        StaticJsonDocument<64> doc;
+        doc["i"] = strtoull(requestId, NULL, 10);
+        doc["r"] = result;
+        return serializeMsgPack(doc, buffer, size);
+    }
+    int n = snprintf(buffer, size, "{\"i\":%s,\"r\":%d}", requestId, result);
+    return n < (int)size ? n : size - 1;
+}
+
+static inline size_t fermiFunctionError(char *buffer, size_t size, FermiEncoding encoding, const char *requestId, const char *error)
+{
+    if (encoding == FERMI_ENCODING_MSGPACK)
+    {
+        StaticJsonDocument<64> doc;
+        doc["i"] = strtoull(requestId, NULL, 10);
+        doc["e"] = error;
+        return serializeMsgPack(doc, buffer, size);
+    }
+    int n = snprintf(buffer, size, "{\"i\":%s,\"e\":\"%s\"}", requestId, error);
+    return n < (int)size ? n : size - 1;
+}
+
+#endif // wm_encoding_h_
@@ -0,0 +1,304 @@
+#pragma once
+
+#ifndef wm_endpoints_h_
+#define wm_endpoints_h_
+
+#include <WiFiClientSecure.h>
+#include "wm_debug.h"
+
+//////////////////////////////////////////////
+
+// Set of cloud endpoints used by the device flow and the MQTT connection.
+// All strings must outlive the FermiDevice (string literals or static buffers).
+struct FermiEndpoints
+{
+    const char *deviceCodeUrl;
+    const char *tokenUrl;
+    const char *userInfoUrl;
+    const char *mqttUri;
+    // CA for the HTTPS and MQTT servers. NULL makes the HTTPS requests skip certificate
+    // verification (setInsecure), which is only meant for local test servers. esp-mqtt has
+    // no such switch and fails an mqtts:// handshake without a CA, so test servers without
+    // a certificate have to be given as mqtt://, see utils/fermi_standin.py.
+    const char *rootCA;
+};
+
+//////////////////////////////////////////////
+
+#ifndef FERMI_CLOUD_MAX_ENDPOINTS
+  #define FERMI_CLOUD_MAX_ENDPOINTS         4
+#endif
+
+// How often the background task measures the TLS connect time of every endpoint
+#ifndef FERMI_CLOUD_PROBE_INTERVAL_MS
+  #define FERMI_CLOUD_PROBE_INTERVAL_MS     300000L
+#endif
+
+#ifndef FERMI_CLOUD_PROBE_TIMEOUT_MS
+  #define FERMI_CLOUD_PROBE_TIMEOUT_MS      5000
+#endif
+
+#ifndef FERMI_CLOUD_PROBE_STACK_SIZE
+  #define FERMI_CLOUD_PROBE_STACK_SIZE      6144
+#endif
+
+// Stickiness: a healthy endpoint is only left for one that is this much faster ...
+#ifndef FERMI_CLOUD_SWITCH_MARGIN_PCT
+  #define FERMI_CLOUD_SWITCH_MARGIN_PCT     30
+#endif
+
+// ... and not before the current choice has been kept for this long
+#ifndef FERMI_CLOUD_MIN_DWELL_MS
+  #define FERMI_CLOUD_MIN_DWELL_MS          600000L
+#endif
+
+// Consecutive failures after which an endpoint is considered down
+#ifndef FERMI_CLOUD_MAX_FAILURES
+  #define FERMI_CLOUD_MAX_FAILURES          3
+#endif
+
+//////////////////////////////////////////////
+
+// Extract host and port of an http(s)/ws(s)/mqtt(s) URL
+bool fermiParseHost(const char *url, char *host, size_t size, uint16_t &port, bool &secure)
+{
+    const char *p = strstr(url, "://");
+    if (!p)
+        return false;
+
+    size_t schemeLen = p - url;
+    secure = url[schemeLen - 1] == 's';
+    if (strncmp(url, "mqtt", 4) == 0)
+        port = secure ? 8883 : 1883;
+    else
+        port = secure ? 443 : 80;
+
+    p += 3;
+    size_t i = 0;
+    while (*p && *p != ':' && *p != '/' && i + 1 < size)
+        host[i++] = *p++;
+    host[i] = '\0';
+
+    if (*p == ':')
+        port = (uint16_t)atoi(p + 1);
+    return i > 0;
+}
+
+//////////////////////////////////////////////
+
+// Keeps the list of endpoint sets, measures them in the background and picks the
+// fastest healthy one. Probe results are written by the probe task as plain 32-bit
+// values; the selection itself only ever runs on the caller's (loop) task. The list is
+// changed under a lock that the probe task also takes while it reads an entry.
+class FermiEndpointSelector
+{
+public:
+    FermiEndpointSelector() : count(0), selected(0), selectedAt(0), measured(false), generation(0), probeTask(NULL)
+    {
+        lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    }
+
+    bool add(const FermiEndpoints &endpoints)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (count >= FERMI_CLOUD_MAX_ENDPOINTS)
+        {
+            xSemaphoreGive(lock);
+            ESP_WML_LOGERROR(F("s:Too many endpoint sets"));
+            return false;
+        }
+        sets[count] = endpoints;
+        stats[count].rttMs = 0;
+        stats[count].failures = 0;
+        count++;
+        xSemaphoreGive(lock);
+        return true;
+    }
+
+    void clear()
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        count = 0;
+        selected = 0;
+        measured = false;
+        // A probe running right now belongs to the old list and is discarded
+        generation++;
+        xSemaphoreGive(lock);
+    }
+
+    uint8_t size() const { return count; }
+    uint8_t currentIndex() const { return selected; }
+    uint32_t rtt(uint8_t i) const { return i < count ? stats[i].rttMs : 0; }
+    const FermiEndpoints &current() const { return sets[selected]; }
+
+    // The current endpoint could not be reached. Fails over once it has failed too often.
+    void reportFailure()
+    {
+        if (stats[selected].failures < 255)
+            stats[selected].failures++;
+        if (count > 1 && stats[selected].failures >= FERMI_CLOUD_MAX_FAILURES)
+        {
+            ESP_WML_LOGWARN1(F("s:Endpoint down, failing over from "), selected);
+            select(true);
+        }
+    }
+
+    void reportSuccess() { stats[selected].failures = 0; }
+
+    // Called from the loop task. Returns true if a better endpoint than the current one
+    // should be used; the caller is expected to reconnect.
+    bool reselect()
+    {
+        if (count < 2)
+            return false;
+        uint8_t previous = selected;
+        select(false);
+        return selected != previous;
+    }
+
+    // Start the background probe task once; no-op with a single endpoint set
+    void startProbing(BaseType_t core = tskNO_AFFINITY)
+    {
+        if (count < 2 || probeTask)
+            return;
+        xTaskCreatePinnedToCore(probeTaskStatic, "fermi_probe", FERMI_CLOUD_PROBE_STACK_SIZE,
+                                this, tskIDLE_PRIORITY + 1, &probeTask, core);
+    }
+
+    // Measure the TLS connect time of every endpoint set once. The lock is not held
+    // during the handshake, so setEndpoints() never waits for a probe.
+    void probeAll()
+    {
+        for (uint8_t i = 0; ; i++)
+        {
+            xSemaphoreTake(lock, portMAX_DELAY);
+            if (i >= count)
+            {
+                xSemaphoreGive(lock);
+                break;
+            }
+            FermiEndpoints endpoints = sets[i];
+            uint32_t probing = generation;
+            xSemaphoreGive(lock);
+
+            uint32_t ms = probe(endpoints);
+
+            xSemaphoreTake(lock, portMAX_DELAY);
+            if (probing == generation)
+            {
+                if (ms == 0)
+                {
+                    if (stats[i].failures < 255)
+                        stats[i].failures++;
+                }
+                else
+                {
+                    // exponentially weighted to ride out single slow handshakes
+                    stats[i].rttMs = stats[i].rttMs ? (stats[i].rttMs * 3 + ms) / 4 : ms;
+                    stats[i].failures = 0;
+                    ESP_WML_LOGINFO3(F("s:Probe endpoint "), i, F(", rtt ms = "), stats[i].rttMs);
+                }
+            }
+            xSemaphoreGive(lock);
+        }
+    }
+
+private:
+    struct Stats
+    {
+        volatile uint32_t rttMs;    // 0 until measured
+        volatile uint8_t failures;
+    };
+
+    bool healthy(uint8_t i) const { return stats[i].failures < FERMI_CLOUD_MAX_FAILURES; }
+
+    void select(bool force)
+    {
+        int best = -1;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            if (!healthy(i) || stats[i].rttMs == 0)
+                continue;
+            if (best < 0 || stats[i].rttMs < stats[best].rttMs)
+                best = i;
+        }
+
+        if (force)
+        {
+            // Current one is down: take the fastest healthy one, else simply the next
+            if (best < 0 || best == selected)
+                best = (selected + 1) % count;
+        }
+        else
+        {
+            if (best < 0 || best == selected)
+                return;
+            uint32_t cur = stats[selected].rttMs;
+            bool dwellOver = !measured || millis() - selectedAt >= FERMI_CLOUD_MIN_DWELL_MS;
+            bool muchFaster = cur == 0 || !healthy(selected) ||
+                              stats[best].rttMs * 100 < cur * (100 - FERMI_CLOUD_SWITCH_MARGIN_PCT);
+            if (!dwellOver || !muchFaster)
+                return;
+        }
+
+        ESP_WML_LOGWARN3(F("s:Switching endpoint "), selected, F(" -> "), best);
+        selected = best;
+        selectedAt = millis();
+        measured = stats[best].rttMs != 0;
+    }
+
+    static uint32_t probe(const FermiEndpoints &endpoints)
+    {
+        char host[64];
+        uint16_t port;
+        bool secure;
+        if (!fermiParseHost(endpoints.mqttUri, host, sizeof(host), port, secure))
+            return 0;
+
+        uint32_t start = millis();
+        bool ok;
+        if (secure)
+        {
+            WiFiClientSecure client;
+            if (endpoints.rootCA)
+                client.setCACert(endpoints.rootCA);
+            else
+                client.setInsecure();
+            client.setHandshakeTimeout(FERMI_CLOUD_PROBE_TIMEOUT_MS / 1000);
+            ok = client.connect(host, port, FERMI_CLOUD_PROBE_TIMEOUT_MS);
+            client.stop();
+        }
+        else
+        {
+            WiFiClient client;
+            ok = client.connect(host, port, FERMI_CLOUD_PROBE_TIMEOUT_MS);
+            client.stop();
+        }
+        uint32_t elapsed = millis() - start;
+        return ok ? std::max<uint32_t>(elapsed, 1) : 0;
+    }
+
+    static void probeTaskStatic(void *arg)
+    {
+        FermiEndpointSelector *self = (FermiEndpointSelector *)arg;
+        while (true)
+        {
+            if (WiFi.status() == WL_CONNECTED)
+                self->probeAll();
+            vTaskDelay(pdMS_TO_TICKS(WiFi.status() == WL_CONNECTED ? FERMI_CLOUD_PROBE_INTERVAL_MS : 5000));
+        }
+    }
+
+    FermiEndpoints sets[FERMI_CLOUD_MAX_ENDPOINTS];
+    Stats stats[FERMI_CLOUD_MAX_ENDPOINTS];
+    uint8_t count;
+    uint8_t selected;
+    uint32_t selectedAt;
+    bool measured;
+    uint32_t generation;        // bumped by clear()
+    TaskHandle_t probeTask;
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lockBuffer;
+};
+
+#endif // wm_endpoints_h_
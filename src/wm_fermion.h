@@ -10,10 +10,23 @@
 #include "wm_file.h"
 #include "wm_wifi.h"
 #include "wm_flags.h"
+#include "wm_json.h"
+#include "wm_retry.h"
+#include "wm_endpoints.h"
+#include "wm_dns.h"
+#include "wm_router.h"
+#include "wm_encoding.h"
+#include "wm_dispatch.h"
+#include "wm_ring.h"
+#include "wm_outbox.h"
+#include "wm_inflight.h"
+#include "wm_batch.h"
+#include "wm_watch.h"
 
 #define WM_REFRESH_TOKEN_FILENAME "/wm_token.dat"
 #define WM_REFRESH_TOKEN_FILENAME_BACKUP "/wm_token.bak"
 
+const char* FERMI_CLOUD_USERCODE_URL         PROGMEM = "https://fermicloud.dev/auth/realms/fermi-cloud/protocol/openid-connect/auth/device";
 const char* FERMI_CLOUD_TOKEN_URL            PROGMEM = "https://fermicloud.dev/auth/realms/fermi-cloud/protocol/openid-connect/token";
 const char* FERMI_CLOUD_USERINFO_URL         PROGMEM = "https://fermicloud.dev/auth/realms/fermi-cloud/protocol/openid-connect/userinfo";
 const char* FERMI_CLOUD_DEVICE_CODE_PAYLOAD  PROGMEM = "client_id=fermi-device&scope=openid&grant_type=urn:ietf:params:oauth:grant-type:device_code&device_code=";
@@ -31,9 +44,24 @@ static System_t System;
 
 //////////////////////////////////////////////
 
-#define FERMI_CLOUD_EVENT_HANDLERS          20
-#define FERMI_CLOUD_FUNCTION_HANDLERS       20
-#define FERMI_CLOUD_VARIABLES               20
+// Handlers registered at runtime. Every slot takes RAM whether used or not; all names
+// share the router table, which needs at least twice as many slots as names.
+#ifndef FERMI_CLOUD_EVENT_HANDLERS
+  #define FERMI_CLOUD_EVENT_HANDLERS        20
+#endif
+
+#ifndef FERMI_CLOUD_FUNCTION_HANDLERS
+  #define FERMI_CLOUD_FUNCTION_HANDLERS     20
+#endif
+
+#ifndef FERMI_CLOUD_VARIABLES
+  #define FERMI_CLOUD_VARIABLES             20
+#endif
+
+static_assert(FERMI_CLOUD_EVENT_HANDLERS <= 0xFFFF && FERMI_CLOUD_FUNCTION_HANDLERS <= 0xFFFF &&
+              FERMI_CLOUD_VARIABLES <= 0xFFFF, "Handler counts are 16 bits");
+static_assert(FERMI_CLOUD_ROUTER_SLOTS >= 2 * (FERMI_CLOUD_EVENT_HANDLERS + FERMI_CLOUD_FUNCTION_HANDLERS + FERMI_CLOUD_VARIABLES),
+              "Raise FERMI_CLOUD_ROUTER_SLOTS together with the handler counts");
 
 #define FERMI_CLOUD_DEVICE_ID_LENGTH        32
 #define FERMI_CLOUD_EVENT_NAME_LENGTH       64
@@ -46,6 +74,34 @@ static System_t System;
 #define FERMI_CLOUD_FUNCTION_TOPIC_BUFFER_LENGTH (FERMI_CLOUD_BASE_BUFFER_LENGTH + sizeof("functions/") + FERMI_CLOUD_FUNCTION_NAME_LENGTH + 1)
 #define FERMI_CLOUD_VARIABLE_TOPIC_BUFFER_LENGTH (FERMI_CLOUD_BASE_BUFFER_LENGTH + sizeof("variables/") + FERMI_CLOUD_VARIABLE_NAME_LENGTH + 1)
 
+// Buffers the OAuth responses are parsed into. Keycloak JWTs are usually well below these sizes.
+#ifndef FERMI_CLOUD_ACCESS_TOKEN_MAX_LEN
+  #define FERMI_CLOUD_ACCESS_TOKEN_MAX_LEN  2048
+#endif
+
+#ifndef FERMI_CLOUD_REFRESH_TOKEN_MAX_LEN
+  #define FERMI_CLOUD_REFRESH_TOKEN_MAX_LEN 1024
+#endif
+
+// Largest variable response ({"v":...}) that is sent back
+#ifndef FERMI_CLOUD_VARIABLE_RESPONSE_MAX_LEN
+  #define FERMI_CLOUD_VARIABLE_RESPONSE_MAX_LEN 256
+#endif
+
+// MQTT events are queued by the esp-mqtt task and handled by loop(). Messages that do not
+// fit are dropped; the reserve keeps room for connect/disconnect notifications.
+#ifndef FERMI_CLOUD_EVENT_RING_SIZE
+  #define FERMI_CLOUD_EVENT_RING_SIZE       4096
+#endif
+
+#ifndef FERMI_CLOUD_EVENT_RING_RESERVE
+  #define FERMI_CLOUD_EVENT_RING_RESERVE    128
+#endif
+
+#define FERMI_CLOUD_ERROR_MAX_LEN           32
+#define FERMI_CLOUD_ERROR_DESC_MAX_LEN      128
+#define FERMI_CLOUD_USER_ID_MAX_LEN         64
+
 #define FERMI_CLOUD_MQTT_URI            "wss://fermicloud.dev:8084/mqtt"
 // #define FERMI_CLOUD_MQTT_URI "mqtts://fermicloud.dev:8883"
 
@@ -55,7 +111,8 @@ enum FetchAccessTokenResult {
     FC_CODE_EXPIRED,
     FC_INVALID_REFRESH_TOKEN,
     FC_CANNOT_LOAD_REFRESH_TOKEN,
-    FC_INVALID_RESPONSE
+    FC_INVALID_RESPONSE,
+    FC_SLOW_DOWN
 };
 
 // This is isrgrootx1.pem, the root Certificate Authority that signed 
@@ -89,6 +146,14 @@ const char* fermiRootCACertificate = \
 "VQD9F6Na/+zmXCc=\n" \
 "-----END CERTIFICATE-----\n";
 
+const FermiEndpoints FERMI_CLOUD_DEFAULT_ENDPOINTS = {
+    FERMI_CLOUD_USERCODE_URL,
+    FERMI_CLOUD_TOKEN_URL,
+    FERMI_CLOUD_USERINFO_URL,
+    FERMI_CLOUD_MQTT_URI,
+    fermiRootCACertificate,
+};
+
 typedef enum
 {
     MY_DEVICES,
@@ -103,19 +168,25 @@ const uint32_t PUBLISH_EVENT_FLAG_PUBLIC = 0x0;
 const uint32_t PUBLISH_EVENT_FLAG_PRIVATE = 0x1;
 const uint32_t PUBLISH_EVENT_FLAG_NO_ACK = 0x2;
 const uint32_t PUBLISH_EVENT_FLAG_WITH_ACK = 0x8;
-const uint32_t PUBLISH_EVENT_FLAG_RETAIN = 0xa;
+const uint32_t PUBLISH_EVENT_FLAG_RETAIN = 0x10;
+const uint32_t PUBLISH_EVENT_FLAG_BATCHED = 0x20;
 
 const PublishFlag PUBLIC(PUBLISH_EVENT_FLAG_PUBLIC);
 const PublishFlag PRIVATE(PUBLISH_EVENT_FLAG_PRIVATE);
 const PublishFlag NO_ACK(PUBLISH_EVENT_FLAG_NO_ACK);
 const PublishFlag WITH_ACK(PUBLISH_EVENT_FLAG_WITH_ACK);
 const PublishFlag WITH_RETAIN(PUBLISH_EVENT_FLAG_RETAIN);
+const PublishFlag BATCHED(PUBLISH_EVENT_FLAG_BATCHED);
 
 typedef void (*EventHandlerFunction)(const char *event_name, const char *data);
 typedef void (*EventHandlerFunctionWithData)(void *handler_data, const char *event_name, const char *data);
-typedef int (*CloudFunctionHandler)(String);
 typedef void (*CloudVariableSerializer)(JsonDocument &doc, const void *ref);
 
+// Handlers that get views into the received MQTT message instead of copies. The data is
+// only valid during the call and is not null-terminated; use wmJsonGet() to look into
+// JSON payloads when needed. CloudFunctionViewHandler is declared in wm_dispatch.h.
+typedef void (*EventViewHandler)(const char *event_name, size_t name_length, const char *data, size_t length);
+
 struct CloudEventHandler
 {
     String topic;
@@ -123,20 +194,18 @@ struct CloudEventHandler
     {
         EventHandlerFunction func;
         EventHandlerFunctionWithData funcWithData;
+        EventViewHandler view;
     };
     void *data;
+    bool isView;
 };
 
 struct CloudFunction
 {
     String funcKey;
     CloudFunctionHandler func;
-};
-
-// Structure for function request/response
-struct CloudFunctionRequest {
-    uint64_t requestId;
-    String parameters;
+    CloudFunctionViewHandler view;      // set instead of func for view handlers
+    uint32_t timeoutMs;                 // 0 = FERMI_CLOUD_FUNCTION_TIMEOUT_MS
 };
 
 struct CloudVariable {
@@ -148,19 +217,103 @@ struct CloudVariable {
     const void *ref;
 };
 
+//////////////////////////////////////////////
+
+// Functions and variables known at build time can be declared in constant tables instead
+// of being registered one by one. The tables live in flash, cost no heap and do not count
+// against FERMI_CLOUD_FUNCTION_HANDLERS/FERMI_CLOUD_VARIABLES:
+//
+//   int counter;
+//   int reset(String);
+//   const FermiStaticFunction functions[] = { FERMI_FUNCTION("reset", reset) };
+//   const FermiStaticVariable variables[] = { FERMI_VARIABLE("counter", counter) };
+//   ...
+//   Fermion.attachFunctions(functions);
+//   Fermion.attachVariables(variables);
+
+struct FermiStaticFunction
+{
+    const char *name;
+    uint32_t hash;
+    CloudFunctionHandler func;
+    CloudFunctionViewHandler view;
+    uint32_t timeoutMs;
+};
+
+struct FermiStaticVariable
+{
+    const char *name;
+    uint32_t hash;
+    CloudVariableSerializer serializer;
+    const void *ref;
+};
+
+template <typename T>
+struct FermiSerializeRef
+{
+    static void serialize(JsonDocument &doc, const void *ref) { doc["v"] = *(const T *)ref; }
+};
+
+template <typename T, T (*F)()>
+struct FermiSerializeCall
+{
+    static void serialize(JsonDocument &doc, const void *) { doc["v"] = F(); }
+};
+
+#define FERMI_FUNCTION(name, func)      { name, fermiHashConst(name), func, NULL, 0 }
+#define FERMI_FUNCTION_VIEW(name, func) { name, fermiHashConst(name), NULL, func, 0 }
+#define FERMI_VARIABLE(name, var)       { name, fermiHashConst(name), &FermiSerializeRef<decltype(var)>::serialize, &(var) }
+// Calculated variable: func is a T func() whose result is sent on every request
+#define FERMI_VARIABLE_FN(name, func)   { name, fermiHashConst(name), &FermiSerializeCall<decltype(func()), func>::serialize, NULL }
+
+//////////////////////////////////////////////
+
 class FermiDevice {
 public:
     CloudEventHandler eventHandlers[FERMI_CLOUD_EVENT_HANDLERS];
     CloudFunction functionHandlers[FERMI_CLOUD_FUNCTION_HANDLERS];
     CloudVariable variables[FERMI_CLOUD_VARIABLES];
-    uint8_t eventHandlerCount;
-    uint8_t functionHandlerCount;
-    uint8_t variableCount;
+    uint16_t eventHandlerCount;
+    uint16_t functionHandlerCount;
+    uint16_t variableCount;
     bool _gotDisconnected;
-    bool _isConnected;
+    // Written on the loop task, read by online() from workers and the deadline timer
+    std::atomic<bool> _isConnected;
+    bool _wasConnected;
     esp_mqtt_client_handle_t mqttClient;
     String deviceID;
     String accessToken;
+    // Maps incoming topics to the handler slots above
+    FermiTopicRouter router;
+    // Tables registered at build time, looked up before the ones above
+    FermiStaticIndex<FermiStaticFunction> staticFunctions;
+    FermiStaticIndex<FermiStaticVariable> staticVariables;
+    // Runs cloud functions off the loop task
+    FermiFunctionDispatcher dispatcher;
+    // esp-mqtt task -> loop task
+    WMSpscRing<FERMI_CLOUD_EVENT_RING_SIZE> events;
+    // Stamped on every record; bumped once a client is destroyed, so records it left in the
+    // ring (its MQTT_EVENT_DISCONNECTED in particular) are not applied to the next client
+    std::atomic<uint16_t> clientGeneration;
+    // Messages split by esp-mqtt because they exceed its buffer
+    uint32_t fragmentsDropped;
+    // Events published while offline
+    FermiOutbox outbox;
+    // WITH_ACK publishes waiting for their PUBACK
+    FermiInflightWindow inflight;
+    // BATCHED events waiting for the next envelope
+    FermiEventBatch batch;
+    // Encoding of device-initiated messages, MSGPACK once the cloud used it
+    FermiEncoding peerEncoding;
+    // Variables pushed on change
+    FermiWatchList watches;
+    FermiEndpointSelector cloud;
+    // Retry-After of the last token request in ms, 0 if the server did not send one
+    uint32_t retryAfterMs;
+    // Held while the client is destroyed, and by publishes that may run on a worker or the
+    // deadline timer, so they never use a client loop() is tearing down
+    SemaphoreHandle_t clientLock;
+    StaticSemaphore_t clientLockBuffer;
 
 
     FermiDevice() : 
@@ -169,9 +322,18 @@ public:
         variableCount(0),
         _gotDisconnected(false),
         _isConnected(false),
+        _wasConnected(false),
+        mqttClient(NULL),
         deviceID(wmHostname()),
-        mqttClient(NULL)
+        fragmentsDropped(0),
+        peerEncoding(FERMI_ENCODING_JSON),
+        retryAfterMs(0)
     {
+        clientLock = xSemaphoreCreateMutexStatic(&clientLockBuffer);
+        clientGeneration = 0;
+        cloud.add(FERMI_CLOUD_DEFAULT_ENDPOINTS);
+        router.setPrefix(deviceID.c_str());
+        dispatcher.setResponder(respondStatic, this);
         // esp_log_level_set("*", ESP_LOG_INFO);
         // esp_log_level_set("esp-tls", ESP_LOG_VERBOSE);
         // esp_log_level_set("MQTT_CLIENT", ESP_LOG_VERBOSE);
@@ -186,17 +348,56 @@ public:
             disconnect();
     }
 
+    // Point the device at another cloud, e.g. a local stand-in for testing.
+    // Takes effect on the next fetch or connect.
+    void setEndpoints(const FermiEndpoints &newEndpoints) {
+        cloud.clear();
+        cloud.add(newEndpoints);
+    }
+
+    // Add an alternative region. With more than one set the device measures all of them
+    // in the background and uses the fastest healthy one, failing over when it is down.
+    bool addEndpoints(const FermiEndpoints &newEndpoints) {
+        return cloud.add(newEndpoints);
+    }
+
+    const FermiEndpoints &endpoints() const {
+        return cloud.current();
+    }
+
+    void setupTlsClient(WiFiClientSecure &client) {
+        if (endpoints().rootCA)
+            client.setCACert(endpoints().rootCA);
+        else
+            client.setInsecure();
+    }
+
+    // Start an HTTPS request. The host is resolved through wmDnsCache and the TLS session
+    // is opened on that address, so HTTPClient reuses the connection instead of asking lwIP.
+    void beginHttps(HTTPClient &https, WiFiClientSecure &client, const char *url, long timeout) {
+        char host[WM_DNS_HOST_MAX_LEN];
+        uint16_t port;
+        bool secure;
+        IPAddress ip;
+        if (fermiParseHost(url, host, sizeof(host), port, secure) && secure && wmDnsCache.resolve(host, ip)) {
+            client.setHandshakeTimeout((timeout + 999) / 1000);
+            if (!client.connect(ip, port, host, endpoints().rootCA, NULL, NULL))
+                ESP_WML_LOGINFO1(F("s:Connect via cached address failed: "), host);
+        }
+        https.begin(client, url);
+    }
+
     bool hasRefreshToken() {
         return FileFS.exists(WM_REFRESH_TOKEN_FILENAME) || FileFS.exists(WM_REFRESH_TOKEN_FILENAME_BACKUP);
     }
 
-    void saveAs(String const &data, char const *filename)
+    void saveAs(const char *data, size_t length, char const *filename)
     {
         ESP_WML_LOGINFO1(F("Save file %s... "), filename);
         File file = FileFS.open(filename, "w");
         if (file)
         {
-            file.write((uint8_t *)data.c_str(), data.length());
+            file.write((const uint8_t *)data, length);
             file.close();
             ESP_WML_LOGINFO(F("OK"));
         }
@@ -204,10 +405,10 @@ public:
             ESP_WML_LOGINFO(F("failed"));
     }
 
-    void saveRefreshToken(String const &token)
+    void saveRefreshToken(const char *token, size_t length)
     {
-        saveAs(token, WM_REFRESH_TOKEN_FILENAME);
-        saveAs(token, WM_REFRESH_TOKEN_FILENAME_BACKUP);
+        saveAs(token, length, WM_REFRESH_TOKEN_FILENAME);
+        saveAs(token, length, WM_REFRESH_TOKEN_FILENAME_BACKUP);
     }
 
     void deleteRefreshToken() {
@@ -217,15 +418,17 @@ public:
     
     FetchAccessTokenResult fetchAccessToken(const char* deviceCode = NULL, long timeout = 5000) {
       WiFiClientSecure client;
-      client.setCACert(fermiRootCACertificate);
+      setupTlsClient(client);
       {
         // Add a scoping block for HTTPClient https to make sure it is destroyed before WiFiClientSecure client is 
         HTTPClient https;
         FetchAccessTokenResult result = FC_INVALID_RESPONSE;
         https.setConnectTimeout(timeout);
         https.setTimeout(timeout);
-        https.begin(client, FERMI_CLOUD_TOKEN_URL);
+        beginHttps(https, client, endpoints().tokenUrl, timeout);
         https.addHeader("Content-Type", "application/x-www-form-urlencoded", false, false);
+        const char *headerKeys[] = { "Retry-After" };
+        https.collectHeaders(headerKeys, 1);
  
         int httpCode;
         if (deviceCode && deviceCode[0] != '\0') {
@@ -244,40 +447,65 @@ public:
         }
 
         ESP_WML_LOGINFO1(F("s:Status code = "), httpCode);
-        StaticJsonDocument<200> filter;
-        DynamicJsonDocument doc(4000);
+        retryAfterMs = wmParseRetryAfter(https.header("Retry-After"));
+        if (httpCode < 0)
+            cloud.reportFailure();
         if (httpCode == 200) {
-            filter["access_token"] = true;
-            filter["refresh_token"] = true;
-            DeserializationError error = deserializeJson(doc, https.getStream(), DeserializationOption::Filter(filter));
-            if (!error) {
-                accessToken = doc["access_token"].as<const char*>();
-                String refreshToken = doc["refresh_token"].as<const char*>();
-                ESP_WML_LOGINFO1(F("s:Refresh token = "), refreshToken.c_str());
-                saveRefreshToken(refreshToken);
-                result = FC_OK;
+            // Both tokens are parsed into one scratch buffer that only lives for this response;
+            // the access token is then copied into a String of its exact size.
+            char *scratch = (char *)malloc(FERMI_CLOUD_ACCESS_TOKEN_MAX_LEN + FERMI_CLOUD_REFRESH_TOKEN_MAX_LEN + 2);
+            if (!scratch) {
+                ESP_WML_LOGERROR(F("s:Cannot allocate token buffer"));
+                https.end();
+                return result;
+            }
+            char *access = scratch;
+            char *refreshToken = scratch + FERMI_CLOUD_ACCESS_TOKEN_MAX_LEN + 1;
+            WMJsonField fields[] = {
+                { "access_token", access, FERMI_CLOUD_ACCESS_TOKEN_MAX_LEN + 1 },
+                { "refresh_token", refreshToken, FERMI_CLOUD_REFRESH_TOKEN_MAX_LEN + 1 },
+            };
+            WMJsonStreamSource source(https.getStream(), timeout);
+            bool parsed = wmJsonExtract(source, fields, 2);
+
+            if (!parsed) {
+                ESP_WML_LOGINFO(F("s:Cannot parse token response"));
+            } else if (fields[0].truncated || fields[1].truncated) {
+                ESP_WML_LOGERROR(F("s:Token exceeds FERMI_CLOUD_*_TOKEN_MAX_LEN"));
+            } else if (fields[0].length == 0 || fields[1].length == 0) {
+                ESP_WML_LOGINFO(F("s:Token missing in response"));
             } else {
-                ESP_WML_LOGINFO1(F("s:Deserialisation error: "), error.c_str());
+                ESP_WML_LOGINFO1(F("s:Refresh token = "), refreshToken);
+                saveRefreshToken(refreshToken, fields[1].length);
+                result = FC_OK;
             }
+            // Moved from a temporary, so the String holds exactly the token and nothing more
+            accessToken = result == FC_OK ? String(access) : String();
+            free(scratch);
         } else if (httpCode == 400) {
-            filter["error"] = true;
-            filter["error_description"] = true;
-            DeserializationError error = deserializeJson(doc, https.getStream(), DeserializationOption::Filter(filter));
-            if (!error) {
-                const char *err = doc["error"].as<const char*>();
+            char err[FERMI_CLOUD_ERROR_MAX_LEN + 1];
+            char errDesc[FERMI_CLOUD_ERROR_DESC_MAX_LEN + 1];
+            WMJsonField fields[] = {
+                { "error", err, sizeof(err) },
+                { "error_description", errDesc, sizeof(errDesc) },
+            };
+            WMJsonStreamSource source(https.getStream(), timeout);
+            if (wmJsonExtract(source, fields, 2)) {
                 if (strcmp(err, "expired_token") == 0) {
                   ESP_WML_LOGINFO(F("s:User code expired"));
                   result = FC_CODE_EXPIRED;
                 } else if (strcmp(err, "authorization_pending") == 0)
                   result = FC_CODE_NOT_VERIFIED_YET;
+                else if (strcmp(err, "slow_down") == 0)
+                  result = FC_SLOW_DOWN;
                 else if (strcmp(err, "invalid_grant") == 0) {
                   result = FC_INVALID_REFRESH_TOKEN;
                 } else {
                   ESP_WML_LOGINFO1(F("s:Got error: "), err);
-                  ESP_WML_LOGINFO1(F("s:Got error description: "), doc["error_description"].as<const char*>());
+                  ESP_WML_LOGINFO1(F("s:Got error description: "), errDesc);
                 }
             } else {
-                ESP_WML_LOGINFO1(F("s:Deserialisation error: "), error.c_str());
+                ESP_WML_LOGINFO(F("s:Cannot parse error response"));
             }
         }
         https.end();
@@ -287,26 +515,31 @@ public:
 
     String fetchUserId() {
         WiFiClientSecure client;
-        client.setCACert(fermiRootCACertificate);
+        setupTlsClient(client);
         {
             HTTPClient https;
             https.setConnectTimeout(5000);
             https.setTimeout(5000);
-            https.begin(client, FERMI_CLOUD_USERINFO_URL);
+            beginHttps(https, client, endpoints().userInfoUrl, 5000);
             https.addHeader("Authorization", "Bearer " + accessToken);
             
             int httpCode = https.GET();
             ESP_WML_LOGINFO1(F("s:Userinfo status code = "), httpCode);
+            if (httpCode < 0)
+                cloud.reportFailure();
             
             String userId;
             if (httpCode == 200) {
-                StaticJsonDocument<512> doc;
-                DeserializationError error = deserializeJson(doc, https.getStream());
-                if (!error) {
-                    userId = doc["sub"].as<const char*>();
+                char sub[FERMI_CLOUD_USER_ID_MAX_LEN + 1];
+                WMJsonField fields[] = {
+                    { "sub", sub, sizeof(sub) },
+                };
+                WMJsonStreamSource source(https.getStream(), 5000);
+                if (wmJsonExtract(source, fields, 1) && !fields[0].truncated) {
+                    userId = sub;
                     ESP_WML_LOGINFO1(F("s:UserId = "), userId.c_str());
                 } else {
-                    ESP_WML_LOGINFO1(F("s:Userinfo deserialisation error: "), error.c_str());
+                    ESP_WML_LOGINFO(F("s:Cannot parse userinfo response"));
                 }
             } else {
                 ESP_WML_LOGINFO1(F("s:Userinfo request failed with code: "), httpCode);
@@ -316,12 +549,20 @@ public:
         }
     }
 
+    // A client has been started but the broker has not answered yet
+    bool isConnecting() {
+        return mqttClient != NULL && !_isConnected && !_gotDisconnected;
+    }
+
     bool isConnected() {
         if (_gotDisconnected) {
-            esp_mqtt_client_destroy(mqttClient);
-            mqttClient = NULL;
+            // Dropped before the broker ever accepted us: count against the endpoint
+            if (!_wasConnected)
+                cloud.reportFailure();
+            _destroyClient();
             _gotDisconnected = false;
             _isConnected = false;
+            inflight.failAll();
         }
         return mqttClient != NULL && _isConnected;
     }
@@ -332,19 +573,34 @@ public:
             // ESP_WML_LOGINFO1(F("s:Access token: %s"), accessToken.c_str());
             // ESP_WML_LOGINFO1(F("s:Heap free: %s"), ESP.getFreeHeap());
 
+            // Pick the best measured region before opening a new session
+            cloud.reselect();
+
             // Fetch userId from userinfo endpoint
             String userId = fetchUserId();
             if (userId.length() == 0) {
                 return false;
             }
 
+            // esp-mqtt resolves on its own; where lwIP allows it, it finds the cached address
+            {
+                char host[WM_DNS_HOST_MAX_LEN];
+                uint16_t port;
+                bool secure;
+                if (fermiParseHost(endpoints().mqttUri, host, sizeof(host), port, secure))
+                    wmDnsCache.shareWithLwip(host);
+            }
+
+            _wasConnected = false;
             esp_mqtt_client_config_t mqtt_cfg = {
-                .uri = FERMI_CLOUD_MQTT_URI,
+                .uri = endpoints().mqttUri,
                 .client_id = deviceID.c_str(),
                 .username = userId.c_str(),
                 .password = accessToken.c_str(),
-                .cert_pem = fermiRootCACertificate,
+                .cert_pem = endpoints().rootCA,
                 .out_buffer_size = 2048,
+                // Same interval the inflight window uses to estimate resends
+                .message_retransmit_timeout = FERMI_CLOUD_RETRANSMIT_MS,
             };
             mqttClient = esp_mqtt_client_init(&mqtt_cfg);
             if (!mqttClient) {
@@ -352,23 +608,23 @@ public:
                 return false;
             }
             ESP_WML_LOGINFO(F("s:esp_mqtt_client_init() ok."));
+            dispatcher.begin();
 
             esp_err_t err = esp_mqtt_client_register_event(mqttClient, MQTT_EVENT_ANY, mqttHandlerStatic, this);
             if (err != ESP_OK) {
-                esp_mqtt_client_destroy(mqttClient);
-                mqttClient = NULL;
+                _destroyClient();
                 ESP_WML_LOGINFO1(F("s:esp_mqtt_client_register_event() failed: "), err);
                 return false;
             }
 
             err = esp_mqtt_client_start(mqttClient);
             if (err != ESP_OK) {
-                esp_mqtt_client_destroy(mqttClient);
-                mqttClient = NULL;
+                _destroyClient();
                 ESP_WML_LOGINFO1(F("s:esp_mqtt_client_start() failed: "), err);
                 return false;
             }
             ESP_WML_LOGINFO(F("s:esp_mqtt_client_start() ok."));
+            cloud.startProbing();
             
             publishCapabilities();
 
@@ -389,6 +645,17 @@ public:
         if (isConnected()) {
             int8_t rssi = WiFi.RSSI();
             auto freeRam = ESP.getFreeHeap();
+            if (peerEncoding == FERMI_ENCODING_MSGPACK) {
+                StaticJsonDocument<64> doc;
+                doc["rssi"] = rssi;
+                doc["free_ram"] = freeRam;
+                char data[32];
+                size_t length = serializeMsgPack(doc, data, sizeof(data));
+                char topic[FERMI_CLOUD_EVENT_TOPIC_BUFFER_LENGTH];
+                _getEventTopic(topic, sizeof(topic), "fermion_heartbeat");
+                _publishLocked(topic, data, length, 0, 0);
+                return;
+            }
             char data[100];
             snprintf(data, sizeof(data), "{\"rssi\":%i,\"free_ram\":%i}", rssi, freeRam);
             ESP_WML_LOGINFO1(F("s:heartBeat() = "), data);
@@ -401,33 +668,169 @@ public:
         if (isConnected()) {
             esp_mqtt_client_stop(mqttClient);
             esp_mqtt_client_disconnect(mqttClient);
-            esp_mqtt_client_destroy(mqttClient);
+            _destroyClient();
         }
         mqttClient = NULL;
+        // No MQTT_EVENT_DISCONNECTED follows a destroy, so the next connect() starts clean
+        _isConnected = false;
+        _gotDisconnected = false;
+        inflight.failAll();
+    }
+
+    // Connected to the broker. Unlike isConnected() this has no side effects and can be
+    // called from any task; _isConnected is only set while a client exists.
+    bool online() const {
+        return _isConnected;
     }
 
     int publish(const char *eventName, const char *eventData, PublishFlags flags)
+    {
+        return publish(eventName, eventData, 0, flags);
+    }
+
+    // WITH_ACK publishes with QoS 1 and NO_ACK (the default) with QoS 0; WITH_RETAIN asks
+    // the broker to keep the event. BATCHED collects the event into the next envelope on
+    // devices/<id>/batch (see wm_batch.h); it is ignored together with WITH_ACK or
+    // WITH_RETAIN, which need a message of their own. While offline the event is kept in
+    // the outbox and sent after reconnecting, unless it is older than ttl seconds by then
+    // (0 = no limit). Until the outbox is drained new events queue behind the stored ones,
+    // so they reach the cloud in order. Returns the message id, 0 when batched or queued
+    // in the outbox or -1.
+    int publish(const char *eventName, const char *eventData, int ttl, PublishFlags flags)
+    {
+        if (strlen(eventName) > FERMI_CLOUD_EVENT_NAME_LENGTH) {
+            ESP_WML_LOGERROR(F("s:Event name too long"));
+            return -1;
+        }
+        if (!online() || outbox.pending() > 0) {
+            if (FERMI_CLOUD_OUTBOX_RECORDS > 0 && outbox.store(eventName, eventData, ttl, flags.value()))
+                return 0;
+            // Too large for the outbox: out of order beats not at all
+            if (!online())
+                return -1;
+        }
+        if (batch.enabled() && (flags.value() & (PUBLISH_EVENT_FLAG_BATCHED | PUBLISH_EVENT_FLAG_WITH_ACK |
+                                                 PUBLISH_EVENT_FLAG_RETAIN)) == PUBLISH_EVENT_FLAG_BATCHED) {
+            FermiEventBatch::Result result = batch.add(eventName, eventData);
+            if (result == FermiEventBatch::FULL) {
+                batch.flush(batchSendStatic, this);
+                result = batch.add(eventName, eventData);
+            }
+            if (result == FermiEventBatch::ADDED)
+                return 0;
+        }
+        return _publishNow(eventName, eventData, flags.value());
+    }
+
+    // Publish with QoS 1 and get called back once the broker acknowledged the event, or
+    // with delivered = false if it did not. Does not block; returns -1 if offline or if
+    // FERMI_CLOUD_INFLIGHT_WINDOW events are still waiting for their ack.
+    int publish(const char *eventName, const char *eventData, PublishFlags flags,
+                FermiPublishCallback callback, void *context = NULL)
     {
         if (strlen(eventName) > FERMI_CLOUD_EVENT_NAME_LENGTH) {
             ESP_WML_LOGERROR(F("s:Event name too long"));
             return -1;
         }
+        if (!online())
+            return -1;
+        return _publishNow(eventName, eventData, (flags | WITH_ACK).value(), callback, context);
+    }
+
+    int _publishNow(const char *eventName, const char *eventData, uint8_t flags,
+                    FermiPublishCallback callback = NULL, void *context = NULL)
+    {
         char topic[FERMI_CLOUD_EVENT_TOPIC_BUFFER_LENGTH];
         _getEventTopic(topic, sizeof(topic), eventName);
-        return esp_mqtt_client_publish(mqttClient, topic, eventData, 0, 0, flags & WITH_RETAIN ? 1 : 0);
+        int retain = flags & PUBLISH_EVENT_FLAG_RETAIN ? 1 : 0;
+        if (!(flags & PUBLISH_EVENT_FLAG_WITH_ACK))
+            return _publishLocked(topic, eventData, 0, 0, retain);
+
+        inflight.take();
+        int msgId = -1;
+        if (inflight.full())
+            inflight.rejected();
+        else {
+            msgId = _publishLocked(topic, eventData, 0, 1, retain);
+            if (msgId > 0)
+                inflight.add(msgId, callback, context);
+        }
+        inflight.give();
+        return msgId;
+    }
+
+    // esp_mqtt_client_publish() that is safe against _destroyClient() on the loop task;
+    // -1 once the client is gone. Lock order: inflight, then clientLock.
+    int _publishLocked(const char *topic, const char *data, int length, int qos, int retain)
+    {
+        xSemaphoreTake(clientLock, portMAX_DELAY);
+        int msgId = mqttClient ? esp_mqtt_client_publish(mqttClient, topic, data, length, qos, retain) : -1;
+        xSemaphoreGive(clientLock);
+        return msgId;
+    }
+
+    // Loop task only. The esp-mqtt task is gone once destroy returns, so nothing pushes
+    // records with the old generation afterwards.
+    void _destroyClient()
+    {
+        _isConnected = false;
+        xSemaphoreTake(clientLock, portMAX_DELAY);
+        esp_mqtt_client_destroy(mqttClient);
+        mqttClient = NULL;
+        clientGeneration++;
+        xSemaphoreGive(clientLock);
+    }
+
+    static bool outboxSendStatic(void *context, const char *name, const char *data, uint8_t flags) {
+        FermiDevice *self = (FermiDevice *)context;
+        return self->online() && self->_publishNow(name, data, flags) >= 0;
+    }
+
+    static bool batchSendStatic(void *context, const char *payload, size_t length) {
+        FermiDevice *self = (FermiDevice *)context;
+        if (!self->online())
+            return false;
+        char topic[FERMI_CLOUD_BASE_BUFFER_LENGTH + sizeof("batch") + 1];
+        self->_getDeviceTopic(topic, sizeof(topic), "batch");
+        return self->_publishLocked(topic, payload, length, 0, 0) >= 0;
     }
 
     bool subscribe(const char *eventName, EventHandlerFunction handler, SubscribeScopeEnum scope)
     {
+        CloudEventHandler h;
+        h.func = handler;
+        h.data = NULL;
+        h.isView = false;
+        return _subscribe(eventName, h);
+    }
+
+    // Subscribe with a handler that gets the name and data as views into the MQTT message
+    bool subscribe(const char *eventName, EventViewHandler handler, SubscribeScopeEnum scope = MY_DEVICES)
+    {
+        CloudEventHandler h;
+        h.view = handler;
+        h.data = NULL;
+        h.isView = true;
+        return _subscribe(eventName, h);
+    }
+
+    bool _subscribe(const char *eventName, CloudEventHandler &handler)
+    {
+        if (eventHandlerCount >= FERMI_CLOUD_EVENT_HANDLERS) {
+            ESP_WML_LOGERROR(F("s:Too many event handlers registered"));
+            return false;
+        }
         char topic[FERMI_CLOUD_EVENT_TOPIC_BUFFER_LENGTH];
         _getEventTopic(topic, sizeof(topic), eventName);
         if (esp_mqtt_client_subscribe(mqttClient, topic, 0) < 0)
             return false;
-        eventHandlers[eventHandlerCount] = CloudEventHandler{
-            .topic = topic,
-            .func = handler,
-            .data = NULL,
-        };
+        // '+' and '#' in eventName are passed on to the broker as MQTT wildcards
+        if (!router.add(FERMI_ROUTE_EVENT, eventName, eventHandlerCount)) {
+            ESP_WML_LOGERROR(F("s:Topic router full"));
+            return false;
+        }
+        handler.topic = topic;
+        eventHandlers[eventHandlerCount] = handler;
         eventHandlerCount++;
         return true;
     }
@@ -439,17 +842,31 @@ public:
         return esp_mqtt_client_unsubscribe(mqttClient, topic) >= 0;
     }
 
-    // Add a cloud function
-    bool function(const char *funcKey, CloudFunctionHandler func)
+    // Add a cloud function. A call that has not returned after timeoutMs is answered with
+    // a timeout error (0 = FERMI_CLOUD_FUNCTION_TIMEOUT_MS).
+    bool function(const char *funcKey, CloudFunctionHandler func, uint32_t timeoutMs = 0)
+    {
+        return _function(funcKey, func, NULL, timeoutMs);
+    }
+
+    // Add a cloud function that gets its parameters as a view. With function workers
+    // the view points into a copy that is valid for the duration of the call.
+    bool function(const char *funcKey, CloudFunctionViewHandler func, uint32_t timeoutMs = 0)
+    {
+        return _function(funcKey, NULL, func, timeoutMs);
+    }
+
+    bool _function(const char *funcKey, CloudFunctionHandler func, CloudFunctionViewHandler view, uint32_t timeoutMs)
     {
         // Check if function with same name already exists
-        for (uint8_t i = 0; i < functionHandlerCount; i++) {
-            if (functionHandlers[i].funcKey == funcKey) {
-                // Replace existing function
-                functionHandlers[i].func = func;
-                ESP_WML_LOGINFO1(F("s:Function replaced: "), funcKey);
-                return true;
-            }
+        int i = _findFunction(funcKey, strlen(funcKey));
+        if (i >= 0) {
+            // Replace existing function
+            functionHandlers[i].func = func;
+            functionHandlers[i].view = view;
+            functionHandlers[i].timeoutMs = timeoutMs;
+            ESP_WML_LOGINFO1(F("s:Function replaced: "), funcKey);
+            return true;
         }
         
         // Add new function if we have space
@@ -457,10 +874,16 @@ public:
             ESP_WML_LOGERROR(F("s:Too many function handlers registered"));
             return false;
         }
+        if (!router.add(FERMI_ROUTE_FUNCTION, funcKey, functionHandlerCount)) {
+            ESP_WML_LOGERROR(F("s:Topic router full"));
+            return false;
+        }
         
         functionHandlers[functionHandlerCount] = CloudFunction{
             .funcKey = String(funcKey),
-            .func = func
+            .func = func,
+            .view = view,
+            .timeoutMs = timeoutMs,
         };
         functionHandlerCount++;
         
@@ -468,6 +891,21 @@ public:
         return true;
     }
 
+    // Add a table of cloud functions declared with FERMI_FUNCTION(). The table must stay
+    // valid for the lifetime of the device, i.e. be a global or static constant.
+    template <size_t N>
+    bool attachFunctions(const FermiStaticFunction (&table)[N])
+    {
+        return staticFunctions.attach(table, N);
+    }
+
+    // Add a table of cloud variables declared with FERMI_VARIABLE()/FERMI_VARIABLE_FN()
+    template <size_t N>
+    bool attachVariables(const FermiStaticVariable (&table)[N])
+    {
+        return staticVariables.attach(table, N);
+    }
+
     // bool subscribe(System.deviceID() + "/" PREFIX_WIDGET, handlerWidget, MY_DEVICES);
 
     // Particle.function("notify", handlerNotificationFunction);
@@ -493,14 +931,13 @@ public:
     bool _variable(const char *name, CloudVariableSerializer serializer, const void *ref)
     {
         // Check if variable with same name already exists
-        for (uint8_t i = 0; i < variableCount; i++) {
-            if (variables[i].name == name) {
-                // Replace existing variable
-                variables[i].serializer = serializer;
-                variables[i].ref = ref;
-                ESP_WML_LOGINFO1(F("s:Variable replaced: "), name);
-                return true;
-            }
+        int i = _findVariable(name, strlen(name));
+        if (i >= 0) {
+            // Replace existing variable
+            variables[i].serializer = serializer;
+            variables[i].ref = ref;
+            ESP_WML_LOGINFO1(F("s:Variable replaced: "), name);
+            return true;
         }
         
         // Add new function if we have space
@@ -508,6 +945,10 @@ public:
             ESP_WML_LOGERROR(F("s:Too many variables registered"));
             return false;
         }
+        if (!router.add(FERMI_ROUTE_VARIABLE, name, variableCount)) {
+            ESP_WML_LOGERROR(F("s:Topic router full"));
+            return false;
+        }
         
         variables[variableCount] = {
             .name = String(name),
@@ -525,7 +966,10 @@ public:
         // Iterate over all functionHandler funcKeys and append them to the funcs array
         {
             JsonArray funcs = doc["f"].to<JsonArray>();        
-            for (uint8_t i = 0; i < functionHandlerCount; i++) {
+            for (size_t i = 0; i < staticFunctions.size(); i++) {
+                funcs.add(staticFunctions[i].name);
+            }
+            for (uint16_t i = 0; i < functionHandlerCount; i++) {
                 funcs.add(functionHandlers[i].funcKey.c_str());
             }
         }
@@ -533,123 +977,344 @@ public:
         // Iterate over all variable names and append them to the vars array
         {
             JsonArray vars = doc["v"].to<JsonArray>();        
-            for (uint8_t i = 0; i < variableCount; i++) {
+            for (size_t i = 0; i < staticVariables.size(); i++) {
+                vars.add(staticVariables[i].name);
+            }
+            for (uint16_t i = 0; i < variableCount; i++) {
                 vars.add(variables[i].name.c_str());
             }
         }
 
+        // Encodings the cloud may use for requests; the capabilities themselves stay JSON
+        {
+            JsonArray encodings = doc["enc"].to<JsonArray>();
+            encodings.add("json");
+            encodings.add("msgpack");
+        }
+
         String payload;
         serializeJson(doc, payload);
         char topic[FERMI_CLOUD_BASE_BUFFER_LENGTH + sizeof("capabilities") + 1];
         _getDeviceTopic(topic, sizeof(topic), "capabilities");
-        return esp_mqtt_client_publish(mqttClient, topic, payload.c_str(), 0, 1, 1) != -1;
+        return _publishLocked(topic, payload.c_str(), 0, 1, 1) != -1;
     }
 
     void eventCallback(const char *topic, size_t topic_length, const char *payload, size_t length)
     {
-        for (uint8_t i = 0; i < eventHandlerCount; i++)
+        // Handler topics all start with "devices/<id>/events/"
+        size_t offset = router.getPrefixLength() + sizeof("events/") - 1;
+
+        // Legacy handlers expect null-terminated strings, which the MQTT buffer does not
+        // provide. The copies are made once, and only if such a handler matches.
+        char name[FERMI_CLOUD_EVENT_NAME_LENGTH + 1];
+        String data;
+        bool terminated = false;
+        auto call = [&](CloudEventHandler &handler) {
+            if (handler.isView) {
+                handler.view(topic, topic_length, payload, length);
+                return;
+            }
+            if (!terminated) {
+                size_t n = std::min(topic_length, sizeof(name) - 1);
+                memcpy(name, topic, n);
+                name[n] = '\0';
+                data = String(payload, length);
+                terminated = true;
+            }
+            if (handler.data)
+                handler.funcWithData(handler.data, name, data.c_str());
+            else
+                handler.func(name, data.c_str());
+        };
+
+        uint32_t hash = fermiHash(topic, topic_length);
+        int cursor = -1;
+        for (int i = router.next(FERMI_ROUTE_EVENT, hash, cursor); i >= 0; i = router.next(FERMI_ROUTE_EVENT, hash, cursor))
         {
             CloudEventHandler &handler = eventHandlers[i];
-            if (handler.topic.length() == topic_length && strncmp(topic, handler.topic.c_str(), topic_length) == 0)
-            {
-                if (handler.data)
-                    handler.funcWithData(handler.data, topic, payload);
-                else
-                    handler.func(topic, payload);
-            }
+            if (handler.topic.length() == offset + topic_length && memcmp(handler.topic.c_str() + offset, topic, topic_length) == 0)
+                call(handler);
+        }
+
+        for (uint8_t w = 0; w < router.wildcardSize(); w++)
+        {
+            CloudEventHandler &handler = eventHandlers[router.wildcard(w)];
+            if (fermiTopicMatches(handler.topic.c_str() + offset, handler.topic.length() - offset, topic, topic_length))
+                call(handler);
         }
     }
 
-    void functionCallback(const char *topic, size_t topic_len, const char *payload, size_t length)
+    // payload is parsed in place and is modified
+    void functionCallback(const char *topic, size_t topic_len, char *payload, size_t length)
     {
-        for (uint8_t i = 0; i < functionHandlerCount; i++)
-        {
+        const FermiStaticFunction *entry = staticFunctions.find(topic, topic_len);
+        if (entry) {
+            _callFunction(entry->name, entry->func, entry->view, entry->timeoutMs, payload, length);
+            return;
+        }
+        int i = _findFunction(topic, topic_len);
+        if (i >= 0) {
             CloudFunction &handler = functionHandlers[i];
-            if (handler.funcKey.length() == topic_len && strncmp(handler.funcKey.c_str(), topic, topic_len) == 0) {
-                // Parse the request payload
-                String payloadStr(payload, length);
-                CloudFunctionRequest request;
-                
-                {
-                    // Try to parse as JSON first
-                    StaticJsonDocument<4000> doc;
-                    DeserializationError error = deserializeJson(doc, payloadStr);
-                    
-                    if (!error) {
-                        // JSON format: {"i": 123, "p": "param_value"}
-                        request.requestId = doc["i"].as<uint64_t>();
-                        request.parameters = doc["p"].as<String>();
-                    } else {
-                        // Simple string format (backward compatibility)
-                        request.requestId = millis(); // generate simple ID
-                        request.parameters = payloadStr;
-                    }
-                }
-                
-                // Execute the function
-                int result = handler.func(request.parameters);
-                
-                String responseJson;
-                {
-                    // Create JSON response
-                    StaticJsonDocument<256> responseDoc;
-                    responseDoc["i"] = request.requestId;
-                    responseDoc["r"] = result;
-                    
-                    serializeJson(responseDoc, responseJson);
-                }
-                
-                // Send function result back
-                char responseTopic[FERMI_CLOUD_FUNCTION_TOPIC_BUFFER_LENGTH + sizeof("/response")];
-                snprintf(responseTopic, sizeof(responseTopic), "devices/%s/functions/%s/response", deviceID.c_str(), handler.funcKey.c_str());
-                esp_mqtt_client_publish(mqttClient, responseTopic, responseJson.c_str(), 0, 0, 0);
-            }
+            _callFunction(handler.funcKey.c_str(), handler.func, handler.view, handler.timeoutMs, payload, length);
         }
     }
 
-    void variableCallback(const char *topic, size_t topic_len)
+    // A request carrying a MessagePack map (e.g. the empty map 0x80) gets a MessagePack value.
+    // <name>/watch starts, changes or cancels a watch, see wm_watch.h.
+    void variableCallback(const char *topic, size_t topic_len, char *payload, size_t length)
     {
-        for (uint8_t i = 0; i < variableCount; i++) {
-            CloudVariable &variable = variables[i];
-            if (variable.name.length() == topic_len && strncmp(variable.name.c_str(), topic, topic_len) == 0) {
-                String responseJson;
-                {
-                    // Create JSON response
-                    StaticJsonDocument<256> responseDoc;
-                    variable.serializer(responseDoc, variable.ref);
-                    serializeJson(responseDoc, responseJson);
-                }
-                                
-                // Send variable value back
-                char responseTopic[FERMI_CLOUD_VARIABLE_TOPIC_BUFFER_LENGTH + sizeof("/value")];
-                snprintf(responseTopic, sizeof(responseTopic), "devices/%s/variables/%s/value", deviceID.c_str(), variable.name.c_str());
-                esp_mqtt_client_publish(mqttClient, responseTopic, responseJson.c_str(), 0, 0, 0);
+        FermiEncoding encoding = _requestEncoding(payload, length);
+        const size_t suffix = sizeof("/watch") - 1;
+        bool watch = topic_len > suffix && memcmp(topic + topic_len - suffix, "/watch", suffix) == 0;
+        if (watch)
+            topic_len -= suffix;
+
+        const char *name;
+        CloudVariableSerializer serializer;
+        const void *ref;
+        if (!_resolveVariable(topic, topic_len, name, serializer, ref))
+            return;
+        if (watch)
+            _watchVariable(name, payload, length, encoding);
+        else
+            _sendVariable(name, serializer, ref, encoding);
+    }
+
+    // Look up a variable, name is set to the registered (stable) name
+    bool _resolveVariable(const char *topic, size_t topic_len, const char *&name, CloudVariableSerializer &serializer,
+                          const void *&ref)
+    {
+        const FermiStaticVariable *entry = staticVariables.find(topic, topic_len);
+        if (entry) {
+            name = entry->name;
+            serializer = entry->serializer;
+            ref = entry->ref;
+            return true;
+        }
+        int i = _findVariable(topic, topic_len);
+        if (i < 0)
+            return false;
+        name = variables[i].name.c_str();
+        serializer = variables[i].serializer;
+        ref = variables[i].ref;
+        return true;
+    }
+
+    void _watchVariable(const char *name, char *payload, size_t length, FermiEncoding encoding)
+    {
+        StaticJsonDocument<128> doc;
+        DeserializationError error = DeserializationError::EmptyInput;
+        if (length)
+            error = encoding == FERMI_ENCODING_MSGPACK ? deserializeMsgPack(doc, payload, length)
+                                                       : deserializeJson(doc, payload, length);
+        long minMs = doc["min"] | 0L;
+        if (error || minMs < 0) {
+            watches.remove(name);
+            ESP_WML_LOGINFO1(F("s:Watch cancelled: "), name);
+            return;
+        }
+        if (!watches.set(name, minMs, doc["max"] | 0UL, doc["db"] | 0.0f, encoding))
+            ESP_WML_LOGWARN1(F("s:Too many watches, ignored: "), name);
+    }
+
+    // Called from loop(): publish the watched variables that changed
+    void _sampleWatches()
+    {
+        if (online())
+            watches.loop(millis(), sampleWatchStatic, notifyWatchStatic, this);
+    }
+
+    static bool sampleWatchStatic(void *context, const char *name, JsonDocument &doc) {
+        FermiDevice *self = (FermiDevice *)context;
+        const char *registered;
+        CloudVariableSerializer serializer;
+        const void *ref;
+        if (!self->_resolveVariable(name, strlen(name), registered, serializer, ref))
+            return false;
+        serializer(doc, ref);
+        return true;
+    }
+
+    static void notifyWatchStatic(void *context, const char *name, const JsonDocument &doc, FermiEncoding encoding) {
+        ((FermiDevice *)context)->_publishVariable(name, doc, encoding);
+    }
+
+    FermiEncoding _requestEncoding(const char *payload, size_t length)
+    {
+        if (!fermiIsMsgPack(payload, length))
+            return FERMI_ENCODING_JSON;
+        peerEncoding = FERMI_ENCODING_MSGPACK;
+        return FERMI_ENCODING_MSGPACK;
+    }
+
+    void _callFunction(const char *name, CloudFunctionHandler func, CloudFunctionViewHandler view, uint32_t timeoutMs,
+                       char *payload, size_t length)
+    {
+        // JSON format: {"i": 123, "p": "param_value"}, the same map in MessagePack, or
+        // anything else is taken as the parameter itself (backward compatibility).
+        // A "p" that is an object or array is passed on as its JSON text.
+        const char *params = payload;
+        size_t paramsLength = length;
+        char requestId[FERMI_CLOUD_REQUEST_ID_MAX_LEN + 1];
+        requestId[0] = '\0';
+        FermiEncoding encoding = _requestEncoding(payload, length);
+
+        size_t start = 0;
+        while (start < length && isspace((uint8_t)payload[start]))
+            start++;
+        if (encoding == FERMI_ENCODING_MSGPACK) {
+            // The strings may live in the document, which ends with this block. "p" is moved
+            // to the front of the payload, the map header and "i" make the payload longer.
+            StaticJsonDocument<128> doc;
+            if (deserializeMsgPack(doc, payload, length) == DeserializationError::Ok) {
+                if (doc["i"].is<uint64_t>())
+                    snprintf(requestId, sizeof(requestId), "%llu", (unsigned long long)doc["i"].as<uint64_t>());
+                else
+                    strcpy(requestId, "0");
+                JsonString p = doc["p"];
+                paramsLength = p.c_str() && p.size() < length ? p.size() : 0;
+                if (paramsLength)
+                    memmove(payload, p.c_str(), paramsLength);
+                payload[paramsLength] = '\0';
+                params = payload;
+            }
+            else {
+                params = "";
+                paramsLength = 0;
+            }
+        }
+        else if (start < length && payload[start] == '{') {
+            WMJsonField fields[] = {
+                { "i", NULL, 0 },
+                { "p", NULL, 0 },
+            };
+            WMJsonInPlaceSource source(payload, length);
+            if (wmJsonExtract(source, fields, 2)) {
+                params = fields[1].value ? fields[1].value : "";
+                paramsLength = fields[1].length;
+                // The id is echoed back as is, so only accept plain numbers
+                if (fields[0].value && fields[0].length <= FERMI_CLOUD_REQUEST_ID_MAX_LEN &&
+                    strspn(fields[0].value, "0123456789") == fields[0].length)
+                    memcpy(requestId, fields[0].value, fields[0].length + 1);
+                else
+                    strcpy(requestId, "0");
             }
         }
+        if (requestId[0] == '\0')
+            snprintf(requestId, sizeof(requestId), "%lu", (unsigned long)millis()); // generate simple ID
+
+        // Parameters too long for a queue slot run inline, as without workers
+        if (dispatcher.enabled() && dispatcher.fits(paramsLength)) {
+            dispatcher.submit(name, func, view, requestId, params, paramsLength, timeoutMs, encoding);
+            return;
+        }
+
+        // Execute the function
+        int result = view ? view(params, paramsLength) : func(String(params, paramsLength));
+
+        // Send function result back
+        char response[FERMI_CLOUD_FUNCTION_RESPONSE_MAX_LEN];
+        size_t responseLength = fermiFunctionResult(response, sizeof(response), encoding, requestId, result);
+        _publishResponse(name, response, responseLength);
+    }
+
+    void _publishResponse(const char *name, const char *response, size_t length)
+    {
+        char responseTopic[FERMI_CLOUD_FUNCTION_TOPIC_BUFFER_LENGTH + sizeof("/response")];
+        snprintf(responseTopic, sizeof(responseTopic), "devices/%s/functions/%s/response", deviceID.c_str(), name);
+        _publishLocked(responseTopic, response, length, 0, 0);
+    }
+
+    static void respondStatic(void *context, const char *name, const char *response, size_t length) {
+        ((FermiDevice *)context)->_publishResponse(name, response, length);
+    }
+
+    void _sendVariable(const char *name, CloudVariableSerializer serializer, const void *ref,
+                       FermiEncoding encoding = FERMI_ENCODING_JSON)
+    {
+        StaticJsonDocument<256> responseDoc;
+        serializer(responseDoc, ref);
+        _publishVariable(name, responseDoc, encoding);
+    }
+
+    void _publishVariable(const char *name, const JsonDocument &doc, FermiEncoding encoding)
+    {
+        char response[FERMI_CLOUD_VARIABLE_RESPONSE_MAX_LEN];
+        size_t length;
+        if (encoding == FERMI_ENCODING_MSGPACK)
+            length = serializeMsgPack(doc, response, sizeof(response));
+        else
+            length = serializeJson(doc, response, sizeof(response));
+                        
+        // Send variable value back
+        char responseTopic[FERMI_CLOUD_VARIABLE_TOPIC_BUFFER_LENGTH + sizeof("/value")];
+        snprintf(responseTopic, sizeof(responseTopic), "devices/%s/variables/%s/value", deviceID.c_str(), name);
+        _publishLocked(responseTopic, response, length, 0, 0);
     }
 
     static void mqttHandlerStatic(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
         ((FermiDevice *)handler_args)->mqttHandler(base, event_id, event_data);
     }
 
+    // Runs on the esp-mqtt task: only copies the event into the ring for loop()
     esp_err_t mqttHandler(esp_event_base_t base, int32_t event_id, void *event_data)
     {
-        Serial.printf("Event dispatched from event loop base=%s, event_id=%d", base, event_id);
         esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
-        esp_mqtt_client_handle_t client = event->client;
-        const char* topic = event->topic;
-        size_t topic_len = event->topic_len;
-        int msg_id;
+
+        switch (event_id)
+        {
+        case MQTT_EVENT_DATA:
+            if (event->data_len != event->total_data_len) {
+                fragmentsDropped++;
+                break;
+            }
+            events.push(clientGeneration, event_id, event->msg_id, event->topic, event->topic_len,
+                        event->data, event->data_len, FERMI_CLOUD_EVENT_RING_RESERVE);
+            break;
+
+        default:
+            events.push(clientGeneration, event_id, event->msg_id, NULL, 0, NULL, 0);
+            break;
+        }
+        return ESP_OK;
+    }
+
+    // Handle the queued MQTT events in the caller's context. Called by WiFiManager::run().
+    void loop()
+    {
+        WMSpscRing<FERMI_CLOUD_EVENT_RING_SIZE>::Record *record;
+        while ((record = events.front()) != NULL) {
+            // Records of a destroyed client are dropped, a handler above may destroy it too
+            if (record->generation == clientGeneration)
+                handleEvent(record->type, record->id, record->key(), record->keyLength, record->data(), record->dataLength);
+            events.pop();
+        }
+        dispatcher.loop();
+        outbox.loop(online(), outboxSendStatic, this);
+        inflight.expire();
+        // A batch started before a disconnect waits for the connection
+        if (batch.due() && online())
+            batch.flush(batchSendStatic, this);
+        _sampleWatches();
+    }
+
+    void handleEvent(int32_t event_id, int msg_id, const char *topic, size_t topic_len, char *data, size_t data_len)
+    {
+        ESP_WML_LOGDEBUG1(F("s:MQTT event = "), event_id);
 
         switch (event_id)
         {
         case MQTT_EVENT_CONNECTED:
-            Serial.println("MQTT_EVENT_CONNECTED");
+            ESP_WML_LOGINFO(F("s:MQTT_EVENT_CONNECTED"));
             _isConnected = true;
+            _wasConnected = true;
+            peerEncoding = FERMI_ENCODING_JSON;
+            // The cloud may have missed changes while we were away
+            watches.resend();
 
             // Subscribe to all handler topics
-            for (uint8_t i = 0; i < eventHandlerCount; i++)
-                esp_mqtt_client_subscribe(client, eventHandlers[i].topic.c_str(), 0);
+            for (uint16_t i = 0; i < eventHandlerCount; i++)
+                esp_mqtt_client_subscribe(mqttClient, eventHandlers[i].topic.c_str(), 0);
 
             // Subscribe to all function topics
             {
@@ -670,62 +1335,85 @@ public:
             break;
 
         case MQTT_EVENT_DISCONNECTED:
-            Serial.println("MQTT_EVENT_DISCONNECTED");
+            ESP_WML_LOGINFO(F("s:MQTT_EVENT_DISCONNECTED"));
             _isConnected = false;
             _gotDisconnected = true;
             // fermion->accessToken.clear();
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
-            Serial.println("MQTT_EVENT_SUBSCRIBED");
+            ESP_WML_LOGDEBUG1(F("s:MQTT_EVENT_SUBSCRIBED, msg_id = "), msg_id);
             break;
 
         case MQTT_EVENT_UNSUBSCRIBED:
-            Serial.println("MQTT_EVENT_UNSUBSCRIBED");
+            ESP_WML_LOGDEBUG1(F("s:MQTT_EVENT_UNSUBSCRIBED, msg_id = "), msg_id);
             break;
 
         case MQTT_EVENT_PUBLISHED:
-            Serial.println("MQTT_EVENT_PUBLISHED");
+            ESP_WML_LOGDEBUG1(F("s:PUBACK msg_id = "), msg_id);
+            inflight.complete(msg_id, true);
+            break;
+
+        case MQTT_EVENT_DELETED:
+            // esp-mqtt gave up on a QoS 1 message
+            ESP_WML_LOGWARN1(F("s:Publish expired, msg_id = "), msg_id);
+            inflight.complete(msg_id, false);
             break;
 
         case MQTT_EVENT_DATA:
-            Serial.println("MQTT_EVENT_DATA");
-            Serial.printf("TOPIC=%.*s\n", event->topic_len, event->topic);
-            Serial.printf("DATA=%.*s\n", event->data_len, event->data);
-
-            // Check if the topic is for this device
-            if (strncmp(topic, "devices/", 8) != 0) break;
-            topic += 8;
-            topic_len -= 8;
-            if (strncmp(topic, deviceID.c_str(), deviceID.length()) != 0) break;
-            topic += deviceID.length();
-            topic_len -= deviceID.length();
-
-            // Check if the topic is a function or event
-            if (strncmp(topic, "/events/", 8) == 0) {
-                topic += 8;
-                topic_len -= 8;
-                eventCallback(topic, topic_len, event->data, event->data_len);
-            } else if (strncmp(topic, "/functions/", 11) == 0) {
-                topic += 11;
-                topic_len -= 11;
-                functionCallback(topic, topic_len, event->data, event->data_len);
-            } else if (strncmp(topic, "/variables/", 11) == 0) {
-                topic += 11;
-                topic_len -= 11;
-                variableCallback(topic, topic_len);
+            // Topic and payload are not terminated, and the payload may hold credentials
+            ESP_WML_LOGDEBUG1(F("s:MQTT_EVENT_DATA, bytes = "), data_len);
+
+            // Check if the topic is for this device and whether it is an event, function or variable
+            {
+                const char *name;
+                size_t name_len;
+                switch (router.classify(topic, topic_len, name, name_len)) {
+                    case FERMI_ROUTE_EVENT:
+                        eventCallback(name, name_len, data, data_len);
+                        break;
+                    case FERMI_ROUTE_FUNCTION:
+                        functionCallback(name, name_len, data, data_len);
+                        break;
+                    case FERMI_ROUTE_VARIABLE:
+                        variableCallback(name, name_len, data, data_len);
+                        break;
+                    default:
+                        break;
+                }
             }
             break;
 
         case MQTT_EVENT_ERROR:
-            Serial.println("MQTT_EVENT_ERROR");
+            ESP_WML_LOGERROR(F("s:MQTT_EVENT_ERROR"));
             break;
         }
-        return ESP_OK;
     }
 
 private:
 
+    int _findFunction(const char *name, size_t len) {
+        uint32_t hash = fermiHash(name, len);
+        int cursor = -1;
+        for (int i = router.next(FERMI_ROUTE_FUNCTION, hash, cursor); i >= 0; i = router.next(FERMI_ROUTE_FUNCTION, hash, cursor)) {
+            const String &key = functionHandlers[i].funcKey;
+            if (key.length() == len && memcmp(key.c_str(), name, len) == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    int _findVariable(const char *name, size_t len) {
+        uint32_t hash = fermiHash(name, len);
+        int cursor = -1;
+        for (int i = router.next(FERMI_ROUTE_VARIABLE, hash, cursor); i >= 0; i = router.next(FERMI_ROUTE_VARIABLE, hash, cursor)) {
+            const String &key = variables[i].name;
+            if (key.length() == len && memcmp(key.c_str(), name, len) == 0)
+                return i;
+        }
+        return -1;
+    }
+
     void _getDeviceTopic(char *buffer, size_t length, const char *subTopic) {
         strncpy(buffer, "devices/", length - 1);
         strncat(buffer, deviceID.c_str(), length - 1);
@@ -67,6 +67,17 @@ FS *filesystem = &SPIFFS;
 
 //////////////////////////////////////////////
 
+// Bumped whenever a file is written through saveFile() or wmFileChanged(), so caches of
+// file contents know they are stale
+volatile uint32_t wmFileGeneration = 0;
+
+void wmFileChanged()
+{
+    wmFileGeneration++;
+}
+
+//////////////////////////////////////////////
+
 bool fileExist(char const *filename)
 {
     if (FileFS.begin())
@@ -85,6 +96,7 @@ bool saveFile(uint8_t *buffer, size_t length, char const *filename)
         {
             file.write(buffer, length);
             file.close();
+            wmFileChanged();
             return true;
         }
     }
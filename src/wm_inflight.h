@@ -0,0 +1,171 @@
+#pragma once
+
+#ifndef wm_inflight_h_
+#define wm_inflight_h_
+
+#include <Arduino.h>
+#include "wm_debug.h"
+
+//////////////////////////////////////////////
+
+// QoS 1 publishes that have not been acknowledged yet. Bounded, so a caller that wants
+// reliable delivery gets an immediate error instead of piling up messages in esp-mqtt.
+
+#ifndef FERMI_CLOUD_INFLIGHT_WINDOW
+  #define FERMI_CLOUD_INFLIGHT_WINDOW       8
+#endif
+
+// An unacknowledged message is reported as failed after this long
+#ifndef FERMI_CLOUD_ACK_TIMEOUT_MS
+  #define FERMI_CLOUD_ACK_TIMEOUT_MS        60000L
+#endif
+
+// esp-mqtt resends an unacknowledged message after this long (message_retransmit_timeout),
+// so a later ack means the message went out more than once
+#ifndef FERMI_CLOUD_RETRANSMIT_MS
+  #define FERMI_CLOUD_RETRANSMIT_MS         1000
+#endif
+
+// delivered is false if the message expired or the ack timed out
+typedef void (*FermiPublishCallback)(void *context, int msgId, bool delivered);
+
+struct FermiPublishStats
+{
+    uint32_t acked;
+    uint32_t failed;
+    uint32_t windowFull;        // QoS 1 publishes rejected because the window was full
+    uint32_t retransmits;       // estimated, see FERMI_CLOUD_RETRANSMIT_MS
+    uint32_t lastAckMs;
+    uint32_t maxAckMs;
+    uint32_t avgAckMs;          // moving average
+    uint8_t inFlight;
+    uint8_t maxInFlight;
+};
+
+//////////////////////////////////////////////
+
+class FermiInflightWindow
+{
+public:
+    FermiInflightWindow()
+    {
+        memset(entries, 0, sizeof(entries));
+        memset(&statistics, 0, sizeof(statistics));
+        lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    }
+
+    // Hold the window across publish + add, so the ack cannot be handled in between
+    void take() { xSemaphoreTake(lock, portMAX_DELAY); }
+    void give() { xSemaphoreGive(lock); }
+
+    // With the window taken
+    bool full() const { return statistics.inFlight >= FERMI_CLOUD_INFLIGHT_WINDOW; }
+
+    void rejected() { statistics.windowFull++; }
+
+    // With the window taken
+    void add(int msgId, FermiPublishCallback callback, void *context)
+    {
+        for (uint8_t i = 0; i < FERMI_CLOUD_INFLIGHT_WINDOW; i++)
+        {
+            Entry &e = entries[i];
+            if (e.msgId)
+                continue;
+            e.msgId = msgId;
+            e.sentAt = millis();
+            e.callback = callback;
+            e.context = context;
+            statistics.inFlight++;
+            if (statistics.inFlight > statistics.maxInFlight)
+                statistics.maxInFlight = statistics.inFlight;
+            return;
+        }
+    }
+
+    // MQTT_EVENT_PUBLISHED (PUBACK) or MQTT_EVENT_DELETED (expired in esp-mqtt)
+    void complete(int msgId, bool delivered)
+    {
+        take();
+        Entry done = {};
+        for (uint8_t i = 0; i < FERMI_CLOUD_INFLIGHT_WINDOW; i++)
+        {
+            if (entries[i].msgId != msgId)
+                continue;
+            done = entries[i];
+            release(entries[i], delivered);
+            break;
+        }
+        give();
+        if (done.msgId && done.callback)
+            done.callback(done.context, msgId, delivered);
+    }
+
+    // The client was destroyed together with its unacknowledged messages
+    void failAll()
+    {
+        for (uint8_t i = 0; i < FERMI_CLOUD_INFLIGHT_WINDOW; i++)
+        {
+            take();
+            Entry e = entries[i];
+            if (e.msgId)
+                release(entries[i], false);
+            give();
+            if (e.msgId && e.callback)
+                e.callback(e.context, e.msgId, false);
+        }
+    }
+
+    // Fail messages whose ack is overdue. Called from the loop.
+    void expire()
+    {
+        uint32_t now = millis();
+        for (uint8_t i = 0; i < FERMI_CLOUD_INFLIGHT_WINDOW; i++)
+        {
+            take();
+            Entry e = entries[i];
+            bool overdue = e.msgId && now - e.sentAt >= FERMI_CLOUD_ACK_TIMEOUT_MS;
+            if (overdue)
+                release(entries[i], false);
+            give();
+            if (overdue && e.callback)
+                e.callback(e.context, e.msgId, false);
+        }
+    }
+
+    const FermiPublishStats &stats() const { return statistics; }
+
+private:
+    struct Entry
+    {
+        int msgId;              // 0 = free, esp-mqtt never uses 0 for QoS 1
+        uint32_t sentAt;
+        FermiPublishCallback callback;
+        void *context;
+    };
+
+    void release(Entry &e, bool delivered)
+    {
+        if (delivered)
+        {
+            uint32_t ms = millis() - e.sentAt;
+            statistics.acked++;
+            statistics.lastAckMs = ms;
+            if (ms > statistics.maxAckMs)
+                statistics.maxAckMs = ms;
+            statistics.avgAckMs = statistics.avgAckMs ? (statistics.avgAckMs * 7 + ms) / 8 : ms;
+            if (ms >= FERMI_CLOUD_RETRANSMIT_MS)
+                statistics.retransmits += ms / FERMI_CLOUD_RETRANSMIT_MS;
+        }
+        else
+            statistics.failed++;
+        e.msgId = 0;
+        statistics.inFlight--;
+    }
+
+    Entry entries[FERMI_CLOUD_INFLIGHT_WINDOW];
+    FermiPublishStats statistics;
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lockBuffer;
+};
+
+#endif // wm_inflight_h_
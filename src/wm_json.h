@@ -0,0 +1,349 @@
+#pragma once
+
+#ifndef wm_json_h_
+#define wm_json_h_
+
+#include <WiFiClient.h>
+
+//////////////////////////////////////////////
+
+// Minimal pull parser used for the OAuth responses. It walks the top-level object of a
+// JSON document byte by byte and copies only the requested members into caller-owned
+// buffers, so no JsonDocument has to be allocated while the TLS session is alive.
+
+#define WM_JSON_KEY_MAX_LEN       32
+
+struct WMJsonField
+{
+    const char *key;
+    char *value;        // destination buffer, always null-terminated after parsing
+    size_t size;        // capacity of value including the terminating '\0'
+    size_t length;      // number of bytes written, 0 if the member was absent
+    bool truncated;     // value did not fit into the buffer
+};
+
+//////////////////////////////////////////////
+
+// Reads from an HTTP body through a small local buffer instead of one read() per byte
+class WMJsonStreamSource
+{
+public:
+    WMJsonStreamSource(WiFiClient &client, unsigned long timeout) :
+        client(client),
+        timeout(timeout),
+        pos(0),
+        len(0)
+    {}
+
+    int next()
+    {
+        if (pos < len)
+            return buf[pos++];
+
+        unsigned long start = millis();
+        while (true)
+        {
+            int avail = client.available();
+            if (avail > 0)
+            {
+                int n = client.read(buf, std::min((size_t)avail, sizeof(buf)));
+                if (n > 0)
+                {
+                    len = n;
+                    pos = 1;
+                    return buf[0];
+                }
+            }
+            else if (!client.connected())
+                return -1;
+
+            if (millis() - start >= timeout)
+                return -1;
+            delay(1);
+        }
+    }
+
+    void bind(WMJsonField *, size_t) {}
+
+private:
+    WiFiClient &client;
+    unsigned long timeout;
+    size_t pos;
+    size_t len;
+    uint8_t buf[64];
+};
+
+//////////////////////////////////////////////
+
+class WMJsonMemorySource
+{
+public:
+    WMJsonMemorySource(const char *data, size_t length) : data(data), length(length), pos(0) {}
+
+    int next() { return pos < length ? (uint8_t)data[pos++] : -1; }
+
+    void bind(WMJsonField *, size_t) {}
+
+private:
+    const char *data;
+    size_t length;
+    size_t pos;
+};
+
+//////////////////////////////////////////////
+
+// Parses a mutable buffer without copying: every requested field is pointed at its value
+// inside the buffer. Strings are unescaped where they are, which never needs more room
+// than the escaped form, and values are null-terminated over the byte that follows them
+// (closing quote, or the ',', '}' or space after any other value). Nested objects and
+// arrays stay raw JSON text. Fields that are absent keep value == NULL.
+class WMJsonInPlaceSource
+{
+public:
+    WMJsonInPlaceSource(char *data, size_t length) : data(data), length(length), pos(0) {}
+
+    int next() { return pos < length ? (uint8_t)data[pos++] : -1; }
+
+    // The value of field starts back bytes before the current position
+    void bind(WMJsonField *field, size_t back)
+    {
+        if (!field)
+            return;
+        field->value = data + pos - back;
+        field->size = length - pos + back + 1;
+    }
+
+private:
+    char *data;
+    size_t length;
+    size_t pos;
+};
+
+//////////////////////////////////////////////
+
+static inline void _wmJsonPut(WMJsonField *field, char c)
+{
+    if (!field)
+        return;
+    if (field->length + 1 < field->size)
+        field->value[field->length++] = c;
+    else
+        field->truncated = true;
+}
+
+static inline void _wmJsonPutUtf8(WMJsonField *field, uint16_t cp)
+{
+    if (cp < 0x80)
+        _wmJsonPut(field, (char)cp);
+    else if (cp < 0x800)
+    {
+        _wmJsonPut(field, (char)(0xC0 | (cp >> 6)));
+        _wmJsonPut(field, (char)(0x80 | (cp & 0x3F)));
+    }
+    else
+    {
+        _wmJsonPut(field, (char)(0xE0 | (cp >> 12)));
+        _wmJsonPut(field, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        _wmJsonPut(field, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+template <typename Source>
+static int _wmJsonSkipWs(Source &src)
+{
+    int c;
+    do
+        c = src.next();
+    while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+    return c;
+}
+
+// Called after the opening quote. Copies the unescaped string into field (if any).
+template <typename Source>
+static bool _wmJsonReadString(Source &src, WMJsonField *field)
+{
+    while (true)
+    {
+        int c = src.next();
+        if (c < 0)
+            return false;
+        if (c == '"')
+            return true;
+        if (c != '\\')
+        {
+            _wmJsonPut(field, (char)c);
+            continue;
+        }
+
+        c = src.next();
+        switch (c)
+        {
+            case 'b': _wmJsonPut(field, '\b'); break;
+            case 'f': _wmJsonPut(field, '\f'); break;
+            case 'n': _wmJsonPut(field, '\n'); break;
+            case 'r': _wmJsonPut(field, '\r'); break;
+            case 't': _wmJsonPut(field, '\t'); break;
+            case 'u':
+            {
+                uint16_t cp = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    int h = src.next();
+                    if (h >= '0' && h <= '9')      cp = (cp << 4) | (h - '0');
+                    else if (h >= 'a' && h <= 'f') cp = (cp << 4) | (h - 'a' + 10);
+                    else if (h >= 'A' && h <= 'F') cp = (cp << 4) | (h - 'A' + 10);
+                    else return false;
+                }
+                _wmJsonPutUtf8(field, cp);
+                break;
+            }
+            case -1:
+                return false;
+            default:
+                // \" \\ \/
+                _wmJsonPut(field, (char)c);
+        }
+    }
+}
+
+// Called after the opening bracket. Copies the rest of a nested object or array into
+// field (if any) as raw text, strings still escaped.
+template <typename Source>
+static bool _wmJsonCopyNested(Source &src, WMJsonField *field)
+{
+    int depth = 1;
+    bool inString = false;
+    while (depth > 0)
+    {
+        int c = src.next();
+        if (c < 0)
+            return false;
+        _wmJsonPut(field, (char)c);
+        if (inString)
+        {
+            if (c == '\\')
+            {
+                c = src.next();
+                if (c < 0)
+                    return false;
+                _wmJsonPut(field, (char)c);
+            }
+            else if (c == '"')
+                inString = false;
+        }
+        else if (c == '"')
+            inString = true;
+        else if (c == '{' || c == '[')
+            depth++;
+        else if (c == '}' || c == ']')
+            depth--;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////
+
+// Extract the requested top-level members of a JSON object. Strings are unescaped,
+// numbers, literals and nested objects or arrays are copied as raw text.
+// Returns false if the input is not a complete JSON object.
+template <typename Source>
+bool wmJsonExtract(Source &src, WMJsonField *fields, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        fields[i].length = 0;
+        fields[i].truncated = false;
+        if (fields[i].size)
+            fields[i].value[0] = '\0';
+    }
+
+    if (_wmJsonSkipWs(src) != '{')
+        return false;
+
+    char key[WM_JSON_KEY_MAX_LEN + 1];
+    while (true)
+    {
+        int c = _wmJsonSkipWs(src);
+        if (c == '}')
+            break;
+        if (c == ',')
+            c = _wmJsonSkipWs(src);
+        if (c != '"')
+            return false;
+
+        WMJsonField keyField = { NULL, key, sizeof(key), 0, false };
+        if (!_wmJsonReadString(src, &keyField))
+            return false;
+        key[keyField.length] = '\0';
+
+        if (_wmJsonSkipWs(src) != ':')
+            return false;
+
+        WMJsonField *field = NULL;
+        if (!keyField.truncated)
+            for (size_t i = 0; i < count; i++)
+                if (strcmp(fields[i].key, key) == 0)
+                {
+                    field = &fields[i];
+                    break;
+                }
+
+        c = _wmJsonSkipWs(src);
+        if (c == '"')
+        {
+            src.bind(field, 0);
+            if (!_wmJsonReadString(src, field))
+                return false;
+        }
+        else if (c == '{' || c == '[')
+        {
+            src.bind(field, 1);
+            _wmJsonPut(field, (char)c);
+            if (!_wmJsonCopyNested(src, field))
+                return false;
+            // The byte after the value is consumed before the terminator goes over it,
+            // in place it would otherwise overwrite input that was not read yet
+            c = src.next();
+            if (c < 0)
+                return false;
+            if (field)
+                field->value[field->length] = '\0';
+            if (c == '}')
+                break;
+            continue;
+        }
+        else
+        {
+            // number, true, false or null: copy the raw token
+            src.bind(field, 1);
+            while (c >= 0 && c != ',' && c != '}' && c != ' ' && c != '\t' && c != '\r' && c != '\n')
+            {
+                _wmJsonPut(field, (char)c);
+                c = src.next();
+            }
+            if (c < 0)
+                return false;
+            if (field)
+                field->value[field->length] = '\0';
+            if (c == '}')
+                break;
+            continue;
+        }
+
+        if (field)
+            field->value[field->length] = '\0';
+    }
+
+    return true;
+}
+
+// Copy a single top-level member of a JSON document in memory. Meant for handlers that
+// receive raw payloads and only sometimes need to look inside them.
+bool wmJsonGet(const char *data, size_t length, const char *key, char *value, size_t size)
+{
+    WMJsonField field = { key, value, size };
+    WMJsonMemorySource source(data, length);
+    return wmJsonExtract(source, &field, 1) && field.length > 0 && !field.truncated;
+}
+
+#endif // wm_json_h_
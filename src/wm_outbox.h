@@ -0,0 +1,416 @@
+#pragma once
+
+#ifndef wm_outbox_h_
+#define wm_outbox_h_
+
+#include <time.h>
+#include <rom/crc.h>
+#include <esp_heap_caps.h>
+#include "wm_file.h"
+
+//////////////////////////////////////////////
+
+// Events published while the cloud is unreachable are kept in a ring of fixed-size
+// records in a file and sent once the connection is back. Each record carries a CRC and
+// a sequence number, so a record torn by a reset is simply skipped after reboot.
+
+#define FERMI_CLOUD_OUTBOX_FILENAME         "/wm_outbox.dat"
+#define FERMI_CLOUD_OUTBOX_MAGIC            0x584F4246      // "FBOX"
+
+// 0 disables the outbox: offline publishes fail as before. A power of two, so the slot of
+// a sequence number stays the same when it wraps around.
+#ifndef FERMI_CLOUD_OUTBOX_RECORDS
+  #define FERMI_CLOUD_OUTBOX_RECORDS        32
+#endif
+
+#if FERMI_CLOUD_OUTBOX_RECORDS & (FERMI_CLOUD_OUTBOX_RECORDS - 1)
+  #error FERMI_CLOUD_OUTBOX_RECORDS must be a power of two
+#endif
+
+// Header, event name and data of one event
+#ifndef FERMI_CLOUD_OUTBOX_RECORD_SIZE
+  #define FERMI_CLOUD_OUTBOX_RECORD_SIZE    256
+#endif
+
+// When full: true overwrites the oldest event, false rejects the new one
+#ifndef FERMI_CLOUD_OUTBOX_DROP_OLDEST
+  #define FERMI_CLOUD_OUTBOX_DROP_OLDEST    true
+#endif
+
+// Drain rate after reconnecting: at most BATCH events every INTERVAL_MS
+#ifndef FERMI_CLOUD_OUTBOX_BATCH
+  #define FERMI_CLOUD_OUTBOX_BATCH          8
+#endif
+
+#ifndef FERMI_CLOUD_OUTBOX_INTERVAL_MS
+  #define FERMI_CLOUD_OUTBOX_INTERVAL_MS    250
+#endif
+
+// Events collected in PSRAM before they are written to flash, to save flash writes on
+// long outages. Staged events are lost on reset. 0 (or no PSRAM) writes through.
+#ifndef FERMI_CLOUD_OUTBOX_STAGE_RECORDS
+  #define FERMI_CLOUD_OUTBOX_STAGE_RECORDS  0
+#endif
+
+#ifndef FERMI_CLOUD_OUTBOX_STAGE_FLUSH_MS
+  #define FERMI_CLOUD_OUTBOX_STAGE_FLUSH_MS 60000L
+#endif
+
+//////////////////////////////////////////////
+
+struct FermiOutboxRecord
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t createdAt;     // epoch seconds, 0 if the clock was not set
+    uint32_t ttl;           // seconds, 0 = keep until sent
+    uint8_t flags;          // PUBLISH_EVENT_FLAG_*
+    uint8_t nameLength;
+    uint16_t dataLength;
+    uint32_t crc;           // over the header up to here and the payload
+
+    char *name() { return (char *)(this + 1); }
+    char *data() { return name() + nameLength; }
+};
+
+#define FERMI_CLOUD_OUTBOX_PAYLOAD_MAX_LEN  (FERMI_CLOUD_OUTBOX_RECORD_SIZE - sizeof(FermiOutboxRecord))
+
+struct FermiOutboxStats
+{
+    uint32_t stored;
+    uint32_t sent;
+    uint32_t dropped;       // overwritten, rejected or too large
+    uint32_t expired;
+};
+
+// Publishes one stored event; returns false if it could not be sent now
+typedef bool (*FermiOutboxSender)(void *context, const char *name, const char *data, uint8_t flags);
+
+//////////////////////////////////////////////
+
+class FermiOutbox
+{
+public:
+    FermiOutbox() : ready(false), head(0), tail(0), lastDrain(0), stage(NULL), staged(0), stagedAt(0)
+    {
+        memset(&statistics, 0, sizeof(statistics));
+        // publish() may also be called from function workers
+        lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    }
+
+    // Open the file and find the pending events. Called lazily, the FS must be mounted.
+    bool begin()
+    {
+        if (ready || FERMI_CLOUD_OUTBOX_RECORDS == 0)
+            return ready;
+        if (!FileFS.begin())
+            return false;
+
+        const size_t size = FERMI_CLOUD_OUTBOX_RECORDS * FERMI_CLOUD_OUTBOX_RECORD_SIZE;
+        File file = FileFS.open(FERMI_CLOUD_OUTBOX_FILENAME, "r");
+        if (!file || file.size() != size)
+        {
+            if (file)
+                file.close();
+            // New or resized: start empty
+            file = FileFS.open(FERMI_CLOUD_OUTBOX_FILENAME, "w");
+            if (!file)
+                return false;
+            memset(buffer, 0, sizeof(buffer));
+            for (uint16_t i = 0; i < FERMI_CLOUD_OUTBOX_RECORDS; i++)
+                file.write(buffer, sizeof(buffer));
+            file.close();
+        }
+        else
+        {
+            bool any = false;
+            for (uint16_t i = 0; i < FERMI_CLOUD_OUTBOX_RECORDS; i++)
+            {
+                if (file.read(buffer, sizeof(buffer)) != sizeof(buffer))
+                    break;
+                FermiOutboxRecord *r = record();
+                if (!valid(r))
+                    continue;
+                if (!any || (int32_t)(r->seq - tail) < 0)
+                    tail = r->seq;
+                if (!any || (int32_t)(r->seq + 1 - head) > 0)
+                    head = r->seq + 1;
+                any = true;
+            }
+            file.close();
+            if (head - tail > FERMI_CLOUD_OUTBOX_RECORDS)
+                tail = head - FERMI_CLOUD_OUTBOX_RECORDS;
+            ESP_WML_LOGINFO1(F("o:Outbox pending = "), head - tail);
+        }
+
+#if FERMI_CLOUD_OUTBOX_STAGE_RECORDS > 0
+        if (psramFound())
+            stage = (uint8_t *)heap_caps_malloc(FERMI_CLOUD_OUTBOX_STAGE_RECORDS * FERMI_CLOUD_OUTBOX_RECORD_SIZE, MALLOC_CAP_SPIRAM);
+#endif
+        ready = true;
+        return true;
+    }
+
+    // Keep an event for later. ttl in seconds, 0 = until sent.
+    bool store(const char *name, const char *data, uint32_t ttl, uint8_t flags)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        bool ok = storeLocked(name, data, ttl, flags);
+        xSemaphoreGive(lock);
+        return ok;
+    }
+
+    // Call from the loop. Writes staged events out when due and, while connected,
+    // sends pending events oldest first. Each record is read under the lock and sent
+    // outside it, so store() from a worker never waits for the network.
+    void loop(bool connected, FermiOutboxSender send, void *context)
+    {
+        // Events left from before a reboot are picked up once the cloud is reachable
+        if (!ready && !connected)
+            return;
+        for (uint8_t n = 0; n < FERMI_CLOUD_OUTBOX_BATCH; n++)
+        {
+            xSemaphoreTake(lock, portMAX_DELAY);
+            uint32_t seq;
+            bool next = begin() && nextLocked(connected, n == 0, seq);
+            xSemaphoreGive(lock);
+            if (!next)
+                return;
+
+            FermiOutboxRecord *r = (FermiOutboxRecord *)outgoing;
+            bool sent = send(context, r->name(), r->name() + r->nameLength + 1, r->flags);
+
+            xSemaphoreTake(lock, portMAX_DELAY);
+            if (sent)
+            {
+                statistics.sent++;
+                // Unless store() has dropped it meanwhile and reused the slot
+                if (tail == seq)
+                {
+                    File file = FileFS.open(FERMI_CLOUD_OUTBOX_FILENAME, "r+");
+                    consumeLocked(file);
+                    if (file)
+                        file.close();
+                }
+            }
+            xSemaphoreGive(lock);
+            if (!sent)
+                return;
+        }
+    }
+
+    uint32_t pending() const
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        uint32_t n = head - tail + staged;
+        xSemaphoreGive(lock);
+        return n;
+    }
+    const FermiOutboxStats &stats() const { return statistics; }
+
+private:
+    bool storeLocked(const char *name, const char *data, uint32_t ttl, uint8_t flags)
+    {
+        if (!begin())
+            return false;
+
+        size_t nameLength = strlen(name);
+        size_t dataLength = data ? strlen(data) : 0;
+        if (nameLength > 255 || nameLength + dataLength > FERMI_CLOUD_OUTBOX_PAYLOAD_MAX_LEN)
+        {
+            ESP_WML_LOGERROR1(F("o:Event too large for outbox: "), name);
+            statistics.dropped++;
+            return false;
+        }
+
+        uint8_t *dest = buffer;
+        if (stage)
+        {
+            if (staged == FERMI_CLOUD_OUTBOX_STAGE_RECORDS)
+                flushStage();
+            if (staged == FERMI_CLOUD_OUTBOX_STAGE_RECORDS)
+            {
+                statistics.dropped++;
+                return false;
+            }
+            dest = stage + staged * FERMI_CLOUD_OUTBOX_RECORD_SIZE;
+        }
+
+        FermiOutboxRecord *r = (FermiOutboxRecord *)dest;
+        memset(dest, 0, FERMI_CLOUD_OUTBOX_RECORD_SIZE);
+        r->magic = FERMI_CLOUD_OUTBOX_MAGIC;
+        r->createdAt = now();
+        r->ttl = ttl;
+        r->flags = flags;
+        r->nameLength = nameLength;
+        r->dataLength = dataLength;
+        memcpy(r->name(), name, nameLength);
+        if (dataLength)
+            memcpy(r->data(), data, dataLength);
+
+        if (stage)
+        {
+            if (staged++ == 0)
+                stagedAt = millis();
+            statistics.stored++;
+            return true;
+        }
+        if (!append(r))
+        {
+            statistics.dropped++;
+            return false;
+        }
+        statistics.stored++;
+        return true;
+    }
+
+    // Copies the oldest pending event to outgoing, name and data each null-terminated.
+    // Torn, overwritten and expired records on the way are consumed.
+    bool nextLocked(bool connected, bool first, uint32_t &seq)
+    {
+        if (first)
+        {
+            if (staged && (connected || millis() - stagedAt >= FERMI_CLOUD_OUTBOX_STAGE_FLUSH_MS))
+                flushStage();
+            if (!connected || head == tail || millis() - lastDrain < FERMI_CLOUD_OUTBOX_INTERVAL_MS)
+                return false;
+            lastDrain = millis();
+        }
+
+        File file = FileFS.open(FERMI_CLOUD_OUTBOX_FILENAME, "r+");
+        if (!file)
+            return false;
+        FermiOutboxRecord *r = record();
+        bool found = false;
+        while (head != tail && !found)
+        {
+            if (!file.seek(offsetOf(tail)) || file.read(buffer, sizeof(buffer)) != sizeof(buffer) ||
+                !valid(r) || r->seq != tail)
+            {
+                // torn or overwritten record
+                tail++;
+                continue;
+            }
+
+            uint32_t t = now();
+            if (r->ttl && r->createdAt && t && t - r->createdAt > r->ttl)
+            {
+                statistics.expired++;
+                consumeLocked(file);
+                continue;
+            }
+            found = true;
+        }
+        file.close();
+        if (!found)
+            return false;
+
+        FermiOutboxRecord *out = (FermiOutboxRecord *)outgoing;
+        memcpy(out, r, sizeof(FermiOutboxRecord));
+        memcpy(out->name(), r->name(), r->nameLength);
+        out->name()[r->nameLength] = '\0';
+        memcpy(out->name() + r->nameLength + 1, r->data(), r->dataLength);
+        out->name()[r->nameLength + 1 + r->dataLength] = '\0';
+        seq = tail;
+        return true;
+    }
+
+    // Erases the record at tail, so it is not found again after a reboot
+    void consumeLocked(File &file)
+    {
+        erase(file, offsetOf(tail));
+        tail++;
+    }
+
+    static uint32_t offsetOf(uint32_t seq)
+    {
+        return (seq % FERMI_CLOUD_OUTBOX_RECORDS) * FERMI_CLOUD_OUTBOX_RECORD_SIZE;
+    }
+
+    FermiOutboxRecord *record() { return (FermiOutboxRecord *)buffer; }
+
+    static uint32_t crc(FermiOutboxRecord *r)
+    {
+        uint32_t c = crc32_le(0, (const uint8_t *)r, offsetof(FermiOutboxRecord, crc));
+        return crc32_le(c, (const uint8_t *)r->name(), r->nameLength + r->dataLength);
+    }
+
+    static bool valid(FermiOutboxRecord *r)
+    {
+        return r->magic == FERMI_CLOUD_OUTBOX_MAGIC &&
+               r->nameLength + r->dataLength <= FERMI_CLOUD_OUTBOX_PAYLOAD_MAX_LEN &&
+               r->crc == crc(r);
+    }
+
+    static uint32_t now()
+    {
+        time_t t = time(NULL);
+        return t > 1600000000 ? (uint32_t)t : 0;
+    }
+
+    bool append(FermiOutboxRecord *r)
+    {
+        if (head - tail >= FERMI_CLOUD_OUTBOX_RECORDS)
+        {
+            // The caller counts the rejected event, a staged one is kept for later
+            if (!FERMI_CLOUD_OUTBOX_DROP_OLDEST)
+                return false;
+            tail++;
+            statistics.dropped++;
+        }
+
+        r->seq = head;
+        r->crc = crc(r);
+        File file = FileFS.open(FERMI_CLOUD_OUTBOX_FILENAME, "r+");
+        if (!file)
+            return false;
+        bool ok = file.seek(offsetOf(head)) &&
+                  file.write((const uint8_t *)r, FERMI_CLOUD_OUTBOX_RECORD_SIZE) == FERMI_CLOUD_OUTBOX_RECORD_SIZE;
+        file.close();
+        if (ok)
+            head++;
+        else
+            ESP_WML_LOGERROR(F("o:Outbox write failed"));
+        return ok;
+    }
+
+    // Writes staged events oldest first. Those that could not be written (write error, or
+    // full without DROP_OLDEST) stay staged, in order, for the next attempt.
+    bool flushStage()
+    {
+        uint8_t written = 0;
+        while (written < staged && append((FermiOutboxRecord *)(stage + written * FERMI_CLOUD_OUTBOX_RECORD_SIZE)))
+            written++;
+        if (written && written < staged)
+            memmove(stage, stage + written * FERMI_CLOUD_OUTBOX_RECORD_SIZE,
+                    (staged - written) * FERMI_CLOUD_OUTBOX_RECORD_SIZE);
+        staged -= written;
+        if (staged)
+            stagedAt = millis();
+        return staged == 0;
+    }
+
+    static void erase(File &file, uint32_t offset)
+    {
+        uint32_t zero = 0;
+        if (file && file.seek(offset))
+            file.write((const uint8_t *)&zero, sizeof(zero));
+    }
+
+    bool ready;
+    uint32_t head;          // seq of the next record to write
+    uint32_t tail;          // seq of the oldest pending record
+    uint32_t lastDrain;
+    uint8_t *stage;
+    uint8_t staged;
+    uint32_t stagedAt;
+    FermiOutboxStats statistics;
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lockBuffer;
+    uint8_t buffer[FERMI_CLOUD_OUTBOX_RECORD_SIZE];
+    // The event loop() is sending, with a terminator after name and data. Only touched by
+    // the loop task.
+    alignas(4) uint8_t outgoing[FERMI_CLOUD_OUTBOX_RECORD_SIZE + 2];
+};
+
+#endif // wm_outbox_h_
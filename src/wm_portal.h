@@ -0,0 +1,393 @@
+#pragma once
+
+#ifndef wm_portal_h_
+#define wm_portal_h_
+
+#include <ESPAsyncWebServer.h>
+#include "wm_debug.h"
+#include "wm_file.h"
+#include "wm_cache.h"
+
+//////////////////////////////////////////////
+
+// Static files of the configuration portal. A file is served from <path>.gz when the
+// client accepts gzip and that variant exists. Every response carries an ETag built from
+// size and modification time, so a reload costs a 304 instead of the body. Names with a
+// content hash (index-3f2a9c1b.js, app.BRsDeKE5.css) never change and may be cached for
+// good; everything else is revalidated. Files embedded at build time (utils/embed_portal.py)
+// take precedence over the filesystem, and small files read from it are kept in
+// wmPortalCache (wm_cache.h). A path found in neither gets the index page, embedded or
+// from the filesystem, for client-side routes and captive portal checks.
+
+#ifndef WM_PORTAL_INDEX
+  #define WM_PORTAL_INDEX               "/index.html"
+#endif
+
+#ifndef WM_PORTAL_IMMUTABLE_MAX_AGE
+  #define WM_PORTAL_IMMUTABLE_MAX_AGE   31536000    // one year
+#endif
+
+// Shortest token taken for a content hash
+#define WM_PORTAL_HASH_MIN_LEN          8
+
+// A file embedded by utils/embed_portal.py. A gzipped file is usually followed by a row of
+// the same path with its identity copy, for clients that do not accept gzip.
+struct WMPortalAsset
+{
+    const char *path;
+    const uint8_t *data;
+    size_t length;
+    const char *mime;
+    const char *etag;           // quoted
+    bool gzip;
+};
+
+// Generated into the project's include directory at build time. Embedded files are served
+// from flash before the filesystem is looked at.
+#if defined(__has_include)
+  #if __has_include("wm_portal_assets.h")
+    #include "wm_portal_assets.h"
+  #endif
+#endif
+
+#ifndef WM_PORTAL_ASSETS_GENERATED
+  #define WM_PORTAL_ASSETS_GENERATED    0
+#endif
+
+//////////////////////////////////////////////
+
+// The last '.' or '-' separated token before the extension looks like a bundler hash:
+// at least WM_PORTAL_HASH_MIN_LEN alphanumerics with at least one digit
+bool wmPortalHashedName(const String &path)
+{
+    int slash = path.lastIndexOf('/');
+    int ext = path.lastIndexOf('.');
+    if (ext <= slash)
+        return false;
+    int start = ext;
+    bool digit = false;
+    while (--start > slash)
+    {
+        char c = path[start];
+        if (c == '.' || c == '-')
+            break;
+        if (!isalnum((uint8_t)c) && c != '_')
+            return false;
+        digit |= isdigit((uint8_t)c) != 0;
+    }
+    return start > slash + 1 && ext - start - 1 >= WM_PORTAL_HASH_MIN_LEN && digit;
+}
+
+#if WM_PORTAL_ASSETS_GENERATED
+// The embedded variant of path the client can take: the gzipped one if it accepts gzip,
+// otherwise the identity copy. NULL if there is none.
+const WMPortalAsset *wmPortalFindAsset(const String &path, bool gzip)
+{
+    size_t low = 0, high = wmPortalAssetCount;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (strcmp(wmPortalAssets[mid].path, path.c_str()) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    const WMPortalAsset *identity = NULL;
+    for (size_t i = low; i < wmPortalAssetCount && strcmp(wmPortalAssets[i].path, path.c_str()) == 0; i++)
+    {
+        if (!wmPortalAssets[i].gzip)
+            identity = &wmPortalAssets[i];
+        else if (gzip)
+            return &wmPortalAssets[i];
+    }
+    return identity;
+}
+#endif
+
+WMFileCache wmPortalCache;
+
+// Content type by extension, for bodies not sent by AsyncFileResponse
+const char *wmPortalMimeType(const String &path)
+{
+    static const char *const types[][2] = {
+        { ".html", "text/html" },
+        { ".htm", "text/html" },
+        { ".css", "text/css" },
+        { ".js", "application/javascript" },
+        { ".json", "application/json" },
+        { ".svg", "image/svg+xml" },
+        { ".png", "image/png" },
+        { ".jpg", "image/jpeg" },
+        { ".gif", "image/gif" },
+        { ".ico", "image/x-icon" },
+        { ".woff2", "font/woff2" },
+        { ".txt", "text/plain" },
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (path.endsWith(types[i][0]))
+            return types[i][1];
+    return "application/octet-stream";
+}
+
+String wmPortalCacheControl(const String &path)
+{
+    return wmPortalHashedName(path) ? "public, max-age=" + String(WM_PORTAL_IMMUTABLE_MAX_AGE) + ", immutable"
+                                    : String("no-cache");
+}
+
+bool wmPortalNotModified(AsyncWebServerRequest *request, const char *etag)
+{
+    AsyncWebHeader *ifNoneMatch = request->getHeader("If-None-Match");
+    return ifNoneMatch && ifNoneMatch->value().indexOf(etag) >= 0;
+}
+
+void wmPortalSend(AsyncWebServerRequest *request, AsyncWebServerResponse *response, const char *etag,
+                  const String &cacheControl)
+{
+    if (!response)
+    {
+        request->send(500);
+        return;
+    }
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", cacheControl);
+    response->addHeader("Vary", "Accept-Encoding");
+    request->send(response);
+}
+
+// Send a cached body. The response keeps the blob alive until it is sent.
+void wmPortalSendCached(AsyncWebServerRequest *request, const WMCacheEntry &entry)
+{
+    AsyncWebServerResponse *response;
+    if (wmPortalNotModified(request, entry.etag))
+        response = request->beginResponse(304);
+    else
+    {
+        WMCacheBlobPtr blob = entry.blob;
+        response = request->beginResponse(wmPortalMimeType(entry.path), blob->length,
+                                          [blob](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                                              size_t n = blob->length - index;
+                                              if (n > maxLen)
+                                                  n = maxLen;
+                                              memcpy(buffer, blob->data + index, n);
+                                              return n;
+                                          });
+        if (response && entry.gzip)
+            response->addHeader("Content-Encoding", "gzip");
+    }
+    wmPortalSend(request, response, entry.etag, wmPortalCacheControl(entry.path));
+}
+
+// Open path or, if gzip is set and it exists, path.gz
+File wmPortalOpen(const String &path, bool gzip)
+{
+    File file;
+    if (gzip)
+        file = FileFS.open(path + ".gz", "r");
+    if (!file || file.isDirectory())
+        file = FileFS.open(path, "r");
+    if (file && file.isDirectory())
+        file.close();
+    return file;
+}
+
+// Send the embedded file at path, false if there is no variant the client accepts
+bool wmPortalServeAsset(AsyncWebServerRequest *request, const String &path, bool gzip)
+{
+#if WM_PORTAL_ASSETS_GENERATED
+    const WMPortalAsset *asset = wmPortalFindAsset(path, gzip);
+    if (!asset)
+        return false;
+    AsyncWebServerResponse *response;
+    if (wmPortalNotModified(request, asset->etag))
+        response = request->beginResponse(304);
+    else
+    {
+        response = request->beginResponse_P(200, asset->mime, asset->data, asset->length);
+        if (response && asset->gzip)
+            response->addHeader("Content-Encoding", "gzip");
+    }
+    wmPortalSend(request, response, asset->etag, wmPortalCacheControl(asset->path));
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Send path from the cache or the filesystem, false if there is no such file
+bool wmPortalServeFile(AsyncWebServerRequest *request, const String &path, bool gzip)
+{
+    const WMCacheEntry *cached = wmPortalCache.find(path, gzip);
+    if (cached)
+    {
+        wmPortalSendCached(request, *cached);
+        return true;
+    }
+
+    File file = wmPortalOpen(path, gzip);
+    if (!file)
+        return false;
+
+    // Differs between the plain and the .gz variant, which also differ in size
+    char etag[WM_PORTAL_ETAG_MAX_LEN];
+    snprintf(etag, sizeof(etag), "\"%x-%lx\"", (unsigned)file.size(), (unsigned long)file.getLastWrite());
+
+    cached = wmPortalCache.add(path, gzip, path, file, etag);
+    if (cached)
+    {
+        file.close();
+        wmPortalSendCached(request, *cached);
+        return true;
+    }
+    file.seek(0);
+
+    AsyncWebServerResponse *response;
+    if (wmPortalNotModified(request, etag))
+    {
+        file.close();
+        response = request->beginResponse(304);
+    }
+    else
+    {
+        // AsyncFileResponse adds "Content-Encoding: gzip" for a .gz file served under the
+        // plain path and takes the content type from the plain path
+        response = request->beginResponse(file, path);
+    }
+    wmPortalSend(request, response, etag, wmPortalCacheControl(path));
+    return true;
+}
+
+// Serve a portal file: embedded, then from the filesystem, then WM_PORTAL_INDEX the same
+// way for unknown paths (client-side routes, captive probes)
+void wmPortalServe(AsyncWebServerRequest *request)
+{
+    String path = request->url();
+    if (path.endsWith("/"))
+        path += "index.html";
+
+    AsyncWebHeader *acceptEncoding = request->getHeader("Accept-Encoding");
+    bool gzip = acceptEncoding && acceptEncoding->value().indexOf("gzip") >= 0;
+
+    if (wmPortalServeAsset(request, path, gzip) || wmPortalServeFile(request, path, gzip) ||
+        wmPortalServeAsset(request, WM_PORTAL_INDEX, gzip) || wmPortalServeFile(request, WM_PORTAL_INDEX, gzip))
+        return;
+    request->send(404);
+}
+
+//////////////////////////////////////////////
+
+// Connectivity checks of phones and laptops joining the AP. They are answered before any
+// other handler with a redirect to the portal, which makes the OS open its captive portal
+// window, and never touch the filesystem. A token bucket keeps a probe storm from pulling
+// the portal page again and again and starving the real page requests. Probes over the
+// rate still get an answer without a body, so the client is not left to retry on a reset
+// connection: 204 where the probe takes that for "online" and backs off, the redirect
+// otherwise.
+
+#ifndef WM_PORTAL_PROBE_RATE
+  #define WM_PORTAL_PROBE_RATE          10      // probes per second
+#endif
+
+#ifndef WM_PORTAL_PROBE_BURST
+  #define WM_PORTAL_PROBE_BURST         20
+#endif
+
+struct WMPortalProbe
+{
+    const char *path;
+    bool noContent;             // answered with 204 over the rate
+};
+
+static const WMPortalProbe wmPortalProbes[] = {
+    { "/generate_204", true },              // Android
+    { "/gen_204", true },
+    { "/hotspot-detect.html", false },      // Apple
+    { "/library/test/success.html", false },
+    { "/connecttest.txt", false },          // Windows
+    { "/ncsi.txt", false },
+    { "/redirect", false },
+    { "/success.txt", false },              // Firefox
+    { "/canonical.html", false },
+    { "/chat", false },                     // WhatsApp, keeps asking otherwise
+    { "/fwlink", false },
+};
+
+struct WMProbeStats
+{
+    uint32_t answered;
+    uint32_t limited;
+};
+
+class WMProbeHandler : public AsyncWebHandler
+{
+public:
+    explicit WMProbeHandler(IPAddress portalIP) : tokens(WM_PORTAL_PROBE_BURST * 1000), refilledAt(millis())
+    {
+        location = "http://" + portalIP.toString() + "/";
+        memset(&statistics, 0, sizeof(statistics));
+    }
+
+    bool canHandle(AsyncWebServerRequest *request) override
+    {
+        return find(request->url()) != NULL;
+    }
+
+    void handleRequest(AsyncWebServerRequest *request) override
+    {
+        const WMPortalProbe *probe = find(request->url());
+        if (!take())
+        {
+            statistics.limited++;
+            if (probe && probe->noContent)
+            {
+                request->send(204);
+                return;
+            }
+        }
+        else
+            statistics.answered++;
+        AsyncWebServerResponse *response = request->beginResponse(302);
+        response->addHeader("Location", location);
+        response->addHeader("Cache-Control", "no-store");
+        request->send(response);
+    }
+
+    bool isRequestHandlerTrivial() override { return true; }
+
+    const WMProbeStats &stats() const { return statistics; }
+
+private:
+    static const WMPortalProbe *find(const String &url)
+    {
+        for (size_t i = 0; i < sizeof(wmPortalProbes) / sizeof(wmPortalProbes[0]); i++)
+            if (url == wmPortalProbes[i].path)
+                return &wmPortalProbes[i];
+        return NULL;
+    }
+
+    // Token bucket in thousandths of a token
+    bool take()
+    {
+        uint32_t now = millis();
+        uint32_t elapsed = now - refilledAt;
+        refilledAt = now;
+        // A long idle time would overflow the product, it fills the bucket anyway
+        if (elapsed >= WM_PORTAL_PROBE_BURST * 1000 / WM_PORTAL_PROBE_RATE)
+            tokens = WM_PORTAL_PROBE_BURST * 1000;
+        else
+            tokens += elapsed * WM_PORTAL_PROBE_RATE;
+        if (tokens > WM_PORTAL_PROBE_BURST * 1000)
+            tokens = WM_PORTAL_PROBE_BURST * 1000;
+        if (tokens < 1000)
+            return false;
+        tokens -= 1000;
+        return true;
+    }
+
+    String location;
+    uint32_t tokens;
+    uint32_t refilledAt;
+    WMProbeStats statistics;
+};
+
+#endif // wm_portal_h_
@@ -0,0 +1,145 @@
+#pragma once
+
+#ifndef wm_retry_h_
+#define wm_retry_h_
+
+#include <esp_system.h>
+
+//////////////////////////////////////////////
+
+// Defaults for the cloud retry policies. A fleet that loses the broker or the token
+// endpoint at the same time must not come back in lockstep, so every delay is drawn
+// with decorrelated jitter and each endpoint has a budget of attempts that refills slowly.
+
+// Never retry sooner than the fixed 10 s state check did, or the fleet hits the server
+// harder than before, see utils/outage_sim.py
+#ifndef WM_RETRY_BASE_MS
+  #define WM_RETRY_BASE_MS              10000L
+#endif
+
+// Bounds how long a device may stay away after the server is back
+#ifndef WM_RETRY_CAP_MS
+  #define WM_RETRY_CAP_MS               60000L
+#endif
+
+// Number of attempts that can be spent back to back ...
+#ifndef WM_RETRY_BUDGET
+  #define WM_RETRY_BUDGET               8
+#endif
+
+// ... and the time it takes to earn one attempt back
+#ifndef WM_RETRY_BUDGET_REFILL_MS
+  #define WM_RETRY_BUDGET_REFILL_MS     60000L
+#endif
+
+// RFC 8628: on "slow_down" the polling interval is increased by 5 seconds for good
+#define WM_RETRY_SLOW_DOWN_MS           5000L
+
+//////////////////////////////////////////////
+
+class WMRetryPolicy
+{
+public:
+    WMRetryPolicy(uint32_t baseMs = WM_RETRY_BASE_MS, uint32_t capMs = WM_RETRY_CAP_MS,
+                  uint8_t budget = WM_RETRY_BUDGET, uint32_t refillMs = WM_RETRY_BUDGET_REFILL_MS) :
+        baseMs(baseMs),
+        capMs(capMs),
+        budget(budget),
+        refillMs(refillMs),
+        tokens(budget),
+        lastRefill(0),
+        sleepMs(baseMs),
+        floorMs(0),
+        failures(0)
+    {}
+
+    // Record a failed attempt and return how long to wait before the next one
+    uint32_t failed()
+    {
+        refill();
+        failures++;
+
+        // Decorrelated jitter: sleep = min(cap, random_between(base, sleep * 3))
+        uint32_t upper = std::min(capMs, sleepMs * 3);
+        sleepMs = upper > baseMs ? baseMs + esp_random() % (upper - baseMs + 1) : baseMs;
+        uint32_t delayMs = sleepMs;
+
+        if (tokens > 0)
+            tokens--;
+        else
+        {
+            // Budget exhausted: wait until the next attempt has been earned back
+            uint32_t untilRefill = refillMs - std::min(refillMs, (uint32_t)(millis() - lastRefill));
+            delayMs = std::max(delayMs, untilRefill);
+        }
+
+        if (floorMs > delayMs)
+            delayMs = floorMs;
+        floorMs = 0;
+
+        ESP_WML_LOGINFO3(F("r:Retry in ms = "), delayMs, F(", failures = "), failures);
+        return delayMs;
+    }
+
+    // Delay before the first attempt after a working connection was lost. Every device
+    // lost it at the same moment, so the attempt is spread over two base intervals.
+    uint32_t first()
+    {
+        return baseMs ? esp_random() % (2 * baseMs) : 0;
+    }
+
+    void succeeded()
+    {
+        sleepMs = baseMs;
+        floorMs = 0;
+        failures = 0;
+    }
+
+    // Server told us not to come back before ms (Retry-After)
+    void retryAfter(uint32_t ms) { floorMs = std::max(floorMs, std::min(ms, capMs)); }
+
+    uint32_t failureCount() const { return failures; }
+
+private:
+    void refill()
+    {
+        uint32_t now = millis();
+        if (lastRefill == 0 || tokens >= budget)
+        {
+            lastRefill = now;
+            return;
+        }
+        uint32_t earned = (now - lastRefill) / refillMs;
+        if (earned)
+        {
+            tokens = std::min<uint32_t>(budget, tokens + earned);
+            lastRefill += earned * refillMs;
+        }
+    }
+
+    uint32_t baseMs;
+    uint32_t capMs;
+    uint8_t budget;
+    uint32_t refillMs;
+    uint8_t tokens;
+    uint32_t lastRefill;
+    uint32_t sleepMs;
+    uint32_t floorMs;
+    uint32_t failures;
+};
+
+//////////////////////////////////////////////
+
+// Retry-After is either delta-seconds or an HTTP-date. Only the former is used by our
+// servers; anything else yields 0 and the regular backoff applies.
+uint32_t wmParseRetryAfter(const String &value)
+{
+    if (value.isEmpty())
+        return 0;
+    for (size_t i = 0; i < value.length(); i++)
+        if (!isDigit(value[i]))
+            return 0;
+    return (uint32_t)value.toInt() * 1000UL;
+}
+
+#endif // wm_retry_h_
@@ -0,0 +1,128 @@
+#pragma once
+
+#ifndef wm_ring_h_
+#define wm_ring_h_
+
+#include <Arduino.h>
+#include <atomic>
+
+//////////////////////////////////////////////
+
+// Lock-free single-producer/single-consumer ring of variable-length records. Used to hand
+// MQTT events from the esp-mqtt task (producer) to the loop task (consumer). Each record
+// is one contiguous block, so key and data can be passed on as views without copying.
+// Only the producer moves head and only the consumer moves tail.
+template <size_t Capacity>
+class WMSpscRing
+{
+public:
+    struct Record
+    {
+        uint16_t size;          // whole record incl. header and padding, WRAP = skip to start
+        int16_t type;
+        int32_t id;
+        uint16_t keyLength;
+        uint16_t dataLength;
+        uint16_t generation;    // set by the producer, e.g. which MQTT client pushed the record
+
+        char *key() { return (char *)(this + 1); }
+        char *data() { return key() + keyLength; }
+    };
+
+    WMSpscRing() : head(0), tail(0), drops(0) {}
+
+    // Producer side. Fails (and counts a drop) if the record does not fit while keeping
+    // reserve bytes free, which leaves room for small records that must not be lost.
+    bool push(uint16_t generation, int16_t type, int32_t id, const char *key, size_t keyLength,
+              const char *data, size_t dataLength, size_t reserve = 0)
+    {
+        size_t need = align(sizeof(Record) + keyLength + dataLength);
+        if (keyLength > 0xFFFF || dataLength > 0xFFFF || need > Capacity / 2)
+        {
+            drops++;
+            return false;
+        }
+
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t t = tail.load(std::memory_order_acquire);
+        size_t offset = h & MASK;
+        size_t contiguous = Capacity - offset;
+        size_t skip = contiguous < need ? contiguous : 0;
+
+        if (Capacity - (h - t) < skip + need + reserve)
+        {
+            drops++;
+            return false;
+        }
+
+        if (skip)
+        {
+            if (skip >= sizeof(Record))
+                ((Record *)(buffer + offset))->size = WRAP;
+            h += skip;
+            offset = 0;
+        }
+
+        Record *r = (Record *)(buffer + offset);
+        r->size = need;
+        r->type = type;
+        r->id = id;
+        r->keyLength = keyLength;
+        r->dataLength = dataLength;
+        r->generation = generation;
+        if (keyLength)
+            memcpy(r->key(), key, keyLength);
+        if (dataLength)
+            memcpy(r->data(), data, dataLength);
+
+        head.store(h + need, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: oldest record or NULL. Valid until pop().
+    Record *front()
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t h = head.load(std::memory_order_acquire);
+        while (t != h)
+        {
+            size_t offset = t & MASK;
+            size_t contiguous = Capacity - offset;
+            if (contiguous < sizeof(Record) || ((Record *)(buffer + offset))->size == WRAP)
+            {
+                // Producer continued at the start of the buffer
+                t += contiguous;
+                tail.store(t, std::memory_order_release);
+                continue;
+            }
+            return (Record *)(buffer + offset);
+        }
+        return NULL;
+    }
+
+    void pop()
+    {
+        Record *r = front();
+        if (r)
+            tail.store(tail.load(std::memory_order_relaxed) + r->size, std::memory_order_release);
+    }
+
+    bool empty() { return front() == NULL; }
+
+    uint32_t dropped() const { return drops; }
+
+private:
+    static_assert((Capacity & (Capacity - 1)) == 0, "WMSpscRing capacity must be a power of two");
+
+    static const uint32_t MASK = Capacity - 1;
+    static const uint16_t WRAP = 0xFFFF;
+
+    static size_t align(size_t n) { return (n + 3) & ~(size_t)3; }
+
+    alignas(4) uint8_t buffer[Capacity];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    volatile uint32_t drops;
+};
+
+#endif // wm_ring_h_
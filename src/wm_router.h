@@ -0,0 +1,382 @@
+#pragma once
+
+#ifndef wm_router_h_
+#define wm_router_h_
+
+#include <Arduino.h>
+#include "wm_debug.h"
+
+//////////////////////////////////////////////
+
+// Dispatch of incoming MQTT topics. The "devices/<id>/" prefix is matched once with a
+// single memcmp, then the remaining name is hashed and looked up in an open-addressed
+// table that points at the handler slot. Wildcard event subscriptions are kept apart
+// and are the only ones matched segment by segment.
+
+enum FermiRouteKind : uint8_t {
+    FERMI_ROUTE_NONE = 0,
+    FERMI_ROUTE_EVENT,
+    FERMI_ROUTE_FUNCTION,
+    FERMI_ROUTE_VARIABLE,
+};
+
+// Must be a power of two and at least twice the number of registered names
+#ifndef FERMI_CLOUD_ROUTER_SLOTS
+  #define FERMI_CLOUD_ROUTER_SLOTS      128
+#endif
+
+#if (FERMI_CLOUD_ROUTER_SLOTS & (FERMI_CLOUD_ROUTER_SLOTS - 1))
+  #error FERMI_CLOUD_ROUTER_SLOTS must be a power of two
+#endif
+
+#ifndef FERMI_CLOUD_WILDCARD_HANDLERS
+  #define FERMI_CLOUD_WILDCARD_HANDLERS 8
+#endif
+
+// Upper bound of the index built for a table registered at compile time. Power of two, at
+// most 256; a table of N entries uses the smallest power of two >= 2 * N of these bytes.
+#ifndef FERMI_CLOUD_STATIC_SLOTS
+  #define FERMI_CLOUD_STATIC_SLOTS      128
+#endif
+
+#if (FERMI_CLOUD_STATIC_SLOTS & (FERMI_CLOUD_STATIC_SLOTS - 1)) || FERMI_CLOUD_STATIC_SLOTS > 256
+  #error FERMI_CLOUD_STATIC_SLOTS must be a power of two not above 256
+#endif
+
+#define FERMI_CLOUD_PREFIX_MAX_LEN      (sizeof("devices/") + 32 + 1)
+
+//////////////////////////////////////////////
+
+// FNV-1a
+static inline uint32_t fermiHash(const char *s, size_t len, uint32_t h = 2166136261u)
+{
+    while (len--)
+    {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Same hash at compile time, for names registered in tables
+constexpr uint32_t fermiHashConst(const char *s, uint32_t h = 2166136261u)
+{
+    return *s ? fermiHashConst(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+// MQTT topic filter match with '+' (one level) and '#' (rest of the topic)
+bool fermiTopicMatches(const char *filter, size_t filterLen, const char *topic, size_t topicLen)
+{
+    size_t f = 0, t = 0;
+    while (f < filterLen)
+    {
+        if (filter[f] == '#')
+            return true;
+        if (filter[f] == '+')
+        {
+            while (t < topicLen && topic[t] != '/')
+                t++;
+            f++;
+            continue;
+        }
+        if (t >= topicLen || filter[f] != topic[t])
+        {
+            // "a/#" also matches "a"
+            return t == topicLen && f + 2 == filterLen && filter[f] == '/' && filter[f + 1] == '#';
+        }
+        f++;
+        t++;
+    }
+    return t == topicLen;
+}
+
+//////////////////////////////////////////////
+
+class FermiTopicRouter
+{
+public:
+    FermiTopicRouter() : prefixLen(0), wildcardCount(0) { clear(); }
+
+    void setPrefix(const char *deviceID)
+    {
+        prefixLen = snprintf(prefix, sizeof(prefix), "devices/%s/", deviceID);
+        if (prefixLen >= sizeof(prefix))
+            prefixLen = sizeof(prefix) - 1;
+    }
+
+    // Split an incoming topic into kind and name. name points into topic.
+    FermiRouteKind classify(const char *topic, size_t len, const char *&name, size_t &nameLen) const
+    {
+        if (len <= prefixLen || memcmp(topic, prefix, prefixLen) != 0)
+            return FERMI_ROUTE_NONE;
+        topic += prefixLen;
+        len -= prefixLen;
+
+        FermiRouteKind kind;
+        size_t skip;
+        switch (topic[0])
+        {
+            case 'e': kind = FERMI_ROUTE_EVENT;    skip = sizeof("events/") - 1;    break;
+            case 'f': kind = FERMI_ROUTE_FUNCTION; skip = sizeof("functions/") - 1; break;
+            case 'v': kind = FERMI_ROUTE_VARIABLE; skip = sizeof("variables/") - 1; break;
+            default:  return FERMI_ROUTE_NONE;
+        }
+        static const char *segments[] = { NULL, "events/", "functions/", "variables/" };
+        if (len <= skip || memcmp(topic, segments[kind], skip) != 0)
+            return FERMI_ROUTE_NONE;
+
+        name = topic + skip;
+        nameLen = len - skip;
+        return kind;
+    }
+
+    void clear()
+    {
+        memset(slots, 0, sizeof(slots));
+        wildcardCount = 0;
+    }
+
+    bool add(FermiRouteKind kind, const char *name, uint16_t index)
+    {
+        size_t len = strlen(name);
+        if (kind == FERMI_ROUTE_EVENT && (memchr(name, '+', len) || memchr(name, '#', len)))
+        {
+            if (wildcardCount >= FERMI_CLOUD_WILDCARD_HANDLERS)
+                return false;
+            wildcards[wildcardCount++] = index;
+            return true;
+        }
+
+        uint32_t hash = fermiHash(name, len);
+        for (uint16_t i = 0, pos = hash & MASK; i < FERMI_CLOUD_ROUTER_SLOTS; i++, pos = (pos + 1) & MASK)
+        {
+            if (slots[pos].kind == FERMI_ROUTE_NONE)
+            {
+                slots[pos].hash = hash;
+                slots[pos].kind = kind;
+                slots[pos].index = index;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Iterate the candidates for a name: start with cursor = -1 and call until it returns -1.
+    // Candidates only share the hash; the caller compares the stored name.
+    int next(FermiRouteKind kind, uint32_t hash, int &cursor) const
+    {
+        uint16_t pos = cursor < 0 ? (hash & MASK) : ((cursor + 1) & MASK);
+        for (uint16_t i = 0; i < FERMI_CLOUD_ROUTER_SLOTS; i++, pos = (pos + 1) & MASK)
+        {
+            const Slot &s = slots[pos];
+            if (s.kind == FERMI_ROUTE_NONE)
+                break;
+            if (s.hash == hash && s.kind == kind)
+            {
+                cursor = pos;
+                return s.index;
+            }
+            if (cursor >= 0 && pos == (hash & MASK))
+                break;   // wrapped around
+        }
+        cursor = -1;
+        return -1;
+    }
+
+    uint8_t wildcardSize() const { return wildcardCount; }
+    uint16_t wildcard(uint8_t i) const { return wildcards[i]; }
+
+    const char *getPrefix() const { return prefix; }
+    size_t getPrefixLength() const { return prefixLen; }
+
+private:
+    static const uint16_t MASK = FERMI_CLOUD_ROUTER_SLOTS - 1;
+
+    struct Slot
+    {
+        uint32_t hash;
+        FermiRouteKind kind;
+        uint16_t index;
+    };
+
+    Slot slots[FERMI_CLOUD_ROUTER_SLOTS];
+    char prefix[FERMI_CLOUD_PREFIX_MAX_LEN];
+    size_t prefixLen;
+    uint16_t wildcards[FERMI_CLOUD_WILDCARD_HANDLERS];
+    uint8_t wildcardCount;
+};
+
+//////////////////////////////////////////////
+
+// Collision-free (perfect hash) index over a constant table of entries with { name, hash }
+// members, e.g. the FERMI_FUNCTION()/FERMI_VARIABLE() tables. The table itself stays in
+// flash. attach() runs hash-and-displace once: names are split into small buckets and each
+// bucket gets a displacement that moves all its names to free slots. A lookup is then two
+// multiplies, two byte reads and one name compare. Two names with the same hash are placed
+// with a seeded hash instead of the precomputed one, which costs hashing the name at lookup.
+template <typename Entry>
+class FermiStaticIndex
+{
+public:
+    FermiStaticIndex() : entries(NULL), count(0), seed(0), bits(0), bucketBits(0) {}
+
+    bool attach(const Entry *table, size_t n)
+    {
+        entries = NULL;
+        count = 0;
+        if (n == 0)
+            return true;
+        if (n * 2 > FERMI_CLOUD_STATIC_SLOTS)
+        {
+            ESP_WML_LOGERROR(F("s:Static table too large for FERMI_CLOUD_STATIC_SLOTS"));
+            return false;
+        }
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = i + 1; j < n; j++)
+                if (strcmp(table[i].name, table[j].name) == 0)
+                {
+                    ESP_WML_LOGERROR1(F("s:Duplicate name in static table: "), table[j].name);
+                    return false;
+                }
+
+        // Two names with the same 32-bit hash land in the same slot for every displacement,
+        // so a collision, or a table no displacement fits, is retried with a seeded hash
+        uint32_t hashes[FERMI_CLOUD_STATIC_SLOTS / 2];
+        for (seed = 0; seed < SEEDS; seed++)
+        {
+            for (size_t i = 0; i < n; i++)
+                hashes[i] = hashOf(table[i].name, strlen(table[i].name), table[i].hash);
+            if (collides(table, hashes, n))
+                continue;
+            for (bits = 1; (1u << bits) < n * 2; bits++)
+                ;
+            bucketBits = bits - 1;
+            for (; bits <= BITS_MAX; bits++)
+            {
+                if (build(hashes, n))
+                {
+                    entries = table;
+                    count = n;
+                    return true;
+                }
+            }
+        }
+        ESP_WML_LOGERROR(F("s:No perfect hash found for static table"));
+        return false;
+    }
+
+    const Entry *find(const char *name, size_t len) const
+    {
+        if (!count)
+            return NULL;
+        uint32_t hash = hashOf(name, len, 0);
+        uint8_t slot = slots[slotOf(hash, displacement[bucketOf(hash)])];
+        if (!slot)
+            return NULL;
+        const Entry &e = entries[slot - 1];
+        return (seed || e.hash == hash) && strncmp(e.name, name, len) == 0 && e.name[len] == '\0' ? &e : NULL;
+    }
+
+    size_t size() const { return count; }
+    const Entry &operator[](size_t i) const { return entries[i]; }
+
+private:
+    static const uint8_t BITS_MAX = FERMI_CLOUD_STATIC_SLOTS == 256 ? 8 : FERMI_CLOUD_STATIC_SLOTS == 128 ? 7 :
+                                    FERMI_CLOUD_STATIC_SLOTS == 64 ? 6 : FERMI_CLOUD_STATIC_SLOTS == 32 ? 5 :
+                                    FERMI_CLOUD_STATIC_SLOTS == 16 ? 4 : FERMI_CLOUD_STATIC_SLOTS == 8 ? 3 :
+                                    FERMI_CLOUD_STATIC_SLOTS == 4 ? 2 : 1;
+    static const uint8_t SEEDS = 4;
+
+    // Seed 0 is the plain name hash, precomputed in the table by fermiHashConst()
+    uint32_t hashOf(const char *name, size_t len, uint32_t precomputed) const
+    {
+        if (seed)
+            return fermiHash(name, len, 2166136261u ^ (seed * 0x9e3779b9u));
+        return precomputed ? precomputed : fermiHash(name, len);
+    }
+
+    bool collides(const Entry *table, const uint32_t *hashes, size_t n) const
+    {
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = i + 1; j < n; j++)
+                if (hashes[i] == hashes[j])
+                {
+                    ESP_WML_LOGINFO3(F("s:Hash collision in static table: "), table[i].name, F(" / "), table[j].name);
+                    return true;
+                }
+        return false;
+    }
+
+    uint8_t bucketOf(uint32_t hash) const
+    {
+        return bucketBits ? (hash * 0x27d4eb2du) >> (32 - bucketBits) : 0;
+    }
+
+    uint8_t slotOf(uint32_t hash, uint8_t d) const
+    {
+        uint32_t h = (hash ^ (d * 0x9e3779b9u)) * 0x85ebca6bu;
+        h ^= h >> 13;
+        return (h * 0xc2b2ae35u) >> (32 - bits);
+    }
+
+    bool build(const uint32_t *hashes, size_t n)
+    {
+        memset(slots, 0, sizeof(slots));
+        memset(displacement, 0, sizeof(displacement));
+        uint8_t buckets = 1 << bucketBits;
+
+        // Largest buckets first, they are the hardest to place
+        for (size_t want = n; want > 0; want--)
+        {
+            for (uint8_t b = 0; b < buckets; b++)
+            {
+                uint8_t members[FERMI_CLOUD_STATIC_SLOTS / 2];
+                size_t size = 0;
+                for (size_t i = 0; i < n; i++)
+                    if (bucketOf(hashes[i]) == b)
+                        members[size++] = i;
+                if (size != want)
+                    continue;
+
+                bool placed = false;
+                for (uint16_t d = 0; d < 256 && !placed; d++)
+                {
+                    placed = true;
+                    for (size_t k = 0; k < size && placed; k++)
+                    {
+                        uint8_t s = slotOf(hashes[members[k]], d);
+                        if (slots[s])
+                            placed = false;
+                        else
+                            slots[s] = members[k] + 1;
+                    }
+                    if (!placed)
+                    {
+                        // undo the partial placement of this bucket
+                        for (size_t k = 0; k < size; k++)
+                        {
+                            uint8_t s = slotOf(hashes[members[k]], d);
+                            if (slots[s] == members[k] + 1)
+                                slots[s] = 0;
+                        }
+                    }
+                    else
+                        displacement[b] = d;
+                }
+                if (!placed)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    const Entry *entries;
+    size_t count;
+    uint8_t seed;                                           // 0 unless the table collides
+    uint8_t bits;
+    uint8_t bucketBits;
+    uint8_t slots[FERMI_CLOUD_STATIC_SLOTS];                // entry index + 1, 0 = empty
+    uint8_t displacement[FERMI_CLOUD_STATIC_SLOTS / 2];
+};
+
+#endif // wm_router_h_
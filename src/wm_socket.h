@@ -0,0 +1,100 @@
+#pragma once
+
+#ifndef wm_socket_h_
+#define wm_socket_h_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+#include "wm_debug.h"
+#include "wm_config.h"
+
+//////////////////////////////////////////////
+
+// Portal channel on /ws, one text frame per message, type letter first:
+//   to the page:    s<state>  c<user code>  g<config JSON as for GET /config>  k (saved)  e<error>
+//   from the page:  g (read config)  p<{"id":..,"pw":..,"id1":..,"pw1":..,"nm":..}> (save)
+// /status and /config keep working for pages that do not use it.
+//
+// Messages arrive on the AsyncTCP task. A config sent with 'p' is only parsed there and
+// handed to loop(), which saves it, changes the state and sends 'k' to every page.
+
+class WMPortalSocket
+{
+public:
+    // Writes the config JSON for 'g'
+    typedef void (*ConfigReader)(void *context, String &json);
+
+    // obfuscated: what the page shows instead of a stored password; sent back, it keeps it
+    explicit WMPortalSocket(const char *obfuscated) : obfuscated(obfuscated), pending(false) {}
+
+    // A message from a page. Returns the reply to that page, empty if there is none.
+    String handle(const char *data, size_t len, ConfigReader reader, void *context)
+    {
+        switch (len ? data[0] : 0)
+        {
+        case 'g':
+        {
+            String json;
+            reader(context, json);
+            return "g" + json;
+        }
+        case 'p':
+        {
+            // The last one is not saved yet, and next is still the loop's
+            if (pending.load(std::memory_order_acquire))
+                return "ebusy";
+            StaticJsonDocument<512> doc;
+            if (deserializeJson(doc, data + 1, len - 1))
+                return "ebad config";
+            next.resetZero();
+            for (uint8_t i = 0; i < WM_NUM_WIFI_CREDENTIALS; i++)
+            {
+                const char *pw = doc[i ? "pw1" : "pw"];
+                keepPassword[i] = pw && strcmp(pw, obfuscated) == 0;
+                parse(doc, i ? "id1" : "id", next.wifiCreds[i].ssid, WM_SSID_MAX_LEN);
+                parse(doc, i ? "pw1" : "pw", next.wifiCreds[i].pw, WM_PASSWORD_MAX_LEN);
+            }
+#if USING_BOARD_NAME
+            parse(doc, "nm", next.boardName, WM_BOARD_NAME_MAX_LEN);
+#endif
+            pending.store(true, std::memory_order_release);
+            return String();
+        }
+        default:
+            return "eunknown";
+        }
+    }
+
+    // From loop(): the config a page sent, with the stored passwords it left obfuscated.
+    // False if there is none.
+    bool take(WMConfig &config)
+    {
+        if (!pending.load(std::memory_order_acquire))
+            return false;
+        for (uint8_t i = 0; i < WM_NUM_WIFI_CREDENTIALS; i++)
+            if (keepPassword[i])
+                memcpy(next.wifiCreds[i].pw, config.wifiCreds[i].pw, WM_PASSWORD_MAX_LEN);
+        config = next;
+        pending.store(false, std::memory_order_release);
+        return true;
+    }
+
+private:
+    void parse(JsonDocument &doc, const char *id, char *pdata, uint8_t maxlen)
+    {
+        const char *value = doc[id];
+        if (value == NULL || strcmp(value, obfuscated) == 0)
+            return;
+        ESP_WML_LOGDEBUG3(F("w:"), id, F("="), value);
+        strncpy(pdata, value, maxlen - 1);
+        pdata[maxlen - 1] = '\0';
+    }
+
+    const char *obfuscated;
+    WMConfig next;
+    bool keepPassword[WM_NUM_WIFI_CREDENTIALS];
+    std::atomic<bool> pending;
+};
+
+#endif // wm_socket_h_
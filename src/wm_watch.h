@@ -0,0 +1,182 @@
+#pragma once
+
+#ifndef wm_watch_h_
+#define wm_watch_h_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "wm_encoding.h"
+
+//////////////////////////////////////////////
+
+// Variables watched by the cloud. Instead of polling devices/<id>/variables/<name>, the
+// cloud sends devices/<id>/variables/<name>/watch with
+//
+//   {"min":<ms>,"max":<ms>,"db":<deadband>}     (an empty payload or "min":-1 cancels)
+//
+// and the device samples the variable from loop() and publishes .../value only when it
+// changed: numbers by more than the deadband, other values by their serialized form. A
+// value is sent at most every min ms and, if max is not 0, at least every max ms.
+
+// Watches active at the same time
+#ifndef FERMI_CLOUD_WATCHES
+  #define FERMI_CLOUD_WATCHES               8
+#endif
+
+// How often a watched variable is serialized to look for a change
+#ifndef FERMI_CLOUD_WATCH_SAMPLE_MS
+  #define FERMI_CLOUD_WATCH_SAMPLE_MS       100
+#endif
+
+//////////////////////////////////////////////
+
+// FNV-1a over the serialized value, so a change can be seen without keeping a copy
+struct FermiHashWriter
+{
+    uint32_t hash = 2166136261u;
+
+    size_t write(uint8_t c)
+    {
+        hash = (hash ^ c) * 16777619u;
+        return 1;
+    }
+
+    size_t write(const uint8_t *s, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            write(s[i]);
+        return n;
+    }
+};
+
+struct FermiVariableWatch
+{
+    const char *name;           // the registered name, NULL = free
+    uint32_t minMs;
+    uint32_t maxMs;             // 0 = only on change
+    float deadband;
+    FermiEncoding encoding;
+    bool sent;                  // false: send the next sample whatever it is
+    uint32_t sampledAt;
+    uint32_t sentAt;
+    double lastNumber;
+    uint32_t lastHash;
+
+    bool due(uint32_t now) const
+    {
+        return name && now - sampledAt >= FERMI_CLOUD_WATCH_SAMPLE_MS && (!sent || now - sentAt >= minMs);
+    }
+
+    // Take a sample, true if it has to be published
+    bool update(JsonVariantConst value, uint32_t now)
+    {
+        sampledAt = now;
+        bool changed;
+        double number = 0;
+        uint32_t hash = 0;
+        if (value.is<double>())
+        {
+            number = value.as<double>();
+            changed = deadband > 0 ? fabs(number - lastNumber) >= deadband : number != lastNumber;
+        }
+        else
+        {
+            FermiHashWriter writer;
+            serializeJson(value, writer);
+            hash = writer.hash;
+            changed = hash != lastHash;
+        }
+
+        if (sent && !changed && !(maxMs && now - sentAt >= maxMs))
+            return false;
+        sent = true;
+        sentAt = now;
+        lastNumber = number;
+        lastHash = hash;
+        return true;
+    }
+};
+
+//////////////////////////////////////////////
+
+// Serializes the current value of a watched variable into doc["v"]; false if the variable
+// is no longer registered
+typedef bool (*FermiWatchSampler)(void *context, const char *name, JsonDocument &doc);
+
+// Publishes a value that changed
+typedef void (*FermiWatchNotifier)(void *context, const char *name, const JsonDocument &doc, FermiEncoding encoding);
+
+//////////////////////////////////////////////
+
+class FermiWatchList
+{
+public:
+    FermiWatchList() { memset(watches, 0, sizeof(watches)); }
+
+    // Start or change the watch of name, which must stay valid while watched
+    bool set(const char *name, uint32_t minMs, uint32_t maxMs, float deadband, FermiEncoding encoding)
+    {
+        FermiVariableWatch *w = find(name);
+        if (!w)
+            w = find(NULL);
+        if (!w)
+            return false;
+        memset(w, 0, sizeof(*w));
+        w->name = name;
+        w->minMs = minMs;
+        w->maxMs = maxMs;
+        w->deadband = deadband;
+        w->encoding = encoding;
+        return true;
+    }
+
+    void remove(const char *name)
+    {
+        FermiVariableWatch *w = find(name);
+        if (w)
+            w->name = NULL;
+    }
+
+    // Send the current values again, e.g. after reconnecting
+    void resend()
+    {
+        for (uint8_t i = 0; i < FERMI_CLOUD_WATCHES; i++)
+            watches[i].sent = false;
+    }
+
+    // Call from the loop while connected: samples the watches that are due and notifies the
+    // values that changed. The watch of a variable that is gone is dropped.
+    void loop(uint32_t now, FermiWatchSampler sample, FermiWatchNotifier notify, void *context)
+    {
+        for (uint8_t i = 0; i < FERMI_CLOUD_WATCHES; i++)
+        {
+            FermiVariableWatch &w = watches[i];
+            if (!w.due(now))
+                continue;
+            StaticJsonDocument<256> doc;
+            if (!sample(context, w.name, doc))
+            {
+                w.name = NULL;
+                continue;
+            }
+            if (w.update(doc["v"], now))
+                notify(context, w.name, doc, w.encoding);
+        }
+    }
+
+    uint8_t size() const { return FERMI_CLOUD_WATCHES; }
+    FermiVariableWatch &operator[](uint8_t i) { return watches[i]; }
+
+private:
+    FermiVariableWatch *find(const char *name)
+    {
+        for (uint8_t i = 0; i < FERMI_CLOUD_WATCHES; i++)
+            if (watches[i].name == name)
+                return &watches[i];
+        return NULL;
+    }
+
+    FermiVariableWatch watches[FERMI_CLOUD_WATCHES];
+};
+
+#endif // wm_watch_h_
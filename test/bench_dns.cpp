@@ -0,0 +1,148 @@
+// Replays a captive-portal query storm through WMCaptiveDns: a dozen phones joining the AP
+// at once, each firing A, AAAA and HTTPS queries for its connectivity checks with EDNS and
+// retrying, plus one client stuck in a retry loop and a few broken packets. The trace is
+// modelled on what phones send right after association. Reports the outcome counts, time
+// per query and heap allocations, which AsyncDNSServer made for every packet.
+
+#include <new>
+#include <vector>
+#include "check.h"
+#include "wm_dns.h"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+//////////////////////////////////////////////
+
+static const char *const hosts[] = {
+    "connectivitycheck.gstatic.com", "www.google.com", "clients3.google.com",
+    "captive.apple.com", "www.apple.com", "gsp-ssl.ls.apple.com",
+    "www.msftconnecttest.com", "dns.msftncsi.com", "detectportal.firefox.com",
+    "g.whatsapp.net", "mtalk.google.com", "time.android.com",
+};
+static const size_t HOSTS = sizeof(hosts) / sizeof(hosts[0]);
+static const uint16_t WM_DNS_TYPE_HTTPS = 65;
+
+struct Query
+{
+    uint32_t at;                // ms into the storm
+    IPAddress from;
+    std::vector<uint8_t> packet;
+};
+
+static std::vector<uint8_t> query(uint16_t id, const char *host, uint16_t type, bool edns)
+{
+    uint8_t buf[WM_DNS_MAX_PACKET];
+    size_t len = wmDnsBuildQuery(buf, sizeof(buf), id, host);
+    _wmDnsPut16(buf + len - 4, type);
+    if (edns)
+    {
+        // OPT pseudo-record: root name, type 41, 1232 byte UDP payload
+        static const uint8_t opt[] = { 0, 0, 41, 0x04, 0xD0, 0, 0, 0, 0, 0, 0 };
+        memcpy(buf + len, opt, sizeof(opt));
+        len += sizeof(opt);
+        _wmDnsPut16(buf + 10, 1);
+    }
+    return std::vector<uint8_t>(buf, buf + len);
+}
+
+static std::vector<Query> storm()
+{
+    std::vector<Query> trace;
+    srand(7);
+    uint16_t id = 1;
+    for (uint8_t phone = 0; phone < 12; phone++)
+    {
+        IPAddress ip(192, 168, 4, 2 + phone);
+        uint32_t joined = rand() % 2000;
+        bool edns = phone % 3 != 0;
+        // Every check is retried after 0.2, 1 and 3 s as long as no portal page is seen
+        for (uint32_t retry : { 0u, 200u, 1000u, 3000u })
+            for (size_t h = 0; h < HOSTS; h++)
+            {
+                const char *host = hosts[(h + phone) % HOSTS];
+                uint32_t at = joined + retry + rand() % 50;
+                trace.push_back({ at, ip, query(id++, host, WM_DNS_TYPE_A, edns) });
+                trace.push_back({ at, ip, query(id++, host, WM_DNS_TYPE_AAAA, edns) });
+                if (phone % 2 == 0)
+                    trace.push_back({ at + 1, ip, query(id++, host, WM_DNS_TYPE_HTTPS, edns) });
+            }
+    }
+    // A client hammering one name at 500 queries per second for 4 s
+    for (uint32_t at = 0; at < 4000; at += 2)
+        trace.push_back({ 500 + at, IPAddress(192, 168, 4, 99), query(id++, "time.android.com", WM_DNS_TYPE_A, false) });
+    // Truncated and non-query packets
+    for (uint32_t i = 0; i < 20; i++)
+    {
+        std::vector<uint8_t> broken = query(id++, hosts[i % HOSTS], WM_DNS_TYPE_A, false);
+        if (i % 2)
+            broken.resize(WM_DNS_HEADER_LEN + 3);
+        else
+            broken[2] |= 0x80;
+        trace.push_back({ i * 200, IPAddress(192, 168, 4, 50), broken });
+    }
+    std::stable_sort(trace.begin(), trace.end(), [](const Query &a, const Query &b) { return a.at < b.at; });
+    return trace;
+}
+
+int main()
+{
+    std::vector<Query> trace = storm();
+    static WMCaptiveDns dns;
+    CHECK(dns.start(53, "*", IPAddress(192, 168, 4, 1)));
+    AsyncUDP *socket = AsyncUDP::listening();
+
+    // In trace time, so the rate limit sees the storm as it happened
+    uint32_t start = millis();
+    size_t before = allocations, replies = 0, replyBytes = 0, queryBytes = 0;
+    for (const Query &q : trace)
+    {
+        hostMillisOffset += q.at - (millis() - start);
+        AsyncUDPPacket packet(q.packet.data(), q.packet.size(), q.from);
+        socket->deliver(packet);
+        queryBytes += q.packet.size();
+        if (packet.replyLength)
+        {
+            replies++;
+            replyBytes += packet.replyLength;
+            CHECK(_wmDnsGet16(packet.reply) == _wmDnsGet16(q.packet.data()) && (packet.reply[2] & 0x80));
+        }
+    }
+    CHECK(allocations == before);
+
+    const WMCaptiveDnsStats &s = dns.stats();
+    CHECK(s.queries == trace.size());
+    CHECK(s.answered + s.empty == replies);
+    CHECK(s.answered + s.empty + s.limited + s.malformed == s.queries);
+    printf("storm: %zu queries over %.1f s from 14 clients, %zu B in, %zu B out\n", trace.size(),
+           trace.back().at / 1000.0, queryBytes, replyBytes);
+    printf("answered %u  empty %u  limited %u  malformed %u  heap allocations 0\n",
+           s.answered, s.empty, s.limited, s.malformed);
+
+    // reply() alone, and a packet through the rate limiter as the AsyncUDP task delivers it
+    uint8_t out[WM_DNS_MAX_PACKET + WM_DNS_ANSWER_LEN];
+    double replyNs = benchNs(trace.size() * 20, [&](size_t i) {
+        const Query &q = trace[i % trace.size()];
+        keep(dns.reply(q.packet.data(), q.packet.size(), out));
+    });
+    double handleNs = benchNs(trace.size() * 20, [&](size_t i) {
+        const Query &q = trace[i % trace.size()];
+        AsyncUDPPacket packet(q.packet.data(), q.packet.size(), q.from);
+        socket->deliver(packet);
+        keep(packet.replyLength);
+    });
+    printf("%-28s %8.0f ns/query\n", "reply()", replyNs);
+    printf("%-28s %8.0f ns/query\n", "rate limit + reply()", handleNs);
+    return 0;
+}
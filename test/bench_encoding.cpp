@@ -0,0 +1,128 @@
+// Bytes on the wire and CPU per message for the JSON and MessagePack encodings: parsing
+// function calls the way FermiDevice::_callFunction() does, and formatting responses and
+// the heartbeat. Needs ArduinoJson, so it is only built when its checkout is given:
+//
+//   make -C test bench ARDUINOJSON=~/Arduino/libraries/ArduinoJson
+
+#include <string>
+#include "check.h"
+#include "wm_json.h"
+#include "wm_encoding.h"
+
+// As in wm_dispatch.h, which needs the esp_timer API
+static const size_t REQUEST_ID_MAX_LEN = 20;
+static const size_t RESPONSE_MAX_LEN = 64;
+
+// _callFunction(), JSON branch: fields are terminated in place
+static size_t parseJson(char *payload, size_t length, char *requestId, const char *&params)
+{
+    WMJsonField fields[] = { { "i", NULL, 0 }, { "p", NULL, 0 } };
+    WMJsonInPlaceSource source(payload, length);
+    if (!wmJsonExtract(source, fields, 2))
+        return 0;
+    params = fields[1].value ? fields[1].value : "";
+    memcpy(requestId, fields[0].value, fields[0].length + 1);
+    return fields[1].length;
+}
+
+// _callFunction(), MessagePack branch: "p" is moved to the front of the payload
+static size_t parseMsgPack(char *payload, size_t length, char *requestId, const char *&params)
+{
+    StaticJsonDocument<128> doc;
+    if (deserializeMsgPack(doc, payload, length) != DeserializationError::Ok)
+        return 0;
+    snprintf(requestId, REQUEST_ID_MAX_LEN + 1, "%llu", (unsigned long long)doc["i"].as<uint64_t>());
+    JsonString p = doc["p"];
+    size_t paramsLength = p.c_str() && p.size() < length ? p.size() : 0;
+    if (paramsLength)
+        memmove(payload, p.c_str(), paramsLength);
+    payload[paramsLength] = '\0';
+    params = payload;
+    return paramsLength;
+}
+
+static std::string callJson(const char *id, const std::string &p)
+{
+    return std::string("{\"i\":") + id + ",\"p\":\"" + p + "\"}";
+}
+
+static std::string callMsgPack(const char *id, const std::string &p)
+{
+    StaticJsonDocument<64> doc;
+    doc["i"] = strtoull(id, NULL, 10);
+    doc["p"] = p.c_str();
+    char buffer[600];
+    size_t n = serializeMsgPack(doc, buffer, sizeof(buffer));
+    return std::string(buffer, n);
+}
+
+static void call(const char *name, const std::string &p)
+{
+    const char *id = "1718031234567";
+    std::string json = callJson(id, p), msgpack = callMsgPack(id, p);
+    char work[600], requestId[REQUEST_ID_MAX_LEN + 1];
+    const char *params;
+
+    // The payload is parsed in place, so both sides copy it first, as the ring would
+    memcpy(work, json.data(), json.size());
+    CHECK(parseJson(work, json.size(), requestId, params) == p.size() && params == p && strcmp(requestId, id) == 0);
+    memcpy(work, msgpack.data(), msgpack.size());
+    CHECK(fermiIsMsgPack(work, msgpack.size()));
+    CHECK(parseMsgPack(work, msgpack.size(), requestId, params) == p.size() && params == p && strcmp(requestId, id) == 0);
+
+    double jsonNs = benchNs(200000, [&](size_t) {
+        memcpy(work, json.data(), json.size());
+        keep(parseJson(work, json.size(), requestId, params));
+    });
+    double msgpackNs = benchNs(200000, [&](size_t) {
+        memcpy(work, msgpack.data(), msgpack.size());
+        keep(parseMsgPack(work, msgpack.size(), requestId, params));
+    });
+    printf("%-20s %8zu %8zu %10.0f %10.0f\n", name, json.size(), msgpack.size(), jsonNs, msgpackNs);
+}
+
+static void response()
+{
+    char buffer[RESPONSE_MAX_LEN];
+    size_t json = fermiFunctionResult(buffer, sizeof(buffer), FERMI_ENCODING_JSON, "1718031234567", 1);
+    size_t msgpack = fermiFunctionResult(buffer, sizeof(buffer), FERMI_ENCODING_MSGPACK, "1718031234567", 1);
+    double jsonNs = benchNs(200000, [&](size_t i) {
+        keep(fermiFunctionResult(buffer, sizeof(buffer), FERMI_ENCODING_JSON, "1718031234567", (int)i));
+    });
+    double msgpackNs = benchNs(200000, [&](size_t i) {
+        keep(fermiFunctionResult(buffer, sizeof(buffer), FERMI_ENCODING_MSGPACK, "1718031234567", (int)i));
+    });
+    printf("%-20s %8zu %8zu %10.0f %10.0f\n", "response", json, msgpack, jsonNs, msgpackNs);
+}
+
+// FermiDevice::heartBeat()
+static void heartbeat()
+{
+    int8_t rssi = -61;
+    uint32_t freeRam = 182344;
+    char data[100];
+    size_t json = 0, msgpack = 0;
+    double jsonNs = benchNs(200000, [&](size_t) {
+        json = snprintf(data, sizeof(data), "{\"rssi\":%i,\"free_ram\":%i}", rssi, (int)freeRam);
+        keep(data);
+    });
+    double msgpackNs = benchNs(200000, [&](size_t) {
+        StaticJsonDocument<64> doc;
+        doc["rssi"] = rssi;
+        doc["free_ram"] = freeRam;
+        msgpack = serializeMsgPack(doc, data, 32);
+        keep(data);
+    });
+    printf("%-20s %8zu %8zu %10.0f %10.0f\n", "heartbeat", json, msgpack, jsonNs, msgpackNs);
+}
+
+int main()
+{
+    printf("%-20s %8s %8s %10s %10s\n", "message", "json B", "msgpk B", "json ns", "msgpk ns");
+    call("call p=on", "on");
+    call("call p=64 B", std::string(64, 'x'));
+    call("call p=400 B", std::string(400, 'x'));
+    response();
+    heartbeat();
+    return 0;
+}
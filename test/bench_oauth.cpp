@@ -0,0 +1,136 @@
+// Replays recorded OAuth device-flow responses through the streaming extractor the way
+// fetchUserCode(), fetchAccessToken() and fetchUserId() read them, and reports time and
+// memory per response. The baseline parsed each one into a DynamicJsonDocument(4000).
+
+#include <new>
+#include "check.h"
+#include "wm_json.h"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+//////////////////////////////////////////////
+
+// Shapes and sizes as returned by the cloud; tokens shortened to typical lengths
+static const char DEVICE_CODE[] =
+    "{\"device_code\":\"GmRhmhcxhwAzkoEqiMEg_DnyEysNkuNhszIySk9eS\",\"user_code\":\"WDJB-MJHT\","
+    "\"verification_uri\":\"https://auth.fermion.io/activate\","
+    "\"verification_uri_complete\":\"https://auth.fermion.io/activate?user_code=WDJB-MJHT\","
+    "\"expires_in\":900,\"interval\":5}";
+
+static const char PENDING[] =
+    "{\"error\":\"authorization_pending\",\"error_description\":\"The user has not yet completed authorization\"}";
+
+static const char USERINFO[] =
+    "{\"sub\":\"auth0|6412f1c2a9e4b3d7c8f01234\",\"nickname\":\"jane\",\"name\":\"jane@example.com\","
+    "\"picture\":\"https://s.gravatar.com/avatar/0f1e2d3c4b5a69788796a5b4c3d2e1f0?s=480&r=pg&d=https%3A%2F%2Fcdn.auth0.com%2Favatars%2Fja.png\","
+    "\"updated_at\":\"2024-03-16T10:12:44.123Z\",\"email\":\"jane@example.com\",\"email_verified\":true}";
+
+static const char REFRESH_TOKEN[] = "v1.MRrwXq2Vh9Nc0Gb3bG4Xg7zQe5sY1dJt2kLm8pRr3uTn0wKf";
+
+static std::string tokenResponse()
+{
+    // RS256 JWTs of about the size the cloud issues, plus an id_token that is skipped
+    std::string access(880, 'A'), id(1190, 'I');
+    for (size_t i = 0; i < access.size(); i += 97)
+        access[i] = '.';
+    return "{\"access_token\":\"" + access + "\",\"refresh_token\":\"" + REFRESH_TOKEN + "\","
+           "\"id_token\":\"" + id + "\",\"scope\":\"openid profile email offline_access\","
+           "\"expires_in\":86400,\"token_type\":\"Bearer\"}";
+}
+
+//////////////////////////////////////////////
+
+struct Replay
+{
+    const char *name;
+    const char *body;
+    size_t length;
+};
+
+static bool parse(const Replay &r, size_t segment, size_t &bytes, size_t &heap)
+{
+    heap = 0;
+    WiFiClient client(r.body, r.length, segment);
+    WMJsonStreamSource source(client, 1000);
+    if (r.body == DEVICE_CODE)
+    {
+        char device[256 + 1], user[16 + 1], uri[160 + 1], interval[8];
+        WMJsonField fields[] = {
+            { "device_code", device, sizeof(device) },
+            { "user_code", user, sizeof(user) },
+            { "verification_uri_complete", uri, sizeof(uri) },
+            { "interval", interval, sizeof(interval) },
+        };
+        bytes = sizeof(device) + sizeof(user) + sizeof(uri) + sizeof(interval);
+        return wmJsonExtract(source, fields, 4) && strcmp(user, "WDJB-MJHT") == 0 && strcmp(interval, "5") == 0;
+    }
+    if (r.body == PENDING)
+    {
+        char err[32 + 1], desc[128 + 1];
+        WMJsonField fields[] = { { "error", err, sizeof(err) }, { "error_description", desc, sizeof(desc) } };
+        bytes = sizeof(err) + sizeof(desc);
+        return wmJsonExtract(source, fields, 2) && strcmp(err, "authorization_pending") == 0;
+    }
+    if (r.body == USERINFO)
+    {
+        char sub[64 + 1];
+        WMJsonField fields[] = { { "sub", sub, sizeof(sub) } };
+        bytes = sizeof(sub);
+        return wmJsonExtract(source, fields, 1) && strcmp(sub, "auth0|6412f1c2a9e4b3d7c8f01234") == 0;
+    }
+    // Both tokens go into one scratch buffer for the response, then the access token is
+    // copied into its String at the exact size
+    char *scratch = (char *)malloc(2048 + 1024 + 2);
+    char *access = scratch, *refresh = scratch + 2048 + 1;
+    WMJsonField fields[] = { { "access_token", access, 2048 + 1 }, { "refresh_token", refresh, 1024 + 1 } };
+    bytes = 0;
+    heap = 2048 + 1024 + 2;
+    bool ok = wmJsonExtract(source, fields, 2) && fields[0].length == 880 && strcmp(refresh, REFRESH_TOKEN) == 0;
+    String token(access, fields[0].length);
+    ok = ok && token.length() == 880;
+    free(scratch);
+    return ok;
+}
+
+int main()
+{
+    std::string token = tokenResponse();
+    Replay replays[] = {
+        { "device_code", DEVICE_CODE, sizeof(DEVICE_CODE) - 1 },
+        { "pending", PENDING, sizeof(PENDING) - 1 },
+        { "token", token.c_str(), token.size() },
+        { "userinfo", USERINFO, sizeof(USERINFO) - 1 },
+    };
+
+    printf("%-12s %6s %9s %12s %12s %10s %10s\n", "response", "bytes", "segment", "ns/parse", "MB/s", "stack B", "heap B");
+    for (const Replay &r : replays)
+    {
+        // Full Ethernet segments and the small records a TLS stack may hand out
+        for (size_t segment : { (size_t)1460, (size_t)64 })
+        {
+            size_t bytes = 0, heap = 0;
+            CHECK(parse(r, segment, bytes, heap));
+            size_t before = allocations;
+            double ns = benchNs(20000, [&](size_t) { CHECK(parse(r, segment, bytes, heap)); });
+            // Only the token response allocates: its scratch buffer and the token's String
+            CHECK(heap || allocations == before);
+            printf("%-12s %6zu %9zu %12.0f %12.1f %10zu %10zu\n", r.name, r.length, segment, ns,
+                   r.length / ns * 1000.0, bytes, heap);
+        }
+    }
+    printf("token heap is freed before fetchAccessToken() returns; the String keeps the token only\n");
+    printf("baseline: DynamicJsonDocument(4000) = 4000 B heap per response\n");
+    return 0;
+}
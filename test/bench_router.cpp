@@ -0,0 +1,109 @@
+// Dispatch cost of an incoming function call with 20, 200 and 2000 registered names of
+// each kind: FermiTopicRouter against the linear strncmp scan it replaced.
+
+#define FERMI_CLOUD_ROUTER_SLOTS    16384
+
+#include <string>
+#include <vector>
+#include "check.h"
+#include "wm_router.h"
+
+static const char *DEVICE_ID = "esp32-3c61053ed814";
+
+// The old MQTT_EVENT_DATA path: prefix checks, then one compare per registered function
+struct LinearDispatch
+{
+    std::string deviceID;
+    std::vector<std::string> functions;
+
+    int find(const char *topic, size_t len) const
+    {
+        if (strncmp(topic, "devices/", 8) != 0)
+            return -1;
+        topic += 8;
+        len -= 8;
+        if (strncmp(topic, deviceID.c_str(), deviceID.length()) != 0)
+            return -1;
+        topic += deviceID.length();
+        len -= deviceID.length();
+        if (strncmp(topic, "/functions/", 11) != 0)
+            return -1;
+        topic += 11;
+        len -= 11;
+        for (size_t i = 0; i < functions.size(); i++)
+            if (functions[i].length() == len && strncmp(functions[i].c_str(), topic, len) == 0)
+                return (int)i;
+        return -1;
+    }
+};
+
+// The current path: classify, hash the name, probe the table, compare the one candidate
+struct RoutedDispatch
+{
+    FermiTopicRouter router;
+    std::vector<std::string> functions;
+
+    int find(const char *topic, size_t len) const
+    {
+        const char *name;
+        size_t nameLen;
+        if (router.classify(topic, len, name, nameLen) != FERMI_ROUTE_FUNCTION)
+            return -1;
+        uint32_t hash = fermiHash(name, nameLen);
+        int cursor = -1;
+        for (int i = router.next(FERMI_ROUTE_FUNCTION, hash, cursor); i >= 0; i = router.next(FERMI_ROUTE_FUNCTION, hash, cursor))
+            if (functions[i].length() == nameLen && memcmp(functions[i].c_str(), name, nameLen) == 0)
+                return i;
+        return -1;
+    }
+};
+
+int main()
+{
+    printf("%8s %14s %14s %14s %14s\n", "names", "linear hit ns", "router hit ns", "linear miss ns", "router miss ns");
+    for (size_t n : { (size_t)20, (size_t)200, (size_t)2000 })
+    {
+        static LinearDispatch linear;
+        static RoutedDispatch routed;
+        linear.deviceID = DEVICE_ID;
+        linear.functions.clear();
+        routed.functions.clear();
+        routed.router.clear();
+        routed.router.setPrefix(DEVICE_ID);
+
+        char name[32];
+        for (size_t i = 0; i < n; i++)
+        {
+            // Events and variables of the same names fill the shared table as on a device
+            snprintf(name, sizeof(name), "relay_%zu", i);
+            CHECK(routed.router.add(FERMI_ROUTE_EVENT, name, i));
+            CHECK(routed.router.add(FERMI_ROUTE_VARIABLE, name, i));
+            CHECK(routed.router.add(FERMI_ROUTE_FUNCTION, name, i));
+            linear.functions.push_back(name);
+            routed.functions.push_back(name);
+        }
+
+        std::vector<std::string> topics;
+        for (size_t i = 0; i < n; i++)
+            topics.push_back(std::string("devices/") + DEVICE_ID + "/functions/" + linear.functions[(i * 7919) % n]);
+        std::string miss = std::string("devices/") + DEVICE_ID + "/functions/unknown_function";
+
+        for (size_t i = 0; i < n; i++)
+            CHECK(linear.find(topics[i].c_str(), topics[i].size()) == routed.find(topics[i].c_str(), topics[i].size()));
+        CHECK(routed.find(miss.c_str(), miss.size()) < 0);
+
+        const size_t iterations = 200000;
+        double linearHit = benchNs(iterations, [&](size_t i) {
+            const std::string &t = topics[i % n];
+            keep(linear.find(t.c_str(), t.size()));
+        });
+        double routedHit = benchNs(iterations, [&](size_t i) {
+            const std::string &t = topics[i % n];
+            keep(routed.find(t.c_str(), t.size()));
+        });
+        double linearMiss = benchNs(iterations / 10, [&](size_t) { keep(linear.find(miss.c_str(), miss.size())); });
+        double routedMiss = benchNs(iterations, [&](size_t) { keep(routed.find(miss.c_str(), miss.size())); });
+        printf("%8zu %14.1f %14.1f %14.1f %14.1f\n", n, linearHit, routedHit, linearMiss, routedMiss);
+    }
+    return 0;
+}
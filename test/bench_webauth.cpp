@@ -0,0 +1,132 @@
+// Cost per request of the WebSocket handshake and the authentication checks, with the
+// baseline code of each where it differed: the handshake malloc()ed its digest and base64
+// buffers and appended the GUID to the key String, checkBasicAuthentication() built
+// "user:password" and its base64 in two new[] buffers. Both sides hash with the same
+// SHA-1 here, so the difference is the copying and the heap, not the SHA engine of the chip.
+
+#include <new>
+#include <libb64/cencode.h>
+#include "check.h"
+#include "WebHash.h"
+#include "WebAuthentication.h"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+//////////////////////////////////////////////
+
+static const char WS_STR_UUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char KEY[] = "dGhlIHNhbXBsZSBub25jZQ==";
+
+// new[] stands in for the malloc() calls, so they are counted
+static bool acceptBefore(String key, char *accept)
+{
+    uint8_t *hash = new uint8_t[20];
+    char *buffer = new char[33];
+    key += WS_STR_UUID;
+    WebHashSHA1 sha1;
+    sha1.update(key.c_str(), key.length());
+    sha1.finish(hash);
+    base64_encodestate state;
+    base64_init_encodestate(&state);
+    int len = base64_encode_block((const char *)hash, 20, buffer, &state);
+    len += base64_encode_blockend(buffer + len, &state);
+    memcpy(accept, buffer, len + 1);
+    delete[] buffer;
+    delete[] hash;
+    return len == 28;
+}
+
+static bool acceptNow(const String &key, char *accept)
+{
+    uint8_t hash[WEB_HASH_SHA1_LEN];
+    WebHashSHA1 sha1;
+    sha1.update(key.c_str(), key.length());
+    sha1.update(WS_STR_UUID);
+    sha1.finish(hash);
+    base64_encodestate state;
+    base64_init_encodestate(&state);
+    int len = base64_encode_block((const char *)hash, WEB_HASH_SHA1_LEN, accept, &state);
+    len += base64_encode_blockend(accept + len, &state);
+    return len == 28;
+}
+
+static bool basicBefore(const char *hash, const char *username, const char *password)
+{
+    size_t toencodeLen = strlen(username) + strlen(password) + 1;
+    size_t encodedLen = base64_encode_expected_len(toencodeLen);
+    if (strlen(hash) != encodedLen)
+        return false;
+    char *toencode = new char[toencodeLen + 1];
+    char *encoded = new char[encodedLen + 1];
+    sprintf(toencode, "%s:%s", username, password);
+    bool ok = base64_encode_chars(toencode, toencodeLen, encoded) > 0 && memcmp(hash, encoded, encodedLen) == 0;
+    delete[] toencode;
+    delete[] encoded;
+    return ok;
+}
+
+template <typename Fn>
+static void row(const char *name, Fn fn)
+{
+    size_t before = allocations;
+    CHECK(fn());
+    size_t perCall = allocations - before;
+    double ns = benchNs(200000, [&](size_t) { keep(fn()); });
+    printf("%-32s %10.0f %8zu\n", name, ns, perCall);
+}
+
+int main()
+{
+    String key(KEY);
+    char accept[33], expected[33];
+    CHECK(acceptBefore(key, expected) && acceptNow(key, accept));
+    CHECK_STR(accept, expected);
+
+    const char *admin = "YWRtaW46Y29ycmVjdCBob3JzZSBiYXR0ZXJ5IHN0YXBsZQ==";
+    static char longUser[100], longPass[200], longHash[400];
+    memset(longUser, 'u', sizeof(longUser) - 1);
+    memset(longPass, 'p', sizeof(longPass) - 1);
+    char credentials[sizeof(longUser) + sizeof(longPass)];
+    int length = snprintf(credentials, sizeof(credentials), "%s:%s", longUser, longPass);
+    base64_encode_chars(credentials, length, longHash);
+
+    const char *digest = "username=\"Mufasa\", realm=\"testrealm@host.com\", "
+                         "nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\", uri=\"/dir/index.html\", "
+                         "qop=auth, nc=00000001, cnonce=\"0a4f113b\", "
+                         "response=\"6629fae49393a05397450978507c4ef1\", "
+                         "opaque=\"5ccc069c403ebaf9f0171e9517f40e41\"";
+
+    printf("%-32s %10s %8s\n", "per request", "ns", "allocs");
+    row("handshake accept, before", [&] { return acceptBefore(key, accept); });
+    row("handshake accept", [&] { return acceptNow(key, accept); });
+    row("basic auth, before", [&] { return basicBefore(admin, "admin", "correct horse battery staple"); });
+    row("basic auth", [&] { return checkBasicAuthentication(admin, "admin", "correct horse battery staple"); });
+    row("basic auth 300 B, before", [&] { return basicBefore(longHash, longUser, longPass); });
+    row("basic auth 300 B", [&] { return checkBasicAuthentication(longHash, longUser, longPass); });
+    row("basic auth wrong password", [&] { return !checkBasicAuthentication(admin, "admin", "correct horse battery stapler"); });
+    row("digest auth", [&] {
+        return checkDigestAuthentication(digest, "GET", "Mufasa", "Circle Of Life", "testrealm@host.com", false,
+                                         "dcd98b7102dd2f0e8b11d0f600bfb0c093", "5ccc069c403ebaf9f0171e9517f40e41",
+                                         "/dir/index.html");
+    });
+    row("digest auth, stored HA1", [&] {
+        return checkDigestAuthentication(digest, "GET", "Mufasa", "939e7578ed9e3c518a452acee763bce9", NULL, true,
+                                         NULL, NULL, NULL);
+    });
+    return 0;
+}
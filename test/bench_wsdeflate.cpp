@@ -0,0 +1,111 @@
+// Compression ratio and CPU cost of the permessage-deflate compressor on typical portal
+// messages: the WiFi scan list, a log chunk and the state update. Every message is
+// inflated again with zlib as a browser would (RFC 7692: append 00 00 ff ff, raw inflate)
+// and compared; zlib's own raw deflate with the same window is shown for reference.
+
+#include <string>
+#include <zlib.h>
+#include "check.h"
+#include "WebSocketDeflate.h"
+
+static std::string scanList()
+{
+    static const char *const ssids[] = { "FRITZ!Box 7590 XY", "Vodafone-4F2A", "eduroam", "DIRECT-7B-HP M283 LaserJet",
+                                         "Telekom_FON", "o2-WLAN42", "MagentaWLAN-8H3K", "Guest", "ESP_3C61A0", "TP-Link_5G_2C1E" };
+    std::string s = "{\"type\":\"scan\",\"networks\":[";
+    for (int i = 0; i < 14; i++)
+    {
+        char entry[160];
+        snprintf(entry, sizeof(entry), "%s{\"ssid\":\"%s\",\"rssi\":%d,\"channel\":%d,\"secure\":%s,\"bssid\":\"%02X:%02X:%02X:%02X:%02X:%02X\"}",
+                 i ? "," : "", ssids[i % 10], -38 - i * 4, 1 + i * 5 % 13, i % 4 ? "true" : "false",
+                 0x3C, 0x61, 0x05 + i, 0x3E, 0xD8 + i, 0x14 * i & 0xFF);
+        s += entry;
+    }
+    return s + "]}";
+}
+
+static std::string logChunk()
+{
+    static const char *const lines[] = {
+        "[WML] s:MQTT event = 7", "[WML] s:PUBACK msg_id = %d", "[WML] d:Serving stale fermion.io",
+        "[WML] o:Outbox pending = %d", "[WML] s:heartBeat() = {\"rssi\":-61,\"free_ram\":%d}",
+        "[WML] s:Function deadline exceeded: relay_%d", "[WML] w:Connected to FRITZ!Box 7590 XY, IP 192.168.178.%d",
+    };
+    std::string s = "{\"type\":\"log\",\"lines\":[";
+    for (int i = 0; s.size() < 4000; i++)
+    {
+        char line[160], text[120];
+        snprintf(text, sizeof(text), lines[i * 5 % 7], 180000 + i * 37);
+        snprintf(line, sizeof(line), "%s\"%8lu %s\"", i ? "," : "", 3600000UL + i * 1237UL, text);
+        s += line;
+    }
+    return s + "]}";
+}
+
+static std::string state()
+{
+    return "{\"type\":\"state\",\"wifi\":{\"ssid\":\"FRITZ!Box 7590 XY\",\"rssi\":-61,\"ip\":\"192.168.178.42\","
+           "\"connected\":true},\"cloud\":{\"connected\":true,\"endpoint\":\"mqtts://eu.fermion.io:8883\","
+           "\"outbox\":0,\"inflight\":1},\"uptime\":3600123,\"free_heap\":182344,\"version\":\"1.10.5\"}";
+}
+
+static size_t inflateMessage(const uint8_t *in, size_t len, uint8_t *out, size_t size)
+{
+    std::string data((const char *)in, len);
+    data.append("\x00\x00\xff\xff", 4);
+    z_stream z = {};
+    CHECK(inflateInit2(&z, -15) == Z_OK);
+    z.next_in = (Bytef *)data.data();
+    z.avail_in = data.size();
+    z.next_out = out;
+    z.avail_out = size;
+    int status = inflate(&z, Z_SYNC_FLUSH);
+    CHECK(status == Z_OK || status == Z_STREAM_END);
+    size_t n = z.total_out;
+    inflateEnd(&z);
+    return n;
+}
+
+static size_t zlibDeflate(const std::string &message, uint8_t *out, size_t size, int level)
+{
+    z_stream z = {};
+    CHECK(deflateInit2(&z, level, Z_DEFLATED, -WS_DEFLATE_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    z.next_in = (Bytef *)message.data();
+    z.avail_in = message.size();
+    z.next_out = out;
+    z.avail_out = size;
+    CHECK(deflate(&z, Z_SYNC_FLUSH) == Z_OK);
+    size_t n = z.total_out - 4;     // without 00 00 ff ff
+    deflateEnd(&z);
+    return n;
+}
+
+int main()
+{
+    struct { const char *name; std::string message; } messages[] = {
+        { "scan list", scanList() },
+        { "log chunk", logChunk() },
+        { "state", state() },
+    };
+    static uint8_t out[8192], back[8192];
+
+    printf("window %u B, chain %d\n", WS_DEFLATE_WINDOW, WS_DEFLATE_CHAIN);
+    printf("%-10s %7s %7s %7s %9s %9s %9s %9s\n", "message", "bytes", "deflate", "ratio", "ns/msg", "MB/s", "zlib -1", "zlib -6");
+    for (auto &m : messages)
+    {
+        const uint8_t *data = (const uint8_t *)m.message.data();
+        size_t len = webSocketDeflateBlock(data, m.message.size(), out, sizeof(out));
+        CHECK(len > 0);
+        CHECK(inflateMessage(out, len, back, sizeof(back)) == m.message.size());
+        CHECK(memcmp(back, data, m.message.size()) == 0);
+
+        double ns = benchNs(2000, [&](size_t) { keep(webSocketDeflateBlock(data, m.message.size(), out, sizeof(out))); });
+        printf("%-10s %7zu %7zu %6.1f%% %9.0f %9.1f %9zu %9zu\n", m.name, m.message.size(), len,
+               100.0 * len / m.message.size(), ns, m.message.size() / ns * 1000.0,
+               zlibDeflate(m.message, back, sizeof(back), 1), zlibDeflate(m.message, back, sizeof(back), 6));
+    }
+
+    // Too little room: the caller sends the message uncompressed
+    CHECK(webSocketDeflateBlock((const uint8_t *)messages[0].message.data(), messages[0].message.size(), out, 64) == 0);
+    return 0;
+}
@@ -0,0 +1,118 @@
+// Portal files embedded by utils/embed_portal.py, which the Makefile runs on portal/: the
+// gzipped copy for clients that accept it and the identity copy for the others, each with
+// its own ETag, a path missing from the table served from the filesystem, and the embedded
+// index page for unknown paths, only after the filesystem had no file either
+
+#include <string>
+#include <zlib.h>
+#include "check.h"
+#include "wm_portal.h"
+
+static_assert(WM_PORTAL_ASSETS_GENERATED, "wm_portal_assets.h was not generated");
+
+typedef std::unique_ptr<AsyncWebServerResponse> Response;
+
+static Response get(const char *url, bool gzip, const String &ifNoneMatch = String())
+{
+    AsyncWebServerRequest request(url);
+    if (gzip)
+        request.addHeader("Accept-Encoding", "gzip");
+    if (ifNoneMatch.length())
+        request.addHeader("If-None-Match", ifNoneMatch);
+    wmPortalServe(&request);
+    CHECK(request.response);
+    return std::move(request.response);
+}
+
+static std::string inflate(const std::string &packed)
+{
+    z_stream z = {};
+    CHECK(inflateInit2(&z, 16 + MAX_WBITS) == Z_OK);
+    std::string out(64 * 1024, '\0');
+    z.next_in = (Bytef *)packed.data();
+    z.avail_in = packed.size();
+    z.next_out = (Bytef *)&out[0];
+    z.avail_out = out.size();
+    CHECK(::inflate(&z, Z_FINISH) == Z_STREAM_END);
+    out.resize(z.total_out);
+    inflateEnd(&z);
+    return out;
+}
+
+static void table()
+{
+    // Sorted by path, the gzipped row of a path before its identity copy
+    for (size_t i = 1; i < wmPortalAssetCount; i++)
+    {
+        int order = strcmp(wmPortalAssets[i - 1].path, wmPortalAssets[i].path);
+        CHECK(order < 0 || (order == 0 && wmPortalAssets[i - 1].gzip && !wmPortalAssets[i].gzip));
+    }
+
+    // Every gzipped file has its identity copy, stored files have nothing but that
+    for (const char *path : { "/index.html", "/app.3f2a9c1b.js", "/style.css" })
+    {
+        const WMPortalAsset *gz = wmPortalFindAsset(path, true), *plain = wmPortalFindAsset(path, false);
+        CHECK(gz && gz->gzip && plain && !plain->gzip);
+    }
+    CHECK(!wmPortalFindAsset("/logo.png", true)->gzip);
+    CHECK(!wmPortalFindAsset("/missing", true));
+}
+
+static void serve()
+{
+    hostFiles.clear();
+    wmFileChanged();
+
+    // Minified, then gzipped
+    Response gz = get("/", true);
+    CHECK(gz->code == 200 && gz->contentType == "text/html");
+    CHECK(gz->header("Content-Encoding") && *gz->header("Content-Encoding") == "gzip");
+    std::string html = inflate(gz->body);
+    CHECK(html.find("<!--") == std::string::npos && html.find(">\n") == std::string::npos);
+    CHECK(html.find("<div id=\"app\">") != std::string::npos);
+
+    // Without gzip: the same bytes, not encoded, under a tag of their own
+    Response plain = get("/index.html", false);
+    CHECK(plain->code == 200 && !plain->header("Content-Encoding") && plain->body == html);
+    CHECK(*plain->header("ETag") != *gz->header("ETag"));
+    CHECK(*plain->header("Vary") == "Accept-Encoding");
+
+    // A prebuilt .gz stands in for the file, its identity copy is the inflated one
+    Response css = get("/style.css", false);
+    CHECK(css->body == inflate(get("/style.css", true)->body));
+
+    // Stored files are the same for everyone
+    Response png = get("/logo.png", true);
+    CHECK(png->code == 200 && !png->header("Content-Encoding") && png->body.compare(0, 4, "\x89PNG") == 0);
+
+    // Revalidation of each variant by its own tag
+    String gzEtag = *gz->header("ETag"), plainEtag = *plain->header("ETag");
+    CHECK(get("/", true, gzEtag)->code == 304);
+    CHECK(get("/", false, plainEtag)->code == 304);
+    CHECK(get("/", false, gzEtag)->code == 200);
+
+    // Hashed names are cached for good, embedded or not
+    Response js = get("/app.3f2a9c1b.js", false);
+    CHECK(*js->header("Cache-Control") == "public, max-age=31536000, immutable");
+    CHECK(js->body.find("Configuration portal") != std::string::npos);
+
+    // Not embedded: the filesystem is asked before the index page
+    File file = FileFS.open("/config.json", "w");
+    file.write((const uint8_t *)"{}", 2);
+    file.close();
+    wmFileChanged();
+    Response config = get("/config.json", true);
+    CHECK(config->code == 200 && config->body == "{}");
+
+    // Neither embedded nor a file: the embedded index, as the client accepts it
+    CHECK(get("/some/where", true)->body == gz->body);
+    CHECK(get("/some/where", false)->body == html);
+}
+
+int main()
+{
+    table();
+    serve();
+    printf("ok\n");
+    return 0;
+}
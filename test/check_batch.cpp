@@ -0,0 +1,58 @@
+// FermiEventBatch: envelope shape, escaping, NULL data and the byte budget
+
+#include <string>
+#include "check.h"
+#include "wm_batch.h"
+
+static std::string sent;
+
+static bool capture(void *context, const char *payload, size_t length)
+{
+    sent.assign(payload, length);
+    return true;
+}
+
+static void envelope()
+{
+    static FermiEventBatch batch;
+    CHECK(batch.add("temp", "21.5") == FermiEventBatch::ADDED);
+    // publish("door", NULL, BATCHED) is legal and sends empty data
+    CHECK(batch.add("door", NULL) == FermiEventBatch::ADDED);
+    CHECK(batch.add("log", "a\"b\\c\n") == FermiEventBatch::ADDED);
+    CHECK(batch.size() == 3);
+    CHECK(batch.flush(capture, NULL));
+    CHECK(batch.size() == 0);
+
+    CHECK(sent.compare(0, 5, "{\"a\":") == 0);
+    CHECK(sent.find("{\"n\":\"temp\",\"t\":") != std::string::npos);
+    CHECK(sent.find(",\"d\":\"21.5\"}") != std::string::npos);
+    CHECK(sent.find("{\"n\":\"door\",\"t\":") != std::string::npos);
+    CHECK(sent.find(",\"d\":\"\"}") != std::string::npos);
+    CHECK(sent.find(",\"d\":\"a\\\"b\\\\c\\u000a\"}]}") != std::string::npos);
+    CHECK(batch.stats().envelopes == 1 && batch.stats().lastEvents == 3 && batch.stats().events == 3);
+}
+
+static void budget()
+{
+    static FermiEventBatch batch;
+    std::string big(FERMI_CLOUD_BATCH_BYTES, 'x');
+    CHECK(batch.add("big", big.c_str()) == FermiEventBatch::TOO_LARGE);
+
+    std::string data(FERMI_CLOUD_BATCH_BYTES / 3, 'y');
+    FermiEventBatch::Result result;
+    int added = 0;
+    while ((result = batch.add("e", data.c_str())) == FermiEventBatch::ADDED)
+        added++;
+    CHECK(result == FermiEventBatch::FULL && added >= 2);
+    CHECK(batch.flush(capture, NULL));
+    CHECK(sent.size() <= FERMI_CLOUD_BATCH_BYTES + FERMI_CLOUD_BATCH_HEAD_LEN);
+    CHECK(batch.add("e", data.c_str()) == FermiEventBatch::ADDED);
+}
+
+int main()
+{
+    envelope();
+    budget();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,142 @@
+// WMFileCache: hits and misses per key and gzip flag, least recently used entries evicted
+// first by count and by bytes, one blob shared by keys serving the same file, files too
+// large to cache, and everything dropped once wmFileChanged() is called
+
+#define WM_PORTAL_CACHE_BYTES       100
+#define WM_PORTAL_CACHE_ENTRIES     3
+#define WM_PORTAL_CACHE_FILE_MAX    90
+
+#include <string>
+#include "check.h"
+#include "wm_cache.h"
+
+static void put(const char *path, size_t length)
+{
+    File file = FileFS.open(path, "w");
+    std::string content(length, path[1]);
+    file.write((const uint8_t *)content.data(), content.size());
+    file.close();
+}
+
+static const WMCacheEntry *add(WMFileCache &cache, const char *key, bool acceptGzip, const char *path)
+{
+    File file = FileFS.open(path, "r");
+    CHECK(file);
+    return cache.add(key, acceptGzip, String(path).endsWith(".gz") ? String(path).substring(0, strlen(path) - 3) : String(path),
+                     file, "\"tag\"");
+}
+
+static void hitsAndMisses()
+{
+    hostFiles.clear();
+    put("/a", 10);
+    put("/a.gz", 5);
+    static WMFileCache cache;
+
+    CHECK(!cache.find("/a", true));
+    const WMCacheEntry *gz = add(cache, "/a", true, "/a.gz");
+    CHECK(gz && gz->gzip && gz->blob->length == 5 && gz->blob->data[0] == 'a');
+
+    // The gzip flag is part of the key
+    CHECK(cache.find("/a", true) == gz);
+    CHECK(!cache.find("/a", false));
+    CHECK(cache.stats().hits == 1 && cache.stats().misses == 2);
+    const WMCacheEntry *plain = add(cache, "/a", false, "/a");
+    CHECK(plain && !plain->gzip && plain != gz);
+    CHECK(cache.find("/a", false) == plain && cache.find("/a", true) == gz);
+    CHECK(cache.stats().entries == 2 && cache.stats().bytes == 15);
+}
+
+static void evictionOrder()
+{
+    hostFiles.clear();
+    put("/a", 10);
+    put("/b", 10);
+    put("/c", 10);
+    put("/d", 10);
+    static WMFileCache cache;
+    add(cache, "/a", false, "/a");
+    add(cache, "/b", false, "/b");
+    add(cache, "/c", false, "/c");
+
+    // /a was used last, so /b goes when /d needs the slot
+    CHECK(cache.find("/a", false));
+    CHECK(add(cache, "/d", false, "/d"));
+    CHECK(cache.stats().evictions == 1 && cache.stats().entries == 3);
+    CHECK(cache.find("/a", false) && !cache.find("/b", false) && cache.find("/c", false) && cache.find("/d", false));
+
+    // By bytes: 85 more need 15 freed, the two least recently used of /a, /c, /d
+    put("/e", 85);
+    CHECK(cache.find("/d", false));
+    CHECK(add(cache, "/e", false, "/e"));
+    CHECK(cache.stats().evictions == 3 && cache.stats().bytes == 95);
+    CHECK(!cache.find("/a", false) && !cache.find("/c", false) && cache.find("/d", false));
+
+    // Larger than WM_PORTAL_CACHE_FILE_MAX: not cached, nothing evicted for it
+    put("/f", WM_PORTAL_CACHE_FILE_MAX + 1);
+    CHECK(!add(cache, "/f", false, "/f"));
+    CHECK(cache.stats().evictions == 3 && cache.stats().entries == 2);
+}
+
+static void sharedBlobs()
+{
+    hostFiles.clear();
+    put("/a", 40);
+    static WMFileCache cache;
+
+    // No .gz variant: both keys serve /a and hold one blob, counted once
+    const WMCacheEntry *gz = add(cache, "/a", true, "/a");
+    const WMCacheEntry *plain = add(cache, "/a", false, "/a");
+    CHECK(gz && plain && gz != plain && gz->blob == plain->blob);
+    CHECK(cache.stats().bytes == 40 && cache.stats().entries == 2);
+
+    // A response still sending the blob keeps it alive after its entries are gone
+    WMCacheBlobPtr sending = plain->blob;
+    put("/b", 10);
+    put("/c", 10);
+    add(cache, "/b", false, "/b");
+    CHECK(cache.find("/a", false));
+    add(cache, "/c", false, "/c");
+    CHECK(!cache.find("/a", true) && cache.find("/a", false));
+    CHECK(cache.stats().bytes == 60);
+    CHECK(cache.find("/c", false));
+
+    // The bytes are released with the last entry holding them
+    put("/d", 60);
+    CHECK(add(cache, "/d", false, "/d"));
+    CHECK(!cache.find("/a", false) && cache.stats().bytes == 70);
+    CHECK(sending.use_count() == 1 && sending->data[39] == 'a');
+}
+
+static void invalidation()
+{
+    hostFiles.clear();
+    put("/a", 10);
+    static WMFileCache cache;
+    CHECK(add(cache, "/a", false, "/a"));
+    CHECK(cache.find("/a", false));
+
+    wmFileChanged();
+    CHECK(!cache.find("/a", false));
+    CHECK(cache.stats().invalidations == 1 && cache.stats().entries == 0 && cache.stats().bytes == 0);
+
+    // Filled again from the new content
+    put("/a", 20);
+    const WMCacheEntry *e = add(cache, "/a", false, "/a");
+    CHECK(e && e->blob->length == 20 && cache.find("/a", false) == e);
+    CHECK(cache.stats().invalidations == 1);
+
+    // clear() releases everything, as closePortal() does
+    cache.clear();
+    CHECK(!cache.find("/a", false) && cache.stats().bytes == 0);
+}
+
+int main()
+{
+    hitsAndMisses();
+    evictionOrder();
+    sharedBlobs();
+    invalidation();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,255 @@
+// DNS wire helpers and WMDnsCache: queries, responses with compressed names and CNAME
+// chains, truncated and malformed packets, and the cache's non-blocking miss, refresh,
+// stale window and eviction over a fake UDP socket
+
+#include <vector>
+#include "check.h"
+#include "wm_dns.h"
+
+typedef std::vector<uint8_t> Packet;
+
+static void put16(Packet &p, uint16_t v)
+{
+    p.push_back(v >> 8);
+    p.push_back(v & 0xFF);
+}
+
+static void name(Packet &p, const char *host)
+{
+    while (*host)
+    {
+        const char *dot = strchr(host, '.');
+        size_t l = dot ? (size_t)(dot - host) : strlen(host);
+        p.push_back((uint8_t)l);
+        p.insert(p.end(), host, host + l);
+        host += l + (dot ? 1 : 0);
+    }
+    p.push_back(0);
+}
+
+static void record(Packet &p, const Packet &owner, uint16_t type, uint32_t ttl, const Packet &data)
+{
+    p.insert(p.end(), owner.begin(), owner.end());
+    put16(p, type);
+    put16(p, WM_DNS_CLASS_IN);
+    put16(p, ttl >> 16);
+    put16(p, ttl & 0xFFFF);
+    put16(p, data.size());
+    p.insert(p.end(), data.begin(), data.end());
+}
+
+static Packet pointer(uint16_t offset)
+{
+    Packet p;
+    put16(p, 0xC000 | offset);
+    return p;
+}
+
+// Response to the query in q: api.fermion.io CNAME edge.fermion.io CNAME
+// lb.eu.fermion.io A 10.1.2.3, every owner name compressed
+static Packet chain(const Packet &q, uint32_t ttl)
+{
+    Packet r = q;
+    r[2] |= 0x80;
+    r[7] = 3;
+    Packet edge, lb;
+    name(edge, "edge");
+    edge.push_back(0xC0);
+    edge.push_back(WM_DNS_HEADER_LEN + 4);      // -> "fermion.io" of the question
+    record(r, pointer(WM_DNS_HEADER_LEN), 5, 600, edge);
+    size_t edgeAt = r.size() - edge.size();
+    name(lb, "lb.eu");
+    lb.pop_back();
+    lb.push_back(0xC0);
+    lb.push_back(edgeAt + 5);                   // -> "fermion.io" behind "edge"
+    record(r, pointer(edgeAt), 5, 600, lb);
+    record(r, pointer(r.size() - lb.size()), WM_DNS_TYPE_A, ttl, { 10, 1, 2, 3 });
+    return r;
+}
+
+static Packet query(uint16_t id, const char *host)
+{
+    uint8_t buf[WM_DNS_MAX_PACKET];
+    size_t len = wmDnsBuildQuery(buf, sizeof(buf), id, host);
+    CHECK(len);
+    return Packet(buf, buf + len);
+}
+
+static void build()
+{
+    Packet q = query(0x1234, "api.fermion.io");
+    static const uint8_t expected[] = {
+        0x12, 0x34, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+        3, 'a', 'p', 'i', 7, 'f', 'e', 'r', 'm', 'i', 'o', 'n', 2, 'i', 'o', 0,
+        0, 1, 0, 1,
+    };
+    CHECK(q == Packet(expected, expected + sizeof(expected)));
+
+    uint8_t buf[WM_DNS_MAX_PACKET];
+    CHECK(wmDnsBuildQuery(buf, sizeof(buf), 1, "") == 0);
+    CHECK(wmDnsBuildQuery(buf, sizeof(buf), 1, "a..b") == 0);
+    CHECK(wmDnsBuildQuery(buf, sizeof(buf), 1, std::string(64, 'x').c_str()) == 0);
+    CHECK(wmDnsBuildQuery(buf, sizeof(buf), 1, std::string(63, 'x').c_str()) == WM_DNS_HEADER_LEN + 65 + 4);
+    CHECK(wmDnsBuildQuery(buf, q.size() - 1, 1, "api.fermion.io") == 0);
+}
+
+static void parse()
+{
+    Packet q = query(7, "api.fermion.io");
+    Packet r = chain(q, 300);
+    uint32_t ip = 0, ttl = 0;
+    CHECK(wmDnsParseResponse(r.data(), r.size(), 7, ip, ttl));
+    CHECK(ip == (uint32_t)IPAddress(10, 1, 2, 3) && ttl == 300);
+
+    // Another query, not a response, an error
+    CHECK(!wmDnsParseResponse(r.data(), r.size(), 8, ip, ttl));
+    Packet notResponse = r;
+    notResponse[2] &= 0x7F;
+    CHECK(!wmDnsParseResponse(notResponse.data(), notResponse.size(), 7, ip, ttl));
+    Packet nxdomain = r;
+    nxdomain[3] |= 3;
+    CHECK(!wmDnsParseResponse(nxdomain.data(), nxdomain.size(), 7, ip, ttl));
+
+    // Cut anywhere: never an answer, never a read past the end (run under `make asan`)
+    for (size_t len = 0; len < r.size(); len++)
+    {
+        Packet cut(r.begin(), r.begin() + len);
+        CHECK(!wmDnsParseResponse(cut.data(), cut.size(), 7, ip, ttl));
+    }
+
+    // More answers announced than present, and a label running past the end
+    Packet extra = r;
+    extra[7] = 4;
+    CHECK(wmDnsParseResponse(extra.data(), extra.size(), 7, ip, ttl));
+    Packet noA = chain(q, 300);
+    noA.resize(noA.size() - 16);
+    noA[7] = 2;
+    CHECK(!wmDnsParseResponse(noA.data(), noA.size(), 7, ip, ttl));
+    Packet runaway = r;
+    runaway[WM_DNS_HEADER_LEN] = 63;
+    CHECK(!wmDnsParseResponse(runaway.data(), runaway.size(), 7, ip, ttl));
+
+    // AAAA and an A record of the wrong size are skipped
+    Packet skipped = q;
+    skipped[2] |= 0x80;
+    skipped[7] = 3;
+    record(skipped, pointer(WM_DNS_HEADER_LEN), WM_DNS_TYPE_AAAA, 60, Packet(16, 0xFE));
+    record(skipped, pointer(WM_DNS_HEADER_LEN), WM_DNS_TYPE_A, 60, Packet(6, 1));
+    record(skipped, pointer(WM_DNS_HEADER_LEN), WM_DNS_TYPE_A, 90, { 192, 0, 2, 7 });
+    CHECK(wmDnsParseResponse(skipped.data(), skipped.size(), 7, ip, ttl));
+    CHECK(ip == (uint32_t)IPAddress(192, 0, 2, 7) && ttl == 90);
+}
+
+//////////////////////////////////////////////
+
+static Packet direct(const Packet &q, uint32_t ttl)
+{
+    Packet r = q;
+    r[2] |= 0x80;
+    r[7] = 1;
+    record(r, pointer(WM_DNS_HEADER_LEN), WM_DNS_TYPE_A, ttl, { 10, 1, 2, 3 });
+    return r;
+}
+
+// Answer the query the cache sent last, as the resolver would
+static void answer(uint32_t ttl)
+{
+    const Packet &q = WiFiUDP::sent();
+    CHECK(q.size() > WM_DNS_HEADER_LEN);
+    WiFiUDP::inbox().push_back(direct(q, ttl));
+    WiFiUDP::sent().clear();
+}
+
+static WMDnsEntry &entry(const char *host)
+{
+    for (WMDnsEntry &e : wmDnsStore.entries)
+        if (strcmp(e.host, host) == 0)
+            return e;
+    CHECK(false);
+    return wmDnsStore.entries[0];
+}
+
+static void cache()
+{
+    static WMDnsCache dns;
+    IPAddress ip;
+    WiFi.state = WL_CONNECTED;
+    dns.clear();
+
+    CHECK(dns.resolve("10.0.0.9", ip) && ip == IPAddress(10, 0, 0, 9));
+
+    // A miss returns at once and is looked up by loop()
+    unsigned long start = millis();
+    CHECK(!dns.resolve("api.fermion.io", ip));
+    CHECK(millis() - start < 100);
+    CHECK(dns.misses == 1 && WiFiUDP::sent().empty());
+    dns.loop();
+    answer(300);
+    dns.loop();
+    CHECK(dns.resolve("api.fermion.io", ip) && ip == IPAddress(10, 1, 2, 3));
+    CHECK(dns.hits == 1 && entry("api.fermion.io").ttl == 300);
+
+    // Expired: served while it is refreshed, for at most WM_DNS_STALE_TTLS TTLs
+    WMDnsEntry &e = entry("api.fermion.io");
+    e.expires = _wmDnsNow() - 300 * WM_DNS_STALE_TTLS + 5;
+    CHECK(dns.resolve("api.fermion.io", ip) && dns.staleHits == 1);
+    e.expires = _wmDnsNow() - 300 * WM_DNS_STALE_TTLS - 1;
+    CHECK(!dns.resolve("api.fermion.io", ip) && dns.misses == 2);
+
+    // No answer: given up after the timeout, retried after WM_DNS_RETRY_MS
+    dns.loop();
+    CHECK(!WiFiUDP::sent().empty());
+    WiFiUDP::sent().clear();
+    hostMillisOffset += WM_DNS_TIMEOUT_MS + 1;
+    dns.loop();
+    dns.loop();
+    CHECK(WiFiUDP::sent().empty());
+    hostMillisOffset += WM_DNS_RETRY_MS;
+    dns.loop();
+    answer(20);
+    dns.loop();
+    CHECK(dns.resolve("api.fermion.io", ip));
+    CHECK(entry("api.fermion.io").ttl == WM_DNS_MIN_TTL_S);
+
+    // An answer to an older query id is ignored
+    e.expires = _wmDnsNow();
+    dns.loop();
+    Packet late = direct(WiFiUDP::sent(), 300);
+    late[1] ^= 1;
+    WiFiUDP::inbox().push_back(late);
+    dns.loop();
+    CHECK(entry("api.fermion.io").ttl == WM_DNS_MIN_TTL_S);
+    hostMillisOffset += WM_DNS_TIMEOUT_MS + 1;
+    dns.loop();
+    hostMillisOffset += WM_DNS_RETRY_MS;
+    dns.loop();
+    answer(300);
+    dns.loop();
+    CHECK(entry("api.fermion.io").ttl == 300);
+
+    // A full cache replaces the entry that expires first
+    const char *hosts[] = { "a.example", "b.example", "c.example", "d.example" };
+    for (const char *host : hosts)
+    {
+        CHECK(!dns.resolve(host, ip));
+        dns.loop();
+        answer(600);
+        dns.loop();
+        CHECK(dns.resolve(host, ip));
+    }
+    entry("c.example").expires = _wmDnsNow() + 100;
+    CHECK(!dns.resolve("api.fermion.io", ip));
+    for (const WMDnsEntry &e : wmDnsStore.entries)
+        CHECK(strcmp(e.host, "c.example") != 0);
+    CHECK(dns.resolve("a.example", ip) && dns.resolve("b.example", ip) && dns.resolve("d.example", ip));
+    WiFiUDP::inbox().clear();
+}
+
+int main()
+{
+    build();
+    parse();
+    cache();
+    printf("ok\n");
+    return 0;
+}
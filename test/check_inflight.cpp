@@ -0,0 +1,128 @@
+// FermiInflightWindow: acks, the window limit, ack timeouts, failAll() on a destroyed
+// client and the retransmit estimate
+
+#include <vector>
+#include "check.h"
+#include "wm_inflight.h"
+
+struct Outcome
+{
+    int msgId;
+    bool delivered;
+};
+
+static std::vector<Outcome> outcomes;
+
+static void record(void *context, int msgId, bool delivered)
+{
+    CHECK(context == &outcomes);
+    outcomes.push_back({ msgId, delivered });
+}
+
+// What _publishNow() does around esp_mqtt_client_publish()
+static bool send(FermiInflightWindow &window, int msgId)
+{
+    window.take();
+    bool ok = !window.full();
+    if (ok)
+        window.add(msgId, record, &outcomes);
+    else
+        window.rejected();
+    window.give();
+    return ok;
+}
+
+static void ack()
+{
+    static FermiInflightWindow window;
+    outcomes.clear();
+    CHECK(send(window, 11));
+    CHECK(send(window, 12));
+    CHECK(window.stats().inFlight == 2);
+
+    window.complete(12, true);
+    window.complete(99, true);      // unknown, e.g. a QoS 1 publish without callback
+    CHECK(outcomes.size() == 1 && outcomes[0].msgId == 12 && outcomes[0].delivered);
+    window.complete(11, false);     // MQTT_EVENT_DELETED
+    CHECK(outcomes.size() == 2 && outcomes[1].msgId == 11 && !outcomes[1].delivered);
+
+    const FermiPublishStats &stats = window.stats();
+    CHECK(stats.acked == 1 && stats.failed == 1 && stats.inFlight == 0 && stats.maxInFlight == 2);
+}
+
+static void windowFull()
+{
+    static FermiInflightWindow window;
+    outcomes.clear();
+    for (int i = 1; i <= FERMI_CLOUD_INFLIGHT_WINDOW; i++)
+        CHECK(send(window, i));
+    CHECK(!send(window, 100));
+    CHECK(window.stats().windowFull == 1);
+
+    // A freed entry is reused
+    window.complete(3, true);
+    CHECK(send(window, 100));
+    CHECK(!send(window, 101));
+    CHECK(window.stats().inFlight == FERMI_CLOUD_INFLIGHT_WINDOW);
+}
+
+static void expire()
+{
+    static FermiInflightWindow window;
+    outcomes.clear();
+    CHECK(send(window, 1));
+    hostMillisOffset += FERMI_CLOUD_ACK_TIMEOUT_MS / 2;
+    CHECK(send(window, 2));
+    window.expire();
+    CHECK(outcomes.empty());
+
+    hostMillisOffset += FERMI_CLOUD_ACK_TIMEOUT_MS / 2;
+    window.expire();
+    CHECK(outcomes.size() == 1 && outcomes[0].msgId == 1 && !outcomes[0].delivered);
+
+    // An ack after the timeout finds nothing
+    window.complete(1, true);
+    CHECK(outcomes.size() == 1 && window.stats().acked == 0);
+    CHECK(window.stats().failed == 1 && window.stats().inFlight == 1);
+}
+
+static void failAll()
+{
+    static FermiInflightWindow window;
+    outcomes.clear();
+    CHECK(send(window, 5));
+    CHECK(send(window, 6));
+    window.failAll();
+    CHECK(outcomes.size() == 2 && !outcomes[0].delivered && !outcomes[1].delivered);
+    CHECK(window.stats().inFlight == 0 && window.stats().failed == 2);
+    window.failAll();
+    CHECK(outcomes.size() == 2);
+}
+
+static void retransmits()
+{
+    static FermiInflightWindow window;
+    outcomes.clear();
+    CHECK(send(window, 1));
+    window.complete(1, true);
+    CHECK(window.stats().retransmits == 0);
+
+    // Acked after 2.5 resend intervals: esp-mqtt sent it twice more
+    CHECK(send(window, 2));
+    hostMillisOffset += FERMI_CLOUD_RETRANSMIT_MS * 5 / 2;
+    window.complete(2, true);
+    CHECK(window.stats().retransmits == 2);
+    CHECK(window.stats().lastAckMs >= FERMI_CLOUD_RETRANSMIT_MS * 5 / 2);
+    CHECK(window.stats().maxAckMs == window.stats().lastAckMs);
+}
+
+int main()
+{
+    ack();
+    windowFull();
+    expire();
+    failAll();
+    retransmits();
+    printf("ok\n");
+    return 0;
+}
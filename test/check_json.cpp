@@ -0,0 +1,111 @@
+// wmJsonExtract() over the stream, memory and in-place sources
+
+#include "check.h"
+#include "wm_json.h"
+
+static void streamSource()
+{
+    const char *body = "{\"a\":1, \"nested\":{\"x\":[1,\"}\"]},\"access_token\":\"ab\\\"c\\u00e9\","
+                       "\"refresh_token\" : \"r\" , \"interval\":5 }";
+    // One byte per segment exercises every refill of the source buffer
+    WiFiClient client(body, strlen(body), 1);
+    WMJsonStreamSource source(client, 100);
+    char access[64], refresh[8], interval[8];
+    WMJsonField fields[] = {
+        { "access_token", access, sizeof(access) },
+        { "refresh_token", refresh, sizeof(refresh) },
+        { "interval", interval, sizeof(interval) },
+    };
+    CHECK(wmJsonExtract(source, fields, 3));
+    CHECK_STR(access, "ab\"c\xc3\xa9");
+    CHECK_STR(refresh, "r");
+    CHECK_STR(interval, "5");
+    CHECK(!fields[0].truncated);
+}
+
+static void truncatedAndAbsent()
+{
+    char x[4], y[4];
+    WMJsonField fields[] = { { "x", x, sizeof(x) }, { "y", y, sizeof(y) } };
+    WMJsonMemorySource source("{\"x\":\"longvalue\"}", 17);
+    CHECK(wmJsonExtract(source, fields, 2));
+    CHECK_STR(x, "lon");
+    CHECK(fields[0].truncated);
+    CHECK(fields[1].length == 0 && y[0] == '\0');
+}
+
+static void malformed()
+{
+    const char *inputs[] = { "", "[1]", "{\"a\":", "{\"a\":\"x", "{\"a\" 1}", "{\"a\":{\"b\":1}" };
+    for (const char *input : inputs)
+    {
+        char a[8];
+        WMJsonField field = { "a", a, sizeof(a) };
+        WMJsonMemorySource source(input, strlen(input));
+        CHECK(!wmJsonExtract(source, &field, 1));
+    }
+}
+
+static void inPlace()
+{
+    char payload[] = "{\"i\":123,\"p\":\"on\\noff\"}";
+    WMJsonField fields[] = { { "i", NULL, 0 }, { "p", NULL, 0 }, { "q", NULL, 0 } };
+    WMJsonInPlaceSource source(payload, strlen(payload));
+    CHECK(wmJsonExtract(source, fields, 3));
+    CHECK(fields[0].value > payload && fields[0].value < payload + sizeof(payload));
+    CHECK_STR(fields[0].value, "123");
+    CHECK_STR(fields[1].value, "on\noff");
+    CHECK(fields[1].length == 6);
+    CHECK(fields[2].value == NULL);
+}
+
+static void nested()
+{
+    // In place the span of a nested value is the value itself, strings still escaped
+    char payload[] = "{\"i\":7,\"p\":{\"on\":[1,2],\"s\":\"a\\\"}\"} ,\"q\":[{}],\"r\":\"x\"}";
+    WMJsonField fields[] = { { "i", NULL, 0 }, { "p", NULL, 0 }, { "q", NULL, 0 }, { "r", NULL, 0 } };
+    WMJsonInPlaceSource source(payload, strlen(payload));
+    CHECK(wmJsonExtract(source, fields, 4));
+    CHECK_STR(fields[0].value, "7");
+    CHECK_STR(fields[1].value, "{\"on\":[1,2],\"s\":\"a\\\"}\"}");
+    CHECK(fields[1].length == strlen(fields[1].value));
+    CHECK_STR(fields[2].value, "[{}]");
+    CHECK_STR(fields[3].value, "x");
+
+    // Last member, closed right after the nested value
+    char last[] = "{\"p\":[\"a\",\"b\"]}";
+    WMJsonField field = { "p", NULL, 0 };
+    WMJsonInPlaceSource lastSource(last, strlen(last));
+    CHECK(wmJsonExtract(lastSource, &field, 1));
+    CHECK_STR(field.value, "[\"a\",\"b\"]");
+
+    // Other sources copy the same text into the buffer
+    const char *doc = "{\"p\":{\"a\":1}, \"x\":2}";
+    char p[16], x[4];
+    WMJsonField copied[] = { { "p", p, sizeof(p) }, { "x", x, sizeof(x) } };
+    WMJsonMemorySource memory(doc, strlen(doc));
+    CHECK(wmJsonExtract(memory, copied, 2));
+    CHECK_STR(p, "{\"a\":1}");
+    CHECK_STR(x, "2");
+}
+
+static void get()
+{
+    const char *doc = "{\"temp\":21.5,\"unit\":\"C\"}";
+    char value[8];
+    CHECK(wmJsonGet(doc, strlen(doc), "temp", value, sizeof(value)));
+    CHECK_STR(value, "21.5");
+    CHECK(!wmJsonGet(doc, strlen(doc), "missing", value, sizeof(value)));
+}
+
+int main()
+{
+    streamSource();
+    truncatedAndAbsent();
+    malformed();
+    inPlace();
+    nested();
+    get();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,219 @@
+// FermiOutbox over the in-memory file system: torn records after a reboot, sequence numbers
+// wrapping around, DROP_OLDEST on a full ring, TTL expiry, a failing flush of the PSRAM
+// stage, and store() from another task while an event is being sent
+
+#define FERMI_CLOUD_OUTBOX_RECORDS          8
+#define FERMI_CLOUD_OUTBOX_BATCH            4
+#define FERMI_CLOUD_OUTBOX_STAGE_RECORDS    3
+
+#include <future>
+#include <vector>
+#include "check.h"
+#include "wm_outbox.h"
+
+struct Sink
+{
+    Sink() : fail(false), storeTo(NULL) {}
+
+    std::vector<std::string> sent;
+    bool fail;
+    FermiOutbox *storeTo;       // stored to from another thread while the next event is sent
+};
+
+static bool send(void *context, const char *name, const char *data, uint8_t flags)
+{
+    Sink &sink = *(Sink *)context;
+    if (sink.fail)
+        return false;
+    if (sink.storeTo)
+    {
+        FermiOutbox *box = sink.storeTo;
+        sink.storeTo = NULL;
+        std::future<bool> stored = std::async(std::launch::async, [box] { return box->store("late", "x", 0, 0); });
+        CHECK(stored.wait_for(std::chrono::seconds(2)) == std::future_status::ready && stored.get());
+    }
+    sink.sent.push_back(std::string(name) + "=" + data);
+    return true;
+}
+
+// Runs loop() one drain interval at a time until nothing is left
+static void drain(FermiOutbox &box, Sink &sink)
+{
+    for (int i = 0; i < 20 && box.pending(); i++)
+    {
+        hostMillisOffset += FERMI_CLOUD_OUTBOX_INTERVAL_MS;
+        box.loop(true, send, &sink);
+    }
+    CHECK(box.pending() == 0);
+}
+
+static void store(FermiOutbox &box, int from, int to)
+{
+    for (int i = from; i < to; i++)
+        CHECK(box.store(("e" + std::to_string(i)).c_str(), "d", 0, 0));
+}
+
+static std::vector<std::string> events(int from, int to)
+{
+    std::vector<std::string> v;
+    for (int i = from; i < to; i++)
+        v.push_back("e" + std::to_string(i) + "=d");
+    return v;
+}
+
+static FermiOutboxRecord *slot(uint32_t i)
+{
+    return (FermiOutboxRecord *)(hostFiles[FERMI_CLOUD_OUTBOX_FILENAME]->data.data() + i * FERMI_CLOUD_OUTBOX_RECORD_SIZE);
+}
+
+static void seal(FermiOutboxRecord *r)
+{
+    r->crc = crc32_le(crc32_le(0, (const uint8_t *)r, offsetof(FermiOutboxRecord, crc)),
+                      (const uint8_t *)r->name(), r->nameLength + r->dataLength);
+}
+
+//////////////////////////////////////////////
+
+static void torn()
+{
+    hostFiles.clear();
+    static FermiOutbox before;
+    store(before, 0, 3);
+    CHECK(before.pending() == 3);
+
+    // Reset while the middle record was written
+    slot(1)->data()[0] ^= 1;
+    static FermiOutbox after;
+    Sink sink;
+    after.loop(false, send, &sink);
+    CHECK(after.pending() == 0);
+    hostMillisOffset += FERMI_CLOUD_OUTBOX_INTERVAL_MS;
+    after.loop(true, send, &sink);
+    CHECK(sink.sent == std::vector<std::string>({ "e0=d", "e2=d" }));
+    CHECK(after.pending() == 0);
+
+    // Sent records are erased and not sent again after the next reboot
+    static FermiOutbox again;
+    hostMillisOffset += FERMI_CLOUD_OUTBOX_INTERVAL_MS;
+    again.loop(true, send, &sink);
+    CHECK(again.pending() == 0 && sink.sent.size() == 2);
+}
+
+static void wraparound()
+{
+    hostFiles.clear();
+    File file = FileFS.open(FERMI_CLOUD_OUTBOX_FILENAME, "w");
+    std::vector<uint8_t> zero(FERMI_CLOUD_OUTBOX_RECORDS * FERMI_CLOUD_OUTBOX_RECORD_SIZE);
+    file.write(zero.data(), zero.size());
+    file.close();
+
+    const uint32_t seqs[] = { 0xFFFFFFFEu, 0xFFFFFFFFu, 0, 1 };
+    for (int i = 0; i < 4; i++)
+    {
+        FermiOutboxRecord *r = slot(seqs[i] % FERMI_CLOUD_OUTBOX_RECORDS);
+        r->magic = FERMI_CLOUD_OUTBOX_MAGIC;
+        r->seq = seqs[i];
+        r->nameLength = 2;
+        r->dataLength = 1;
+        r->name()[0] = 'e';
+        r->name()[1] = '0' + i;
+        r->data()[0] = 'd';
+        seal(r);
+    }
+
+    static FermiOutbox box;
+    Sink sink;
+    hostMillisOffset += FERMI_CLOUD_OUTBOX_INTERVAL_MS;
+    box.loop(true, send, &sink);
+    CHECK(sink.sent == events(0, 4));
+
+    // New records continue after the wrapped sequence
+    store(box, 4, 6);
+    CHECK(slot(2)->seq == 2 && slot(3)->seq == 3);
+    drain(box, sink);
+    CHECK(sink.sent == events(0, 6));
+}
+
+static void dropOldest()
+{
+    hostFiles.clear();
+    static FermiOutbox box;
+    store(box, 0, FERMI_CLOUD_OUTBOX_RECORDS + 2);
+    CHECK(box.pending() == FERMI_CLOUD_OUTBOX_RECORDS);
+    CHECK(box.stats().dropped == 2 && box.stats().stored == FERMI_CLOUD_OUTBOX_RECORDS + 2);
+
+    // A failed send keeps the event
+    Sink sink;
+    sink.fail = true;
+    hostMillisOffset += FERMI_CLOUD_OUTBOX_INTERVAL_MS;
+    box.loop(true, send, &sink);
+    CHECK(box.pending() == FERMI_CLOUD_OUTBOX_RECORDS);
+    sink.fail = false;
+
+    // Sent outside the lock: another task stores while e2 is being sent, which drops e2
+    // (full ring) but must not make loop() consume e3 in its place
+    sink.storeTo = &box;
+    drain(box, sink);
+    std::vector<std::string> expected = events(2, FERMI_CLOUD_OUTBOX_RECORDS + 2);
+    expected.push_back("late=x");
+    CHECK(sink.sent == expected);
+}
+
+static void ttl()
+{
+    hostFiles.clear();
+    static FermiOutbox box;
+    CHECK(box.store("old", "a", 10, 0));
+    CHECK(box.store("keep", "b", 0, 0));
+    CHECK(box.store("new", "c", 10, 0));
+
+    // Stored 100 s ago
+    slot(0)->createdAt -= 100;
+    seal(slot(0));
+    slot(1)->createdAt -= 100;
+    seal(slot(1));
+
+    Sink sink;
+    drain(box, sink);
+    CHECK(sink.sent == std::vector<std::string>({ "keep=b", "new=c" }));
+    CHECK(box.stats().expired == 1 && box.stats().sent == 2);
+}
+
+static void stage()
+{
+    hostFiles.clear();
+    hostPsramFound = true;
+    static FermiOutbox box;
+    store(box, 0, 3);
+    CHECK(box.pending() == 3);
+    CHECK(slot(0)->magic == 0);
+
+    // Room for one record: e0 is written, e1 and e2 stay staged
+    hostFileWriteBudget = FERMI_CLOUD_OUTBOX_RECORD_SIZE;
+    Sink sink;
+    hostMillisOffset += FERMI_CLOUD_OUTBOX_STAGE_FLUSH_MS;
+    box.loop(false, send, &sink);
+    CHECK(slot(0)->magic == FERMI_CLOUD_OUTBOX_MAGIC && slot(1)->magic == 0);
+    CHECK(box.pending() == 3);
+
+    // Stage full, flash still failing: the new event is rejected
+    store(box, 3, 4);
+    CHECK(!box.store("e4", "d", 0, 0));
+    CHECK(box.stats().dropped == 1 && box.pending() == 4);
+
+    hostFileWriteBudget = SIZE_MAX;
+    drain(box, sink);
+    CHECK(sink.sent == events(0, 4));
+    hostPsramFound = false;
+}
+
+int main()
+{
+    torn();
+    wraparound();
+    dropOldest();
+    ttl();
+    stage();
+    printf("ok\n");
+    return 0;
+}
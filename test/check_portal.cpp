@@ -0,0 +1,107 @@
+// Portal file serving from the filesystem: the .gz variant for clients that accept it,
+// ETag revalidation with 304, immutable caching of hashed names, the index fallback, and
+// new ETags and bodies once a file changes
+
+#include <string>
+#include "check.h"
+#include "wm_portal.h"
+
+static void put(const char *path, const std::string &content)
+{
+    File file = FileFS.open(path, "w");
+    file.write((const uint8_t *)content.data(), content.size());
+    file.close();
+    wmFileChanged();
+}
+
+typedef std::unique_ptr<AsyncWebServerResponse> Response;
+
+// Serve url and return the response sent
+static Response get(const char *url, bool gzip, const String &ifNoneMatch = String())
+{
+    AsyncWebServerRequest request(url);
+    if (gzip)
+        request.addHeader("Accept-Encoding", "gzip, deflate, br");
+    if (ifNoneMatch.length())
+        request.addHeader("If-None-Match", ifNoneMatch);
+    wmPortalServe(&request);
+    CHECK(request.response);
+    return std::move(request.response);
+}
+
+static void hashedNames()
+{
+    CHECK(wmPortalHashedName("/assets/app.3f2a9c1b.js"));
+    CHECK(wmPortalHashedName("/index-3f2a9c1b.js"));
+    CHECK(wmPortalHashedName("/app.BRsDeKE5.css"));
+    CHECK(!wmPortalHashedName("/index.html"));
+    CHECK(!wmPortalHashedName("/app.abcdefgh.js"));        // no digit
+    CHECK(!wmPortalHashedName("/app.1234567.js"));         // too short
+    CHECK(!wmPortalHashedName("/3f2a9c1b.js"));            // nothing but the hash
+    CHECK(!wmPortalHashedName("/v1.2/readme"));
+}
+
+static void serve()
+{
+    hostFiles.clear();
+    put("/index.html", "<html>plain</html>");
+    put("/index.html.gz", "GZ<html>");
+    put("/app.3f2a9c1b.js.gz", "GZjs");
+    put("/big.txt", std::string(WM_PORTAL_CACHE_FILE_MAX + 1, 'b'));
+    put("/big.txt.gz", std::string(WM_PORTAL_CACHE_FILE_MAX + 1, 'z'));
+
+    // gzip accepted: the .gz variant under the plain name
+    Response gz = get("/", true);
+    CHECK(gz->code == 200 && gz->body == "GZ<html>");
+    CHECK(gz->header("Content-Encoding") && *gz->header("Content-Encoding") == "gzip");
+    CHECK(*gz->header("Cache-Control") == "no-cache" && *gz->header("Vary") == "Accept-Encoding");
+    String gzEtag = *gz->header("ETag");
+    CHECK(gzEtag.startsWith("\"") && gzEtag.endsWith("\""));
+
+    // Not accepted: the plain file, with an ETag of its own
+    Response plain = get("/index.html", false);
+    CHECK(plain->code == 200 && plain->body == "<html>plain</html>");
+    CHECK(!plain->header("Content-Encoding"));
+    String plainEtag = *plain->header("ETag");
+    CHECK(plainEtag != gzEtag);
+
+    // Revalidation: 304 without a body, for the variant the tag belongs to only
+    Response same = get("/", true, gzEtag);
+    CHECK(same->code == 304 && same->body.empty() && *same->header("ETag") == gzEtag);
+    CHECK(get("/", false, gzEtag)->code == 200);
+
+    // Hashed names are cached for good
+    Response js = get("/app.3f2a9c1b.js", true);
+    CHECK(js->code == 200 && js->body == "GZjs");
+    CHECK(*js->header("Cache-Control") == "public, max-age=31536000, immutable");
+
+    // Unknown paths get the index page, as captive portal checks expect
+    CHECK(get("/some/where", true)->body == "GZ<html>");
+
+    // Too large for the cache: streamed from the file, same headers
+    Response big = get("/big.txt", true);
+    CHECK(big->code == 200 && big->body == std::string(WM_PORTAL_CACHE_FILE_MAX + 1, 'z'));
+    CHECK(*big->header("Content-Encoding") == "gzip" && *big->header("Cache-Control") == "no-cache");
+    String bigEtag = *big->header("ETag");
+    CHECK(get("/big.txt", true, bigEtag)->code == 304);
+    CHECK(get("/big.txt", false)->body == std::string(WM_PORTAL_CACHE_FILE_MAX + 1, 'b'));
+
+    // A changed file has a new tag and body, the cached one is dropped
+    put("/index.html.gz", "GZ<html>v2");
+    Response changed = get("/", true, gzEtag);
+    CHECK(changed->code == 200 && changed->body == "GZ<html>v2");
+    CHECK(*changed->header("ETag") != gzEtag);
+
+    // Nothing to fall back to
+    hostFiles.clear();
+    wmFileChanged();
+    CHECK(get("/", true)->code == 404);
+}
+
+int main()
+{
+    hashedNames();
+    serve();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,71 @@
+// WMProbeHandler: probes answered with the redirect to the portal up to the burst, then at
+// WM_PORTAL_PROBE_RATE; over the rate a 204 for the probes that take it and the redirect
+// for the others, never a reset connection; a long idle time refills the bucket to the
+// burst and no further
+
+#include "check.h"
+#include "wm_portal.h"
+
+static int probe(WMProbeHandler &handler, const char *url)
+{
+    AsyncWebServerRequest request(url);
+    CHECK(handler.canHandle(&request));
+    handler.handleRequest(&request);
+    CHECK(request.response);
+    CHECK(!request.client()->aborted && !request.client()->closed);
+    if (request.response->code == 302)
+        CHECK(*request.response->header("Location") == "http://192.168.4.1/");
+    if (request.response->code == 204)
+        CHECK(request.response->body.empty());
+    return request.response->code;
+}
+
+static void matching()
+{
+    WMProbeHandler handler(IPAddress(192, 168, 4, 1));
+    AsyncWebServerRequest page("/index.html"), prefix("/generate_204/x");
+    CHECK(!handler.canHandle(&page) && !handler.canHandle(&prefix));
+    CHECK(probe(handler, "/generate_204") == 302);
+    CHECK(probe(handler, "/hotspot-detect.html") == 302);
+}
+
+static void window()
+{
+    WMProbeHandler handler(IPAddress(192, 168, 4, 1));
+
+    // The burst is redirected
+    for (int i = 0; i < WM_PORTAL_PROBE_BURST; i++)
+        CHECK(probe(handler, "/gen_204") == 302);
+    CHECK(handler.stats().answered == WM_PORTAL_PROBE_BURST);
+
+    // Over the rate: cheap answers
+    CHECK(probe(handler, "/generate_204") == 204);
+    CHECK(probe(handler, "/gen_204") == 204);
+    CHECK(probe(handler, "/connecttest.txt") == 302);
+    CHECK(handler.stats().limited == 3 && handler.stats().answered == WM_PORTAL_PROBE_BURST);
+
+    // One token per 1000 / WM_PORTAL_PROBE_RATE ms
+    hostMillisOffset += 1000 / WM_PORTAL_PROBE_RATE;
+    CHECK(probe(handler, "/generate_204") == 302);
+    CHECK(probe(handler, "/generate_204") == 204);
+    hostMillisOffset += 3 * 1000 / WM_PORTAL_PROBE_RATE;
+    for (int i = 0; i < 3; i++)
+        CHECK(probe(handler, "/generate_204") == 302);
+    CHECK(probe(handler, "/generate_204") == 204);
+    CHECK(handler.stats().answered == WM_PORTAL_PROBE_BURST + 4);
+
+    // Five days idle, elapsed * rate wraps around to a few thousandths: a full bucket
+    // nevertheless, and not more
+    hostMillisOffset += 429496730u;
+    for (int i = 0; i < WM_PORTAL_PROBE_BURST; i++)
+        CHECK(probe(handler, "/generate_204") == 302);
+    CHECK(probe(handler, "/generate_204") == 204);
+}
+
+int main()
+{
+    matching();
+    window();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,151 @@
+// WMSpscRing: record layout, wrap-around and a two-thread stress run in the shape of the
+// esp-mqtt task feeding loop(), including the client generation check. Run it under
+// `make tsan` as well.
+
+#include <atomic>
+#include <thread>
+#include "check.h"
+#include "wm_ring.h"
+
+typedef WMSpscRing<1024> Ring;
+typedef WMSpscRing<4096> EventRing;
+
+static void records()
+{
+    static Ring ring;
+    CHECK(ring.empty());
+    CHECK(ring.push(3, 7, -1, "topic", 5, "data", 4));
+    CHECK(ring.push(3, 8, 42, NULL, 0, NULL, 0));
+    Ring::Record *r = ring.front();
+    CHECK(r && r->generation == 3 && r->type == 7 && r->id == -1);
+    CHECK(r->keyLength == 5 && memcmp(r->key(), "topic", 5) == 0);
+    CHECK(r->dataLength == 4 && memcmp(r->data(), "data", 4) == 0);
+    ring.pop();
+    r = ring.front();
+    CHECK(r && r->type == 8 && r->id == 42 && r->keyLength == 0 && r->dataLength == 0);
+    ring.pop();
+    CHECK(ring.empty());
+
+    // Larger than half the ring is never accepted
+    static char big[600];
+    CHECK(!ring.push(0, 1, 0, NULL, 0, big, sizeof(big)));
+    CHECK(ring.dropped() == 1);
+}
+
+static void wrapAndReserve()
+{
+    static Ring ring;
+    char data[200];
+    for (int round = 0; round < 50; round++)
+    {
+        memset(data, 'a' + round % 26, sizeof(data));
+        size_t length = 100 + round % 90;
+        CHECK(ring.push(0, 1, round, NULL, 0, data, length));
+        Ring::Record *r = ring.front();
+        CHECK(r && r->id == round && r->dataLength == length && r->data()[length - 1] == data[0]);
+        ring.pop();
+    }
+    CHECK(ring.empty());
+
+    // The reserve keeps room for the small records
+    while (ring.push(0, 1, 0, NULL, 0, data, 100, 64))
+        ;
+    CHECK(ring.push(0, 2, 0, NULL, 0, NULL, 0));
+}
+
+//////////////////////////////////////////////
+
+enum { DATA = 1, DISCONNECTED = 2, CONNECTED = 3 };
+
+static const int CLIENTS = 200;
+static const int RECORDS_PER_CLIENT = 2000;
+
+static void fill(char *buffer, size_t length, uint32_t seq)
+{
+    for (size_t i = 0; i < length; i++)
+        buffer[i] = (char)(seq * 31 + i);
+}
+
+// The esp-mqtt task of one client: data, then its disconnect, then the auto-reconnect that
+// esp-mqtt attempts before loop() got around to destroying the client
+static void produce(EventRing &ring, std::atomic<uint16_t> &generation, uint32_t &seq, int &stale)
+{
+    char topic[64], data[300];
+    for (int i = 0; i < RECORDS_PER_CLIENT; i++, seq++)
+    {
+        size_t topicLength = 8 + seq % 40, dataLength = (seq * 7) % sizeof(data);
+        fill(topic, topicLength, seq);
+        fill(data, dataLength, seq + 1);
+        // The consumer keeps up eventually; spin like a producer that must not drop data
+        while (!ring.push(generation, DATA, seq, topic, topicLength, data, dataLength, 64))
+            std::this_thread::yield();
+    }
+    while (!ring.push(generation, DISCONNECTED, 0, NULL, 0, NULL, 0))
+        std::this_thread::yield();
+    if (ring.push(generation, CONNECTED, 0, NULL, 0, NULL, 0))
+        stale++;
+}
+
+static void stress()
+{
+    static EventRing ring;
+    std::atomic<uint16_t> generation(0);
+    uint32_t produced = 0, expected = 0;
+    int stale = 0, dropped = 0;
+    char buffer[300];
+
+    std::thread producer(produce, std::ref(ring), std::ref(generation), std::ref(produced), std::ref(stale));
+    for (int client = 0; client < CLIENTS;)
+    {
+        EventRing::Record *r = ring.front();
+        if (!r)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        if (r->generation != generation)
+        {
+            // Left by a destroyed client
+            CHECK(r->type == CONNECTED);
+            dropped++;
+            ring.pop();
+            continue;
+        }
+        if (r->type == DATA)
+        {
+            CHECK((uint32_t)r->id == expected);
+            CHECK(r->keyLength == 8 + expected % 40 && r->dataLength == (expected * 7) % sizeof(buffer));
+            fill(buffer, r->keyLength, expected);
+            CHECK(memcmp(r->key(), buffer, r->keyLength) == 0);
+            fill(buffer, r->dataLength, expected + 1);
+            CHECK(memcmp(r->data(), buffer, r->dataLength) == 0);
+            expected++;
+            ring.pop();
+            continue;
+        }
+        // Everything after this from the same client is applied to nobody
+        CHECK(r->type == DISCONNECTED);
+        ring.pop();
+        producer.join();
+        generation++;
+        if (++client < CLIENTS)
+            producer = std::thread(produce, std::ref(ring), std::ref(generation), std::ref(produced), std::ref(stale));
+    }
+    while (EventRing::Record *r = ring.front())
+    {
+        CHECK(r->generation != generation);
+        dropped++;
+        ring.pop();
+    }
+    CHECK(expected == (uint32_t)CLIENTS * RECORDS_PER_CLIENT);
+    CHECK(dropped == stale);
+}
+
+int main()
+{
+    records();
+    wrapAndReserve();
+    stress();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,99 @@
+// FermiStaticIndex: every name of a table is found, misses and near misses are rejected,
+// duplicate names fail the attach, and a 32-bit hash collision is retried with a seed
+
+#include <string>
+#include <vector>
+#include "check.h"
+#include "wm_router.h"
+
+struct Entry
+{
+    const char *name;
+    uint32_t hash;
+};
+
+static const Entry table[] = {
+    { "reset", fermiHashConst("reset") },
+    { "relay", fermiHashConst("relay") },
+    { "relay2", fermiHashConst("relay2") },
+    { "led", fermiHashConst("led") },
+    { "temperature", fermiHashConst("temperature") },
+    { "humidity", fermiHashConst("humidity") },
+    { "", fermiHashConst("") },
+};
+
+static const Entry *find(const FermiStaticIndex<Entry> &index, const char *name)
+{
+    return index.find(name, strlen(name));
+}
+
+static void lookup()
+{
+    static FermiStaticIndex<Entry> index;
+    CHECK(index.attach(table, sizeof(table) / sizeof(table[0])));
+    CHECK(index.size() == sizeof(table) / sizeof(table[0]));
+    for (const Entry &e : table)
+        CHECK(find(index, e.name) == &e);
+
+    CHECK(find(index, "unknown") == NULL);
+    CHECK(find(index, "rel") == NULL);
+    CHECK(find(index, "relay23") == NULL);
+    CHECK(find(index, "Reset") == NULL);
+    // A length shorter than the string: only the first len bytes are the name
+    CHECK(index.find("relay2", 5) == &table[1]);
+
+    // Up to the largest table FERMI_CLOUD_STATIC_SLOTS allows
+    static std::vector<std::string> names;
+    static std::vector<Entry> big;
+    for (size_t i = 0; i < FERMI_CLOUD_STATIC_SLOTS / 2; i++)
+        names.push_back("var_" + std::to_string(i));
+    for (const std::string &n : names)
+        big.push_back({ n.c_str(), fermiHash(n.c_str(), n.size()) });
+    CHECK(index.attach(big.data(), big.size()));
+    for (const Entry &e : big)
+        CHECK(find(index, e.name) == &e);
+    CHECK(find(index, "var_") == NULL);
+    CHECK(find(index, "reset") == NULL);
+
+    big.push_back({ "one_more", fermiHashConst("one_more") });
+    CHECK(!index.attach(big.data(), big.size()));
+    CHECK(index.size() == 0 && find(index, "var_0") == NULL);
+
+    CHECK(index.attach(table, 0) && index.size() == 0);
+}
+
+static void duplicates()
+{
+    static FermiStaticIndex<Entry> index;
+    static const Entry dup[] = {
+        { "reset", fermiHashConst("reset") },
+        { "led", fermiHashConst("led") },
+        { "reset", fermiHashConst("reset") },
+    };
+    CHECK(!index.attach(dup, 3));
+    CHECK(index.size() == 0);
+
+    // Different names with the same FNV-1a hash: placed with a seeded hash instead
+    static const Entry collision[] = {
+        { "fn_384719", fermiHashConst("fn_384719") },
+        { "led", fermiHashConst("led") },
+        { "fn_1144716", fermiHashConst("fn_1144716") },
+    };
+    CHECK(collision[0].hash == collision[2].hash);
+    CHECK(index.attach(collision, 3));
+    for (const Entry &e : collision)
+        CHECK(find(index, e.name) == &e);
+    CHECK(find(index, "fn_384718") == NULL);
+
+    // And back to the plain hash for the next table
+    CHECK(index.attach(table, 2));
+    CHECK(find(index, "relay") == &table[1] && find(index, "fn_384719") == NULL);
+}
+
+int main()
+{
+    lookup();
+    duplicates();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,97 @@
+// WMPortalSocket: 'g' answered with the config JSON, 'p' parsed on the AsyncTCP task and
+// only applied by take() on the loop, one config at a time, stored passwords kept when a
+// page sends them back obfuscated, and the errors. Needs ArduinoJson, see check_watch.cpp.
+
+#define USING_BOARD_NAME    true
+
+#include <future>
+#include "check.h"
+#include "wm_socket.h"
+
+static const char obfuscated[] = "********";
+
+static void readConfig(void *context, String &json)
+{
+    json = "{\"id\":\"" + String(((WMConfig *)context)->getSSID(0)) + "\"}";
+}
+
+static String send(WMPortalSocket &socket, WMConfig &config, const char *message)
+{
+    return socket.handle(message, strlen(message), readConfig, &config);
+}
+
+static void messages()
+{
+    WMConfig config;
+    strcpy(config.wifiCreds[0].ssid, "home");
+    strcpy(config.wifiCreds[0].pw, "secret123");
+    strcpy(config.wifiCreds[1].pw, "other123");
+    static WMPortalSocket socket(obfuscated);
+
+    CHECK(send(socket, config, "g") == "g{\"id\":\"home\"}");
+    CHECK(send(socket, config, "x") == "eunknown");
+    CHECK(socket.handle("", 0, readConfig, &config) == "eunknown");
+    CHECK(send(socket, config, "p{\"id\":") == "ebad config");
+    CHECK(!socket.take(config));
+
+    // Accepted without a reply, the config is untouched until the loop takes it
+    CHECK(send(socket, config, "p{\"id\":\"office\",\"pw\":\"********\",\"id1\":\"lab\",\"pw1\":\"newpass12\",\"nm\":\"bench\"}") == "");
+    CHECK(strcmp(config.getSSID(0), "home") == 0);
+
+    // A second one before that is refused, not mixed into the first
+    CHECK(send(socket, config, "p{\"id\":\"other\"}") == "ebusy");
+
+    CHECK(socket.take(config));
+    CHECK(strcmp(config.getSSID(0), "office") == 0 && strcmp(config.getPW(0), "secret123") == 0);
+    CHECK(strcmp(config.getSSID(1), "lab") == 0 && strcmp(config.getPW(1), "newpass12") == 0);
+    CHECK(strcmp(config.boardName, "bench") == 0 && strcmp(config.header, WM_BOARD_TYPE) == 0);
+    CHECK(!socket.take(config));
+
+    // Fields left out are empty, as with POST /config
+    CHECK(send(socket, config, "p{\"id\":\"cafe\"}") == "");
+    CHECK(socket.take(config));
+    CHECK(strcmp(config.getSSID(0), "cafe") == 0 && config.getPW(0)[0] == 0 && config.getSSID(1)[0] == 0);
+
+    // Long values are cut to the field
+    std::string longName = "p{\"id\":\"" + std::string(100, 'n') + "\"}";
+    CHECK(send(socket, config, longName.c_str()) == "");
+    CHECK(socket.take(config));
+    CHECK(strlen(config.getSSID(0)) == WM_SSID_MAX_LEN - 1);
+}
+
+// 'p' from the AsyncTCP task while the loop takes configs
+static void handOff()
+{
+    WMConfig config;
+    static WMPortalSocket socket(obfuscated);
+    const int rounds = 1000;
+    std::future<int> tcp = std::async(std::launch::async, [] {
+        WMConfig unused;
+        int accepted = 0;
+        for (int i = 0; i < rounds * 100 && accepted < rounds; i++)
+            if (send(socket, unused, "p{\"id\":\"net\",\"pw\":\"password1\"}") == "")
+                accepted++;
+        return accepted;
+    });
+    int taken = 0;
+    for (;;)
+    {
+        bool done = tcp.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        if (socket.take(config))
+        {
+            CHECK(strcmp(config.getSSID(0), "net") == 0 && strcmp(config.getPW(0), "password1") == 0);
+            taken++;
+        }
+        else if (done)
+            break;
+    }
+    CHECK(taken == tcp.get() && taken > 0);
+}
+
+int main()
+{
+    messages();
+    handOff();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,190 @@
+// FermiWatchList: change detection of numbers (deadband) and other values (hash of their
+// JSON), the min and max intervals, resend() after a reconnect, and the notify path with
+// watches that are removed, replaced or whose variable is gone. Needs ArduinoJson, so it
+// is only built when its checkout is given:
+//
+//   make -C test ARDUINOJSON=~/Arduino/libraries/ArduinoJson
+
+#define FERMI_CLOUD_WATCHES     2
+
+#include <string>
+#include <vector>
+#include "check.h"
+#include "wm_watch.h"
+
+// The device's variables and what was published
+struct Device
+{
+    Device() : temperature(20.0), status("idle"), samples(0) {}
+
+    double temperature;
+    std::string status;
+    size_t samples;
+    std::vector<std::string> published;
+
+    void loop(FermiWatchList &watches, uint32_t now)
+    {
+        watches.loop(now, sample, notify, this);
+    }
+
+    static bool sample(void *context, const char *name, JsonDocument &doc)
+    {
+        Device &d = *(Device *)context;
+        d.samples++;
+        if (strcmp(name, "temperature") == 0)
+            doc["v"] = d.temperature;
+        else if (strcmp(name, "status") == 0)
+            doc["v"] = d.status.c_str();
+        else
+            return false;
+        return true;
+    }
+
+    static void notify(void *context, const char *name, const JsonDocument &doc, FermiEncoding encoding)
+    {
+        Device &d = *(Device *)context;
+        JsonVariantConst v = doc["v"];
+        char value[32];
+        if (v.is<double>())
+            snprintf(value, sizeof(value), "%g", v.as<double>());
+        else
+            snprintf(value, sizeof(value), "%s", v.as<const char *>());
+        d.published.push_back(std::string(name) + "=" + value + (encoding == FERMI_ENCODING_MSGPACK ? "/mp" : ""));
+    }
+
+    // Published since the last call
+    std::vector<std::string> take()
+    {
+        std::vector<std::string> p;
+        p.swap(published);
+        return p;
+    }
+};
+
+typedef std::vector<std::string> Published;
+
+static void numbers()
+{
+    static FermiWatchList watches;
+    Device d;
+    static const char *name = "temperature";
+    CHECK(watches.set(name, 1000, 0, 0.5f, FERMI_ENCODING_JSON));
+
+    // The first sample is always sent
+    uint32_t now = 1000;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "temperature=20" }));
+
+    // Sampled every FERMI_CLOUD_WATCH_SAMPLE_MS at most, and not sent again within min
+    d.temperature = 25;
+    d.samples = 0;
+    d.loop(watches, now + FERMI_CLOUD_WATCH_SAMPLE_MS - 1);
+    d.loop(watches, now + 500);
+    CHECK(d.samples == 0 && d.take().empty());
+
+    // Changed by more than the deadband once min has passed
+    now += 1000;
+    d.loop(watches, now);
+    CHECK(d.samples == 1 && d.take() == Published({ "temperature=25" }));
+
+    // Within the deadband: not sent, and the reference stays at the last value sent
+    d.temperature = 25.3;
+    now += 1000;
+    d.loop(watches, now);
+    d.temperature = 25.4;
+    now += 1000;
+    d.loop(watches, now);
+    CHECK(d.take().empty());
+    d.temperature = 25.5;
+    now += 1000;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "temperature=25.5" }));
+
+    // After a reconnect the value is sent even though it did not change
+    watches.resend();
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "temperature=25.5" }));
+
+    // Without a deadband any change counts
+    CHECK(watches.set(name, 0, 0, 0, FERMI_ENCODING_MSGPACK));
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.loop(watches, now);
+    d.temperature = 25.50001;
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.loop(watches, now);
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "temperature=25.5/mp", "temperature=25.5/mp" }));
+}
+
+static void values()
+{
+    static FermiWatchList watches;
+    Device d;
+    static const char *name = "status";
+    CHECK(watches.set(name, 0, 5000, 0, FERMI_ENCODING_JSON));
+
+    uint32_t now = 1000;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "status=idle" }));
+
+    // Same text: nothing, other text: sent
+    now += 1000;
+    d.loop(watches, now);
+    CHECK(d.take().empty());
+    d.status = "busy";
+    now += 1000;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "status=busy" }));
+
+    // Unchanged, but max has passed since it was sent
+    now += 5000 - FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.loop(watches, now);
+    CHECK(d.take().empty());
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "status=busy" }));
+}
+
+static void list()
+{
+    static FermiWatchList watches;
+    Device d;
+    static const char *temperature = "temperature", *status = "status", *gone = "gone";
+    CHECK(watches.set(temperature, 0, 0, 0, FERMI_ENCODING_JSON));
+    CHECK(watches.set(status, 0, 0, 0, FERMI_ENCODING_JSON));
+    CHECK(!watches.set(gone, 0, 0, 0, FERMI_ENCODING_JSON));
+
+    uint32_t now = 1000;
+    d.loop(watches, now);
+    CHECK(d.take() == Published({ "temperature=20", "status=idle" }));
+
+    // A cancelled watch is no longer sampled, its slot can be used again
+    watches.remove(status);
+    d.status = "busy";
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.samples = 0;
+    d.loop(watches, now);
+    CHECK(d.samples == 1 && d.take().empty());
+
+    // A variable that is no longer registered drops its watch on the next sample
+    CHECK(watches.set(gone, 0, 0, 0, FERMI_ENCODING_JSON));
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.loop(watches, now);
+    CHECK(d.take().empty());
+    CHECK(watches.set(status, 0, 0, 0, FERMI_ENCODING_JSON));
+    now += FERMI_CLOUD_WATCH_SAMPLE_MS;
+    d.samples = 0;
+    d.loop(watches, now);
+    CHECK(d.samples == 2 && d.take() == Published({ "status=busy" }));
+}
+
+int main()
+{
+    numbers();
+    values();
+    list();
+    printf("ok\n");
+    return 0;
+}
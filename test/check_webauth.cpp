@@ -0,0 +1,161 @@
+// WebHash and WebAuthentication.cpp from esp32c3_ESPAsyncWebServer_Patch: known digests, the
+// Sec-WebSocket-Accept value, the basic-auth matcher against whole-string base64 and the
+// digest-auth example of RFC 2617
+
+#include <string>
+#include <libb64/cencode.h>
+#include "check.h"
+#include "WebHash.h"
+#include "WebAuthentication.h"
+
+static void md5Hex(const char *s, char *hex)
+{
+    WebHashMD5 md5;
+    md5.update(s);
+    md5.finishHex(hex);
+}
+
+static void hashes()
+{
+    char hex[WEB_HASH_SHA1_LEN * 2 + 1];
+    md5Hex("", hex);
+    CHECK_STR(hex, "d41d8cd98f00b204e9800998ecf8427e");
+    md5Hex("abc", hex);
+    CHECK_STR(hex, "900150983cd24fb0d6963f7d28e17f72");
+
+    uint8_t digest[WEB_HASH_SHA1_LEN];
+    WebHashSHA1 sha1;
+    sha1.update("abc");
+    sha1.finish(digest);
+    webHashHex(digest, WEB_HASH_SHA1_LEN, hex);
+    CHECK_STR(hex, "a9993e364706816aba3e25717850c26c9cd0d89d");
+
+    // Pieces hash like the whole, including ones past the 16-bit MD5Update() length
+    std::string big(70000, 'x');
+    for (size_t i = 0; i < big.size(); i++)
+        big[i] = (char)(i * 7);
+    char whole[WEB_HASH_MD5_LEN * 2 + 1];
+    {
+        WebHashMD5 md5;
+        md5.update(big.data(), big.size());
+        md5.finishHex(whole);
+    }
+    WebHashMD5 md5;
+    md5.update(big.data(), 3);
+    md5.update(big.data() + 3, 65536);
+    md5.update(big.data() + 65539, big.size() - 65539);
+    md5.finishHex(hex);
+    CHECK_STR(hex, whole);
+
+    CHECK(webHashEqual("abcd", "abcd", 4));
+    CHECK(!webHashEqual("abcd", "abce", 4));
+    CHECK(webHashEqual("a", "b", 0));
+}
+
+// AsyncWebSocketResponse's constructor, with the sample handshake of RFC 6455
+static void handshake()
+{
+    const char *key = "dGhlIHNhbXBsZSBub25jZQ==";
+    uint8_t hash[WEB_HASH_SHA1_LEN];
+    char buffer[33];
+    WebHashSHA1 sha1;
+    sha1.update(key);
+    sha1.update("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    sha1.finish(hash);
+    base64_encodestate state;
+    base64_init_encodestate(&state);
+    int len = base64_encode_block((const char *)hash, WEB_HASH_SHA1_LEN, buffer, &state);
+    len += base64_encode_blockend(buffer + len, &state);
+    CHECK(len == 28);
+    CHECK_STR(buffer, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+
+static std::string encode(const std::string &s)
+{
+    std::string out(base64_encode_expected_len(s.size()) + 1, '\0');
+    out.resize(base64_encode_chars(s.data(), s.size(), &out[0]));
+    return out;
+}
+
+static void basic()
+{
+    CHECK(checkBasicAuthentication("QWxhZGRpbjpvcGVuIHNlc2FtZQ==", "Aladdin", "open sesame"));
+    CHECK(!checkBasicAuthentication("QWxhZGRpbjpvcGVuIHNlc2FtZQ==", "Aladdin", "open sesamf"));
+    CHECK(!checkBasicAuthentication("QWxhZGRpbjpvcGVuIHNlc2FtZQ=", "Aladdin", "open sesame"));
+    CHECK(!checkBasicAuthentication("QWxhZGRpbjpvcGVuIHNlc2FtZQ==", "Aladdi", "nopen sesame"));
+    CHECK(!checkBasicAuthentication(NULL, "a", "b"));
+    CHECK(!checkBasicAuthentication("YTpi", NULL, "b"));
+    CHECK(!checkBasicAuthentication("YTpi", "a", NULL));
+    CHECK(checkBasicAuthentication("Og==", "", ""));
+
+    // Every split of the 192-byte blocks, every padding, one flipped character anywhere
+    for (size_t userLength = 0; userLength < 400; userLength += 13)
+        for (size_t passLength = 0; passLength < 400; passLength++)
+        {
+            std::string user(userLength, 'u'), pass(passLength, 'p');
+            for (size_t i = 0; i < userLength; i++)
+                user[i] = (char)('A' + (i * 5 + passLength) % 58);
+            for (size_t i = 0; i < passLength; i++)
+                pass[i] = (char)(0x80 + (i * 3 + userLength) % 120);
+            std::string hash = encode(user + ":" + pass);
+            CHECK(checkBasicAuthentication(hash.c_str(), user.c_str(), pass.c_str()));
+            std::string wrong = hash;
+            size_t at = (userLength * 31 + passLength * 17) % wrong.size();
+            wrong[at] = wrong[at] == 'A' ? 'B' : 'A';
+            CHECK(!checkBasicAuthentication(wrong.c_str(), user.c_str(), pass.c_str()));
+            CHECK(!checkBasicAuthentication(hash.c_str(), user.c_str(), (pass + "x").c_str()));
+        }
+}
+
+// RFC 2617, section 3.5
+static void digest()
+{
+    const char *header = "username=\"Mufasa\", realm=\"testrealm@host.com\", "
+                         "nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\", uri=\"/dir/index.html\", "
+                         "qop=auth, nc=00000001, cnonce=\"0a4f113b\", "
+                         "response=\"6629fae49393a05397450978507c4ef1\", "
+                         "opaque=\"5ccc069c403ebaf9f0171e9517f40e41\"";
+    const char *nonce = "dcd98b7102dd2f0e8b11d0f600bfb0c093";
+    const char *opaque = "5ccc069c403ebaf9f0171e9517f40e41";
+
+    CHECK(checkDigestAuthentication(header, "GET", "Mufasa", "Circle Of Life", "testrealm@host.com",
+                                    false, nonce, opaque, "/dir/index.html"));
+    CHECK(checkDigestAuthentication(header, "GET", "Mufasa", "939e7578ed9e3c518a452acee763bce9", NULL,
+                                    true, NULL, NULL, NULL));
+    CHECK(!checkDigestAuthentication(header, "GET", "Mufasa", "Circle of Life", NULL, false, NULL, NULL, NULL));
+    CHECK(!checkDigestAuthentication(header, "POST", "Mufasa", "Circle Of Life", NULL, false, NULL, NULL, NULL));
+    CHECK(!checkDigestAuthentication(header, "GET", "mufasa", "Circle Of Life", NULL, false, NULL, NULL, NULL));
+    CHECK(!checkDigestAuthentication(header, "GET", "Mufasa", "Circle Of Life", NULL, false, "00", NULL, NULL));
+    CHECK(!checkDigestAuthentication("username=\"Mufasa\"", "GET", "Mufasa", "x", NULL, false, NULL, NULL, NULL));
+    CHECK(!checkDigestAuthentication("username=\"Mufasa\", realm", "GET", "Mufasa", "x", NULL, false, NULL, NULL, NULL));
+    CHECK(!checkDigestAuthentication(NULL, "GET", "Mufasa", "x", NULL, false, NULL, NULL, NULL));
+
+    // Parsed in place: spaces around the names and values, a comma inside quotes
+    const char *spaced = "username = \"Mufasa\" ,realm=\"testrealm@host.com\",nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\","
+                         "uri=\"/dir/index.html\",qop = auth ,nc=00000001\t, cnonce=\"0a4f113b\", "
+                         "response=\"6629fae49393a05397450978507c4ef1\"";
+    CHECK(checkDigestAuthentication(spaced, "GET", "Mufasa", "Circle Of Life", "testrealm@host.com",
+                                    false, nonce, NULL, "/dir/index.html"));
+    const char *comma = "username=\"Mufasa\", uri=\"/a,b\", qop=auth, nc=1, cnonce=\"c\", nonce=\"n\", "
+                        "response=\"e61eb34a96fce1db576fc0a868b31000\"";
+    CHECK(!checkDigestAuthentication(comma, "GET", "Mufasa", "x", NULL, false, NULL, NULL, "/a"));
+    CHECK(checkDigestAuthentication(comma, "GET", "Mufasa", "x", NULL, false, NULL, NULL, "/a,b"));
+
+    String hash = generateDigestHash("Mufasa", "Circle Of Life", "testrealm@host.com");
+    CHECK_STR(hash.c_str(), "Mufasa:testrealm@host.com:939e7578ed9e3c518a452acee763bce9");
+
+    // Realm, then a 32 digit nonce and opaque
+    String challenge = requestDigestAuthentication("esp");
+    CHECK(challenge.startsWith("realm=\"esp\", qop=\"auth\", nonce=\""));
+    CHECK(challenge.length() == strlen("realm=\"esp\", qop=\"auth\", nonce=\"\", opaque=\"\"") + 64);
+}
+
+int main()
+{
+    hashes();
+    handshake();
+    basic();
+    digest();
+    printf("ok\n");
+    return 0;
+}
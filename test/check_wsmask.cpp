@@ -0,0 +1,55 @@
+// webSocketMask() against the byte-wise loop it replaced, for every alignment and payload
+// offset and lengths up to 16 KB. Run it under `make asan` for out-of-bounds and
+// misaligned accesses.
+
+#include <vector>
+#include "check.h"
+#include "WebSocketMask.h"
+
+static void reference(uint8_t *data, size_t len, const uint8_t *mask, size_t offset)
+{
+    for (size_t i = 0; i < len; i++)
+        data[i] ^= mask[(offset + i) & 3];
+}
+
+static void compare(size_t len, size_t align, size_t offset, const uint8_t *mask)
+{
+    // Exactly len bytes from the allocation on, so ASan sees any access past the end
+    std::vector<uint8_t> expected(len), storage(len + align);
+    uint8_t *data = storage.data() + align;
+    for (size_t i = 0; i < len; i++)
+        expected[i] = data[i] = (uint8_t)(i * 131 + len);
+    reference(expected.data(), len, mask, offset);
+    webSocketMask(data, len, mask, offset);
+    CHECK(len == 0 || memcmp(data, expected.data(), len) == 0);
+}
+
+int main()
+{
+    const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    for (size_t len = 0; len <= 64; len++)
+        for (size_t align = 0; align < 4; align++)
+            for (size_t offset = 0; offset < 8; offset++)
+                compare(len, align, offset, mask);
+
+    srand(3);
+    for (int round = 0; round < 2000; round++)
+    {
+        uint8_t random[4];
+        for (uint8_t &b : random)
+            b = rand();
+        compare(rand() % (16 * 1024 + 1), rand() % 4, rand(), random);
+    }
+
+    // A frame unmasked in the pieces _onData() receives must equal one pass
+    std::vector<uint8_t> whole(5000), pieces(5000);
+    for (size_t i = 0; i < whole.size(); i++)
+        whole[i] = pieces[i] = (uint8_t)i;
+    webSocketMask(whole.data(), whole.size(), mask, 0);
+    for (size_t at = 0, n = 1; at < pieces.size(); at += n, n = n * 3 % 1439 + 1)
+        webSocketMask(pieces.data() + at, std::min(n, pieces.size() - at), mask, at);
+    CHECK(whole == pieces);
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,135 @@
+// WebSocketPool: blocks handed out until the pool is exhausted, then NULL so the caller
+// falls back to the heap, sizes over the block size never pooled, blocks reused once given
+// back, create()/destroy() of messages through a base pointer from the pool and from the
+// heap alike, a disabled pool, and take/give from two threads (run it under `make tsan`)
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "WebSocketPool.h"
+
+// Stand-ins for AsyncWebSocketMessage and its subclasses
+struct Message
+{
+    static int alive;
+    Message() { alive++; }
+    virtual ~Message() { alive--; }
+};
+int Message::alive = 0;
+
+struct Basic : Message
+{
+    Basic(const char *data, size_t len) : text(data, len) {}
+    std::string text;       // released by the virtual destructor
+};
+
+struct Multi : Message
+{
+    explicit Multi(int opcode) : opcode(opcode) {}
+    int opcode;
+};
+
+static void exhaustion()
+{
+    static WebSocketPool<4, 32> pool;
+    void *blocks[4];
+    for (int i = 0; i < 4; i++)
+    {
+        blocks[i] = pool.take(i * 10);
+        CHECK(blocks[i] && pool.owns(blocks[i]) && ((uintptr_t)blocks[i] & 7) == 0);
+        memset(blocks[i], i, 32);
+    }
+    CHECK(pool.stats().hits == 4 && pool.stats().inUse == 4 && pool.stats().peakInUse == 4);
+
+    // Exhausted, and too large: left to the caller's heap
+    CHECK(!pool.take(8));
+    CHECK(!pool.take(33));
+    CHECK(pool.stats().misses == 2);
+    int local;
+    CHECK(!pool.owns(&local) && !pool.owns(NULL));
+
+    // A block given back is handed out again, the others are untouched
+    pool.give(blocks[2]);
+    CHECK(pool.stats().inUse == 3);
+    CHECK(pool.take(32) == blocks[2]);
+    CHECK(((uint8_t *)blocks[3])[31] == 3);
+    for (int i = 0; i < 4; i++)
+        pool.give(blocks[i]);
+    CHECK(pool.stats().inUse == 0 && pool.stats().peakInUse == 4);
+}
+
+static void messages()
+{
+    static WebSocketPool<2, (sizeof(Basic) > sizeof(Multi) ? sizeof(Basic) : sizeof(Multi))> pool;
+
+    Message *a = pool.create<Basic>("hello, a long enough text to live on the heap", 46);
+    Message *b = pool.create<Multi>(1);
+    CHECK(pool.owns(a) && pool.owns(b));
+
+    // Exhausted: plain new, destroy() deletes it
+    Message *c = pool.create<Basic>("c", 1);
+    CHECK(!pool.owns(c) && Message::alive == 3);
+    CHECK(((Basic *)c)->text == "c" && ((Multi *)b)->opcode == 1);
+    pool.destroy(c);
+    pool.destroy(a);
+    CHECK(Message::alive == 1 && pool.stats().inUse == 1);
+
+    // The freed block serves the next message
+    Message *d = pool.create<Multi>(2);
+    CHECK(d == a);
+    pool.destroy(b);
+    pool.destroy(d);
+    CHECK(Message::alive == 0 && pool.stats().inUse == 0 && pool.stats().misses == 1);
+}
+
+static void disabled()
+{
+    static WebSocketPool<0, 128> pool;
+    CHECK(!pool.take(1));
+    Message *m = pool.create<Multi>(0);
+    CHECK(m && !pool.owns(m));
+    pool.destroy(m);
+    CHECK(Message::alive == 0 && pool.stats().hits == 0 && pool.stats().misses == 2);
+}
+
+// Queued from the user task, released from the AsyncTCP task
+static void threads()
+{
+    static WebSocketPool<8, 64> pool;
+    const int rounds = 20000;
+    auto worker = [] {
+        std::vector<void *> held;
+        for (int i = 0; i < rounds; i++)
+        {
+            void *block = pool.take(64);
+            if (block)
+            {
+                memset(block, i, 64);
+                held.push_back(block);
+            }
+            if (held.size() > 3 || (!block && !held.empty()))
+            {
+                pool.give(held.back());
+                held.pop_back();
+            }
+        }
+        for (void *block : held)
+            pool.give(block);
+    };
+    std::thread other(worker);
+    worker();
+    other.join();
+    WebSocketPoolStats stats = pool.stats();
+    CHECK(stats.inUse == 0 && stats.hits + stats.misses == 2 * rounds && stats.peakInUse <= 8);
+}
+
+int main()
+{
+    exhaustion();
+    messages();
+    disabled();
+    threads();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+// Minimal stand-in for the parts of the Arduino-ESP32 core used by the headers under
+// test. Only what the checks and benchmarks in test/ need, nothing more.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define F(s)            (s)
+#define FPSTR(s)        (s)
+#define PROGMEM
+#define DEC             10
+#define HEX             16
+
+//////////////////////////////////////////////
+
+// Time can be moved forward by a test to expire deadlines without sleeping
+extern uint32_t hostMillisOffset;
+
+inline unsigned long millis()
+{
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return (unsigned long)duration_cast<milliseconds>(steady_clock::now() - start).count() + hostMillisOffset;
+}
+
+inline unsigned long micros()
+{
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return (unsigned long)duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+inline void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+// Hardware RNG on the chip; good enough for jitter and ids on the host
+inline uint32_t esp_random() { return ((uint32_t)rand() << 16) ^ (uint32_t)rand(); }
+
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+// In newlib on the chip, and only in glibc from 2.38
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t n = strlen(src);
+    if (size)
+    {
+        size_t copy = n < size ? n : size - 1;
+        memcpy(dst, src, copy);
+        dst[copy] = '\0';
+    }
+    return n;
+}
+#endif
+
+//////////////////////////////////////////////
+
+class String
+{
+public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    String(const char *s, size_t n) : s(s, n) {}
+    String(const std::string &s) : s(s) {}
+    explicit String(int n) : s(std::to_string(n)) {}
+    explicit String(unsigned n) : s(std::to_string(n)) {}
+    explicit String(long n) : s(std::to_string(n)) {}
+    explicit String(unsigned long n) : s(std::to_string(n)) {}
+    String(unsigned long n, int base)
+    {
+        char buffer[24];
+        snprintf(buffer, sizeof(buffer), base == HEX ? "%lx" : "%lu", n);
+        s = buffer;
+    }
+
+    const char *c_str() const { return s.c_str(); }
+    size_t length() const { return s.size(); }
+    bool isEmpty() const { return s.empty(); }
+    char operator[](size_t i) const { return s[i]; }
+    long toInt() const { return atol(s.c_str()); }
+    bool reserve(size_t n) { s.reserve(n); return true; }
+    char *begin() { return &s[0]; }
+    const char *begin() const { return s.c_str(); }
+
+    bool operator==(const char *other) const { return s == other; }
+    bool operator==(const String &other) const { return s == other.s; }
+    bool operator!=(const String &other) const { return s != other.s; }
+    String &operator+=(const char *other) { s += other; return *this; }
+    String &operator+=(const String &other) { s += other.s; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    bool concat(const char *other) { s += other; return true; }
+    bool concat(const String &other) { s += other.s; return true; }
+
+    bool equals(const char *other) const { return s == other; }
+    bool startsWith(const char *prefix) const { return s.compare(0, strlen(prefix), prefix) == 0; }
+    bool endsWith(const char *suffix) const
+    {
+        size_t n = strlen(suffix);
+        return n <= s.size() && s.compare(s.size() - n, n, suffix) == 0;
+    }
+    void replace(const char *from, const char *to)
+    {
+        size_t n = strlen(from), m = strlen(to);
+        for (size_t at = s.find(from); n && at != std::string::npos; at = s.find(from, at + m))
+            s.replace(at, n, to);
+    }
+    friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+    friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+    friend String operator+(const char *a, const String &b) { return String(a + b.s); }
+    int indexOf(const char *needle) const
+    {
+        size_t at = s.find(needle);
+        return at == std::string::npos ? -1 : (int)at;
+    }
+    int indexOf(char c) const
+    {
+        size_t at = s.find(c);
+        return at == std::string::npos ? -1 : (int)at;
+    }
+    int lastIndexOf(char c) const
+    {
+        size_t at = s.rfind(c);
+        return at == std::string::npos ? -1 : (int)at;
+    }
+    bool equalsIgnoreCase(const String &other) const { return strcasecmp(s.c_str(), other.s.c_str()) == 0; }
+    String substring(size_t from) const { return from < s.size() ? String(s.substr(from)) : String(); }
+    String substring(size_t from, size_t to) const
+    {
+        return from < to && from < s.size() ? String(s.substr(from, to - from)) : String();
+    }
+    void trim()
+    {
+        size_t first = s.find_first_not_of(" \t\r\n");
+        s = first == std::string::npos ? std::string() : s.substr(first, s.find_last_not_of(" \t\r\n") - first + 1);
+    }
+
+protected:
+    void setLen(size_t n) { s.resize(n); }
+
+private:
+    std::string s;
+};
+
+//////////////////////////////////////////////
+
+class HardwareSerial
+{
+public:
+    template <typename T> size_t print(const T &) { return 0; }
+    template <typename T> size_t println(const T &) { return 0; }
+};
+
+extern HardwareSerial Serial;
+
+//////////////////////////////////////////////
+
+class EspClass
+{
+public:
+    uint64_t getEfuseMac() { return 0x14D83E05613CULL; }
+    uint32_t getFreeHeap() { return 200000; }
+};
+
+extern EspClass ESP;
+
+// A test sets it before the code under test looks for PSRAM
+extern bool hostPsramFound;
+inline bool psramFound() { return hostPsramFound; }
+
+//////////////////////////////////////////////
+
+// FreeRTOS mutexes as used by the library: static storage, take forever, give
+#define portMAX_DELAY           0xFFFFFFFFu
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define tskIDLE_PRIORITY        0
+#define tskNO_AFFINITY          0x7FFFFFFF
+#define pdMS_TO_TICKS(ms)       (ms)
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+struct StaticSemaphore_t
+{
+    std::recursive_timed_mutex mutex;
+};
+typedef StaticSemaphore_t *SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer) { return buffer; }
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        s->mutex.lock();
+        return pdTRUE;
+    }
+    return s->mutex.try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    s->mutex.unlock();
+    return pdTRUE;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <functional>
+#include "Arduino.h"
+#include "IPAddress.h"
+
+// One received datagram. Replies are kept for the test to look at.
+class AsyncUDPPacket
+{
+public:
+    AsyncUDPPacket(const uint8_t *data, size_t length, IPAddress remote) :
+        replyLength(0), payload(data), size(length), remote(remote)
+    {}
+
+    const uint8_t *data() { return payload; }
+    size_t length() { return size; }
+    IPAddress remoteIP() { return remote; }
+
+    size_t write(const uint8_t *data, size_t len)
+    {
+        replyLength = std::min(len, sizeof(reply));
+        memcpy(reply, data, replyLength);
+        return len;
+    }
+
+    uint8_t reply[1024];
+    size_t replyLength;
+
+private:
+    const uint8_t *payload;
+    size_t size;
+    IPAddress remote;
+};
+
+typedef std::function<void(AsyncUDPPacket &packet)> AuPacketHandlerFunction;
+
+// Nothing is bound. A test takes the socket that listened last and hands packets to
+// deliver() as the AsyncUDP task would.
+class AsyncUDP
+{
+public:
+    bool listen(uint16_t port)
+    {
+        listening() = this;
+        return true;
+    }
+
+    void onPacket(AuPacketHandlerFunction fn) { handler = fn; }
+    void close() { handler = nullptr; }
+
+    static AsyncUDP *&listening()
+    {
+        static AsyncUDP *udp = nullptr;
+        return udp;
+    }
+
+    void deliver(AsyncUDPPacket &packet)
+    {
+        if (handler)
+            handler(packet);
+    }
+
+private:
+    AuPacketHandlerFunction handler;
+};
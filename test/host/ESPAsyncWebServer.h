@@ -0,0 +1,150 @@
+#pragma once
+
+// Stand-in for the request/response side of ESPAsyncWebServer. A test builds a request,
+// hands it to a handler and looks at the response it sent, body included.
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "Arduino.h"
+#include "IPAddress.h"
+#include "FS.h"
+
+class AsyncWebHeader
+{
+public:
+    AsyncWebHeader(const String &name, const String &value) : headerName(name), headerValue(value) {}
+
+    const String &name() const { return headerName; }
+    const String &value() const { return headerValue; }
+
+private:
+    String headerName;
+    String headerValue;
+};
+
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+
+class AsyncWebServerResponse
+{
+public:
+    AsyncWebServerResponse(int code, const String &contentType) : code(code), contentType(contentType) {}
+    virtual ~AsyncWebServerResponse() {}
+
+    void addHeader(const String &name, const String &value) { headers.push_back(AsyncWebHeader(name, value)); }
+
+    // Host only: what goes on the wire
+    const String *header(const char *name) const
+    {
+        for (const AsyncWebHeader &h : headers)
+            if (h.name().equalsIgnoreCase(name))
+                return &h.value();
+        return NULL;
+    }
+
+    int code;
+    String contentType;
+    std::vector<AsyncWebHeader> headers;
+    std::string body;
+};
+
+class AsyncClient
+{
+public:
+    AsyncClient() : aborted(false), closed(false) {}
+
+    void abort() { aborted = true; }
+    void close(bool now = false) { closed = true; }
+
+    bool aborted;
+    bool closed;
+};
+
+class AsyncWebServerRequest
+{
+public:
+    explicit AsyncWebServerRequest(const String &url) : path(url) {}
+
+    const String &url() const { return path; }
+    AsyncClient *client() { return &tcp; }
+
+    // Host only: a header sent by the client
+    void addHeader(const String &name, const String &value) { headers.push_back(AsyncWebHeader(name, value)); }
+
+    AsyncWebHeader *getHeader(const String &name)
+    {
+        for (AsyncWebHeader &h : headers)
+            if (h.name().equalsIgnoreCase(name))
+                return &h;
+        return NULL;
+    }
+
+    bool hasHeader(const String &name) { return getHeader(name) != NULL; }
+
+    AsyncWebServerResponse *beginResponse(int code, const String &contentType = String(), const String &content = String())
+    {
+        AsyncWebServerResponse *response = new AsyncWebServerResponse(code, contentType);
+        response->body = content.c_str();
+        return response;
+    }
+
+    // Pulls the body from the filler in small pieces, as the server does
+    AsyncWebServerResponse *beginResponse(const String &contentType, size_t length, AwsResponseFiller filler)
+    {
+        AsyncWebServerResponse *response = new AsyncWebServerResponse(200, contentType);
+        uint8_t chunk[100];
+        while (response->body.size() < length)
+        {
+            size_t n = filler(chunk, sizeof(chunk), response->body.size());
+            if (!n)
+                break;
+            response->body.append((const char *)chunk, n);
+        }
+        return response;
+    }
+
+    AsyncWebServerResponse *beginResponse_P(int code, const String &contentType, const uint8_t *content, size_t length)
+    {
+        AsyncWebServerResponse *response = new AsyncWebServerResponse(code, contentType);
+        response->body.assign((const char *)content, length);
+        return response;
+    }
+
+    // AsyncFileResponse: a .gz file served under the plain path gets its Content-Encoding
+    AsyncWebServerResponse *beginResponse(File content, const String &path, const String &contentType = String(),
+                                          bool download = false)
+    {
+        AsyncWebServerResponse *response = new AsyncWebServerResponse(200, contentType);
+        if (!download && String(content.name()).endsWith(".gz") && !path.endsWith(".gz"))
+            response->addHeader("Content-Encoding", "gzip");
+        response->body.resize(content.size());
+        content.seek(0);
+        content.read((uint8_t *)&response->body[0], response->body.size());
+        content.close();
+        return response;
+    }
+
+    void send(AsyncWebServerResponse *r) { response.reset(r); }
+    void send(int code, const String &contentType = String(), const String &content = String())
+    {
+        send(beginResponse(code, contentType, content));
+    }
+
+    // Host only: the response sent, NULL if none
+    std::unique_ptr<AsyncWebServerResponse> response;
+
+private:
+    String path;
+    std::vector<AsyncWebHeader> headers;
+    AsyncClient tcp;
+};
+
+class AsyncWebHandler
+{
+public:
+    virtual ~AsyncWebHandler() {}
+
+    virtual bool canHandle(AsyncWebServerRequest *request) { return false; }
+    virtual void handleRequest(AsyncWebServerRequest *request) {}
+    virtual bool isRequestHandlerTrivial() { return true; }
+};
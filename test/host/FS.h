@@ -0,0 +1,127 @@
+#pragma once
+
+// In-memory file system with the File/FS API of the core. The files live in hostFiles,
+// where a test can look at them or change them, e.g. to tear a record.
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <time.h>
+#include "Arduino.h"
+
+struct HostFile
+{
+    HostFile() : lastWrite(0) {}
+
+    std::vector<uint8_t> data;
+    time_t lastWrite;
+};
+
+extern std::map<std::string, std::shared_ptr<HostFile>> hostFiles;
+
+// Bytes that can still be written before writes fail, as on a full or failing flash
+extern size_t hostFileWriteBudget;
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File
+{
+public:
+    File() : pos(0), writable(false) {}
+    File(const std::string &path, std::shared_ptr<HostFile> file, bool writable)
+        : path(path), file(file), pos(0), writable(writable) {}
+
+    explicit operator bool() const { return (bool)file; }
+
+    size_t size() const { return file ? file->data.size() : 0; }
+    size_t position() const { return pos; }
+    int available() { return (int)(size() - pos); }
+    const char *name() const { return path.c_str(); }
+    bool isDirectory() const { return false; }
+    time_t getLastWrite() const { return file ? file->lastWrite : 0; }
+    File openNextFile() { return File(); }
+    void flush() {}
+    void close() { file.reset(); }
+
+    bool seek(uint32_t offset, SeekMode mode = SeekSet)
+    {
+        size_t base = mode == SeekSet ? 0 : mode == SeekCur ? pos : size();
+        if (!file || base + offset > size())
+            return false;
+        pos = base + offset;
+        return true;
+    }
+
+    size_t read(uint8_t *buf, size_t n)
+    {
+        if (!file)
+            return 0;
+        n = std::min(n, size() - pos);
+        memcpy(buf, file->data.data() + pos, n);
+        pos += n;
+        return n;
+    }
+
+    int read()
+    {
+        uint8_t c;
+        return read(&c, 1) ? c : -1;
+    }
+
+    size_t write(const uint8_t *buf, size_t n)
+    {
+        if (!file || !writable)
+            return 0;
+        n = std::min(n, hostFileWriteBudget);
+        hostFileWriteBudget -= n;
+        if (pos + n > file->data.size())
+            file->data.resize(pos + n);
+        memcpy(file->data.data() + pos, buf, n);
+        pos += n;
+        file->lastWrite++;
+        return n;
+    }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+
+private:
+    std::string path;
+    std::shared_ptr<HostFile> file;
+    size_t pos;
+    bool writable;
+};
+
+class FS
+{
+public:
+    bool begin(bool formatOnFail = false) { return true; }
+    void end() {}
+
+    bool exists(const char *path) { return hostFiles.count(path) != 0; }
+    bool exists(const String &path) { return exists(path.c_str()); }
+
+    // "r" and "r+" open an existing file, "w" creates or truncates, "a" appends
+    File open(const char *path, const char *mode = "r")
+    {
+        auto it = hostFiles.find(path);
+        if (mode[0] == 'r')
+            return it == hostFiles.end() ? File() : File(path, it->second, mode[1] == '+');
+
+        if (it == hostFiles.end())
+            it = hostFiles.insert(std::make_pair(std::string(path), std::make_shared<HostFile>())).first;
+        File file(path, it->second, true);
+        if (mode[0] == 'w')
+        {
+            it->second->data.clear();
+            it->second->lastWrite++;
+        }
+        else
+            file.seek(0, SeekEnd);
+        return file;
+    }
+
+    File open(const String &path, const char *mode = "r") { return open(path.c_str(), mode); }
+
+    bool remove(const char *path) { return hostFiles.erase(path) != 0; }
+    bool remove(const String &path) { return remove(path.c_str()); }
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Arduino.h"
+
+// IPv4 address kept in network order, as the ESP32 core does
+class IPAddress
+{
+public:
+    IPAddress() : address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+    IPAddress(uint32_t address) : address(address) {}
+
+    operator uint32_t() const { return address; }
+    uint8_t operator[](int i) const { return (uint8_t)(address >> (8 * i)); }
+
+    String toString() const
+    {
+        char s[16];
+        snprintf(s, sizeof(s), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+        return String(s);
+    }
+
+    bool fromString(const char *s)
+    {
+        unsigned a, b, c, d;
+        char tail;
+        if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4 || a > 255 || b > 255 || c > 255 || d > 255)
+            return false;
+        *this = IPAddress(a, b, c, d);
+        return true;
+    }
+
+private:
+    uint32_t address;
+};
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "FS.h"
+
+class SPIFFSFS : public FS
+{
+};
+
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,11 @@
+#pragma once
+
+// ESPAsyncWebServer's WebAuthentication.h, which the patch directory does not carry
+
+#include "Arduino.h"
+
+bool checkBasicAuthentication(const char *header, const char *username, const char *password);
+String requestDigestAuthentication(const char *realm);
+bool checkDigestAuthentication(const char *header, const char *method, const char *username, const char *password,
+                               const char *realm, bool passwordIsHash, const char *nonce, const char *opaque, const char *uri);
+String generateDigestHash(const char *username, const char *password, const char *realm);
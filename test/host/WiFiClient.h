@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Replays a recorded response body. Data becomes available in segments of at most
+// segment bytes, like TCP segments arriving one after the other.
+class WiFiClient
+{
+public:
+    WiFiClient(const char *data = "", size_t length = 0, size_t segment = 1460) :
+        data(data), length(length), segment(segment), pos(0), limit(0)
+    {}
+
+    int available()
+    {
+        if (pos == limit)
+            limit = std::min(length, pos + segment);
+        return (int)(limit - pos);
+    }
+
+    int read(uint8_t *buffer, size_t size)
+    {
+        size_t n = std::min(size, (size_t)available());
+        memcpy(buffer, data + pos, n);
+        pos += n;
+        return (int)n;
+    }
+
+    uint8_t connected() { return pos < length; }
+
+private:
+    const char *data;
+    size_t length;
+    size_t segment;
+    size_t pos;
+    size_t limit;
+};
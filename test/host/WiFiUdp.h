@@ -0,0 +1,66 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include "Arduino.h"
+#include "IPAddress.h"
+
+// A socket on a shared fake network: sent() holds the last datagram sent by anyone,
+// inbox() the datagrams a test queued for the next parsePacket()/read()
+class WiFiUDP
+{
+public:
+    static std::vector<uint8_t> &sent()
+    {
+        static std::vector<uint8_t> packet;
+        return packet;
+    }
+
+    static std::deque<std::vector<uint8_t>> &inbox()
+    {
+        static std::deque<std::vector<uint8_t>> packets;
+        return packets;
+    }
+
+    int parsePacket()
+    {
+        current.clear();
+        if (inbox().empty())
+            return 0;
+        current = inbox().front();
+        inbox().pop_front();
+        return (int)current.size();
+    }
+
+    void flush() { current.clear(); }
+
+    int read(uint8_t *buffer, size_t size)
+    {
+        size_t n = std::min(size, current.size());
+        memcpy(buffer, current.data(), n);
+        current.clear();
+        return (int)n;
+    }
+
+    int beginPacket(IPAddress ip, uint16_t port)
+    {
+        out.clear();
+        return 1;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+        out.insert(out.end(), buffer, buffer + size);
+        return size;
+    }
+
+    int endPacket()
+    {
+        sent() = out;
+        return 1;
+    }
+
+private:
+    std::vector<uint8_t> current;
+    std::vector<uint8_t> out;
+};
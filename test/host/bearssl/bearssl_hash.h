@@ -0,0 +1,18 @@
+#pragma once
+
+// BearSSL's SHA-1, which WebHash.cpp uses off ESP32, on top of OpenSSL
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <stddef.h>
+#include <openssl/sha.h>
+
+typedef SHA_CTX br_sha1_context;
+
+inline void br_sha1_init(br_sha1_context *ctx) { SHA1_Init(ctx); }
+inline void br_sha1_update(br_sha1_context *ctx, const void *data, size_t len) { SHA1_Update(ctx, data, len); }
+// Unlike SHA1_Final(), br_sha1_out() leaves the context usable
+inline void br_sha1_out(const br_sha1_context *ctx, void *digest)
+{
+    SHA_CTX copy = *ctx;
+    SHA1_Final((unsigned char *)digest, &copy);
+}
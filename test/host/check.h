@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+// Checks stop at the first failure with its location
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                                \
+        }                                                                           \
+    } while (0)
+
+#define CHECK_STR(a, b)     CHECK(strcmp((a), (b)) == 0)
+
+// Nanoseconds per call of fn, best of a few rounds to ride out scheduler noise
+template <typename Fn>
+double benchNs(size_t iterations, Fn fn)
+{
+    double best = 0;
+    for (int round = 0; round < 5; round++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++)
+            fn(i);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+        if (round == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+// Keep the optimizer from dropping a result
+template <typename T>
+inline void keep(const T &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
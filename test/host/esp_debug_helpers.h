@@ -0,0 +1,3 @@
+#pragma once
+
+inline void esp_backtrace_print(int depth) {}
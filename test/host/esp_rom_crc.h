@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// Same CRC-32 as the ROM function (and zlib's crc32): reflected, initial and final inversion
+static inline uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    return crc32_le(crc, buf, len);
+}
@@ -0,0 +1,13 @@
+#include "Arduino.h"
+#include "WiFi.h"
+#include "FS.h"
+#include "SPIFFS.h"
+
+uint32_t hostMillisOffset = 0;
+HardwareSerial Serial;
+WiFiClass WiFi;
+EspClass ESP;
+bool hostPsramFound = false;
+std::map<std::string, std::shared_ptr<HostFile>> hostFiles;
+size_t hostFileWriteBudget = SIZE_MAX;
+SPIFFSFS SPIFFS;
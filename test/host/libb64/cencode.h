@@ -0,0 +1,113 @@
+#pragma once
+
+// libb64's encoder as shipped with the Arduino cores (public domain, Chris Venter)
+
+typedef enum
+{
+    step_A, step_B, step_C
+} base64_encodestep;
+
+typedef struct
+{
+    base64_encodestep step;
+    char result;
+    int stepcount;
+} base64_encodestate;
+
+#define base64_encode_expected_len(n) ((((4 * (n)) / 3) + 3) & ~3)
+
+static inline char base64_encode_value(char value)
+{
+    static const char encoding[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    return (unsigned char)value > 63 ? '=' : encoding[(int)value];
+}
+
+static inline void base64_init_encodestate(base64_encodestate *state)
+{
+    state->step = step_A;
+    state->result = 0;
+    state->stepcount = 0;
+}
+
+static inline int base64_encode_block(const char *plaintext, int length, char *code, base64_encodestate *state)
+{
+    const char *in = plaintext;
+    const char *const end = plaintext + length;
+    char *out = code;
+    char result = state->result;
+    char fragment;
+
+    switch (state->step)
+    {
+        while (1)
+        {
+        case step_A:
+            if (in == end)
+            {
+                state->result = result;
+                state->step = step_A;
+                return out - code;
+            }
+            fragment = *in++;
+            result = (fragment & 0x0fc) >> 2;
+            *out++ = base64_encode_value(result);
+            result = (fragment & 0x003) << 4;
+            // fall through
+        case step_B:
+            if (in == end)
+            {
+                state->result = result;
+                state->step = step_B;
+                return out - code;
+            }
+            fragment = *in++;
+            result |= (fragment & 0x0f0) >> 4;
+            *out++ = base64_encode_value(result);
+            result = (fragment & 0x00f) << 2;
+            // fall through
+        case step_C:
+            if (in == end)
+            {
+                state->result = result;
+                state->step = step_C;
+                return out - code;
+            }
+            fragment = *in++;
+            result |= (fragment & 0x0c0) >> 6;
+            *out++ = base64_encode_value(result);
+            result = (fragment & 0x03f) >> 0;
+            *out++ = base64_encode_value(result);
+        }
+    }
+    return out - code;
+}
+
+static inline int base64_encode_blockend(char *code, base64_encodestate *state)
+{
+    char *out = code;
+
+    switch (state->step)
+    {
+    case step_B:
+        *out++ = base64_encode_value(state->result);
+        *out++ = '=';
+        *out++ = '=';
+        break;
+    case step_C:
+        *out++ = base64_encode_value(state->result);
+        *out++ = '=';
+        break;
+    case step_A:
+        break;
+    }
+    *out = 0;
+    return out - code;
+}
+
+static inline int base64_encode_chars(const char *plaintext, int length, char *code)
+{
+    base64_encodestate state;
+    base64_init_encodestate(&state);
+    int len = base64_encode_block(plaintext, length, code, &state);
+    return len + base64_encode_blockend(code + len, &state);
+}
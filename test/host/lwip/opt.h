@@ -0,0 +1,3 @@
+#pragma once
+
+// lwIP configuration and APIs are not available on the host: LWIP_DNS stays undefined
@@ -0,0 +1,13 @@
+#pragma once
+
+// The ESP8266 core's MD5 API, which WebHash.cpp uses off ESP32, on top of OpenSSL
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <stdint.h>
+#include <openssl/md5.h>
+
+typedef MD5_CTX md5_context_t;
+
+inline void MD5Init(md5_context_t *ctx) { MD5_Init(ctx); }
+inline void MD5Update(md5_context_t *ctx, const uint8_t *data, uint16_t len) { MD5_Update(ctx, data, len); }
+inline void MD5Final(uint8_t digest[16], md5_context_t *ctx) { MD5_Final(digest, ctx); }
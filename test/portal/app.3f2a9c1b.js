@@ -0,0 +1,4 @@
+// Fixture for check_assets
+const app = document.getElementById("app");
+app.textContent = "Configuration portal";
+app.textContent += " for the device, configuration portal";
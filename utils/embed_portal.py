@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+#
+# Embed the portal web UI into the firmware.
+#
+# Minifies and gzips every file below data/ and writes include/wm_portal_assets.h with one
+# constexpr byte array per file plus a table of path, length, MIME type and ETag. When
+# that header is on the include path, wm_portal.h serves these blobs straight from flash
+# and the portal works without any file in LittleFS/SPIFFS.
+#
+# A gzipped file also gets its identity copy, for clients that do not send
+# "Accept-Encoding: gzip". --gzip-only leaves those out to save flash; such clients then
+# get the file from the filesystem, or nothing.
+#
+# PlatformIO:   extra_scripts = pre:utils/embed_portal.py
+#               (custom_portal_data / custom_portal_header override the paths,
+#               custom_portal_gzip_only = yes drops the identity copies)
+# Standalone:   python3 utils/embed_portal.py [--gzip-only] [data_dir] [output_header]
+#
+# test/check_assets.cpp builds the header from test/portal/ and serves it.
+#
+# The output only changes when the input does (gzip mtime is fixed at 0), so it does not
+# trigger rebuilds by itself.
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+import sys
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".htm": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".mjs": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".jpeg": "image/jpeg",
+    ".gif": "image/gif",
+    ".ico": "image/x-icon",
+    ".woff": "font/woff",
+    ".woff2": "font/woff2",
+    ".txt": "text/plain",
+}
+
+# Already compressed, gzip would only add its header
+STORED = {".png", ".jpg", ".jpeg", ".gif", ".woff", ".woff2", ".gz"}
+
+
+def minify(ext, text):
+    # Conservative: comments and runs of whitespace only. Scripts are left alone unless
+    # they were minified by the UI build already; inline <pre> blocks are not expected.
+    if ext == ".css":
+        text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+        text = re.sub(r"\s+", " ", text)
+        text = re.sub(r"\s*([{};,>])\s*", r"\1", text)
+        return text.strip()
+    if ext in (".html", ".htm"):
+        text = re.sub(r"<!--(?!\[if).*?-->", "", text, flags=re.S)
+        text = re.sub(r">\s+<", "><", text)
+        text = re.sub(r"[ \t]*\n[ \t\n]*", "\n", text)
+        return text.strip()
+    if ext == ".json":
+        return re.sub(r"\n\s*", "", text)
+    return text
+
+
+def encode(path):
+    """The body to embed, whether it is gzipped, and the identity body"""
+    ext = os.path.splitext(path)[1].lower()
+    with open(path, "rb") as f:
+        raw = f.read()
+    if ext == ".gz":
+        # A prebuilt foo.gz stands in for foo
+        return raw, True, gzip.decompress(raw)
+    if ext in (".html", ".htm", ".css", ".json"):
+        raw = minify(ext, raw.decode("utf-8")).encode("utf-8")
+    if ext in STORED:
+        return raw, False, raw
+    packed = gzip.compress(raw, compresslevel=9, mtime=0)
+    if len(packed) >= len(raw):
+        return raw, False, raw
+    return packed, True, raw
+
+
+def identifier(index):
+    return "wm_portal_asset_%d" % index
+
+
+def generate(data_dir, header, gzip_only=False):
+    found = {}
+    for root, _, names in os.walk(data_dir):
+        for name in names:
+            if name.startswith("."):
+                continue
+            full = os.path.join(root, name)
+            url = "/" + os.path.relpath(full, data_dir).replace(os.sep, "/")
+            if url.endswith(".gz"):
+                found[url[:-3]] = full
+            else:
+                found.setdefault(url, full)
+    files = sorted(found.items())
+
+    out = []
+    out.append("// Generated by utils/embed_portal.py from %s, do not edit" % os.path.basename(os.path.normpath(data_dir)))
+    out.append("#pragma once")
+    out.append("")
+    out.append("#define WM_PORTAL_ASSETS_GENERATED 1")
+    out.append("")
+    table = []
+
+    def embed(url, data, gzipped):
+        index = len(table)
+        ext = os.path.splitext(url)[1].lower()
+        mime = MIME_TYPES.get(ext, "application/octet-stream")
+        etag = '\\"%s\\"' % hashlib.sha1(data).hexdigest()[:16]
+        body = ",".join("0x%02x" % b for b in data)
+        lines = [body[j:j + 120] for j in range(0, len(body), 120)] or [""]
+        out.append("constexpr uint8_t %s[] = {" % identifier(index))
+        out.extend("  " + line for line in lines)
+        out.append("};")
+        table.append('  { "%s", %s, %d, "%s", "%s", %s },' % (url, identifier(index), len(data), mime, etag,
+                                                            "true" if gzipped else "false"))
+
+    # The gzipped row of a path comes first, its identity copy right after it
+    for url, full in files:
+        data, gzipped, identity = encode(full)
+        embed(url, data, gzipped)
+        if gzipped and not gzip_only:
+            embed(url, identity, False)
+
+    out.append("")
+    out.append("// Sorted by path")
+    out.append("constexpr WMPortalAsset wmPortalAssets[] = {")
+    out.extend(table)
+    out.append("};")
+    out.append("")
+    out.append("constexpr size_t wmPortalAssetCount = %d;" % len(table))
+    out.append("")
+    text = "\n".join(out)
+
+    old = None
+    if os.path.exists(header):
+        with open(header) as f:
+            old = f.read()
+    if old != text:
+        os.makedirs(os.path.dirname(os.path.abspath(header)), exist_ok=True)
+        with open(header, "w") as f:
+            f.write(text)
+        print("embed_portal: %d files, %d rows -> %s" % (len(files), len(table), header))
+
+
+def main_platformio(env):
+    project = env.subst("$PROJECT_DIR")
+    data_dir = env.GetProjectOption("custom_portal_data", os.path.join(project, "data"))
+    header = env.GetProjectOption("custom_portal_header",
+                                  os.path.join(env.subst("$PROJECT_INCLUDE_DIR"), "wm_portal_assets.h"))
+    gzip_only = env.GetProjectOption("custom_portal_gzip_only", "no").lower() in ("yes", "true", "1")
+    if os.path.isdir(data_dir):
+        generate(data_dir, header, gzip_only)
+    else:
+        print("embed_portal: no %s, portal is served from the filesystem" % data_dir)
+
+
+try:
+    Import("env")  # noqa: F821, provided by PlatformIO/SCons
+    main_platformio(env)  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        parser = argparse.ArgumentParser(description="Embed the portal web UI into the firmware")
+        parser.add_argument("--gzip-only", action="store_true", help="no identity copies of gzipped files")
+        parser.add_argument("data_dir", nargs="?", default="data")
+        parser.add_argument("header", nargs="?", default=os.path.join("include", "wm_portal_assets.h"))
+        arguments = parser.parse_args()
+        generate(arguments.data_dir, arguments.header, arguments.gzip_only)
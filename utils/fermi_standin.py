@@ -0,0 +1,444 @@
+#!/usr/bin/env python3
+#
+# Local stand-in for the cloud: the OAuth device-flow endpoints (device code, token,
+# userinfo) over HTTPS and a small MQTT 3.1.1 broker, plus an end-to-end benchmark.
+#
+# Point the device at it with
+#
+#   const FermiEndpoints standin = {
+#       "https://<host>:8443/device", "https://<host>:8443/token", "https://<host>:8443/userinfo",
+#       "mqtt://<host>:1883", NULL };
+#   Fermion.setEndpoints(standin);
+#
+# rootCA NULL makes the HTTPS requests skip verification of the self-signed certificate.
+# esp-mqtt has no such switch, so the broker is plain TCP; pass --mqtt-tls to serve
+# mqtts:// instead and put the printed certificate into rootCA.
+#
+# Benchmark: the time from the first request of the device flow to the device's
+# fermion_hello (connected and subscribed), then --calls function calls to --function
+# with the round trip of each. The device reports its own boot-to-WM_READY time through
+# getBootToReadyTime(); with --selftest a simulated device runs against the stand-in.
+#
+#   python3 utils/fermi_standin.py [--calls 100] [--function echo] [--params on]
+#   python3 utils/fermi_standin.py --selftest
+
+import argparse
+import asyncio
+import json
+import os
+import ssl
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.parse
+import urllib.request
+
+ACCESS_TOKEN = "standin-access-token"
+REFRESH_TOKEN = "standin-refresh-token"
+USER_ID = "standin-user"
+
+
+def now_ms():
+    return time.monotonic() * 1000.0
+
+
+def self_signed_cert(host):
+    folder = tempfile.mkdtemp(prefix="fermi_standin_")
+    cert, key = os.path.join(folder, "cert.pem"), os.path.join(folder, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "30",
+                    "-subj", "/CN=%s" % host, "-keyout", key, "-out", cert],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+class Timeline:
+    """Milestones of one device session, relative to its first OAuth request"""
+
+    def __init__(self):
+        self.start = None
+        self.marks = []
+
+    def mark(self, name):
+        t = now_ms()
+        if self.start is None:
+            self.start = t
+        self.marks.append((name, t - self.start))
+        print("standin: %8.1f ms  %s" % (t - self.start, name))
+
+
+#############################################
+# OAuth device flow
+
+class OAuth:
+    def __init__(self, args, timeline):
+        self.args = args
+        self.timeline = timeline
+        self.polls = 0
+
+    def handle(self, method, path, body):
+        path = urllib.parse.urlparse(path).path
+        form = urllib.parse.parse_qs(body.decode("utf-8", "replace"))
+        if path == "/device" and method == "POST":
+            self.timeline.mark("device code requested")
+            self.polls = 0
+            return 200, {"device_code": "standin-device-code", "user_code": "TEST-CODE",
+                         "verification_uri": "https://localhost/activate",
+                         "verification_uri_complete": "https://localhost/activate?user_code=TEST-CODE",
+                         "expires_in": 900, "interval": self.args.interval}
+        if path == "/token" and method == "POST":
+            grant = form.get("grant_type", [""])[0]
+            if grant == "refresh_token":
+                self.timeline.mark("token refreshed")
+            else:
+                self.polls += 1
+                if self.polls <= self.args.pending:
+                    return 400, {"error": "authorization_pending",
+                                 "error_description": "The user has not yet completed authorization"}
+                self.timeline.mark("token issued after %d polls" % self.polls)
+            return 200, {"access_token": ACCESS_TOKEN, "refresh_token": REFRESH_TOKEN,
+                         "expires_in": 86400, "token_type": "Bearer"}
+        if path == "/userinfo" and method == "GET":
+            self.timeline.mark("userinfo")
+            return 200, {"sub": USER_ID}
+        return 404, {"error": "not_found"}
+
+    async def serve(self, reader, writer):
+        try:
+            while True:
+                line = await reader.readline()
+                if not line:
+                    break
+                method, path, _ = line.decode("latin-1").split(" ", 2)
+                headers = {}
+                while True:
+                    line = await reader.readline()
+                    if line in (b"\r\n", b"\n", b""):
+                        break
+                    name, _, value = line.decode("latin-1").partition(":")
+                    headers[name.strip().lower()] = value.strip()
+                body = await reader.readexactly(int(headers.get("content-length", "0")))
+                code, payload = self.handle(method, path, body)
+                data = json.dumps(payload, separators=(",", ":")).encode()
+                writer.write(b"HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\n"
+                             b"Connection: keep-alive\r\n\r\n" % (code, b"OK" if code == 200 else b"Error", len(data)))
+                writer.write(data)
+                await writer.drain()
+        except (ConnectionError, asyncio.IncompleteReadError, asyncio.CancelledError, ValueError, ssl.SSLError):
+            pass
+        writer.close()
+
+
+#############################################
+# MQTT 3.1.1 broker: QoS 0 and 1, retained messages, no persistence
+
+def topic_matches(topic_filter, topic):
+    f, t = topic_filter.split("/"), topic.split("/")
+    for i, part in enumerate(f):
+        if part == "#":
+            return True
+        if i >= len(t) or (part != "+" and part != t[i]):
+            return False
+    return len(f) == len(t)
+
+
+def mqtt_string(s):
+    data = s.encode("utf-8")
+    return struct.pack(">H", len(data)) + data
+
+
+def mqtt_packet(kind, flags, body):
+    length, header = len(body), bytearray([kind << 4 | flags])
+    while True:
+        byte, length = length % 128, length // 128
+        header.append(byte | (0x80 if length else 0))
+        if not length:
+            return bytes(header) + body
+
+
+async def mqtt_read(reader):
+    first = (await reader.readexactly(1))[0]
+    length, shift = 0, 0
+    while True:
+        byte = (await reader.readexactly(1))[0]
+        length |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    return first >> 4, first & 0x0F, await reader.readexactly(length)
+
+
+class Session:
+    def __init__(self, broker, writer):
+        self.broker = broker
+        self.writer = writer
+        self.client_id = ""
+        self.filters = {}
+        self.next_id = 1
+
+    def send(self, kind, flags, body):
+        self.writer.write(mqtt_packet(kind, flags, body))
+
+    def deliver(self, topic, payload, qos=0, retain=False):
+        body = mqtt_string(topic)
+        if qos:
+            body += struct.pack(">H", self.next_id)
+            self.next_id = self.next_id % 0xFFFF + 1
+        self.send(3, (qos << 1) | (1 if retain else 0), body + payload)
+
+
+class Broker:
+    def __init__(self, timeline, on_publish, on_subscribe):
+        self.timeline = timeline
+        self.sessions = []
+        self.retained = {}
+        self.on_publish = on_publish
+        self.on_subscribe = on_subscribe
+
+    def publish(self, topic, payload, retain=False):
+        if retain:
+            self.retained[topic] = payload
+        for session in self.sessions:
+            if any(topic_matches(f, topic) for f in session.filters):
+                session.deliver(topic, payload)
+        self.on_publish(topic, payload)
+
+    async def serve(self, reader, writer):
+        session = Session(self, writer)
+        try:
+            kind, _, body = await mqtt_read(reader)
+            if kind != 1:
+                raise ConnectionError("expected CONNECT")
+            pos = 2 + struct.unpack(">H", body[:2])[0] + 2          # protocol name, level, flags
+            flags = body[pos - 1]
+            pos += 2                                                # keep-alive
+            size = struct.unpack(">H", body[pos:pos + 2])[0]
+            session.client_id = body[pos + 2:pos + 2 + size].decode()
+            self.timeline.mark("mqtt connect %s (%s)" % (session.client_id, "password" if flags & 0x40 else "no password"))
+            session.send(2, 0, b"\x00\x00")
+            self.sessions.append(session)
+            await writer.drain()
+
+            while True:
+                kind, flags, body = await mqtt_read(reader)
+                if kind == 3:                                       # PUBLISH
+                    size = struct.unpack(">H", body[:2])[0]
+                    topic, pos = body[2:2 + size].decode(), 2 + size
+                    qos = (flags >> 1) & 3
+                    if qos:
+                        packet_id = body[pos:pos + 2]
+                        pos += 2
+                        session.send(4 if qos == 1 else 5, 0, packet_id)
+                    self.publish(topic, body[pos:], retain=bool(flags & 1))
+                elif kind == 6:                                     # PUBREL
+                    session.send(7, 0, body[:2])
+                elif kind == 8:                                     # SUBSCRIBE
+                    pos, granted = 2, bytearray()
+                    while pos < len(body):
+                        size = struct.unpack(">H", body[pos:pos + 2])[0]
+                        topic_filter = body[pos + 2:pos + 2 + size].decode()
+                        granted.append(min(body[pos + 2 + size], 1))
+                        pos += 3 + size
+                        session.filters[topic_filter] = True
+                        self.on_subscribe(session, topic_filter)
+                        for topic, payload in self.retained.items():
+                            if topic_matches(topic_filter, topic):
+                                session.deliver(topic, payload, retain=True)
+                    session.send(9, 0, body[:2] + bytes(granted))
+                elif kind == 10:                                    # UNSUBSCRIBE
+                    pos = 2
+                    while pos < len(body):
+                        size = struct.unpack(">H", body[pos:pos + 2])[0]
+                        session.filters.pop(body[pos + 2:pos + 2 + size].decode(), None)
+                        pos += 2 + size
+                    session.send(11, 0, body[:2])
+                elif kind == 12:                                    # PINGREQ
+                    session.send(13, 0, b"")
+                elif kind == 14:                                    # DISCONNECT
+                    break
+                await writer.drain()
+        except (ConnectionError, asyncio.IncompleteReadError, asyncio.CancelledError, ValueError, ssl.SSLError):
+            pass
+        if session in self.sessions:
+            self.sessions.remove(session)
+            self.timeline.mark("mqtt disconnect %s" % session.client_id)
+        writer.close()
+
+
+#############################################
+# Benchmark
+
+class Bench:
+    def __init__(self, args, timeline):
+        self.args = args
+        self.timeline = timeline
+        self.broker = None
+        self.device = None
+        self.ready = asyncio.Event()
+        self.ready_ms = 0
+        self.responses = {}
+
+    def on_subscribe(self, session, topic_filter):
+        if topic_filter.startswith("devices/") and topic_filter.endswith("/functions/#"):
+            self.device = topic_filter.split("/")[1]
+
+    def on_publish(self, topic, payload):
+        if self.device is None:
+            return
+        base = "devices/%s/" % self.device
+        if topic == base + "events/fermion_hello" and not self.ready.is_set():
+            self.timeline.mark("ready (fermion_hello from %s)" % self.device)
+            self.ready_ms = self.timeline.marks[-1][1]
+            self.ready.set()
+        elif topic.startswith(base + "functions/") and topic.endswith("/response"):
+            try:
+                request_id = json.loads(payload)["i"]
+            except (ValueError, KeyError, TypeError):
+                return
+            future = self.responses.pop(request_id, None)
+            if future and not future.done():
+                future.set_result(now_ms())
+
+    async def run(self):
+        await self.ready.wait()
+        topic = "devices/%s/functions/%s" % (self.device, self.args.function)
+        rtts, lost = [], 0
+        loop = asyncio.get_running_loop()
+        for i in range(1, self.args.calls + 1):
+            future = loop.create_future()
+            self.responses[i] = future
+            payload = json.dumps({"i": i, "p": self.args.params}, separators=(",", ":")).encode()
+            sent = now_ms()
+            self.broker.publish(topic, payload)
+            try:
+                rtts.append(await asyncio.wait_for(future, self.args.timeout) - sent)
+            except asyncio.TimeoutError:
+                self.responses.pop(i, None)
+                lost += 1
+
+        print("standin: first request to ready %.1f ms" % self.ready_ms)
+        if rtts:
+            rtts.sort()
+            pick = lambda q: rtts[min(len(rtts) - 1, int(q * len(rtts)))]
+            print("standin: %d calls, %d lost, rtt ms min %.2f p50 %.2f p95 %.2f p99 %.2f max %.2f mean %.2f" %
+                  (len(rtts) + lost, lost, rtts[0], pick(0.50), pick(0.95), pick(0.99), rtts[-1],
+                   statistics.mean(rtts)))
+        else:
+            print("standin: %d calls, all lost" % lost)
+        return lost == 0
+
+
+#############################################
+# Simulated device for --selftest: device flow, connect, subscribe, answer calls
+
+def simulated_device(args):
+    context = ssl._create_unverified_context()
+    base = "https://127.0.0.1:%d" % args.http_port
+
+    def post(path, data):
+        request = urllib.request.Request(base + path, data=data.encode(), method="POST")
+        try:
+            with urllib.request.urlopen(request, context=context) as r:
+                return r.status, json.load(r)
+        except urllib.error.HTTPError as e:
+            return e.code, json.load(e)
+
+    _, code = post("/device", "client_id=fermi-device&scope=openid offline_access")
+    while True:
+        status, _ = post("/token", "client_id=fermi-device&grant_type=urn:ietf:params:oauth:grant-type:"
+                                   "device_code&device_code=" + code["device_code"])
+        if status == 200:
+            break
+        time.sleep(code["interval"])
+    with urllib.request.urlopen(urllib.request.Request(base + "/userinfo"), context=context) as r:
+        json.load(r)
+
+
+async def simulated_mqtt(args, device_id="selftest"):
+    reader, writer = await asyncio.open_connection("127.0.0.1", args.mqtt_port)
+    writer.write(mqtt_packet(1, 0, mqtt_string("MQTT") + b"\x04\xc2\x00\x3c" + mqtt_string(device_id) +
+                             mqtt_string(USER_ID) + mqtt_string(ACCESS_TOKEN)))
+    await mqtt_read(reader)
+    base = "devices/%s/" % device_id
+    writer.write(mqtt_packet(8, 2, b"\x00\x01" + mqtt_string(base + "functions/#") + b"\x00"))
+    await mqtt_read(reader)
+    hello = json.dumps({"version": "1.0.0", "device": "selftest"}).encode()
+    writer.write(mqtt_packet(3, 1, mqtt_string(base + "events/fermion_hello") + hello))
+    await writer.drain()
+    while True:
+        kind, _, body = await mqtt_read(reader)
+        if kind != 3:
+            continue
+        size = struct.unpack(">H", body[:2])[0]
+        topic = body[2:2 + size].decode()
+        if topic.endswith("/response"):
+            continue                # our own answer, functions/# matches it too
+        call = json.loads(body[2 + size:])
+        response = json.dumps({"i": call["i"], "r": len(call["p"])}, separators=(",", ":")).encode()
+        writer.write(mqtt_packet(3, 0, mqtt_string(topic + "/response") + response))
+        await writer.drain()
+
+
+#############################################
+
+async def main(args):
+    timeline = Timeline()
+    bench = Bench(args, timeline)
+    oauth = OAuth(args, timeline)
+    broker = Broker(timeline, bench.on_publish, bench.on_subscribe)
+    bench.broker = broker
+
+    cert, key = (args.cert, args.key) if args.cert else self_signed_cert(args.host)
+    tls = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    tls.load_cert_chain(cert, key)
+    http_server = await asyncio.start_server(oauth.serve, args.bind, args.http_port, ssl=tls)
+    mqtt_server = await asyncio.start_server(broker.serve, args.bind, args.mqtt_port,
+                                             ssl=tls if args.mqtt_tls else None)
+    print("standin: https://%s:%d/{device,token,userinfo}  %s://%s:%d" %
+          (args.host, args.http_port, "mqtts" if args.mqtt_tls else "mqtt", args.host, args.mqtt_port))
+    if args.mqtt_tls:
+        with open(cert) as f:
+            print(f.read())
+
+    device = None
+    if args.selftest:
+        loop = asyncio.get_running_loop()
+        await loop.run_in_executor(None, simulated_device, args)
+        device = asyncio.ensure_future(simulated_mqtt(args))
+
+    async with http_server, mqtt_server:
+        ok = await bench.run()
+        if device:
+            device.cancel()
+        if args.selftest or args.exit:
+            return 0 if ok else 1
+        print("standin: still serving, Ctrl-C to stop")
+        await asyncio.Event().wait()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Local OAuth device-flow and MQTT stand-in with an end-to-end benchmark")
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--host", default="localhost", help="name in the certificate and the printed URLs")
+    parser.add_argument("--http-port", type=int, default=8443)
+    parser.add_argument("--mqtt-port", type=int, default=1883)
+    parser.add_argument("--mqtt-tls", action="store_true", help="serve mqtts:// with the same certificate")
+    parser.add_argument("--cert", help="PEM certificate, a self-signed one is made if omitted")
+    parser.add_argument("--key", help="PEM private key for --cert")
+    parser.add_argument("--interval", type=int, default=5, help="polling interval handed out with the device code")
+    parser.add_argument("--pending", type=int, default=0, help="token polls answered with authorization_pending")
+    parser.add_argument("--function", default="echo", help="cloud function called by the benchmark")
+    parser.add_argument("--params", default="on")
+    parser.add_argument("--calls", type=int, default=100)
+    parser.add_argument("--timeout", type=float, default=10.0, help="seconds to wait for each response")
+    parser.add_argument("--exit", action="store_true", help="stop after the benchmark")
+    parser.add_argument("--selftest", action="store_true", help="run against a simulated device and exit")
+    arguments = parser.parse_args()
+    if arguments.selftest:
+        arguments.interval, arguments.pending = 1, min(arguments.pending, 2)
+    try:
+        sys.exit(asyncio.run(main(arguments)))
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+#
+# Load curve on the broker when a fleet comes back from an outage.
+#
+# Every device loses the broker at t = 0 and keeps retrying until the broker is back
+# (--outage) and has room for it (--capacity connects per second, the rest fail and are
+# retried). Two policies are compared:
+#
+#   fixed   the old behaviour: a connect attempt on every 10 s state check
+#   jitter  WMRetryPolicy from src/wm_retry.h with its default knobs, ported one to one:
+#           the first attempt after the drop is spread by first(), then every attempt the
+#           broker did not accept waits for failed()
+#
+# Prints the peak connect rate, how long the fleet takes to reconnect and the number of
+# attempts; --csv writes attempts and successes per second for plotting.
+#
+#   python3 utils/outage_sim.py [--devices 10000] [--outage 600] [--capacity 500] [--csv load.csv]
+
+import argparse
+import heapq
+import random
+
+# src/wm_retry.h
+WM_RETRY_BASE_MS = 10000
+WM_RETRY_CAP_MS = 60000
+WM_RETRY_BUDGET = 8
+WM_RETRY_BUDGET_REFILL_MS = 60000
+
+# src/wm.h, wmStateCheckIntervals[WM_READY]
+WM_READY_CHECK_MS = 10000
+
+
+class RetryPolicy:
+    """Port of WMRetryPolicy; esp_random() is replaced by the seeded generator"""
+
+    def __init__(self, rng, base=WM_RETRY_BASE_MS, cap=WM_RETRY_CAP_MS, budget=WM_RETRY_BUDGET,
+                 refill=WM_RETRY_BUDGET_REFILL_MS):
+        self.rng = rng
+        self.base, self.cap, self.budget, self.refill_ms = base, cap, budget, refill
+        self.tokens = budget
+        self.last_refill = 0
+        self.sleep = base
+        self.failures = 0
+
+    def refill(self, now):
+        if self.last_refill == 0 or self.tokens >= self.budget:
+            self.last_refill = now
+            return
+        earned = (now - self.last_refill) // self.refill_ms
+        if earned:
+            self.tokens = min(self.budget, self.tokens + earned)
+            self.last_refill += earned * self.refill_ms
+
+    def first(self):
+        return self.rng.randrange(2 * self.base)
+
+    def failed(self, now):
+        self.refill(now)
+        self.failures += 1
+        upper = min(self.cap, self.sleep * 3)
+        self.sleep = self.base + self.rng.randrange(upper - self.base + 1) if upper > self.base else self.base
+        delay = self.sleep
+        if self.tokens > 0:
+            self.tokens -= 1
+        else:
+            delay = max(delay, self.refill_ms - min(self.refill_ms, now - self.last_refill))
+        return delay
+
+
+def simulate(policy, args, seed):
+    rng = random.Random(seed)
+    # Absolute device uptime in ms; the outage starts at t0 on every device
+    t0 = 3600 * 1000
+    queue = []
+    for device in range(args.devices):
+        detect = rng.uniform(0, args.detect * 1000)
+        # The drop is seen on the next state check, whose phase is random per device
+        first = t0 + detect + rng.uniform(0, WM_READY_CHECK_MS)
+        retry = RetryPolicy(random.Random(rng.random())) if policy == "jitter" else None
+        if retry:
+            first += retry.first()
+        heapq.heappush(queue, (first, device, retry))
+
+    horizon = (args.outage + args.horizon) * 1000
+    seconds = int(horizon // 1000) + 1
+    attempts = [0] * seconds
+    successes = [0] * seconds
+    accepted = {}
+    total, done_at = 0, []
+    while queue:
+        t, device, retry = heapq.heappop(queue)
+        rel = t - t0
+        if rel >= horizon:
+            break
+        second = int(rel // 1000)
+        attempts[second] += 1
+        total += 1
+        up = rel >= args.outage * 1000
+        if up and (args.capacity == 0 or accepted.get(second, 0) < args.capacity):
+            accepted[second] = accepted.get(second, 0) + 1
+            successes[second] += 1
+            done_at.append(rel)
+            continue
+        # loopState() sees the session was not accepted and waits brokerRetry.failed(),
+        # counted from the start of the attempt
+        delay = retry.failed(int(t)) if retry else WM_READY_CHECK_MS
+        heapq.heappush(queue, (t + delay, device, retry))
+
+    return attempts, successes, total, sorted(done_at)
+
+
+def report(policy, args, attempts, successes, total, done_at):
+    def reconnected(q):
+        # seconds after the broker came back until this share of the fleet was connected
+        n = int(q * args.devices + 0.5)
+        return "%.1f s" % (done_at[n - 1] / 1000.0 - args.outage) if 0 < n <= len(done_at) else "-"
+
+    after = attempts[args.outage:]
+    print("%-7s attempts %8d  peak/s %6d  peak/s after recovery %6d  reconnected %6d/%d  50%% %s  99%% %s  100%% %s" %
+          (policy, total, max(attempts), max(after) if after else 0, len(done_at), args.devices,
+           reconnected(0.50), reconnected(0.99), reconnected(1.0)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Broker load after a fleet-wide outage")
+    parser.add_argument("--devices", type=int, default=10000)
+    parser.add_argument("--outage", type=int, default=600, help="seconds until the broker is back")
+    parser.add_argument("--capacity", type=int, default=500, help="connects per second the broker accepts, 0 = unlimited")
+    parser.add_argument("--detect", type=float, default=0, help="devices notice the outage within this many seconds")
+    parser.add_argument("--horizon", type=int, default=1800, help="seconds simulated after the outage")
+    parser.add_argument("--policy", choices=["fixed", "jitter", "both"], default="both")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--csv", help="write per-second attempts and successes")
+    args = parser.parse_args()
+
+    policies = ["fixed", "jitter"] if args.policy == "both" else [args.policy]
+    results = {}
+    for policy in policies:
+        results[policy] = simulate(policy, args, args.seed)
+        report(policy, args, *results[policy])
+
+    if args.csv:
+        with open(args.csv, "w") as f:
+            f.write("second," + ",".join("%s_attempts,%s_successes" % (p, p) for p in policies) + "\n")
+            for second in range(len(results[policies[0]][0])):
+                row = []
+                for p in policies:
+                    row += [results[p][0][second], results[p][1][second]]
+                f.write("%d,%s\n" % (second, ",".join(str(v) for v in row)))
+
+
+if __name__ == "__main__":
+    main()